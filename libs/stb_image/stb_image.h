@@ -196,6 +196,27 @@ RECENT REVISION HISTORY:
 //
 // ===========================================================================
 //
+// Reentrant loading
+//
+// The stbi_set_* switches and the HDR gamma/scale setters are process-wide.
+// To decode from several threads with different settings, fill in an
+// stbi_load_options and call one of the *_with_options loaders instead:
+//
+//    stbi_load_options opt;
+//    stbi_load_options_init(&opt);
+//    opt.flip_vertically = 1;
+//    opt.desired_channels = 4;
+//    unsigned char *data = stbi_load_with_options(filename, &x, &y, &n, &opt);
+//    if (!data) puts(opt.failure_reason);
+//    stbi_image_free_with_options(data, &opt);
+//
+// These never read the global settings. The options may also carry an
+// stbi_allocator, which then serves every allocation of that call; and
+// stbi_failure_reason() is kept per thread where thread locals are
+// available (define STBI_NO_THREAD_LOCALS to opt out).
+//
+// ===========================================================================
+//
 // SIMD support
 //
 // The JPEG decoder will try to automatically use SIMD kernels on x86 when
@@ -303,6 +324,8 @@ RECENT REVISION HISTORY:
 //
 
 
+#include <stddef.h> // size_t, used by stbi_allocator
+
 #ifndef STBI_NO_STDIO
 #include <stdio.h>
 #endif // STBI_NO_STDIO
@@ -413,7 +436,7 @@ STBIDEF int      stbi_is_hdr_from_file(FILE *f);
 
 
 // get a VERY brief reason for failure
-// NOT THREADSAFE
+// the reason is kept per thread when the compiler supports thread locals
 STBIDEF const char *stbi_failure_reason  (void);
 
 // free the loaded image -- this is just free()
@@ -446,6 +469,111 @@ STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert);
 // flip the image vertically, so the first pixel in the output array is the bottom left
 STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip);
 
+////////////////////////////////////
+//
+// reentrant interface
+//
+// the stbi_set_* and stbi_*_gamma/scale functions above change process-wide
+// settings. the *_with_options functions take every setting from an
+// stbi_load_options instead, so threads can decode concurrently with
+// different settings without racing on globals.
+
+// custom allocator used for every allocation of a *_with_options call,
+// including the returned image. realloc gets the old size so simple arenas
+// can implement it. free must accept NULL.
+typedef struct
+{
+   void *(*malloc) (void *user, size_t size);
+   void *(*realloc)(void *user, void *p, size_t old_size, size_t new_size);
+   void  (*free)   (void *user, void *p);
+   void  *user;
+} stbi_allocator;
+
+// runs task(task_user, i) for every i in [0, count), possibly several at
+// once on other threads, and returns once all of them are done. the tasks
+// never allocate nor block on each other, so running them one after the
+// other on the calling thread is always correct.
+typedef void stbi_parallel_for(void *user, int count, void (*task)(void *task_user, int index), void *task_user);
+
+// receives rows [first_row, first_row+count) of a load's result, stride
+// bytes apart, once they are final. rows is only valid during the call.
+typedef void stbi_rows_ready(void *user, stbi_uc const *rows, size_t stride, int first_row, int count);
+
+typedef struct
+{
+   int   desired_channels;      // same as the desired_channels argument of stbi_load
+   int   flip_vertically;       // see stbi_set_flip_vertically_on_load
+   int   unpremultiply;         // see stbi_set_unpremultiply_on_load
+   int   convert_iphone_png_to_rgb; // see stbi_convert_iphone_png_to_rgb
+   float ldr_to_hdr_gamma, ldr_to_hdr_scale;
+   float hdr_to_ldr_gamma, hdr_to_ldr_scale;
+   stbi_allocator const *allocator; // NULL uses STBI_MALLOC/STBI_REALLOC/STBI_FREE
+
+   // 8-bit loaders only: decode into this buffer instead of allocating the
+   // result, rows output_stride bytes apart (0 = tightly packed). The load
+   // fails if the image needs more than output_size bytes; on success it
+   // returns output, which stbi_image_free_with_options leaves alone.
+   // JPEG writes here directly, other formats are copied in once.
+   stbi_uc *output;
+   size_t   output_stride;
+   size_t   output_size;
+
+   // JPEG only: decode at 1/2, 1/4 or 1/8 size (2, 4 or 8, anything else is
+   // full size), for thumbnails and low-resolution tiers. The IDCT works
+   // from the coefficients straight to the averaged pixels, which skips
+   // most of the IDCT and upsampling work. The result is
+   // ceil(x/denom) by ceil(y/denom) pixels; stbi_info still reports x by y,
+   // stbi_info_from_memory_with_options the reduced size.
+   int      jpeg_scale_denom;
+
+   // JPEG only: spread the decoding of large images (STBI_JPEG_PARALLEL_MIN_PIXELS
+   // and up, 4 megapixels by default) over parallel_for. Baseline scans split the entropy decoding at
+   // their restart markers when they have some; otherwise the IDCT of each
+   // band of MCU rows runs while the next band is entropy decoded. Color
+   // conversion is split by rows. NULL decodes everything on the calling
+   // thread. The result is the same either way.
+   stbi_parallel_for *parallel_for;
+   void              *parallel_user;
+
+   // 8-bit loaders only: called with each band of finished rows, in
+   // decoding order (the last rows of the result first with
+   // flip_vertically), so they can be used while the rest still decodes.
+   // Baseline JPEG hands rows over as its scan completes them, progressive
+   // JPEG a band at a time once all scans are in, other formats all rows
+   // at once at the end. A load that fails may have handed some over.
+   stbi_rows_ready *rows_ready;
+   void            *rows_user;
+
+   const char *failure_reason;  // out: set when a load returns NULL
+} stbi_load_options;
+
+// fill in the library defaults, NOT the current global settings
+STBIDEF void     stbi_load_options_init(stbi_load_options *options);
+
+// results of these must be released with stbi_image_free_with_options
+STBIDEF stbi_uc *stbi_load_from_memory_with_options   (stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, stbi_load_options *options);
+STBIDEF stbi_uc *stbi_load_from_callbacks_with_options(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *channels_in_file, stbi_load_options *options);
+STBIDEF stbi_us *stbi_load_16_from_memory_with_options(stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, stbi_load_options *options);
+#ifndef STBI_NO_LINEAR
+STBIDEF float   *stbi_loadf_from_memory_with_options  (stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, stbi_load_options *options);
+#endif
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_with_options               (char const *filename, int *x, int *y, int *channels_in_file, stbi_load_options *options);
+#endif
+
+STBIDEF void     stbi_image_free_with_options(void *retval_from_stbi_load, stbi_load_options const *options);
+
+// decode only through options->rows_ready, which must be set: the result is
+// not kept. JPEG then never holds more than a band of converted rows, other
+// formats still decode the whole image first. Returns 1 on success, 0 with
+// failure_reason set otherwise.
+STBIDEF int      stbi_stream_from_memory_with_options   (stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, stbi_load_options *options);
+STBIDEF int      stbi_stream_from_callbacks_with_options(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *channels_in_file, stbi_load_options *options);
+
+// header only, like stbi_info_from_memory, but reports the size a load with
+// these options produces (jpeg_scale_denom) and sets failure_reason
+STBIDEF int      stbi_info_from_memory_with_options(stbi_uc const *buffer, int len, int *x, int *y, int *comp, stbi_load_options *options);
+
 // ZLIB client - used by PNG, available for other purposes
 
 STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen);
@@ -542,12 +670,14 @@ typedef unsigned short stbi__uint16;
 typedef   signed short stbi__int16;
 typedef unsigned int   stbi__uint32;
 typedef   signed int   stbi__int32;
+typedef unsigned __int64 stbi__uint64;
 #else
 #include <stdint.h>
 typedef uint16_t stbi__uint16;
 typedef int16_t  stbi__int16;
 typedef uint32_t stbi__uint32;
 typedef int32_t  stbi__int32;
+typedef uint64_t stbi__uint64;
 #endif
 
 // should produce compiler error if size is wrong
@@ -559,16 +689,6 @@ typedef unsigned char validate_uint32[sizeof(stbi__uint32)==4 ? 1 : -1];
 #define STBI_NOTUSED(v)  (void)sizeof(v)
 #endif
 
-#ifdef _MSC_VER
-#define STBI_HAS_LROTL
-#endif
-
-#ifdef STBI_HAS_LROTL
-   #define stbi_lrot(x,y)  _lrotl(x,y)
-#else
-   #define stbi_lrot(x,y)  (((x) << (y)) | ((x) >> (32 - (y))))
-#endif
-
 #if defined(STBI_MALLOC) && defined(STBI_FREE) && (defined(STBI_REALLOC) || defined(STBI_REALLOC_SIZED))
 // ok
 #elif !defined(STBI_MALLOC) && !defined(STBI_FREE) && !defined(STBI_REALLOC) && !defined(STBI_REALLOC_SIZED)
@@ -587,6 +707,26 @@ typedef unsigned char validate_uint32[sizeof(stbi__uint32)==4 ? 1 : -1];
 #define STBI_REALLOC_SIZED(p,oldsz,newsz) STBI_REALLOC(p,newsz)
 #endif
 
+#ifndef STBI_NO_THREAD_LOCALS
+   #if defined(__cplusplus) && __cplusplus >= 201103L
+      #define STBI_THREAD_LOCAL       thread_local
+   #elif defined(__GNUC__) && __GNUC__ < 5
+      #define STBI_THREAD_LOCAL       __thread
+   #elif defined(_MSC_VER)
+      #define STBI_THREAD_LOCAL       __declspec(thread)
+   #elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_THREADS__)
+      #define STBI_THREAD_LOCAL       _Thread_local
+   #elif defined(__GNUC__)
+      #define STBI_THREAD_LOCAL       __thread
+   #endif
+#endif
+
+// without thread locals, the failure reason and the allocator of the
+// *_with_options functions are shared between threads again
+#ifndef STBI_THREAD_LOCAL
+#define STBI_THREAD_LOCAL
+#endif
+
 // x86/x64 detection
 #if defined(__x86_64__) || defined(_M_X64)
 #define STBI__X64_TARGET
@@ -665,6 +805,68 @@ static int stbi__sse2_available(void)
    return 1;
 }
 #endif
+
+// AVX2 kernels are compiled for the AVX2 target on their own and only picked
+// once CPUID says both the CPU and the OS support them, so the rest of the
+// library keeps running on plain SSE2 machines. Define STBI_NO_AVX2 to leave
+// them out.
+#if !defined(STBI_NO_AVX2) && ((defined(_MSC_VER) && _MSC_VER >= 1800) || defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define STBI_AVX2
+#include <immintrin.h>
+
+#ifdef _MSC_VER
+#define STBI__AVX2_TARGET
+
+static int stbi__avx2_available(void)
+{
+   int info[4];
+   __cpuid(info,0);
+   if (info[0] < 7)
+      return 0;
+   __cpuid(info,1);
+   // the OS has to save the YMM registers: OSXSAVE and AVX, then XCR0 bits 1-2
+   if ((info[2] & 0x18000000) != 0x18000000 || (_xgetbv(0) & 6) != 6)
+      return 0;
+   __cpuidex(info,7,0);
+   return ((info[1] >> 5) & 1) != 0;
+}
+#else
+#define STBI__AVX2_TARGET __attribute__((target("avx2")))
+
+static int stbi__avx2_available(void)
+{
+   // also checks that the OS saves the YMM registers
+   __builtin_cpu_init();
+   return __builtin_cpu_supports("avx2") != 0;
+}
+#endif
+#endif
+
+// same for the SSSE3 byte shuffles of the channel conversions, picked at
+// run time as well. Define STBI_NO_SSSE3 to leave them out.
+#if !defined(STBI_NO_SSSE3) && ((defined(_MSC_VER) && _MSC_VER >= 1500) || defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define STBI_SSSE3
+#include <tmmintrin.h>
+
+#ifdef _MSC_VER
+#define STBI__SSSE3_TARGET
+
+static int stbi__ssse3_available(void)
+{
+   int info[4];
+   __cpuid(info,1);
+   return ((info[2] >> 9) & 1) != 0;
+}
+#else
+#define STBI__SSSE3_TARGET __attribute__((target("ssse3")))
+
+static int stbi__ssse3_available(void)
+{
+   __builtin_cpu_init();
+   return __builtin_cpu_supports("ssse3") != 0;
+}
+#endif
+#endif
 #endif
 
 // ARM NEON
@@ -702,13 +904,38 @@ typedef struct
 
    stbi_uc *img_buffer, *img_buffer_end;
    stbi_uc *img_buffer_original, *img_buffer_original_end;
+
+   // per-load settings, from the globals or from stbi_load_options
+   int flip_vertically;
+   int unpremultiply;
+   int de_iphone;
+   float l2h_gamma, l2h_scale;
+   float h2l_gamma_i, h2l_scale_i;
+
+   // caller-provided destination of the 8-bit result, see stbi_load_options
+   stbi_uc *dst;
+   size_t dst_stride, dst_size;
+
+   int jpeg_scale; // log2 of jpeg_scale_denom
+
+   stbi_parallel_for *parallel_for;
+   void *parallel_user;
+
+   // rows_ready of stbi_load_options. stream: the result is dropped once
+   // streamed, so a loader needn't keep it; rows_emitted: the loader
+   // called rows_ready itself
+   stbi_rows_ready *rows_ready;
+   void *rows_user;
+   int stream, rows_emitted;
 } stbi__context;
 
 
 static void stbi__refill_buffer(stbi__context *s);
+static void stbi__load_settings(stbi__context *s);
 
-// initialize a memory-decode context
-static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
+// the _io variants leave the per-load settings alone, the *_with_options
+// functions fill them in from the options instead of the globals
+static void stbi__start_mem_io(stbi__context *s, stbi_uc const *buffer, int len)
 {
    s->io.read = NULL;
    s->read_from_callbacks = 0;
@@ -716,8 +943,7 @@ static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
    s->img_buffer_end = s->img_buffer_original_end = (stbi_uc *) buffer+len;
 }
 
-// initialize a callback-based context
-static void stbi__start_callbacks(stbi__context *s, stbi_io_callbacks *c, void *user)
+static void stbi__start_callbacks_io(stbi__context *s, stbi_io_callbacks *c, void *user)
 {
    s->io = *c;
    s->io_user_data = user;
@@ -728,6 +954,20 @@ static void stbi__start_callbacks(stbi__context *s, stbi_io_callbacks *c, void *
    s->img_buffer_original_end = s->img_buffer_end;
 }
 
+// initialize a memory-decode context
+static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
+{
+   stbi__load_settings(s);
+   stbi__start_mem_io(s, buffer, len);
+}
+
+// initialize a callback-based context
+static void stbi__start_callbacks(stbi__context *s, stbi_io_callbacks *c, void *user)
+{
+   stbi__load_settings(s);
+   stbi__start_callbacks_io(s, c, user);
+}
+
 #ifndef STBI_NO_STDIO
 
 static int stbi__stdio_read(void *user, char *data, int size)
@@ -781,6 +1021,7 @@ typedef struct
    int bits_per_channel;
    int num_channels;
    int channel_order;
+   int flipped; // the decoder already honored s->flip_vertically
 } stbi__result_info;
 
 #ifndef STBI_NO_JPEG
@@ -840,8 +1081,7 @@ static void    *stbi__pnm_load(stbi__context *s, int *x, int *y, int *comp, int
 static int      stbi__pnm_info(stbi__context *s, int *x, int *y, int *comp);
 #endif
 
-// this is not threadsafe
-static const char *stbi__g_failure_reason;
+static STBI_THREAD_LOCAL const char *stbi__g_failure_reason;
 
 STBIDEF const char *stbi_failure_reason(void)
 {
@@ -854,11 +1094,32 @@ static int stbi__err(const char *str)
    return 0;
 }
 
+// allocator of the *_with_options call running on this thread, if any
+static STBI_THREAD_LOCAL stbi_allocator const *stbi__g_allocator;
+
 static void *stbi__malloc(size_t size)
 {
+    if (stbi__g_allocator)
+       return stbi__g_allocator->malloc(stbi__g_allocator->user, size);
     return STBI_MALLOC(size);
 }
 
+static void *stbi__realloc_sized(void *p, size_t old_size, size_t new_size)
+{
+    if (stbi__g_allocator)
+       return stbi__g_allocator->realloc(stbi__g_allocator->user, p, old_size, new_size);
+    STBI_NOTUSED(old_size);
+    return STBI_REALLOC_SIZED(p, old_size, new_size);
+}
+
+static void stbi__free(void *p)
+{
+    if (stbi__g_allocator)
+       stbi__g_allocator->free(stbi__g_allocator->user, p);
+    else
+       STBI_FREE(p);
+}
+
 // stb_image uses ints pervasively, including for offset calculations.
 // therefore the largest decoded image size we can support with the
 // current code, even on 64-bit targets, is INT_MAX. this is not a
@@ -955,11 +1216,11 @@ STBIDEF void stbi_image_free(void *retval_from_stbi_load)
 }
 
 #ifndef STBI_NO_LINEAR
-static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp);
+static float   *stbi__ldr_to_hdr(stbi__context *s, stbi_uc *data, int x, int y, int comp);
 #endif
 
 #ifndef STBI_NO_HDR
-static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp);
+static stbi_uc *stbi__hdr_to_ldr(stbi__context *s, float   *data, int x, int y, int comp);
 #endif
 
 static int stbi__vertically_flip_on_load = 0;
@@ -969,6 +1230,56 @@ STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip)
     stbi__vertically_flip_on_load = flag_true_if_should_flip;
 }
 
+#ifndef STBI_NO_LINEAR
+static float stbi__l2h_gamma=2.2f, stbi__l2h_scale=1.0f;
+
+STBIDEF void   stbi_ldr_to_hdr_gamma(float gamma) { stbi__l2h_gamma = gamma; }
+STBIDEF void   stbi_ldr_to_hdr_scale(float scale) { stbi__l2h_scale = scale; }
+#endif
+
+static float stbi__h2l_gamma_i=1.0f/2.2f, stbi__h2l_scale_i=1.0f;
+
+STBIDEF void   stbi_hdr_to_ldr_gamma(float gamma) { stbi__h2l_gamma_i = 1/gamma; }
+STBIDEF void   stbi_hdr_to_ldr_scale(float scale) { stbi__h2l_scale_i = 1/scale; }
+
+static int stbi__unpremultiply_on_load = 0;
+static int stbi__de_iphone_flag = 0;
+
+STBIDEF void stbi_set_unpremultiply_on_load(int flag_true_if_should_unpremultiply)
+{
+   stbi__unpremultiply_on_load = flag_true_if_should_unpremultiply;
+}
+
+STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert)
+{
+   stbi__de_iphone_flag = flag_true_if_should_convert;
+}
+
+// snapshot the global settings, the decoders only look at the context
+static void stbi__load_settings(stbi__context *s)
+{
+   s->flip_vertically = stbi__vertically_flip_on_load;
+   s->unpremultiply = stbi__unpremultiply_on_load;
+   s->de_iphone = stbi__de_iphone_flag;
+   #ifndef STBI_NO_LINEAR
+   s->l2h_gamma = stbi__l2h_gamma;
+   s->l2h_scale = stbi__l2h_scale;
+   #else
+   s->l2h_gamma = 2.2f;
+   s->l2h_scale = 1.0f;
+   #endif
+   s->h2l_gamma_i = stbi__h2l_gamma_i;
+   s->h2l_scale_i = stbi__h2l_scale_i;
+   s->dst = NULL;
+   s->dst_stride = s->dst_size = 0;
+   s->jpeg_scale = 0;
+   s->parallel_for = NULL;
+   s->parallel_user = NULL;
+   s->rows_ready = NULL;
+   s->rows_user = NULL;
+   s->stream = s->rows_emitted = 0;
+}
+
 static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
 {
    memset(ri, 0, sizeof(*ri)); // make sure it's initialized if we add new fields
@@ -1001,7 +1312,7 @@ static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int re
    #ifndef STBI_NO_HDR
    if (stbi__hdr_test(s)) {
       float *hdr = stbi__hdr_load(s, x,y,comp,req_comp, ri);
-      return stbi__hdr_to_ldr(hdr, *x, *y, req_comp ? req_comp : *comp);
+      return stbi__hdr_to_ldr(s, hdr, *x, *y, req_comp ? req_comp : *comp);
    }
    #endif
 
@@ -1026,7 +1337,7 @@ static stbi_uc *stbi__convert_16_to_8(stbi__uint16 *orig, int w, int h, int chan
    for (i = 0; i < img_len; ++i)
       reduced[i] = (stbi_uc)((orig[i] >> 8) & 0xFF); // top half of each byte is sufficient approx of 16->8 bit scaling
 
-   STBI_FREE(orig);
+   stbi__free(orig);
    return reduced;
 }
 
@@ -1042,22 +1353,43 @@ static stbi__uint16 *stbi__convert_8_to_16(stbi_uc *orig, int w, int h, int chan
    for (i = 0; i < img_len; ++i)
       enlarged[i] = (stbi__uint16)((orig[i] << 8) + orig[i]); // replicate to high and low byte, maps 0->0, 255->0xffff
 
-   STBI_FREE(orig);
+   stbi__free(orig);
    return enlarged;
 }
 
-static void stbi__vertical_flip(void *image, int w, int h, int bytes_per_pixel)
+// JPEG, PNG, BMP and TGA write their rows in flipped order themselves, this
+// pass is only left for the other formats
+static void stbi__vertical_flip_strided(void *image, size_t bytes_per_row, int h, size_t stride)
 {
    int row;
-   size_t bytes_per_row = (size_t)w * bytes_per_pixel;
    stbi_uc temp[2048];
    stbi_uc *bytes = (stbi_uc *)image;
 
    for (row = 0; row < (h>>1); row++) {
-      stbi_uc *row0 = bytes + row*bytes_per_row;
-      stbi_uc *row1 = bytes + (h - row - 1)*bytes_per_row;
+      stbi_uc *row0 = bytes + row*stride;
+      stbi_uc *row1 = bytes + (h - row - 1)*stride;
       // swap row0 with row1
       size_t bytes_left = bytes_per_row;
+#if defined(STBI_SSE2)
+      // swap through registers, 32 bytes at a time
+      for (; bytes_left >= 32; bytes_left -= 32, row0 += 32, row1 += 32) {
+         __m128i a0 = _mm_loadu_si128((__m128i *) row0);
+         __m128i a1 = _mm_loadu_si128((__m128i *) (row0 + 16));
+         __m128i b0 = _mm_loadu_si128((__m128i *) row1);
+         __m128i b1 = _mm_loadu_si128((__m128i *) (row1 + 16));
+         _mm_storeu_si128((__m128i *) row0, b0);
+         _mm_storeu_si128((__m128i *) (row0 + 16), b1);
+         _mm_storeu_si128((__m128i *) row1, a0);
+         _mm_storeu_si128((__m128i *) (row1 + 16), a1);
+      }
+#elif defined(STBI_NEON)
+      for (; bytes_left >= 16; bytes_left -= 16, row0 += 16, row1 += 16) {
+         uint8x16_t a = vld1q_u8(row0);
+         uint8x16_t b = vld1q_u8(row1);
+         vst1q_u8(row0, b);
+         vst1q_u8(row1, a);
+      }
+#endif
       while (bytes_left) {
          size_t bytes_copy = (bytes_left < sizeof(temp)) ? bytes_left : sizeof(temp);
          memcpy(temp, row0, bytes_copy);
@@ -1070,6 +1402,41 @@ static void stbi__vertical_flip(void *image, int w, int h, int bytes_per_pixel)
    }
 }
 
+static void stbi__vertical_flip(void *image, int w, int h, int bytes_per_pixel)
+{
+   size_t bytes_per_row = (size_t)w * bytes_per_pixel;
+   stbi__vertical_flip_strided(image, bytes_per_row, h, bytes_per_row);
+}
+
+// row pitch of the caller's destination for a w*h*n image, or 0 if the
+// image doesn't fit
+static size_t stbi__dst_stride(stbi__context *s, int w, int h, int n)
+{
+   size_t row = (size_t) w * n;
+   size_t stride = s->dst_stride ? s->dst_stride : row;
+   if (stride < row || h <= 0 || s->dst_size < row) return 0;
+   if ((size_t) (h-1) > (s->dst_size - row) / stride) return 0;
+   return stride;
+}
+
+// move a decoder's result into the caller's destination, flipping on the way
+static stbi_uc *stbi__copy_to_dst(stbi__context *s, stbi_uc *result, int w, int h, int n, int flip)
+{
+   int row;
+   size_t row_bytes = (size_t) w * n;
+   size_t stride = stbi__dst_stride(s, w, h, n);
+   if (!stride) {
+      stbi__free(result);
+      return stbi__errpuc("output too small", "Image doesn't fit in the output buffer");
+   }
+   for (row = 0; row < h; ++row) {
+      int src_row = flip ? h - 1 - row : row;
+      memcpy(s->dst + row*stride, result + src_row*row_bytes, row_bytes);
+   }
+   stbi__free(result);
+   return s->dst;
+}
+
 static void stbi__vertical_flip_slices(void *image, int w, int h, int z, int bytes_per_pixel)
 {
    int slice;
@@ -1098,11 +1465,24 @@ static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x,
 
    // @TODO: move stbi__convert_format to here
 
-   if (stbi__vertically_flip_on_load) {
+   if (s->dst) {
+      int channels = req_comp ? req_comp : *comp;
+      if (result != s->dst)
+         result = stbi__copy_to_dst(s, (stbi_uc *) result, *x, *y, channels, s->flip_vertically && !ri.flipped);
+      else if (s->flip_vertically && !ri.flipped)
+         stbi__vertical_flip_strided(result, (size_t) *x * channels, *y, stbi__dst_stride(s, *x, *y, channels));
+   } else if (s->flip_vertically && !ri.flipped) {
       int channels = req_comp ? req_comp : *comp;
       stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi_uc));
    }
 
+   // loaders that don't hand their rows over as they go do it all at once
+   if (result && s->rows_ready && !s->rows_emitted) {
+      int channels = req_comp ? req_comp : *comp;
+      size_t stride = s->dst ? stbi__dst_stride(s, *x, *y, channels) : (size_t) *x * channels;
+      s->rows_ready(s->rows_user, (stbi_uc *) result, stride, 0, *y);
+   }
+
    return (unsigned char *) result;
 }
 
@@ -1123,7 +1503,7 @@ static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x,
    // @TODO: move stbi__convert_format16 to here
    // @TODO: special case RGB-to-Y (and RGBA-to-YA) for 8-bit-to-16-bit case to keep more precision
 
-   if (stbi__vertically_flip_on_load) {
+   if (s->flip_vertically && !ri.flipped) {
       int channels = req_comp ? req_comp : *comp;
       stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi__uint16));
    }
@@ -1132,9 +1512,9 @@ static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x,
 }
 
 #if !defined(STBI_NO_HDR) || !defined(STBI_NO_LINEAR)
-static void stbi__float_postprocess(float *result, int *x, int *y, int *comp, int req_comp)
+static void stbi__float_postprocess(stbi__context *s, float *result, int *x, int *y, int *comp, int req_comp)
 {
-   if (stbi__vertically_flip_on_load && result != NULL) {
+   if (s->flip_vertically && result != NULL) {
       int channels = req_comp ? req_comp : *comp;
       stbi__vertical_flip(result, *x, *y, channels * sizeof(float));
    }
@@ -1233,6 +1613,158 @@ STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk, void *u
    return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
 }
 
+// settings of a *_with_options call, the globals are never read
+static void stbi__options_settings(stbi__context *s, stbi_load_options const *options)
+{
+   s->flip_vertically = options->flip_vertically;
+   s->unpremultiply = options->unpremultiply;
+   s->de_iphone = options->convert_iphone_png_to_rgb;
+   s->l2h_gamma = options->ldr_to_hdr_gamma;
+   s->l2h_scale = options->ldr_to_hdr_scale;
+   s->h2l_gamma_i = 1/options->hdr_to_ldr_gamma;
+   s->h2l_scale_i = 1/options->hdr_to_ldr_scale;
+   s->dst = options->output;
+   s->dst_stride = options->output_stride;
+   s->dst_size = options->output_size;
+   switch (options->jpeg_scale_denom) {
+      case 2:  s->jpeg_scale = 1; break;
+      case 4:  s->jpeg_scale = 2; break;
+      case 8:  s->jpeg_scale = 3; break;
+      default: s->jpeg_scale = 0; break;
+   }
+   s->parallel_for = options->parallel_for;
+   s->parallel_user = options->parallel_user;
+   s->rows_ready = options->rows_ready;
+   s->rows_user = options->rows_user;
+   s->stream = s->rows_emitted = 0;
+}
+
+// the allocator is reached through a thread local, install the call's own
+// for its duration and put back whatever an enclosing call had
+static stbi_allocator const *stbi__begin_options_call(stbi_load_options *options)
+{
+   stbi_allocator const *outer = stbi__g_allocator;
+   stbi__g_allocator = options->allocator;
+   stbi__g_failure_reason = NULL;
+   options->failure_reason = NULL;
+   return outer;
+}
+
+static void *stbi__end_options_call(stbi_load_options *options, stbi_allocator const *outer, void *result)
+{
+   if (result == NULL)
+      options->failure_reason = stbi__g_failure_reason;
+   stbi__g_allocator = outer;
+   return result;
+}
+
+STBIDEF void stbi_load_options_init(stbi_load_options *options)
+{
+   memset(options, 0, sizeof(*options));
+   options->ldr_to_hdr_gamma = 2.2f;
+   options->ldr_to_hdr_scale = 1.0f;
+   options->hdr_to_ldr_gamma = 2.2f;
+   options->hdr_to_ldr_scale = 1.0f;
+}
+
+STBIDEF stbi_uc *stbi_load_from_memory_with_options(stbi_uc const *buffer, int len, int *x, int *y, int *comp, stbi_load_options *options)
+{
+   stbi__context s;
+   stbi_allocator const *outer = stbi__begin_options_call(options);
+   stbi__options_settings(&s, options);
+   stbi__start_mem_io(&s,buffer,len);
+   return (stbi_uc *) stbi__end_options_call(options, outer,
+      stbi__load_and_postprocess_8bit(&s,x,y,comp,options->desired_channels));
+}
+
+STBIDEF stbi_uc *stbi_load_from_callbacks_with_options(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, stbi_load_options *options)
+{
+   stbi__context s;
+   stbi_allocator const *outer = stbi__begin_options_call(options);
+   stbi__options_settings(&s, options);
+   stbi__start_callbacks_io(&s, (stbi_io_callbacks *) clbk, user);
+   return (stbi_uc *) stbi__end_options_call(options, outer,
+      stbi__load_and_postprocess_8bit(&s,x,y,comp,options->desired_channels));
+}
+
+static int stbi__stream_8bit(stbi__context *s, int *x, int *y, int *comp, stbi_load_options *options)
+{
+   stbi_uc *result;
+   if (!s->rows_ready) return stbi__err("no rows_ready", "Streaming needs a rows_ready callback");
+   s->stream = 1;
+   result = stbi__load_and_postprocess_8bit(s, x, y, comp, options->desired_channels);
+   if (!result) return 0;
+   // whatever the loader kept: JPEG's last band, other formats' whole image
+   if (result != s->dst) stbi__free(result);
+   return 1;
+}
+
+STBIDEF int stbi_stream_from_memory_with_options(stbi_uc const *buffer, int len, int *x, int *y, int *comp, stbi_load_options *options)
+{
+   stbi__context s;
+   int r;
+   stbi_allocator const *outer = stbi__begin_options_call(options);
+   stbi__options_settings(&s, options);
+   stbi__start_mem_io(&s,buffer,len);
+   r = stbi__stream_8bit(&s,x,y,comp,options);
+   if (!r)
+      options->failure_reason = stbi__g_failure_reason;
+   stbi__g_allocator = outer;
+   return r;
+}
+
+STBIDEF int stbi_stream_from_callbacks_with_options(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, stbi_load_options *options)
+{
+   stbi__context s;
+   int r;
+   stbi_allocator const *outer = stbi__begin_options_call(options);
+   stbi__options_settings(&s, options);
+   stbi__start_callbacks_io(&s, (stbi_io_callbacks *) clbk, user);
+   r = stbi__stream_8bit(&s,x,y,comp,options);
+   if (!r)
+      options->failure_reason = stbi__g_failure_reason;
+   stbi__g_allocator = outer;
+   return r;
+}
+
+STBIDEF stbi_us *stbi_load_16_from_memory_with_options(stbi_uc const *buffer, int len, int *x, int *y, int *comp, stbi_load_options *options)
+{
+   stbi__context s;
+   stbi_allocator const *outer = stbi__begin_options_call(options);
+   stbi__options_settings(&s, options);
+   s.dst = NULL;
+   s.rows_ready = NULL;
+   stbi__start_mem_io(&s,buffer,len);
+   return (stbi_us *) stbi__end_options_call(options, outer,
+      stbi__load_and_postprocess_16bit(&s,x,y,comp,options->desired_channels));
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_with_options(char const *filename, int *x, int *y, int *comp, stbi_load_options *options)
+{
+   stbi_uc *result;
+   FILE *f = stbi__fopen(filename, "rb");
+   if (!f) {
+      stbi__err("can't fopen", "Unable to open file");
+      options->failure_reason = stbi__g_failure_reason;
+      return NULL;
+   }
+   result = stbi_load_from_callbacks_with_options(&stbi__stdio_callbacks, f, x, y, comp, options);
+   fclose(f);
+   return result;
+}
+#endif
+
+STBIDEF void stbi_image_free_with_options(void *retval_from_stbi_load, stbi_load_options const *options)
+{
+   if (options && options->output && retval_from_stbi_load == options->output)
+      return; // the caller's own buffer
+   if (options && options->allocator)
+      options->allocator->free(options->allocator->user, retval_from_stbi_load);
+   else
+      STBI_FREE(retval_from_stbi_load);
+}
+
 #ifndef STBI_NO_GIF
 STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int **delays, int *x, int *y, int *z, int *comp, int req_comp)
 {
@@ -1241,7 +1773,7 @@ STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int *
    stbi__start_mem(&s,buffer,len);
 
    result = (unsigned char*) stbi__load_gif_main(&s, delays, x, y, z, comp, req_comp);
-   if (stbi__vertically_flip_on_load) {
+   if (s.flip_vertically) {
       stbi__vertical_flip_slices( result, *x, *y, *z, *comp );
    }
 
@@ -1258,13 +1790,13 @@ static float *stbi__loadf_main(stbi__context *s, int *x, int *y, int *comp, int
       stbi__result_info ri;
       float *hdr_data = stbi__hdr_load(s,x,y,comp,req_comp, &ri);
       if (hdr_data)
-         stbi__float_postprocess(hdr_data,x,y,comp,req_comp);
+         stbi__float_postprocess(s,hdr_data,x,y,comp,req_comp);
       return hdr_data;
    }
    #endif
    data = stbi__load_and_postprocess_8bit(s, x, y, comp, req_comp);
    if (data)
-      return stbi__ldr_to_hdr(data, *x, *y, req_comp ? req_comp : *comp);
+      return stbi__ldr_to_hdr(s, data, *x, *y, req_comp ? req_comp : *comp);
    return stbi__errpf("unknown image type", "Image not of any known type, or corrupt");
 }
 
@@ -1282,6 +1814,18 @@ STBIDEF float *stbi_loadf_from_callbacks(stbi_io_callbacks const *clbk, void *us
    return stbi__loadf_main(&s,x,y,comp,req_comp);
 }
 
+STBIDEF float *stbi_loadf_from_memory_with_options(stbi_uc const *buffer, int len, int *x, int *y, int *comp, stbi_load_options *options)
+{
+   stbi__context s;
+   stbi_allocator const *outer = stbi__begin_options_call(options);
+   stbi__options_settings(&s, options);
+   s.dst = NULL;
+   s.rows_ready = NULL;
+   stbi__start_mem_io(&s,buffer,len);
+   return (float *) stbi__end_options_call(options, outer,
+      stbi__loadf_main(&s,x,y,comp,options->desired_channels));
+}
+
 #ifndef STBI_NO_STDIO
 STBIDEF float *stbi_loadf(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
@@ -1362,18 +1906,6 @@ STBIDEF int      stbi_is_hdr_from_callbacks(stbi_io_callbacks const *clbk, void
    #endif
 }
 
-#ifndef STBI_NO_LINEAR
-static float stbi__l2h_gamma=2.2f, stbi__l2h_scale=1.0f;
-
-STBIDEF void   stbi_ldr_to_hdr_gamma(float gamma) { stbi__l2h_gamma = gamma; }
-STBIDEF void   stbi_ldr_to_hdr_scale(float scale) { stbi__l2h_scale = scale; }
-#endif
-
-static float stbi__h2l_gamma_i=1.0f/2.2f, stbi__h2l_scale_i=1.0f;
-
-STBIDEF void   stbi_hdr_to_ldr_gamma(float gamma) { stbi__h2l_gamma_i = 1/gamma; }
-STBIDEF void   stbi_hdr_to_ldr_scale(float scale) { stbi__h2l_scale_i = 1/scale; }
-
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -1516,26 +2048,111 @@ static stbi_uc stbi__compute_y(int r, int g, int b)
    return (stbi_uc) (((r*77) + (g*150) +  (29*b)) >> 8);
 }
 
+// expands the start of a row of n pixels to RGBA, returns how many pixels
+// it converted: the rest of the row is left to the scalar loop
+typedef int stbi__expand_row_kernel(stbi_uc const *src, stbi_uc *dest, int n);
+
+#ifdef STBI_SSE2
+static int stbi__expand_grey_simd(stbi_uc const *src, stbi_uc *dest, int n)
+{
+   int i = 0;
+   __m128i alpha = _mm_set1_epi8((char) 255);
+   for (; i + 16 <= n; i += 16) {
+      __m128i g = _mm_loadu_si128((__m128i const *) (src + i));
+      // g g pairs and g 255 pairs, interleaved into g g g 255
+      __m128i gg_lo = _mm_unpacklo_epi8(g, g);
+      __m128i gg_hi = _mm_unpackhi_epi8(g, g);
+      __m128i ga_lo = _mm_unpacklo_epi8(g, alpha);
+      __m128i ga_hi = _mm_unpackhi_epi8(g, alpha);
+      _mm_storeu_si128((__m128i *) (dest + 4*i +  0), _mm_unpacklo_epi16(gg_lo, ga_lo));
+      _mm_storeu_si128((__m128i *) (dest + 4*i + 16), _mm_unpackhi_epi16(gg_lo, ga_lo));
+      _mm_storeu_si128((__m128i *) (dest + 4*i + 32), _mm_unpacklo_epi16(gg_hi, ga_hi));
+      _mm_storeu_si128((__m128i *) (dest + 4*i + 48), _mm_unpackhi_epi16(gg_hi, ga_hi));
+   }
+   return i;
+}
+
+static int stbi__expand_grey_alpha_simd(stbi_uc const *src, stbi_uc *dest, int n)
+{
+   int i = 0;
+   __m128i low = _mm_set1_epi16(0xff);
+   for (; i + 8 <= n; i += 8) {
+      __m128i ga = _mm_loadu_si128((__m128i const *) (src + 2*i));
+      // g a as 16 bits: g g next to g a is g g g a
+      __m128i g = _mm_and_si128(ga, low);
+      __m128i gg = _mm_or_si128(g, _mm_slli_epi16(g, 8));
+      _mm_storeu_si128((__m128i *) (dest + 4*i +  0), _mm_unpacklo_epi16(gg, ga));
+      _mm_storeu_si128((__m128i *) (dest + 4*i + 16), _mm_unpackhi_epi16(gg, ga));
+   }
+   return i;
+}
+#endif
+
+#ifdef STBI_SSSE3
+static STBI__SSSE3_TARGET int stbi__expand_rgb_ssse3(stbi_uc const *src, stbi_uc *dest, int n)
+{
+   int i = 0;
+   // 4 pixels out of the first 12 bytes of a load, or out of its last 12
+   __m128i first = _mm_setr_epi8(0,1,2,-1, 3,4,5,-1, 6,7,8,-1, 9,10,11,-1);
+   __m128i last = _mm_setr_epi8(4,5,6,-1, 7,8,9,-1, 10,11,12,-1, 13,14,15,-1);
+   __m128i alpha = _mm_set1_epi32((int) 0xff000000u);
+   for (; i + 16 <= n; i += 16) {
+      // 48 bytes in 4 loads, none reaching past the 16th pixel
+      stbi_uc const *p = src + 3*i;
+      __m128i a = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *) (p +  0)), first);
+      __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *) (p + 12)), first);
+      __m128i c = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *) (p + 24)), first);
+      __m128i d = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *) (p + 32)), last);
+      _mm_storeu_si128((__m128i *) (dest + 4*i +  0), _mm_or_si128(a, alpha));
+      _mm_storeu_si128((__m128i *) (dest + 4*i + 16), _mm_or_si128(b, alpha));
+      _mm_storeu_si128((__m128i *) (dest + 4*i + 32), _mm_or_si128(c, alpha));
+      _mm_storeu_si128((__m128i *) (dest + 4*i + 48), _mm_or_si128(d, alpha));
+   }
+   return i;
+}
+#endif
+
+// the SIMD kernel expanding img_n channels to RGBA, NULL when there's none
+static stbi__expand_row_kernel *stbi__expand_kernel(int img_n, int req_comp)
+{
+   if (req_comp != 4) return NULL;
+#ifdef STBI_SSSE3
+   if (img_n == 3 && stbi__ssse3_available()) return stbi__expand_rgb_ssse3;
+#endif
+#ifdef STBI_SSE2
+   if (img_n == 1 && stbi__sse2_available()) return stbi__expand_grey_simd;
+   if (img_n == 2 && stbi__sse2_available()) return stbi__expand_grey_alpha_simd;
+#endif
+   STBI_NOTUSED(img_n);
+   return NULL;
+}
+
 static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int req_comp, unsigned int x, unsigned int y)
 {
    int i,j;
    unsigned char *good;
+   stbi__expand_row_kernel *expand;
 
    if (req_comp == img_n) return data;
    STBI_ASSERT(req_comp >= 1 && req_comp <= 4);
 
    good = (unsigned char *) stbi__malloc_mad3(req_comp, x, y, 0);
    if (good == NULL) {
-      STBI_FREE(data);
+      stbi__free(data);
       return stbi__errpuc("outofmem", "Out of memory");
    }
 
+   expand = stbi__expand_kernel(img_n, req_comp);
    for (j=0; j < (int) y; ++j) {
       unsigned char *src  = data + j * x * img_n   ;
       unsigned char *dest = good + j * x * req_comp;
+      // pixels the SIMD kernel did
+      int done = expand ? expand(src, dest, (int) x) : 0;
+      src  += done * img_n;
+      dest += done * req_comp;
 
       #define STBI__COMBO(a,b)  ((a)*8+(b))
-      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=(int) x-done-1; i >= 0; --i, src += a, dest += b)
       // convert source image with img_n components to one with req_comp components;
       // avoid switch per pixel, so use switch per scanline and massive macros
       switch (STBI__COMBO(img_n, req_comp)) {
@@ -1556,7 +2173,7 @@ static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int r
       #undef STBI__CASE
    }
 
-   STBI_FREE(data);
+   stbi__free(data);
    return good;
 }
 
@@ -1575,7 +2192,7 @@ static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int r
 
    good = (stbi__uint16 *) stbi__malloc(req_comp * x * y * 2);
    if (good == NULL) {
-      STBI_FREE(data);
+      stbi__free(data);
       return (stbi__uint16 *) stbi__errpuc("outofmem", "Out of memory");
    }
 
@@ -1605,45 +2222,45 @@ static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int r
       #undef STBI__CASE
    }
 
-   STBI_FREE(data);
+   stbi__free(data);
    return good;
 }
 
 #ifndef STBI_NO_LINEAR
-static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp)
+static float   *stbi__ldr_to_hdr(stbi__context *s, stbi_uc *data, int x, int y, int comp)
 {
    int i,k,n;
    float *output;
    if (!data) return NULL;
    output = (float *) stbi__malloc_mad4(x, y, comp, sizeof(float), 0);
-   if (output == NULL) { STBI_FREE(data); return stbi__errpf("outofmem", "Out of memory"); }
+   if (output == NULL) { stbi__free(data); return stbi__errpf("outofmem", "Out of memory"); }
    // compute number of non-alpha components
    if (comp & 1) n = comp; else n = comp-1;
    for (i=0; i < x*y; ++i) {
       for (k=0; k < n; ++k) {
-         output[i*comp + k] = (float) (pow(data[i*comp+k]/255.0f, stbi__l2h_gamma) * stbi__l2h_scale);
+         output[i*comp + k] = (float) (pow(data[i*comp+k]/255.0f, s->l2h_gamma) * s->l2h_scale);
       }
       if (k < comp) output[i*comp + k] = data[i*comp+k]/255.0f;
    }
-   STBI_FREE(data);
+   stbi__free(data);
    return output;
 }
 #endif
 
 #ifndef STBI_NO_HDR
 #define stbi__float2int(x)   ((int) (x))
-static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
+static stbi_uc *stbi__hdr_to_ldr(stbi__context *s, float   *data, int x, int y, int comp)
 {
    int i,k,n;
    stbi_uc *output;
    if (!data) return NULL;
    output = (stbi_uc *) stbi__malloc_mad3(x, y, comp, 0);
-   if (output == NULL) { STBI_FREE(data); return stbi__errpuc("outofmem", "Out of memory"); }
+   if (output == NULL) { stbi__free(data); return stbi__errpuc("outofmem", "Out of memory"); }
    // compute number of non-alpha components
    if (comp & 1) n = comp; else n = comp-1;
    for (i=0; i < x*y; ++i) {
       for (k=0; k < n; ++k) {
-         float z = (float) pow(data[i*comp+k]*stbi__h2l_scale_i, stbi__h2l_gamma_i) * 255 + 0.5f;
+         float z = (float) pow(data[i*comp+k]*s->h2l_scale_i, s->h2l_gamma_i) * 255 + 0.5f;
          if (z < 0) z = 0;
          if (z > 255) z = 255;
          output[i*comp + k] = (stbi_uc) stbi__float2int(z);
@@ -1655,7 +2272,7 @@ static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
          output[i*comp + k] = (stbi_uc) stbi__float2int(z);
       }
    }
-   STBI_FREE(data);
+   stbi__free(data);
    return output;
 }
 #endif
@@ -1684,7 +2301,7 @@ static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
 #ifndef STBI_NO_JPEG
 
 // huffman decoding acceleration
-#define FAST_BITS   9  // larger handles more cases; smaller stomps less cache
+#define FAST_BITS   10 // larger handles more cases; smaller stomps less cache
 
 typedef struct
 {
@@ -1727,7 +2344,7 @@ typedef struct
       int      coeff_w, coeff_h; // number of 8x8 coefficient blocks
    } img_comp[4];
 
-   stbi__uint32   code_buffer; // jpeg entropy-coded buffer
+   stbi__uint64   code_buffer; // jpeg entropy-coded buffer, next bit in the MSB
    int            code_bits;   // number of valid bits
    unsigned char  marker;      // marker seen while filling entropy buffer
    int            nomore;      // flag if we saw a marker so must stop
@@ -1745,8 +2362,14 @@ typedef struct
    int scan_n, order[4];
    int restart_interval, todo;
 
+   int scale;      // log2 of the scaling denominator, see jpeg_scale_denom
+   int block_size; // size of the decoded blocks, 8 >> scale
+
+   void *stream;   // rows_ready loads: the stbi__jpeg_output fed by stbi__jpeg_stream
+
 // kernels
    void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
+   void (*idct_pair_kernel)(stbi_uc *out_a, int stride_a, short *a, stbi_uc *out_b, int stride_b, short *b); // NULL: one block at a time
    void (*YCbCr_to_RGB_kernel)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step);
    stbi_uc *(*resample_row_hv_2_kernel)(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs);
 } stbi__jpeg;
@@ -1756,9 +2379,12 @@ static int stbi__build_huffman(stbi__huffman *h, int *count)
    int i,j,k=0;
    unsigned int code;
    // build size list for each symbol (from JPEG spec)
-   for (i=0; i < 16; ++i)
-      for (j=0; j < count[i]; ++j)
+   for (i=0; i < 16; ++i) {
+      for (j=0; j < count[i]; ++j) {
          h->size[k++] = (stbi_uc) (i+1);
+         if (k >= 257) return stbi__err("bad size list","Corrupt JPEG");
+      }
+   }
    h->size[k] = 0;
 
    // compute actual symbols (from jpeg spec)
@@ -1815,15 +2441,43 @@ static void stbi__build_fast_ac(stbi__int16 *fast_ac, stbi__huffman *h)
             // if the result is small enough, we can fit it in fast_ac table
             if (k >= -128 && k <= 127)
                fast_ac[i] = (stbi__int16) ((k * 256) + (run * 16) + (len + magbits));
+         } else if (!magbits && (run == 0 || run == 15)) {
+            // end of block or run of 16 zeros, stored with a zero value
+            fast_ac[i] = (stbi__int16) ((run * 16) + len);
          }
       }
    }
 }
 
+// fills the bit buffer up to at least 57 bits, unless a marker stops it
 static void stbi__grow_buffer_unsafe(stbi__jpeg *j)
 {
+   stbi__context *s = j->s;
+   if (!j->nomore && s->img_buffer_end - s->img_buffer >= 8) {
+      // bulk refill: take all the whole bytes that fit from one 8-byte
+      // big-endian load, as long as none of them is 0xff (byte stuffing or
+      // a marker, left to the loop below)
+      int n = (63 - j->code_bits) >> 3, i;
+      stbi__uint64 v = 0, keep, ff;
+      for (i=0; i < 8; ++i)
+         v = (v << 8) | s->img_buffer[i];
+      keep = ~(stbi__uint64) 0 << (64 - 8*n);
+      ff = ((v & 0x7f7f7f7f7f7f7f7fULL) + 0x0101010101010101ULL) & v & 0x8080808080808080ULL;
+      if ((ff & keep) == 0) {
+         j->code_buffer |= (v & keep) >> j->code_bits;
+         j->code_bits += 8*n;
+         s->img_buffer += n;
+         return;
+      }
+   }
+   if (j->nomore) {
+      // past a marker the stream reads as zeros. code_bits may have gone
+      // negative on corrupt data, so don't shift anything in
+      while (j->code_bits <= 56) j->code_bits += 8;
+      return;
+   }
    do {
-      unsigned int b = j->nomore ? 0 : stbi__get8(j->s);
+      unsigned int b = stbi__get8(j->s);
       if (b == 0xff) {
          int c = stbi__get8(j->s);
          while (c == 0xff) c = stbi__get8(j->s); // consume fill bytes
@@ -1833,14 +2487,11 @@ static void stbi__grow_buffer_unsafe(stbi__jpeg *j)
             return;
          }
       }
-      j->code_buffer |= b << (24 - j->code_bits);
+      j->code_buffer |= (stbi__uint64) b << (56 - j->code_bits);
       j->code_bits += 8;
-   } while (j->code_bits <= 24);
+   } while (j->code_bits <= 56);
 }
 
-// (1 << n) - 1
-static const stbi__uint32 stbi__bmask[17]={0,1,3,7,15,31,63,127,255,511,1023,2047,4095,8191,16383,32767,65535};
-
 // decode a jpeg huffman value from the bitstream
 stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
 {
@@ -1851,7 +2502,7 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
 
    // look at the top FAST_BITS and determine what symbol ID it is,
    // if the code is <= FAST_BITS
-   c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+   c = (int) (j->code_buffer >> (64 - FAST_BITS));
    k = h->fast[c];
    if (k < 255) {
       int s = h->size[k];
@@ -1868,7 +2519,7 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
    // end; in other words, regardless of the number of bits, it
    // wants to be compared against something shifted to have 16;
    // that way we don't need to shift inside the loop.
-   temp = j->code_buffer >> 16;
+   temp = (unsigned int) (j->code_buffer >> 48);
    for (k=FAST_BITS+1 ; ; ++k)
       if (temp < h->maxcode[k])
          break;
@@ -1882,8 +2533,8 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
       return -1;
 
    // convert the huffman code to the symbol id
-   c = ((j->code_buffer >> (32 - k)) & stbi__bmask[k]) + h->delta[k];
-   STBI_ASSERT((((j->code_buffer) >> (32 - h->size[c])) & stbi__bmask[h->size[c]]) == h->code[c]);
+   c = (int) (j->code_buffer >> (64 - k)) + h->delta[k];
+   STBI_ASSERT((j->code_buffer >> (64 - h->size[c])) == h->code[c]);
 
    // convert the id to a symbol
    j->code_bits -= k;
@@ -1898,15 +2549,14 @@ static const int stbi__jbias[16] = {0,-1,-3,-7,-15,-31,-63,-127,-255,-511,-1023,
 // always extends everything it receives.
 stbi_inline static int stbi__extend_receive(stbi__jpeg *j, int n)
 {
-   unsigned int k;
+   int k;
    int sgn;
+   STBI_ASSERT(n > 0 && n < 16);
    if (j->code_bits < n) stbi__grow_buffer_unsafe(j);
 
-   sgn = (stbi__int32)j->code_buffer >> 31; // sign bit is always in MSB
-   k = stbi_lrot(j->code_buffer, n);
-   STBI_ASSERT(n >= 0 && n < (int) (sizeof(stbi__bmask)/sizeof(*stbi__bmask)));
-   j->code_buffer = k & ~stbi__bmask[n];
-   k &= stbi__bmask[n];
+   sgn = - (int) (j->code_buffer >> 63); // sign bit is always in MSB
+   k = (int) (j->code_buffer >> (64 - n));
+   j->code_buffer <<= n;
    j->code_bits -= n;
    return k + (stbi__jbias[n] & ~sgn);
 }
@@ -1914,23 +2564,23 @@ stbi_inline static int stbi__extend_receive(stbi__jpeg *j, int n)
 // get some unsigned bits
 stbi_inline static int stbi__jpeg_get_bits(stbi__jpeg *j, int n)
 {
-   unsigned int k;
+   int k;
+   STBI_ASSERT(n > 0 && n < 16);
    if (j->code_bits < n) stbi__grow_buffer_unsafe(j);
-   k = stbi_lrot(j->code_buffer, n);
-   j->code_buffer = k & ~stbi__bmask[n];
-   k &= stbi__bmask[n];
+   k = (int) (j->code_buffer >> (64 - n));
+   j->code_buffer <<= n;
    j->code_bits -= n;
    return k;
 }
 
 stbi_inline static int stbi__jpeg_get_bit(stbi__jpeg *j)
 {
-   unsigned int k;
+   int k;
    if (j->code_bits < 1) stbi__grow_buffer_unsafe(j);
-   k = j->code_buffer;
+   k = (int) (j->code_buffer >> 63);
    j->code_buffer <<= 1;
    --j->code_bits;
-   return k & 0x80000000;
+   return k;
 }
 
 // given a value that's at position X in the zigzag stream,
@@ -1958,7 +2608,7 @@ static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman
 
    if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
    t = stbi__jpeg_huff_decode(j, hdc);
-   if (t < 0) return stbi__err("bad huffman code","Corrupt JPEG");
+   if (t < 0 || t > 15) return stbi__err("bad huffman code","Corrupt JPEG");
 
    // 0 all the ac values now so we can do it 32-bits at a time
    memset(data,0,64*sizeof(data[0]));
@@ -1974,16 +2624,21 @@ static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman
       unsigned int zig;
       int c,r,s;
       if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-      c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+      c = (int) (j->code_buffer >> (64 - FAST_BITS));
       r = fac[c];
       if (r) { // fast-AC path
-         k += (r >> 4) & 15; // run
          s = r & 15; // combined length
          j->code_buffer <<= s;
          j->code_bits -= s;
-         // decode into unzigzag'd location
-         zig = stbi__jpeg_dezigzag[k++];
-         data[zig] = (short) ((r >> 8) * dequant[zig]);
+         if ((r >> 8) == 0) { // no coefficient
+            if (r < 16) break; // end block
+            k += 16;
+         } else {
+            k += (r >> 4) & 15; // run
+            // decode into unzigzag'd location
+            zig = stbi__jpeg_dezigzag[k++];
+            data[zig] = (short) ((r >> 8) * dequant[zig]);
+         }
       } else {
          int rs = stbi__jpeg_huff_decode(j, hac);
          if (rs < 0) return stbi__err("bad huffman code","Corrupt JPEG");
@@ -2015,11 +2670,12 @@ static int stbi__jpeg_decode_block_prog_dc(stbi__jpeg *j, short data[64], stbi__
       // first scan for DC coefficient, must be first
       memset(data,0,64*sizeof(data[0])); // 0 all the ac values now
       t = stbi__jpeg_huff_decode(j, hdc);
+      if (t < 0 || t > 15) return stbi__err("bad huffman code","Corrupt JPEG");
       diff = t ? stbi__extend_receive(j, t) : 0;
 
       dc = j->img_comp[b].dc_pred + diff;
       j->img_comp[b].dc_pred = dc;
-      data[0] = (short) (dc << j->succ_low);
+      data[0] = (short) (dc * (1 << j->succ_low));
    } else {
       // refinement scan for DC coefficient
       if (stbi__jpeg_get_bit(j))
@@ -2048,15 +2704,20 @@ static int stbi__jpeg_decode_block_prog_ac(stbi__jpeg *j, short data[64], stbi__
          unsigned int zig;
          int c,r,s;
          if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-         c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+         c = (int) (j->code_buffer >> (64 - FAST_BITS));
          r = fac[c];
          if (r) { // fast-AC path
-            k += (r >> 4) & 15; // run
             s = r & 15; // combined length
             j->code_buffer <<= s;
             j->code_bits -= s;
-            zig = stbi__jpeg_dezigzag[k++];
-            data[zig] = (short) ((r >> 8) << shift);
+            if ((r >> 8) == 0) { // no coefficient
+               if (r < 16) break; // end of band, eob_run is already 0
+               k += 16;
+            } else {
+               k += (r >> 4) & 15; // run
+               zig = stbi__jpeg_dezigzag[k++];
+               data[zig] = (short) ((r >> 8) * (1 << shift));
+            }
          } else {
             int rs = stbi__jpeg_huff_decode(j, hac);
             if (rs < 0) return stbi__err("bad huffman code","Corrupt JPEG");
@@ -2074,7 +2735,7 @@ static int stbi__jpeg_decode_block_prog_ac(stbi__jpeg *j, short data[64], stbi__
             } else {
                k += r;
                zig = stbi__jpeg_dezigzag[k++];
-               data[zig] = (short) (stbi__extend_receive(j,s) << shift);
+               data[zig] = (short) (stbi__extend_receive(j,s) * (1 << shift));
             }
          }
       } while (k <= j->spec_end);
@@ -2260,6 +2921,87 @@ static void stbi__idct_block(stbi_uc *out, int out_stride, short data[64])
    }
 }
 
+// reduced-size IDCTs, for decoding at 1/2, 1/4 or 1/8 scale. each output
+// pixel is the average of the full-size pixels it covers (before clamping),
+// computed straight from the coefficients: the constants are the 1D basis
+// functions averaged over each output pixel's span, times 4096. the even
+// frequencies are symmetric around the block center and the odd ones
+// antisymmetric, so each 1D pass splits into two halves, like the full IDCT
+
+// 8 coefficients s0..s7 (s4 averages out) to 4 pair averages o0..o3
+#define STBI__IDCT_HALF(s0,s1,s2,s3,s5,s6,s7) \
+   int e0 = (s0) * 1448; \
+   int e1 = (s2) * 1338 - (s6) * 554; \
+   int d0 = (s1) * 1856 + (s3) *  652 - (s5) *  435 - (s7) * 369; \
+   int d1 = (s1) *  769 - (s3) * 1573 + (s5) * 1051 - (s7) * 153; \
+   int o0 = e0 + e1 + d0, o1 = e0 - e1 + d1; \
+   int o2 = e0 - e1 - d1, o3 = e0 + e1 - d0;
+
+// 8 coefficients to the 2 averages of each half
+#define STBI__IDCT_QUARTER(s0,s1,s3,s5,s7) \
+   int e0 = (s0) * 1448; \
+   int d0 = (s1) * 1312 - (s3) * 461 + (s5) * 308 - (s7) * 261; \
+   int o0 = e0 + d0, o1 = e0 - d0;
+
+static void stbi__idct_4x4(stbi_uc *out, int out_stride, short data[64])
+{
+   int i, tmp[8*4], *t = tmp;
+   short *d = data;
+   // rows, keeping 2 extra bits; a row without AC terms is flat
+   for (i=0; i < 8; ++i, d += 8, t += 4) {
+      if (d[1]==0 && d[2]==0 && d[3]==0 && d[5]==0 && d[6]==0 && d[7]==0) {
+         t[0] = t[1] = t[2] = t[3] = (d[0] * 1448 + 512) >> 10;
+      } else {
+         STBI__IDCT_HALF(d[0],d[1],d[2],d[3],d[5],d[6],d[7])
+         t[0] = (o0 + 512) >> 10;
+         t[1] = (o1 + 512) >> 10;
+         t[2] = (o2 + 512) >> 10;
+         t[3] = (o3 + 512) >> 10;
+      }
+   }
+   // columns; 14 bits of scale left, and the 128 bias
+   for (i=0; i < 4; ++i, ++out) {
+      t = tmp + i;
+      {
+         STBI__IDCT_HALF(t[0],t[4],t[8],t[12],t[20],t[24],t[28])
+         o0 += (128 << 14) + (1 << 13);
+         o1 += (128 << 14) + (1 << 13);
+         o2 += (128 << 14) + (1 << 13);
+         o3 += (128 << 14) + (1 << 13);
+         out[0]            = stbi__clamp(o0 >> 14);
+         out[out_stride]   = stbi__clamp(o1 >> 14);
+         out[out_stride*2] = stbi__clamp(o2 >> 14);
+         out[out_stride*3] = stbi__clamp(o3 >> 14);
+      }
+   }
+}
+
+static void stbi__idct_2x2(stbi_uc *out, int out_stride, short data[64])
+{
+   int i, tmp[8*2], *t = tmp;
+   short *d = data;
+   for (i=0; i < 8; ++i, d += 8, t += 2) {
+      STBI__IDCT_QUARTER(d[0],d[1],d[3],d[5],d[7])
+      t[0] = (o0 + 512) >> 10;
+      t[1] = (o1 + 512) >> 10;
+   }
+   for (i=0; i < 2; ++i, ++out) {
+      t = tmp + i;
+      {
+         STBI__IDCT_QUARTER(t[0],t[2],t[6],t[10],t[14])
+         out[0]          = stbi__clamp((o0 + (128 << 14) + (1 << 13)) >> 14);
+         out[out_stride] = stbi__clamp((o1 + (128 << 14) + (1 << 13)) >> 14);
+      }
+   }
+}
+
+static void stbi__idct_1x1(stbi_uc *out, int out_stride, short data[64])
+{
+   STBI_NOTUSED(out_stride);
+   // the block average is just the DC term
+   out[0] = stbi__clamp(((data[0] + 4) >> 3) + 128);
+}
+
 #ifdef STBI_SSE2
 // sse2 integer IDCT. not the fastest possible implementation but it
 // produces bit-identical results to the generic C version so it's
@@ -2441,6 +3183,185 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
 
 #endif // STBI_SSE2
 
+#ifdef STBI_AVX2
+// the SSE2 IDCT above on two blocks at once, a in the low 128-bit lane of
+// every register and b in the high one. AVX2 unpacks, packs and shuffles
+// stay within their lane, so the transposes carry over unchanged and both
+// blocks come out bit-identical to stbi__idct_block.
+static STBI__AVX2_TARGET void stbi__idct_pair_avx2(stbi_uc *out_a, int stride_a, short *a, stbi_uc *out_b, int stride_b, short *b)
+{
+   __m256i row0, row1, row2, row3, row4, row5, row6, row7;
+   __m256i tmp;
+
+   // dot product constant: even elems=x, odd elems=y
+   #define dct_const(x,y)  _mm256_set1_epi32((int) (((unsigned int) (y) << 16) | ((x) & 0xffff)))
+
+   #define dct_rot(out0,out1, x,y,c0,c1) \
+      __m256i c0##lo = _mm256_unpacklo_epi16((x),(y)); \
+      __m256i c0##hi = _mm256_unpackhi_epi16((x),(y)); \
+      __m256i out0##_l = _mm256_madd_epi16(c0##lo, c0); \
+      __m256i out0##_h = _mm256_madd_epi16(c0##hi, c0); \
+      __m256i out1##_l = _mm256_madd_epi16(c0##lo, c1); \
+      __m256i out1##_h = _mm256_madd_epi16(c0##hi, c1)
+
+   #define dct_widen(out, in) \
+      __m256i out##_l = _mm256_srai_epi32(_mm256_unpacklo_epi16(_mm256_setzero_si256(), (in)), 4); \
+      __m256i out##_h = _mm256_srai_epi32(_mm256_unpackhi_epi16(_mm256_setzero_si256(), (in)), 4)
+
+   #define dct_wadd(out, a, b) \
+      __m256i out##_l = _mm256_add_epi32(a##_l, b##_l); \
+      __m256i out##_h = _mm256_add_epi32(a##_h, b##_h)
+
+   #define dct_wsub(out, a, b) \
+      __m256i out##_l = _mm256_sub_epi32(a##_l, b##_l); \
+      __m256i out##_h = _mm256_sub_epi32(a##_h, b##_h)
+
+   #define dct_bfly32o(out0, out1, a,b,bias,s) \
+      { \
+         __m256i abiased_l = _mm256_add_epi32(a##_l, bias); \
+         __m256i abiased_h = _mm256_add_epi32(a##_h, bias); \
+         dct_wadd(sum, abiased, b); \
+         dct_wsub(dif, abiased, b); \
+         out0 = _mm256_packs_epi32(_mm256_srai_epi32(sum_l, s), _mm256_srai_epi32(sum_h, s)); \
+         out1 = _mm256_packs_epi32(_mm256_srai_epi32(dif_l, s), _mm256_srai_epi32(dif_h, s)); \
+      }
+
+   #define dct_interleave8(a, b) \
+      tmp = a; \
+      a = _mm256_unpacklo_epi8(a, b); \
+      b = _mm256_unpackhi_epi8(tmp, b)
+
+   #define dct_interleave16(a, b) \
+      tmp = a; \
+      a = _mm256_unpacklo_epi16(a, b); \
+      b = _mm256_unpackhi_epi16(tmp, b)
+
+   #define dct_pass(bias,shift) \
+      { \
+         /* even part */ \
+         dct_rot(t2e,t3e, row2,row6, rot0_0,rot0_1); \
+         __m256i sum04 = _mm256_add_epi16(row0, row4); \
+         __m256i dif04 = _mm256_sub_epi16(row0, row4); \
+         dct_widen(t0e, sum04); \
+         dct_widen(t1e, dif04); \
+         dct_wadd(x0, t0e, t3e); \
+         dct_wsub(x3, t0e, t3e); \
+         dct_wadd(x1, t1e, t2e); \
+         dct_wsub(x2, t1e, t2e); \
+         /* odd part */ \
+         dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
+         dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
+         __m256i sum17 = _mm256_add_epi16(row1, row7); \
+         __m256i sum35 = _mm256_add_epi16(row3, row5); \
+         dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
+         dct_wadd(x4, y0o, y4o); \
+         dct_wadd(x5, y1o, y5o); \
+         dct_wadd(x6, y2o, y5o); \
+         dct_wadd(x7, y3o, y4o); \
+         dct_bfly32o(row0,row7, x0,x7,bias,shift); \
+         dct_bfly32o(row1,row6, x1,x6,bias,shift); \
+         dct_bfly32o(row2,row5, x2,x5,bias,shift); \
+         dct_bfly32o(row3,row4, x3,x4,bias,shift); \
+      }
+
+   // row k of a in the low lane, of b in the high one
+   #define dct_load(k) \
+      _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_load_si128((const __m128i *) (a + k*8))), _mm_load_si128((const __m128i *) (b + k*8)), 1)
+
+   // the 8 rows of one block, as the SSE2 IDCT stores them
+   #define dct_store(out, stride, p0, p1, p2, p3) \
+      _mm_storel_epi64((__m128i *) out, p0); out += stride; \
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p0, 0x4e)); out += stride; \
+      _mm_storel_epi64((__m128i *) out, p2); out += stride; \
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p2, 0x4e)); out += stride; \
+      _mm_storel_epi64((__m128i *) out, p1); out += stride; \
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p1, 0x4e)); out += stride; \
+      _mm_storel_epi64((__m128i *) out, p3); out += stride; \
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p3, 0x4e))
+
+   __m256i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
+   __m256i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
+   __m256i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+   __m256i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+   __m256i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
+   __m256i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
+   __m256i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
+   __m256i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
+
+   // rounding biases in column/row passes, see stbi__idct_block for explanation.
+   __m256i bias_0 = _mm256_set1_epi32(512);
+   __m256i bias_1 = _mm256_set1_epi32(65536 + (128<<17));
+
+   row0 = dct_load(0);
+   row1 = dct_load(1);
+   row2 = dct_load(2);
+   row3 = dct_load(3);
+   row4 = dct_load(4);
+   row5 = dct_load(5);
+   row6 = dct_load(6);
+   row7 = dct_load(7);
+
+   // column pass
+   dct_pass(bias_0, 10);
+
+   {
+      // 16bit 8x8 transposes of both blocks
+      dct_interleave16(row0, row4);
+      dct_interleave16(row1, row5);
+      dct_interleave16(row2, row6);
+      dct_interleave16(row3, row7);
+
+      dct_interleave16(row0, row2);
+      dct_interleave16(row1, row3);
+      dct_interleave16(row4, row6);
+      dct_interleave16(row5, row7);
+
+      dct_interleave16(row0, row1);
+      dct_interleave16(row2, row3);
+      dct_interleave16(row4, row5);
+      dct_interleave16(row6, row7);
+   }
+
+   // row pass
+   dct_pass(bias_1, 17);
+
+   {
+      // pack
+      __m256i p0 = _mm256_packus_epi16(row0, row1);
+      __m256i p1 = _mm256_packus_epi16(row2, row3);
+      __m256i p2 = _mm256_packus_epi16(row4, row5);
+      __m256i p3 = _mm256_packus_epi16(row6, row7);
+
+      // 8bit 8x8 transposes
+      dct_interleave8(p0, p2);
+      dct_interleave8(p1, p3);
+
+      dct_interleave8(p0, p1);
+      dct_interleave8(p2, p3);
+
+      dct_interleave8(p0, p2);
+      dct_interleave8(p1, p3);
+
+      // store a from the low lanes, b from the high ones
+      dct_store(out_a, stride_a, _mm256_castsi256_si128(p0), _mm256_castsi256_si128(p1), _mm256_castsi256_si128(p2), _mm256_castsi256_si128(p3));
+      dct_store(out_b, stride_b, _mm256_extracti128_si256(p0, 1), _mm256_extracti128_si256(p1, 1), _mm256_extracti128_si256(p2, 1),
+                _mm256_extracti128_si256(p3, 1));
+   }
+
+#undef dct_const
+#undef dct_rot
+#undef dct_widen
+#undef dct_wadd
+#undef dct_wsub
+#undef dct_bfly32o
+#undef dct_interleave8
+#undef dct_interleave16
+#undef dct_pass
+#undef dct_load
+#undef dct_store
+}
+#endif // STBI_AVX2
+
 #ifdef STBI_NEON
 
 // NEON integer IDCT. should produce bit-identical
@@ -2649,6 +3570,53 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
 
 #endif // STBI_NEON
 
+// blocks on their way to the IDCT. With a kernel taking two blocks at
+// once, each block waits for the next one; otherwise it goes through right
+// away. A waiting block's coefficients have to stay put until it is
+// paired or flushed.
+typedef struct
+{
+   stbi__jpeg *z;
+   stbi_uc *out;  // the waiting block, NULL when none waits
+   int out_stride;
+   short *data;
+} stbi__idct_queue;
+
+static void stbi__idct_queue_init(stbi__idct_queue *q, stbi__jpeg *z)
+{
+   q->z = z;
+   q->out = NULL;
+}
+
+static void stbi__idct_queue_block(stbi__idct_queue *q, stbi_uc *out, int out_stride, short *data)
+{
+   if (!q->z->idct_pair_kernel) {
+      q->z->idct_block_kernel(out, out_stride, data);
+   } else if (!q->out) {
+      q->out = out;
+      q->out_stride = out_stride;
+      q->data = data;
+   } else {
+      q->z->idct_pair_kernel(q->out, q->out_stride, q->data, out, out_stride, data);
+      q->out = NULL;
+   }
+}
+
+static void stbi__idct_queue_flush(stbi__idct_queue *q)
+{
+   if (q->out) {
+      q->z->idct_block_kernel(q->out, q->out_stride, q->data);
+      q->out = NULL;
+   }
+}
+
+// the half of a two-block buffer that doesn't hold the waiting block, for
+// decoding the next block into
+static short *stbi__idct_queue_slot(stbi__idct_queue *q, short *buffer)
+{
+   return q->out && q->data == buffer ? buffer + 64 : buffer;
+}
+
 #define STBI__MARKER_none  0xff
 // if there's a pending marker from the entropy stream, return that
 // otherwise, fetch from the stream and get a marker. if there's no
@@ -2683,13 +3651,328 @@ static void stbi__jpeg_reset(stbi__jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
+// parallel decoding of large images, see stbi_load_options::parallel_for.
+// tasks can run on any thread: they never allocate, and report their
+// errors through the job since stbi__g_failure_reason is per thread
+
+#ifndef STBI_JPEG_PARALLEL_MIN_PIXELS
+#define STBI_JPEG_PARALLEL_MIN_PIXELS  (4 << 20)
+#endif
+
+#define STBI__JPEG_MAX_TASKS      32 // a job is cut in at most this many tasks
+#define STBI__JPEG_BAND_MCU_ROWS  4  // MCU rows per band of the pipelined decode
+
+static int stbi__jpeg_parallel(stbi__jpeg *z)
+{
+   return z->s->parallel_for != NULL && (stbi__uint64) z->s->img_x * z->s->img_y >= STBI_JPEG_PARALLEL_MIN_PIXELS;
+}
+
+// MCU grid of the current scan: an interleaved scan codes h*v blocks of
+// each of its components per MCU, a single-component scan one block per
+// MCU in raster order of that component
+static void stbi__jpeg_scan_grid(stbi__jpeg *z, int *mcu_w, int *mcu_h, int *mcu_blocks)
+{
+   int k;
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      *mcu_w = (z->img_comp[n].x+7) >> 3;
+      *mcu_h = (z->img_comp[n].y+7) >> 3;
+      *mcu_blocks = 1;
+      return;
+   }
+   *mcu_w = z->img_mcu_x;
+   *mcu_h = z->img_mcu_y;
+   *mcu_blocks = 0;
+   for (k=0; k < z->scan_n; ++k)
+      *mcu_blocks += z->img_comp[z->order[k]].h * z->img_comp[z->order[k]].v;
+}
+
+// entropy decode one MCU of a baseline scan into mcu_blocks blocks of
+// dequantized coefficients, in coding order
+static int stbi__jpeg_decode_mcu(stbi__jpeg *z, short *coeff)
+{
+   int k,b;
+   for (k=0; k < z->scan_n; ++k) {
+      int n = z->order[k];
+      int ha = z->img_comp[n].ha;
+      int blocks = z->scan_n == 1 ? 1 : z->img_comp[n].h * z->img_comp[n].v;
+      for (b=0; b < blocks; ++b, coeff += 64)
+         if (!stbi__jpeg_decode_block(z, coeff, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+   }
+   return 1;
+}
+
+// queue the blocks stbi__jpeg_decode_mcu left in coeff for the IDCT into
+// MCU (i,j)
+static void stbi__jpeg_idct_mcu(stbi__idct_queue *q, int i, int j, short *coeff)
+{
+   stbi__jpeg *z = q->z;
+   int k,x,y,bs = z->block_size;
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      stbi__idct_queue_block(q, z->img_comp[n].data+z->img_comp[n].w2*j*bs+i*bs, z->img_comp[n].w2, coeff);
+      return;
+   }
+   for (k=0; k < z->scan_n; ++k) {
+      int n = z->order[k];
+      for (y=0; y < z->img_comp[n].v; ++y) {
+         for (x=0; x < z->img_comp[n].h; ++x, coeff += 64) {
+            int x2 = (i*z->img_comp[n].h + x)*bs;
+            int y2 = (j*z->img_comp[n].v + y)*bs;
+            stbi__idct_queue_block(q, z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, coeff);
+         }
+      }
+   }
+}
+
+// finds where each restart interval of the scan starting at the current
+// position begins. fails unless there are exactly count intervals, closed
+// by some other marker
+static int stbi__jpeg_find_restarts(stbi__context *s, stbi_uc **segment, int count)
+{
+   stbi_uc *p = s->img_buffer, *end = s->img_buffer_end;
+   int n = 1;
+   segment[0] = p;
+   for (;;) {
+      stbi_uc c;
+      p = (stbi_uc *) memchr(p, 0xff, (size_t) (end - p));
+      if (!p) return 0;
+      do ++p; while (p < end && *p == 0xff); // fill bytes
+      if (p == end) return 0;
+      c = *p++;
+      if (c == 0) continue; // stuffed byte
+      if (!STBI__RESTART(c)) return n == count;
+      if (n == count) return 0;
+      segment[n++] = p;
+   }
+}
+
+typedef struct
+{
+   stbi__jpeg z;      // copy of the decoder...
+   stbi__context s;   // ...reading from its own position
+   int ok;
+} stbi__jpeg_task;
+
+typedef struct
+{
+   stbi__jpeg_task *task;
+   short *coeff;      // one MCU of coefficients per task
+   stbi_uc **segment; // first byte of each restart interval
+   int segments, tasks;
+   int mcu_w, mcu_total, mcu_blocks;
+} stbi__jpeg_restart_job;
+
+// decode a contiguous run of restart intervals, each from a fresh decoder
+// state. it only succeeds if every interval ends exactly where the next
+// one was found, i.e. if the serial decode would have gone the same way
+static void stbi__jpeg_restart_task(void *user, int t)
+{
+   stbi__jpeg_restart_job *job = (stbi__jpeg_restart_job *) user;
+   stbi__jpeg *z = &job->task[t].z;
+   short *coeff = job->coeff + (size_t) t * job->mcu_blocks * 64;
+   int ri = z->restart_interval;
+   int s = (int) ((stbi__uint64) t * job->segments / job->tasks);
+   int last = (int) ((stbi__uint64) (t+1) * job->segments / job->tasks);
+   stbi__idct_queue q;
+   stbi__idct_queue_init(&q, z);
+   job->task[t].ok = 0;
+   for (; s < last; ++s) {
+      int m = s * ri;
+      int end = job->mcu_total - m < ri ? job->mcu_total : m + ri;
+      z->s->img_buffer = job->segment[s];
+      stbi__jpeg_reset(z);
+      for (; m < end; ++m) {
+         if (!stbi__jpeg_decode_mcu(z, coeff)) return;
+         // the next MCU decodes into the same coefficients
+         stbi__jpeg_idct_mcu(&q, m % job->mcu_w, m / job->mcu_w, coeff);
+         stbi__idct_queue_flush(&q);
+      }
+      if (end - s * ri == ri) {
+         // same end of interval check as stbi__parse_entropy_coded_data
+         if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+         if (s+1 < job->segments && (!STBI__RESTART(z->marker) || z->s->img_buffer != job->segment[s+1])) return;
+      }
+   }
+   job->task[t].ok = 1;
+}
+
+// decode a baseline scan with restart markers, splitting it at the markers.
+// returns 0 if the serial decode has to run instead, leaving z untouched
+static int stbi__jpeg_parallel_restarts(stbi__jpeg *z, int mcu_w, int mcu_h, int mcu_blocks)
+{
+   stbi__jpeg_restart_job job;
+   void *coeff_raw;
+   int t, ok = 1;
+
+   if (z->restart_interval == 0 || z->s->read_from_callbacks) return 0;
+   job.mcu_w = mcu_w;
+   job.mcu_total = mcu_w * mcu_h;
+   job.mcu_blocks = mcu_blocks;
+   job.segments = (job.mcu_total + z->restart_interval-1) / z->restart_interval;
+   if (job.segments < 2) return 0;
+   job.tasks = job.segments < STBI__JPEG_MAX_TASKS ? job.segments : STBI__JPEG_MAX_TASKS;
+
+   job.segment = (stbi_uc **) stbi__malloc(sizeof(stbi_uc *) * job.segments);
+   if (!job.segment) return 0;
+   if (!stbi__jpeg_find_restarts(z->s, job.segment, job.segments)) { stbi__free(job.segment); return 0; }
+   job.task = (stbi__jpeg_task *) stbi__malloc(sizeof(stbi__jpeg_task) * job.tasks);
+   coeff_raw = stbi__malloc(sizeof(short) * 64 * mcu_blocks * job.tasks + 15);
+   if (!job.task || !coeff_raw) {
+      stbi__free(coeff_raw);
+      stbi__free(job.task);
+      stbi__free(job.segment);
+      return 0;
+   }
+   job.coeff = (short *) (((size_t) coeff_raw + 15) & ~15);
+   for (t=0; t < job.tasks; ++t) {
+      memcpy(&job.task[t].z, z, sizeof(*z));
+      memcpy(&job.task[t].s, z->s, sizeof(*z->s));
+      job.task[t].z.s = &job.task[t].s;
+   }
+
+   z->s->parallel_for(z->s->parallel_user, job.tasks, stbi__jpeg_restart_task, &job);
+
+   for (t=0; t < job.tasks; ++t)
+      ok &= job.task[t].ok;
+   if (ok) {
+      // carry on after the scan from where its last interval left off
+      stbi__jpeg *e = &job.task[job.tasks-1].z;
+      z->code_buffer = e->code_buffer;
+      z->code_bits = e->code_bits;
+      z->marker = e->marker;
+      z->nomore = e->nomore;
+      z->todo = e->todo;
+      z->s->img_buffer = e->s->img_buffer;
+   }
+   stbi__free(coeff_raw);
+   stbi__free(job.task);
+   stbi__free(job.segment);
+   return ok;
+}
+
+// hands over the output rows the first mcu_rows MCU rows of a scan complete
+static int stbi__jpeg_stream(stbi__jpeg *z, int mcu_rows);
+
+typedef struct
+{
+   stbi__jpeg *z;
+   short *coeff[2];  // coefficients of alternate bands
+   int decoded[2];   // number of MCUs in each
+   int mcu_w, mcu_h, mcu_blocks;
+   int band;         // band entropy decoded by this step, the previous one goes through the IDCT
+   int entropy;      // whether task 0 entropy decodes this step
+   int stopped, failed;
+   const char *failure;
+} stbi__jpeg_pipeline;
+
+// entropy decode the next band of MCU rows, following the serial decoder
+// exactly, restart intervals included
+static void stbi__jpeg_entropy_band(stbi__jpeg_pipeline *p)
+{
+   stbi__jpeg *z = p->z;
+   int m = p->band * STBI__JPEG_BAND_MCU_ROWS * p->mcu_w;
+   int end = p->mcu_w * p->mcu_h - m < STBI__JPEG_BAND_MCU_ROWS * p->mcu_w ? p->mcu_w * p->mcu_h : m + STBI__JPEG_BAND_MCU_ROWS * p->mcu_w;
+   short *coeff = p->coeff[p->band & 1];
+   int *decoded = &p->decoded[p->band & 1];
+   for (; m < end; ++m, coeff += 64 * p->mcu_blocks) {
+      if (!stbi__jpeg_decode_mcu(z, coeff)) {
+         p->failure = stbi__g_failure_reason;
+         p->failed = p->stopped = 1;
+         return;
+      }
+      ++*decoded;
+      if (--z->todo <= 0) {
+         if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+         if (!STBI__RESTART(z->marker)) { p->stopped = 1; return; }
+         stbi__jpeg_reset(z);
+      }
+   }
+}
+
+static void stbi__jpeg_pipeline_task(void *user, int index)
+{
+   stbi__jpeg_pipeline *p = (stbi__jpeg_pipeline *) user;
+   int band, first, end, i, j;
+   short *coeff;
+   stbi__idct_queue q;
+   if (p->entropy && index == 0) {
+      stbi__jpeg_entropy_band(p);
+      return;
+   }
+   // IDCT one MCU row of the previous band
+   band = p->band - 1;
+   first = (index - p->entropy) * p->mcu_w;
+   end = p->decoded[band & 1] - first < p->mcu_w ? p->decoded[band & 1] : first + p->mcu_w;
+   coeff = p->coeff[band & 1] + (size_t) first * 64 * p->mcu_blocks;
+   j = band * STBI__JPEG_BAND_MCU_ROWS + index - p->entropy;
+   stbi__idct_queue_init(&q, p->z);
+   for (i=first; i < end; ++i, coeff += 64 * p->mcu_blocks)
+      stbi__jpeg_idct_mcu(&q, i - first, j, coeff);
+   stbi__idct_queue_flush(&q);
+}
+
+// decode a baseline scan as a pipeline over bands of MCU rows: each step
+// entropy decodes one band on one task while the others run the IDCT of
+// the band before. returns -1 if the serial decode has to run instead
+static int stbi__jpeg_pipelined_scan(stbi__jpeg *z, int mcu_w, int mcu_h, int mcu_blocks)
+{
+   stbi__jpeg_pipeline p;
+   int bands = (mcu_h + STBI__JPEG_BAND_MCU_ROWS-1) / STBI__JPEG_BAND_MCU_ROWS;
+   size_t band_coeff = (size_t) 64 * mcu_blocks * mcu_w * STBI__JPEG_BAND_MCU_ROWS;
+   void *coeff_raw = stbi__malloc(sizeof(short) * 2 * band_coeff + 15);
+   int b;
+   if (!coeff_raw) return -1;
+   p.z = z;
+   p.coeff[0] = (short *) (((size_t) coeff_raw + 15) & ~15);
+   p.coeff[1] = p.coeff[0] + band_coeff;
+   p.mcu_w = mcu_w;
+   p.mcu_h = mcu_h;
+   p.mcu_blocks = mcu_blocks;
+   p.stopped = p.failed = 0;
+   p.failure = NULL;
+   for (b=0; b <= bands; ++b) {
+      int rows = b == 0 ? 0 : b < bands ? STBI__JPEG_BAND_MCU_ROWS : mcu_h - (b-1) * STBI__JPEG_BAND_MCU_ROWS;
+      p.band = b;
+      p.entropy = b < bands && !p.stopped;
+      p.decoded[b & 1] = 0;
+      if (p.entropy + rows > 0)
+         z->s->parallel_for(z->s->parallel_user, p.entropy + rows, stbi__jpeg_pipeline_task, &p);
+      if (p.failed) break;
+      if (z->stream && rows && !stbi__jpeg_stream(z, (b-1) * STBI__JPEG_BAND_MCU_ROWS + rows)) {
+         stbi__free(coeff_raw);
+         return 0;
+      }
+   }
+   stbi__free(coeff_raw);
+   if (p.failed) {
+      stbi__g_failure_reason = p.failure;
+      return 0;
+   }
+   return 1;
+}
+
+static int stbi__jpeg_parallel_scan(stbi__jpeg *z)
+{
+   int mcu_w, mcu_h, mcu_blocks;
+   stbi__jpeg_scan_grid(z, &mcu_w, &mcu_h, &mcu_blocks);
+   if (stbi__jpeg_parallel_restarts(z, mcu_w, mcu_h, mcu_blocks)) return 1;
+   return stbi__jpeg_pipelined_scan(z, mcu_w, mcu_h, mcu_blocks);
+}
+
 static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
 {
    stbi__jpeg_reset(z);
+   if (!z->progressive && stbi__jpeg_parallel(z)) {
+      int r = stbi__jpeg_parallel_scan(z);
+      if (r >= 0) return r;
+   }
    if (!z->progressive) {
       if (z->scan_n == 1) {
          int i,j;
-         STBI_SIMD_ALIGN(short, data[64]);
+         // two blocks, for the IDCT to take them in pairs
+         STBI_SIMD_ALIGN(short, data[128]);
+         stbi__idct_queue q;
          int n = z->order[0];
          // non-interleaved data, we just need to process one block at a time,
          // in trivial scanline order
@@ -2697,25 +3980,31 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
          // component has, independent of interleaved MCU blocking and such
          int w = (z->img_comp[n].x+7) >> 3;
          int h = (z->img_comp[n].y+7) >> 3;
+         stbi__idct_queue_init(&q, z);
          for (j=0; j < h; ++j) {
             for (i=0; i < w; ++i) {
                int ha = z->img_comp[n].ha;
-               if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               short *block = stbi__idct_queue_slot(&q, data);
+               if (!stbi__jpeg_decode_block(z, block, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+               stbi__idct_queue_block(&q, z->img_comp[n].data+z->img_comp[n].w2*j*z->block_size+i*z->block_size, z->img_comp[n].w2, block);
                // every data block is an MCU, so countdown the restart interval
                if (--z->todo <= 0) {
                   if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
                   // if it's NOT a restart, then just bail, so we get corrupt data
                   // rather than no data
-                  if (!STBI__RESTART(z->marker)) return 1;
+                  if (!STBI__RESTART(z->marker)) { stbi__idct_queue_flush(&q); return 1; }
                   stbi__jpeg_reset(z);
                }
             }
+            stbi__idct_queue_flush(&q);
+            if (z->stream && !stbi__jpeg_stream(z, j+1)) return 0;
          }
          return 1;
       } else { // interleaved
          int i,j,k,x,y;
-         STBI_SIMD_ALIGN(short, data[64]);
+         STBI_SIMD_ALIGN(short, data[128]);
+         stbi__idct_queue q;
+         stbi__idct_queue_init(&q, z);
          for (j=0; j < z->img_mcu_y; ++j) {
             for (i=0; i < z->img_mcu_x; ++i) {
                // scan an interleaved mcu... process scan_n components in order
@@ -2725,11 +4014,12 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                   // by the basic H and V specified for the component
                   for (y=0; y < z->img_comp[n].v; ++y) {
                      for (x=0; x < z->img_comp[n].h; ++x) {
-                        int x2 = (i*z->img_comp[n].h + x)*8;
-                        int y2 = (j*z->img_comp[n].v + y)*8;
+                        int x2 = (i*z->img_comp[n].h + x)*z->block_size;
+                        int y2 = (j*z->img_comp[n].v + y)*z->block_size;
                         int ha = z->img_comp[n].ha;
-                        if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-                        z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
+                        short *block = stbi__idct_queue_slot(&q, data);
+                        if (!stbi__jpeg_decode_block(z, block, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                        stbi__idct_queue_block(&q, z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, block);
                      }
                   }
                }
@@ -2737,10 +4027,12 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                // so now count down the restart interval
                if (--z->todo <= 0) {
                   if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                  if (!STBI__RESTART(z->marker)) return 1;
+                  if (!STBI__RESTART(z->marker)) { stbi__idct_queue_flush(&q); return 1; }
                   stbi__jpeg_reset(z);
                }
             }
+            stbi__idct_queue_flush(&q);
+            if (z->stream && !stbi__jpeg_stream(z, j+1)) return 0;
          }
          return 1;
       }
@@ -2814,21 +4106,50 @@ static void stbi__jpeg_dequantize(short *data, stbi__uint16 *dequant)
       data[i] *= dequant[i];
 }
 
+// dequantize and idct block rows [j0,j1) of component n
+static void stbi__jpeg_finish_rows(stbi__jpeg *z, int n, int j0, int j1)
+{
+   int i,j;
+   int w = (z->img_comp[n].x+7) >> 3;
+   stbi__idct_queue q;
+   stbi__idct_queue_init(&q, z);
+   for (j=j0; j < j1; ++j) {
+      for (i=0; i < w; ++i) {
+         short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
+         stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
+         stbi__idct_queue_block(&q, z->img_comp[n].data+z->img_comp[n].w2*j*z->block_size+i*z->block_size, z->img_comp[n].w2, data);
+      }
+   }
+   stbi__idct_queue_flush(&q);
+}
+
+typedef struct
+{
+   stbi__jpeg *z;
+   int n, rows, tasks;
+} stbi__jpeg_finish_job;
+
+static void stbi__jpeg_finish_task(void *user, int t)
+{
+   stbi__jpeg_finish_job *job = (stbi__jpeg_finish_job *) user;
+   stbi__jpeg_finish_rows(job->z, job->n, job->rows * t / job->tasks, job->rows * (t+1) / job->tasks);
+}
+
 static void stbi__jpeg_finish(stbi__jpeg *z)
 {
    if (z->progressive) {
-      // dequantize and idct the data
-      int i,j,n;
+      int n;
       for (n=0; n < z->s->img_n; ++n) {
-         int w = (z->img_comp[n].x+7) >> 3;
          int h = (z->img_comp[n].y+7) >> 3;
-         for (j=0; j < h; ++j) {
-            for (i=0; i < w; ++i) {
-               short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
-               stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
-            }
-         }
+         if (stbi__jpeg_parallel(z)) {
+            stbi__jpeg_finish_job job;
+            job.z = z;
+            job.n = n;
+            job.rows = h;
+            job.tasks = h < STBI__JPEG_MAX_TASKS ? h : STBI__JPEG_MAX_TASKS;
+            z->s->parallel_for(z->s->parallel_user, job.tasks, stbi__jpeg_finish_task, &job);
+         } else
+            stbi__jpeg_finish_rows(z, n, 0, h);
       }
    }
 }
@@ -2980,17 +4301,17 @@ static int stbi__free_jpeg_components(stbi__jpeg *z, int ncomp, int why)
    int i;
    for (i=0; i < ncomp; ++i) {
       if (z->img_comp[i].raw_data) {
-         STBI_FREE(z->img_comp[i].raw_data);
+         stbi__free(z->img_comp[i].raw_data);
          z->img_comp[i].raw_data = NULL;
          z->img_comp[i].data = NULL;
       }
       if (z->img_comp[i].raw_coeff) {
-         STBI_FREE(z->img_comp[i].raw_coeff);
+         stbi__free(z->img_comp[i].raw_coeff);
          z->img_comp[i].raw_coeff = 0;
          z->img_comp[i].coeff = 0;
       }
       if (z->img_comp[i].linebuf) {
-         STBI_FREE(z->img_comp[i].linebuf);
+         stbi__free(z->img_comp[i].linebuf);
          z->img_comp[i].linebuf = NULL;
       }
    }
@@ -3056,8 +4377,8 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       //
       // img_mcu_x, img_mcu_y: <=17 bits; comp[i].h and .v are <=4 (checked earlier)
       // so these muls can't overflow with 32-bit ints (which we require)
-      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
+      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * z->block_size;
+      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * z->block_size;
       z->img_comp[i].coeff = 0;
       z->img_comp[i].raw_coeff = 0;
       z->img_comp[i].linebuf = NULL;
@@ -3067,10 +4388,10 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       // align blocks for idct using mmx/sse
       z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
       if (z->progressive) {
-         // w2, h2 are multiples of 8 (see above)
-         z->img_comp[i].coeff_w = z->img_comp[i].w2 / 8;
-         z->img_comp[i].coeff_h = z->img_comp[i].h2 / 8;
-         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].w2, z->img_comp[i].h2, sizeof(short), 15);
+         // one block of coefficients per block_size pixels (see above)
+         z->img_comp[i].coeff_w = z->img_mcu_x * z->img_comp[i].h;
+         z->img_comp[i].coeff_h = z->img_mcu_y * z->img_comp[i].v;
+         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].coeff_w * 64, z->img_comp[i].coeff_h, sizeof(short), 15);
          if (z->img_comp[i].raw_coeff == NULL)
             return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
          z->img_comp[i].coeff = (short*) (((size_t) z->img_comp[i].raw_coeff + 15) & ~15);
@@ -3351,6 +4672,75 @@ static stbi_uc *stbi__resample_row_hv_2_simd(stbi_uc *out, stbi_uc *in_near, stb
 }
 #endif
 
+#ifdef STBI_AVX2
+// same filter as stbi__resample_row_hv_2_simd, 16 input pixels at a time
+static STBI__AVX2_TARGET stbi_uc *stbi__resample_row_hv_2_avx2(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
+{
+   int i=0,t0,t1;
+
+   if (w == 1) {
+      out[0] = out[1] = stbi__div4(3*in_near[0] + in_far[0] + 2);
+      return out;
+   }
+
+   t1 = 3*in_near[0] + in_far[0];
+   for (; i < ((w-1) & ~15); i += 16) {
+      // vertical pass, 3*x + y = 4*x + (y - x)
+      __m256i farw  = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_far + i)));
+      __m256i nearw = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_near + i)));
+      __m256i diff  = _mm256_sub_epi16(farw, nearw);
+      __m256i nears = _mm256_slli_epi16(nearw, 2);
+      __m256i curr  = _mm256_add_epi16(nears, diff);
+
+      // shift the current row by one pixel each way. alignr works within
+      // 128-bit lanes, so the pixel crossing the middle comes from a lane
+      // swapped copy of the row
+      __m256i lo0  = _mm256_permute2x128_si256(curr, curr, 0x08);
+      __m256i hi0  = _mm256_permute2x128_si256(curr, curr, 0x81);
+      __m256i prv0 = _mm256_alignr_epi8(curr, lo0, 14);
+      __m256i nxt0 = _mm256_alignr_epi8(hi0, curr, 2);
+      __m256i prev = _mm256_insert_epi16(prv0, (short) t1, 0);
+      __m256i next = _mm256_insert_epi16(nxt0, (short) (3*in_near[i+16] + in_far[i+16]), 15);
+
+      // horizontal pass, polyphase like the SSE2 version
+      __m256i bias = _mm256_set1_epi16(8);
+      __m256i curs = _mm256_slli_epi16(curr, 2);
+      __m256i prvd = _mm256_sub_epi16(prev, curr);
+      __m256i nxtd = _mm256_sub_epi16(next, curr);
+      __m256i curb = _mm256_add_epi16(curs, bias);
+      __m256i even = _mm256_add_epi16(prvd, curb);
+      __m256i odd  = _mm256_add_epi16(nxtd, curb);
+
+      // interleave and pack; per-lane unpacks and packs cancel out, so the
+      // pixels come out in order
+      __m256i int0 = _mm256_unpacklo_epi16(even, odd);
+      __m256i int1 = _mm256_unpackhi_epi16(even, odd);
+      __m256i de0  = _mm256_srli_epi16(int0, 4);
+      __m256i de1  = _mm256_srli_epi16(int1, 4);
+      __m256i outv = _mm256_packus_epi16(de0, de1);
+      _mm256_storeu_si256((__m256i *) (out + i*2), outv);
+
+      t1 = 3*in_near[i+15] + in_far[i+15];
+   }
+
+   t0 = t1;
+   t1 = 3*in_near[i] + in_far[i];
+   out[i*2] = stbi__div16(3*t1 + t0 + 8);
+
+   for (++i; i < w; ++i) {
+      t0 = t1;
+      t1 = 3*in_near[i]+in_far[i];
+      out[i*2-1] = stbi__div16(3*t0 + t1 + 8);
+      out[i*2  ] = stbi__div16(3*t1 + t0 + 8);
+   }
+   out[w*2-1] = stbi__div4(t1+2);
+
+   STBI_NOTUSED(hs);
+
+   return out;
+}
+#endif
+
 static stbi_uc *stbi__resample_row_generic(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
 {
    // resample with nearest-neighbor
@@ -3525,10 +4915,73 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
 }
 #endif
 
+#ifdef STBI_AVX2
+// same math as the SSE2 path of stbi__YCbCr_to_RGB_simd, 16 pixels at a time
+static STBI__AVX2_TARGET void stbi__YCbCr_to_RGB_avx2(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
+{
+   int i = 0;
+
+   if (step == 4) {
+      __m256i signflip  = _mm256_set1_epi16(-0x8000);
+      __m256i cr_const0 = _mm256_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
+      __m256i cr_const1 = _mm256_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
+      __m256i cb_const0 = _mm256_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
+      __m256i cb_const1 = _mm256_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
+      __m256i y_bias = _mm256_set1_epi16(128);
+      __m256i xw = _mm256_set1_epi16(255); // alpha channel
+
+      for (; i+15 < count; i += 16) {
+         // widen to short: y in the high byte over a 128 bias, cr and cb
+         // as (x - 128) << 8
+         __m256i y_words  = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (y+i)));
+         __m256i cr_words = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (pcr+i)));
+         __m256i cb_words = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (pcb+i)));
+         __m256i yw  = _mm256_or_si256(_mm256_slli_epi16(y_words, 8), y_bias);
+         __m256i crw = _mm256_xor_si256(_mm256_slli_epi16(cr_words, 8), signflip);
+         __m256i cbw = _mm256_xor_si256(_mm256_slli_epi16(cb_words, 8), signflip);
+
+         // color transform
+         __m256i yws = _mm256_srli_epi16(yw, 4);
+         __m256i cr0 = _mm256_mulhi_epi16(cr_const0, crw);
+         __m256i cb0 = _mm256_mulhi_epi16(cb_const0, cbw);
+         __m256i cb1 = _mm256_mulhi_epi16(cbw, cb_const1);
+         __m256i cr1 = _mm256_mulhi_epi16(crw, cr_const1);
+         __m256i rws = _mm256_add_epi16(cr0, yws);
+         __m256i gwt = _mm256_add_epi16(cb0, yws);
+         __m256i bws = _mm256_add_epi16(yws, cb1);
+         __m256i gws = _mm256_add_epi16(gwt, cr1);
+
+         // descale
+         __m256i rw = _mm256_srai_epi16(rws, 4);
+         __m256i bw = _mm256_srai_epi16(bws, 4);
+         __m256i gw = _mm256_srai_epi16(gws, 4);
+
+         // back to byte and interleave; this works per 128-bit lane, which
+         // leaves pixels 0-3,8-11 in o0 and 4-7,12-15 in o1
+         __m256i brb = _mm256_packus_epi16(rw, bw);
+         __m256i gxb = _mm256_packus_epi16(gw, xw);
+         __m256i t0 = _mm256_unpacklo_epi8(brb, gxb);
+         __m256i t1 = _mm256_unpackhi_epi8(brb, gxb);
+         __m256i o0 = _mm256_unpacklo_epi16(t0, t1);
+         __m256i o1 = _mm256_unpackhi_epi16(t0, t1);
+
+         // store
+         _mm256_storeu_si256((__m256i *) (out + 0), _mm256_permute2x128_si256(o0, o1, 0x20));
+         _mm256_storeu_si256((__m256i *) (out + 32), _mm256_permute2x128_si256(o0, o1, 0x31));
+         out += 64;
+      }
+   }
+
+   // whatever is left, and step == 3
+   stbi__YCbCr_to_RGB_simd(out, y+i, pcb+i, pcr+i, count-i, step);
+}
+#endif
+
 // set up the kernels
 static void stbi__setup_jpeg(stbi__jpeg *j)
 {
    j->idct_block_kernel = stbi__idct_block;
+   j->idct_pair_kernel = NULL;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_row;
    j->resample_row_hv_2_kernel = stbi__resample_row_hv_2;
 
@@ -3540,11 +4993,29 @@ static void stbi__setup_jpeg(stbi__jpeg *j)
    }
 #endif
 
+#ifdef STBI_AVX2
+   // the IDCT takes blocks two at a time to fill the 256-bit registers
+   if (stbi__avx2_available()) {
+      j->idct_pair_kernel = stbi__idct_pair_avx2;
+      j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_avx2;
+      j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_avx2;
+   }
+#endif
+
 #ifdef STBI_NEON
    j->idct_block_kernel = stbi__idct_simd;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
    j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
 #endif
+
+   j->scale = j->s->jpeg_scale;
+   j->block_size = 8 >> j->scale;
+   j->stream = NULL;
+   if (j->scale == 1) j->idct_block_kernel = stbi__idct_4x4;
+   if (j->scale == 2) j->idct_block_kernel = stbi__idct_2x2;
+   if (j->scale == 3) j->idct_block_kernel = stbi__idct_1x1;
+   // the pair kernel is for full size blocks only
+   if (j->scale != 0) j->idct_pair_kernel = NULL;
 }
 
 // clean up the temporary component buffers
@@ -3570,174 +5041,361 @@ static stbi_uc stbi__blinn_8x8(stbi_uc x, stbi_uc y)
    return (stbi_uc) ((t + (t >>8)) >> 8);
 }
 
-static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
+typedef struct
 {
-   int n, decode_n, is_rgb;
-   z->s->img_n = 0; // make stbi__cleanup_jpeg safe
-
-   // validate req_comp
-   if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
-
-   // load a jpeg image from whichever source, but leave in YCbCr format
-   if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
-
-   // determine actual number of components to generate
-   n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
-
-   is_rgb = z->s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
-
-   if (z->s->img_n == 3 && n < 3 && !is_rgb)
-      decode_n = 1;
-   else
-      decode_n = z->s->img_n;
-
-   // resample and color-convert
-   {
-      int k;
-      unsigned int i,j;
-      stbi_uc *output;
-      stbi_uc *coutput[4];
-
-      stbi__resample res_comp[4];
-
-      for (k=0; k < decode_n; ++k) {
+   stbi__jpeg *z;
+   stbi__resample res_comp[4]; // state at the first row
+   int req_comp, n, decode_n, is_rgb;
+   stbi__uint32 w, h;          // size of the result, reduced when scaling
+   int comp_y[4];              // rows of each component at that size
+   stbi_uc *output;
+   size_t stride;
+   stbi__uint32 first_row;     // row of the result at output
+   stbi_uc *row_tail;
+   // parallel conversion only: line buffers and row tail of each band
+   stbi_uc *scratch;
+   size_t band_scratch;
+   int bands;
+   // rows_ready loads only: rows handed over so far, and how many output
+   // holds when it is a band rather than the whole result (0)
+   stbi__uint32 emitted, band_rows;
+   int started;
+} stbi__jpeg_output;
+
+// move a resampler to where it is after emitting `row` rows
+static void stbi__resample_seek(stbi__resample *r, stbi_uc *data, int w2, int h, stbi__uint32 row)
+{
+   stbi__uint32 a = ((stbi__uint32) (r->vs >> 1) + row) / (stbi__uint32) r->vs;
+   stbi__uint32 last = (stbi__uint32) h - 1;
+   r->ystep = (int) (((stbi__uint32) (r->vs >> 1) + row) % (stbi__uint32) r->vs);
+   r->ypos  = (int) a;
+   r->line1 = data + (size_t) w2 * (a < last ? a : last);
+   r->line0 = a == 0 ? data : data + (size_t) w2 * (a-1 < last ? a-1 : last);
+}
+
+// resample and color-convert rows [j0,j1), emitting them bottom-up when
+// flipping. row_tail, if any, takes every row when every_row is set and
+// only the last one otherwise
+static void stbi__jpeg_output_rows(stbi__jpeg_output *o, stbi_uc **linebuf, stbi_uc *row_tail, int every_row, stbi__uint32 j0, stbi__uint32 j1)
+{
+   stbi__jpeg *z = o->z;
+   int k, n = o->n, is_rgb = o->is_rgb;
+   unsigned int i,j;
+   stbi_uc *coutput[4];
+   stbi__resample res_comp[4];
+
+   for (k=0; k < o->decode_n; ++k) {
+      res_comp[k] = o->res_comp[k];
+      if (j0)
+         stbi__resample_seek(&res_comp[k], z->img_comp[k].data, z->img_comp[k].w2, o->comp_y[k], j0);
+   }
+   for (j=j0; j < j1; ++j) {
+      size_t out_row = (z->s->flip_vertically ? o->h - 1 - j : j) - o->first_row;
+      stbi_uc *tail = row_tail && (every_row || j == j1-1) ? row_tail : NULL;
+      stbi_uc *out = tail ? tail : o->output + o->stride * out_row;
+      for (k=0; k < o->decode_n; ++k) {
          stbi__resample *r = &res_comp[k];
-
-         // allocate line buffer big enough for upsampling off the edges
-         // with upsample factor of 4
-         z->img_comp[k].linebuf = (stbi_uc *) stbi__malloc(z->s->img_x + 3);
-         if (!z->img_comp[k].linebuf) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
-         r->hs      = z->img_h_max / z->img_comp[k].h;
-         r->vs      = z->img_v_max / z->img_comp[k].v;
-         r->ystep   = r->vs >> 1;
-         r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
-         r->ypos    = 0;
-         r->line0   = r->line1 = z->img_comp[k].data;
-
-         if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
-         else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
-         else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
-         else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
-         else                               r->resample = stbi__resample_row_generic;
-      }
-
-      // can't error after this so, this is safe
-      output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
-      if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
-      // now go ahead and resample
-      for (j=0; j < z->s->img_y; ++j) {
-         stbi_uc *out = output + n * z->s->img_x * j;
-         for (k=0; k < decode_n; ++k) {
-            stbi__resample *r = &res_comp[k];
-            int y_bot = r->ystep >= (r->vs >> 1);
-            coutput[k] = r->resample(z->img_comp[k].linebuf,
-                                     y_bot ? r->line1 : r->line0,
-                                     y_bot ? r->line0 : r->line1,
-                                     r->w_lores, r->hs);
-            if (++r->ystep >= r->vs) {
-               r->ystep = 0;
-               r->line0 = r->line1;
-               if (++r->ypos < z->img_comp[k].y)
-                  r->line1 += z->img_comp[k].w2;
-            }
+         int y_bot = r->ystep >= (r->vs >> 1);
+         coutput[k] = r->resample(linebuf[k],
+                                  y_bot ? r->line1 : r->line0,
+                                  y_bot ? r->line0 : r->line1,
+                                  r->w_lores, r->hs);
+         if (++r->ystep >= r->vs) {
+            r->ystep = 0;
+            r->line0 = r->line1;
+            if (++r->ypos < o->comp_y[k])
+               r->line1 += z->img_comp[k].w2;
          }
-         if (n >= 3) {
-            stbi_uc *y = coutput[0];
-            if (z->s->img_n == 3) {
-               if (is_rgb) {
-                  for (i=0; i < z->s->img_x; ++i) {
-                     out[0] = y[i];
-                     out[1] = coutput[1][i];
-                     out[2] = coutput[2][i];
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else {
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else if (z->s->img_n == 4) {
-               if (z->app14_color_transform == 0) { // CMYK
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(coutput[0][i], m);
-                     out[1] = stbi__blinn_8x8(coutput[1][i], m);
-                     out[2] = stbi__blinn_8x8(coutput[2][i], m);
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else if (z->app14_color_transform == 2) { // YCCK
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(255 - out[0], m);
-                     out[1] = stbi__blinn_8x8(255 - out[1], m);
-                     out[2] = stbi__blinn_8x8(255 - out[2], m);
-                     out += n;
-                  }
-               } else { // YCbCr + alpha?  Ignore the fourth channel for now
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = out[1] = out[2] = y[i];
-                  out[3] = 255; // not used if n==3
+      }
+      if (n >= 3) {
+         stbi_uc *y = coutput[0];
+         if (z->s->img_n == 3) {
+            if (is_rgb) {
+               for (i=0; i < o->w; ++i) {
+                  out[0] = y[i];
+                  out[1] = coutput[1][i];
+                  out[2] = coutput[2][i];
+                  out[3] = 255;
                   out += n;
                }
-         } else {
-            if (is_rgb) {
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i)
-                     *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-               else {
-                  for (i=0; i < z->s->img_x; ++i, out += 2) {
-                     out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-                     out[1] = 255;
-                  }
+            } else {
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], o->w, n);
+            }
+         } else if (z->s->img_n == 4) {
+            if (z->app14_color_transform == 0) { // CMYK
+               for (i=0; i < o->w; ++i) {
+                  stbi_uc m = coutput[3][i];
+                  out[0] = stbi__blinn_8x8(coutput[0][i], m);
+                  out[1] = stbi__blinn_8x8(coutput[1][i], m);
+                  out[2] = stbi__blinn_8x8(coutput[2][i], m);
+                  out[3] = 255;
+                  out += n;
                }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
-               for (i=0; i < z->s->img_x; ++i) {
+            } else if (z->app14_color_transform == 2) { // YCCK
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], o->w, n);
+               for (i=0; i < o->w; ++i) {
                   stbi_uc m = coutput[3][i];
-                  stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
-                  stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
-                  stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
-                  out[0] = stbi__compute_y(r, g, b);
-                  out[1] = 255;
+                  out[0] = stbi__blinn_8x8(255 - out[0], m);
+                  out[1] = stbi__blinn_8x8(255 - out[1], m);
+                  out[2] = stbi__blinn_8x8(255 - out[2], m);
                   out += n;
                }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
+            } else { // YCbCr + alpha?  Ignore the fourth channel for now
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], o->w, n);
+            }
+         } else
+            for (i=0; i < o->w; ++i) {
+               out[0] = out[1] = out[2] = y[i];
+               out[3] = 255; // not used if n==3
+               out += n;
+            }
+      } else {
+         if (is_rgb) {
+            if (n == 1)
+               for (i=0; i < o->w; ++i)
+                  *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+            else {
+               for (i=0; i < o->w; ++i, out += 2) {
+                  out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
                   out[1] = 255;
-                  out += n;
                }
-            } else {
-               stbi_uc *y = coutput[0];
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
-               else
-                  for (i=0; i < z->s->img_x; ++i) *out++ = y[i], *out++ = 255;
             }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
+            for (i=0; i < o->w; ++i) {
+               stbi_uc m = coutput[3][i];
+               stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
+               stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
+               stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
+               out[0] = stbi__compute_y(r, g, b);
+               out[1] = 255;
+               out += n;
+            }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
+            for (i=0; i < o->w; ++i) {
+               out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
+               out[1] = 255;
+               out += n;
+            }
+         } else {
+            stbi_uc *y = coutput[0];
+            if (n == 1)
+               for (i=0; i < o->w; ++i) out[i] = y[i];
+            else
+               for (i=0; i < o->w; ++i) *out++ = y[i], *out++ = 255;
          }
       }
+      if (tail)
+         memcpy(o->output + o->stride * out_row, tail, (size_t) n * o->w);
+   }
+}
+
+static void stbi__jpeg_output_task(void *user, int b)
+{
+   stbi__jpeg_output *o = (stbi__jpeg_output *) user;
+   stbi__context *s = o->z->s;
+   stbi_uc *scratch = o->scratch + o->band_scratch * (size_t) b;
+   stbi_uc *linebuf[4];
+   int k;
+   for (k=0; k < o->decode_n; ++k)
+      linebuf[k] = scratch + (size_t) k * (o->w + 3);
+   // a 3-channel row also stores a byte into the next row, which is the
+   // first of another band for the last row of this one
+   stbi__jpeg_output_rows(o, linebuf, o->n == 3 ? linebuf[0] + (size_t) o->decode_n * (o->w + 3) : NULL,
+                          s->dst || s->flip_vertically,
+                          (stbi__uint32) ((stbi__uint64) o->h * (stbi__uint32) b / (stbi__uint32) o->bands),
+                          (stbi__uint32) ((stbi__uint64) o->h * (stbi__uint32) (b+1) / (stbi__uint32) o->bands));
+}
+
+// set up the color conversion once the frame header is in: the size at the
+// decoding scale, resamplers, line buffers and where the rows go
+static int stbi__jpeg_begin_output(stbi__jpeg_output *o)
+{
+   stbi__jpeg *z = o->z;
+   int k, n, d = 1 << z->scale;
+
+   o->started = 1;
+   o->w = (z->s->img_x + d-1) >> z->scale;
+   o->h = (z->s->img_y + d-1) >> z->scale;
+
+   // determine actual number of components to generate
+   n = o->n = o->req_comp ? o->req_comp : z->s->img_n >= 3 ? 3 : 1;
+
+   o->is_rgb = z->s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
+
+   if (z->s->img_n == 3 && n < 3 && !o->is_rgb)
+      o->decode_n = 1;
+   else
+      o->decode_n = z->s->img_n;
+
+   for (k=0; k < o->decode_n; ++k) {
+      stbi__resample *r = &o->res_comp[k];
+
+      o->comp_y[k] = (int) ((o->h * (stbi__uint32) z->img_comp[k].v + (stbi__uint32) z->img_v_max-1) / (stbi__uint32) z->img_v_max);
+
+      // allocate line buffer big enough for upsampling off the edges
+      // with upsample factor of 4
+      z->img_comp[k].linebuf = (stbi_uc *) stbi__malloc(o->w + 3);
+      if (!z->img_comp[k].linebuf) return stbi__err("outofmem", "Out of memory");
+
+      r->hs      = z->img_h_max / z->img_comp[k].h;
+      r->vs      = z->img_v_max / z->img_comp[k].v;
+      r->ystep   = r->vs >> 1;
+      r->w_lores = (int) ((o->w + (stbi__uint32) r->hs-1) / (stbi__uint32) r->hs);
+      r->ypos    = 0;
+      r->line0   = r->line1 = z->img_comp[k].data;
+
+      if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
+      else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
+      else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
+      else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
+      else                               r->resample = stbi__resample_row_generic;
+   }
+
+   o->first_row = o->emitted = o->band_rows = 0;
+   if (z->s->dst) {
+      // color-convert straight into the caller's buffer
+      o->stride = stbi__dst_stride(z->s, (int) o->w, (int) o->h, n);
+      if (!o->stride) return stbi__err("output too small", "Image doesn't fit in the output buffer");
+      o->output = z->s->dst;
+   } else {
+      // a streamed result is never assembled, rows go through a band of
+      // two MCU rows at a time
+      if (z->stream && z->s->stream)
+         o->band_rows = (stbi__uint32) (2 * z->img_v_max * z->block_size) < o->h ? (stbi__uint32) (2 * z->img_v_max * z->block_size) : o->h;
+      o->stride = (size_t) n * o->w;
+      o->output = (stbi_uc *) stbi__malloc_mad3(n, (int) o->w, (int) (o->band_rows ? o->band_rows : o->h), 1);
+      if (!o->output) return stbi__err("outofmem", "Out of memory");
+   }
+
+   // the 3-channel converters store a 4th byte past each pixel; that byte
+   // would land past a caller's row, or on an already written row when
+   // writing bottom-up, so those rows go through a scratch
+   if (n == 3 && (z->s->dst || z->s->flip_vertically)) {
+      o->row_tail = (stbi_uc *) stbi__malloc_mad2(n, (int) o->w, 1);
+      if (!o->row_tail) return stbi__err("outofmem", "Out of memory");
+   }
+   return 1;
+}
+
+// release what stbi__jpeg_begin_output allocated besides the line buffers,
+// keeping the result when it's handed back
+static void stbi__jpeg_end_output(stbi__jpeg_output *o, int keep_output)
+{
+   if (!keep_output && o->output != o->z->s->dst)
+      stbi__free(o->output);
+   stbi__free(o->row_tail);
+}
+
+// convert the rows up to `ready` that weren't yet and hand them over, a
+// band at a time when the output is one
+static void stbi__jpeg_emit_rows(stbi__jpeg_output *o, stbi__uint32 ready)
+{
+   stbi__context *s = o->z->s;
+   stbi_uc *linebuf[4];
+   int k;
+   for (k=0; k < o->decode_n; ++k)
+      linebuf[k] = o->z->img_comp[k].linebuf;
+   while (o->emitted < ready) {
+      stbi__uint32 j0 = o->emitted, j1 = ready, first;
+      if (o->band_rows && j1 - j0 > o->band_rows)
+         j1 = j0 + o->band_rows;
+      // bottom-up, these rows come out as the result's rows [first, first+j1-j0)
+      first = s->flip_vertically ? o->h - j1 : j0;
+      if (o->band_rows)
+         o->first_row = first;
+      stbi__jpeg_output_rows(o, linebuf, o->row_tail, 1, j0, j1);
+      s->rows_ready(s->rows_user, o->output + o->stride * (first - o->first_row), o->stride, (int) first, (int) (j1 - j0));
+      o->emitted = j1;
+   }
+}
+
+static int stbi__jpeg_stream(stbi__jpeg *z, int mcu_rows)
+{
+   stbi__jpeg_output *o = (stbi__jpeg_output *) z->stream;
+   stbi__uint32 ready;
+   int k;
+   // only a baseline scan of every component finishes rows by itself
+   if (z->progressive || z->scan_n != z->s->img_n) return 1;
+   if (!o->started && !stbi__jpeg_begin_output(o)) return 0;
+   ready = o->h;
+   for (k=0; k < o->decode_n; ++k) {
+      // a scan of one component has plain blocks instead of MCUs
+      stbi__uint32 rows = (stbi__uint32) mcu_rows * (stbi__uint32) (z->scan_n == 1 ? 1 : z->img_comp[k].v) * (stbi__uint32) z->block_size;
+      if (rows < (stbi__uint32) o->comp_y[k]) {
+         // output row j upsamples from rows up to (j + vs/2) / vs
+         stbi__uint32 vs = (stbi__uint32) o->res_comp[k].vs;
+         if (rows * vs - vs/2 < ready)
+            ready = rows * vs - vs/2;
+      }
+   }
+   stbi__jpeg_emit_rows(o, ready);
+   return 1;
+}
+
+static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
+{
+   stbi__jpeg_output o;
+   z->s->img_n = 0; // make stbi__cleanup_jpeg safe
+
+   // validate req_comp
+   if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
+
+   o.z = z;
+   o.req_comp = req_comp;
+   o.output = o.row_tail = o.scratch = NULL;
+   o.started = 0;
+   z->stream = z->s->rows_ready ? &o : NULL;
+
+   // load a jpeg image from whichever source, but leave in YCbCr format.
+   // rows_ready loads color-convert what a baseline scan completes as it goes
+   if (!stbi__decode_jpeg_image(z) || (!o.started && !stbi__jpeg_begin_output(&o))) {
+      stbi__jpeg_end_output(&o, 0);
       stbi__cleanup_jpeg(z);
-      *out_x = z->s->img_x;
-      *out_y = z->s->img_y;
-      if (comp) *comp = z->s->img_n >= 3 ? 3 : 1; // report original components, not output
-      return output;
+      return NULL;
+   }
+
+   // resample and color-convert the rest
+   if (z->stream) {
+      stbi__jpeg_emit_rows(&o, o.h);
+      z->s->rows_emitted = 1;
+   } else {
+      o.bands = 1;
+      if (stbi__jpeg_parallel(z)) {
+         // bands of rows with their own buffers; stay serial without them
+         o.bands = o.h / 16 < STBI__JPEG_MAX_TASKS ? (int) o.h / 16 : STBI__JPEG_MAX_TASKS;
+         o.band_scratch = (size_t) o.decode_n * (o.w + 3) + (o.n == 3 ? (size_t) o.n * o.w + 1 : 0);
+         if (o.bands > 1)
+            o.scratch = (stbi_uc *) stbi__malloc_mad2(o.bands, (int) o.band_scratch, 0);
+         if (!o.scratch) o.bands = 1;
+      }
+      if (o.bands > 1) {
+         z->s->parallel_for(z->s->parallel_user, o.bands, stbi__jpeg_output_task, &o);
+         stbi__free(o.scratch);
+      } else {
+         stbi_uc *linebuf[4];
+         int k;
+         for (k=0; k < o.decode_n; ++k)
+            linebuf[k] = z->img_comp[k].linebuf;
+         stbi__jpeg_output_rows(&o, linebuf, o.row_tail, 1, 0, o.h);
+      }
    }
+   stbi__jpeg_end_output(&o, 1);
+   stbi__cleanup_jpeg(z);
+   *out_x = (int) o.w;
+   *out_y = (int) o.h;
+   if (comp) *comp = z->s->img_n >= 3 ? 3 : 1; // report original components, not output
+   return o.output;
 }
 
 static void *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
 {
    unsigned char* result;
    stbi__jpeg* j = (stbi__jpeg*) stbi__malloc(sizeof(stbi__jpeg));
-   STBI_NOTUSED(ri);
    j->s = s;
    stbi__setup_jpeg(j);
    result = load_jpeg_image(j, x,y,comp,req_comp);
-   STBI_FREE(j);
+   ri->flipped = 1; // load_jpeg_image writes the rows in flipped order
+   stbi__free(j);
    return result;
 }
 
@@ -3749,7 +5407,7 @@ static int stbi__jpeg_test(stbi__context *s)
    stbi__setup_jpeg(j);
    r = stbi__decode_jpeg_header(j, STBI__SCAN_type);
    stbi__rewind(s);
-   STBI_FREE(j);
+   stbi__free(j);
    return r;
 }
 
@@ -3759,8 +5417,9 @@ static int stbi__jpeg_info_raw(stbi__jpeg *j, int *x, int *y, int *comp)
       stbi__rewind( j->s );
       return 0;
    }
-   if (x) *x = j->s->img_x;
-   if (y) *y = j->s->img_y;
+   // the size load_jpeg_image ends up with
+   if (x) *x = (int) ((j->s->img_x + (1u << j->s->jpeg_scale) - 1) >> j->s->jpeg_scale);
+   if (y) *y = (int) ((j->s->img_y + (1u << j->s->jpeg_scale) - 1) >> j->s->jpeg_scale);
    if (comp) *comp = j->s->img_n >= 3 ? 3 : 1;
    return 1;
 }
@@ -3771,7 +5430,7 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
    stbi__jpeg* j = (stbi__jpeg*) (stbi__malloc(sizeof(stbi__jpeg)));
    j->s = s;
    result = stbi__jpeg_info_raw(j, x, y, comp);
-   STBI_FREE(j);
+   stbi__free(j);
    return result;
 }
 #endif
@@ -3875,7 +5534,8 @@ typedef struct
 {
    stbi_uc *zbuffer, *zbuffer_end;
    int num_bits;
-   stbi__uint32 code_buffer;
+   stbi__uint64 code_buffer;
+   int eof_bits; // zeros shifted in past the end of the input, at the top of code_buffer
 
    char *zout;
    char *zout_start;
@@ -3891,20 +5551,49 @@ stbi_inline static stbi_uc stbi__zget8(stbi__zbuf *z)
    return *z->zbuffer++;
 }
 
+// the bytes at p as a little-endian 64-bit value
+stbi_inline static stbi__uint64 stbi__zload64(const stbi_uc *p)
+{
+#if defined(STBI__X86_TARGET) || defined(STBI__X64_TARGET) || defined(_M_ARM64) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+   stbi__uint64 v;
+   memcpy(&v, p, 8);
+   return v;
+#else
+   stbi__uint64 v = 0;
+   int i;
+   for (i=7; i >= 0; --i)
+      v = (v << 8) | p[i];
+   return v;
+#endif
+}
+
+// tops the bit buffer up to at least 56 bits, which is enough for a whole
+// length/distance pair (at most 48 bits). Past the end of the input it
+// shifts in zeros
 static void stbi__fill_bits(stbi__zbuf *z)
 {
+   if (z->zbuffer_end - z->zbuffer >= 8) {
+      // take whole bytes from one unaligned 8-byte load. Bits above
+      // num_bits may then hold the start of the next byte; it gets or'ed in
+      // again at the same place on the next refill, which changes nothing
+      z->code_buffer |= stbi__zload64(z->zbuffer) << z->num_bits;
+      z->zbuffer += (63 - z->num_bits) >> 3;
+      z->num_bits |= 56;
+      return;
+   }
    do {
-      STBI_ASSERT(z->code_buffer < (1U << z->num_bits));
-      z->code_buffer |= (unsigned int) stbi__zget8(z) << z->num_bits;
+      if (z->zbuffer >= z->zbuffer_end)
+         z->eof_bits += 8;
+      z->code_buffer |= (stbi__uint64) stbi__zget8(z) << z->num_bits;
       z->num_bits += 8;
-   } while (z->num_bits <= 24);
+   } while (z->num_bits <= 56);
 }
 
 stbi_inline static unsigned int stbi__zreceive(stbi__zbuf *z, int n)
 {
    unsigned int k;
    if (z->num_bits < n) stbi__fill_bits(z);
-   k = z->code_buffer & ((1 << n) - 1);
+   k = (unsigned int) (z->code_buffer & ((1U << n) - 1));
    z->code_buffer >>= n;
    z->num_bits -= n;
    return k;
@@ -3915,7 +5604,7 @@ static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
    int b,s,k;
    // not resolved by fast table, so compute it the slow way
    // use jpeg approach, which requires MSbits at top
-   k = stbi__bit_reverse(a->code_buffer, 16);
+   k = stbi__bit_reverse((int) (a->code_buffer & 0xffff), 16);
    for (s=STBI__ZFAST_BITS+1; ; ++s)
       if (k < z->maxcode[s])
          break;
@@ -3928,10 +5617,10 @@ static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
    return z->value[b];
 }
 
-stbi_inline static int stbi__zhuffman_decode(stbi__zbuf *a, stbi__zhuffman *z)
+// decodes with at least 16 bits already buffered
+stbi_inline static int stbi__zhuffman_decode_buffered(stbi__zbuf *a, stbi__zhuffman *z)
 {
    int b,s;
-   if (a->num_bits < 16) stbi__fill_bits(a);
    b = z->fast[a->code_buffer & STBI__ZFAST_MASK];
    if (b) {
       s = b >> 9;
@@ -3942,6 +5631,12 @@ stbi_inline static int stbi__zhuffman_decode(stbi__zbuf *a, stbi__zhuffman *z)
    return stbi__zhuffman_decode_slowpath(a, z);
 }
 
+stbi_inline static int stbi__zhuffman_decode(stbi__zbuf *a, stbi__zhuffman *z)
+{
+   if (a->num_bits < 16) stbi__fill_bits(a);
+   return stbi__zhuffman_decode_buffered(a, z);
+}
+
 static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room for n bytes
 {
    char *q;
@@ -3952,7 +5647,7 @@ static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room
    limit = old_limit = (int) (z->zout_end - z->zout_start);
    while (cur + n > limit)
       limit *= 2;
-   q = (char *) STBI_REALLOC_SIZED(z->zout_start, old_limit, limit);
+   q = (char *) stbi__realloc_sized(z->zout_start, old_limit, limit);
    STBI_NOTUSED(old_limit);
    if (q == NULL) return stbi__err("outofmem", "Out of memory");
    z->zout_start = q;
@@ -3975,11 +5670,29 @@ static const int stbi__zdist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129
 static const int stbi__zdist_extra[32] =
 { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
 
+// takes n bits off a buffer known to hold them
+stbi_inline static int stbi__zbits(stbi__zbuf *a, int n)
+{
+   int k = (int) (a->code_buffer & ((1U << n) - 1));
+   a->code_buffer >>= n;
+   a->num_bits -= n;
+   return k;
+}
+
 static int stbi__parse_huffman_block(stbi__zbuf *a)
 {
    char *zout = a->zout;
    for(;;) {
-      int z = stbi__zhuffman_decode(a, &a->z_length);
+      int z;
+      // one refill covers a literal/length code, its extra bits, a distance
+      // code and its extra bits: 15+5+15+13 = 48
+      if (a->num_bits < 48) {
+         // the zeros past the end of the input decode as something, so a
+         // truncated stream would otherwise grow its output forever
+         if (a->num_bits < a->eof_bits) return stbi__err("unexpected end","Corrupt PNG");
+         stbi__fill_bits(a);
+      }
+      z = stbi__zhuffman_decode_buffered(a, &a->z_length);
       if (z < 256) {
          if (z < 0) return stbi__err("bad huffman code","Corrupt PNG"); // error in huffman codes
          if (zout >= a->zout_end) {
@@ -3987,20 +5700,30 @@ static int stbi__parse_huffman_block(stbi__zbuf *a)
             zout = a->zout;
          }
          *zout++ = (char) z;
+         // literals come in runs, and a literal code is at most 15 bits:
+         // keep going while the buffer still holds a full code
+         while (a->num_bits >= 15 && zout < a->zout_end) {
+            int b = a->z_length.fast[a->code_buffer & STBI__ZFAST_MASK];
+            if (b == 0 || (b & 511) >= 256) break;
+            stbi__zbits(a, b >> 9);
+            *zout++ = (char) (b & 511);
+         }
       } else {
          stbi_uc *p;
          int len,dist;
          if (z == 256) {
             a->zout = zout;
+            if (a->num_bits < a->eof_bits) return stbi__err("unexpected end","Corrupt PNG");
             return 1;
          }
          z -= 257;
+         if (z >= 29) return stbi__err("bad huffman code","Corrupt PNG");
          len = stbi__zlength_base[z];
-         if (stbi__zlength_extra[z]) len += stbi__zreceive(a, stbi__zlength_extra[z]);
-         z = stbi__zhuffman_decode(a, &a->z_distance);
-         if (z < 0) return stbi__err("bad huffman code","Corrupt PNG");
+         if (stbi__zlength_extra[z]) len += stbi__zbits(a, stbi__zlength_extra[z]);
+         z = stbi__zhuffman_decode_buffered(a, &a->z_distance);
+         if (z < 0 || z >= 30) return stbi__err("bad huffman code","Corrupt PNG");
          dist = stbi__zdist_base[z];
-         if (stbi__zdist_extra[z]) dist += stbi__zreceive(a, stbi__zdist_extra[z]);
+         if (stbi__zdist_extra[z]) dist += stbi__zbits(a, stbi__zdist_extra[z]);
          if (zout - a->zout_start < dist) return stbi__err("bad dist","Corrupt PNG");
          if (zout + len > a->zout_end) {
             if (!stbi__zexpand(a, zout, len)) return 0;
@@ -4008,8 +5731,19 @@ static int stbi__parse_huffman_block(stbi__zbuf *a)
          }
          p = (stbi_uc *) (zout - dist);
          if (dist == 1) { // run of one byte; common in images.
-            stbi_uc v = *p;
-            if (len) { do *zout++ = v; while (--len); }
+            memset(zout, *p, len);
+            zout += len;
+         } else if (dist >= 8 && a->zout_end - zout >= len + 8) {
+            // 8 bytes per step; the source stays at least 8 bytes behind so
+            // every load sees finished output. The last step may spill up to
+            // 7 bytes into room that gets overwritten later anyway
+            char *end = zout + len;
+            do {
+               memcpy(zout, p, 8);
+               zout += 8;
+               p += 8;
+            } while (zout < end);
+            zout = end;
          } else {
             if (len) { do *zout++ = *p++; while (--len); }
          }
@@ -4068,30 +5802,46 @@ static int stbi__compute_huffman_codes(stbi__zbuf *a)
 
 static int stbi__parse_uncompressed_block(stbi__zbuf *a)
 {
-   stbi_uc header[4];
-   int len,nlen,k;
+   stbi_uc header[4], buffered[8];
+   int len,nlen,k,n,i;
    if (a->num_bits & 7)
       stbi__zreceive(a, a->num_bits & 7); // discard
-   // drain the bit-packed data into header
-   k = 0;
+   // drain the bit-packed data; up to 7 bytes can be buffered, the header
+   // comes first and the rest is block data
+   n = 0;
    while (a->num_bits > 0) {
-      header[k++] = (stbi_uc) (a->code_buffer & 255); // suppress MSVC run-time check
+      buffered[n++] = (stbi_uc) (a->code_buffer & 255); // suppress MSVC run-time check
       a->code_buffer >>= 8;
       a->num_bits -= 8;
    }
    STBI_ASSERT(a->num_bits == 0);
+   a->code_buffer = 0; // drop the partial byte a refill may have left
+   // zeros from past the end of the input are read again by stbi__zget8
+   n -= a->eof_bits >> 3;
+   if (n < 0) n = 0;
+   a->eof_bits = 0;
+   for (k=0; k < 4 && k < n; ++k)
+      header[k] = buffered[k];
    // now fill header the normal way
-   while (k < 4)
-      header[k++] = stbi__zget8(a);
+   for (i=k; i < 4; ++i)
+      header[i] = stbi__zget8(a);
    len  = header[1] * 256 + header[0];
    nlen = header[3] * 256 + header[2];
    if (nlen != (len ^ 0xffff)) return stbi__err("zlib corrupt","Corrupt PNG");
-   if (a->zbuffer + len > a->zbuffer_end) return stbi__err("read past buffer","Corrupt PNG");
    if (a->zout + len > a->zout_end)
       if (!stbi__zexpand(a, a->zout, len)) return 0;
+   // block data still in the bit buffer
+   for (; k < n && len > 0; ++k, --len)
+      *a->zout++ = (char) buffered[k];
+   if (a->zbuffer + len > a->zbuffer_end) return stbi__err("read past buffer","Corrupt PNG");
    memcpy(a->zout, a->zbuffer, len);
    a->zbuffer += len;
    a->zout += len;
+   // bytes past a short block go back into the bit buffer
+   for (i=n-1; i >= k; --i) {
+      a->code_buffer = (a->code_buffer << 8) | buffered[i];
+      a->num_bits += 8;
+   }
    return 1;
 }
 
@@ -4144,6 +5894,7 @@ static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
       if (!stbi__parse_zlib_header(a)) return 0;
    a->num_bits = 0;
    a->code_buffer = 0;
+   a->eof_bits = 0;
    do {
       final = stbi__zreceive(a,1);
       type = stbi__zreceive(a,2);
@@ -4186,7 +5937,7 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      STBI_FREE(a.zout_start);
+      stbi__free(a.zout_start);
       return NULL;
    }
 }
@@ -4207,7 +5958,7 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, i
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      STBI_FREE(a.zout_start);
+      stbi__free(a.zout_start);
       return NULL;
    }
 }
@@ -4234,7 +5985,7 @@ STBIDEF char *stbi_zlib_decode_noheader_malloc(char const *buffer, int len, int
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      STBI_FREE(a.zout_start);
+      stbi__free(a.zout_start);
       return NULL;
    }
 }
@@ -4326,8 +6077,118 @@ static int stbi__paeth(int a, int b, int c)
 
 static const stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
 
+#ifdef STBI_SSE2
+// 8-bit RGB/RGBA pixels, kept in the low bytes of an SSE register. The 3-byte
+// forms must not touch the byte after the pixel: it belongs to the next
+// pixel, or to an already decoded row when flipping
+static __m128i stbi__png_load_pixel(stbi_uc const *p, int n)
+{
+   int v;
+   if (n == 4)
+      memcpy(&v, p, 4);
+   else
+      v = p[0] | (p[1] << 8) | (p[2] << 16);
+   return _mm_cvtsi32_si128(v);
+}
+
+static void stbi__png_store_pixel(stbi_uc *p, __m128i v, int n)
+{
+   int x = _mm_cvtsi128_si32(v);
+   if (n == 4) {
+      memcpy(p, &x, 4);
+   } else {
+      p[0] = STBI__BYTECAST(x);
+      p[1] = STBI__BYTECAST(x >> 8);
+      p[2] = STBI__BYTECAST(x >> 16);
+   }
+}
+
+// unfilters the rest of a row of 8-bit RGB or RGBA pixels once the caller
+// has done the first one. The scalar loops go a byte at a time; here every
+// channel of a pixel is done at once, and Up runs 16 bytes at a time when
+// nothing gets expanded. With out_n == img_n+1 the alpha byte comes out
+// opaque by itself: every neighbour already has 255 there and the raw
+// pixel adds 0
+static void stbi__png_unfilter_row_sse2(int filter, stbi_uc *cur, stbi_uc const *raw, stbi_uc const *prior, int img_n, int out_n, stbi__uint32 count)
+{
+   __m128i zero  = _mm_setzero_si128();
+   __m128i a, b, c, d, lowbytes;
+   stbi__uint32 i = 0;
+
+   switch (filter) {
+      case STBI__F_sub:
+         a = stbi__png_load_pixel(cur - out_n, out_n);
+         for (; i < count; ++i, cur += out_n, raw += img_n) {
+            a = _mm_add_epi8(a, stbi__png_load_pixel(raw, img_n));
+            stbi__png_store_pixel(cur, a, out_n);
+         }
+         break;
+
+      case STBI__F_up:
+         if (img_n == out_n) {
+            stbi__uint32 n = count * img_n, k = 0;
+            for (; k+16 <= n; k += 16) {
+               b = _mm_loadu_si128((__m128i const *) (prior + k));
+               d = _mm_loadu_si128((__m128i const *) (raw + k));
+               _mm_storeu_si128((__m128i *) (cur + k), _mm_add_epi8(b, d));
+            }
+            for (; k < n; ++k)
+               cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
+            break;
+         }
+         for (; i < count; ++i, cur += out_n, raw += img_n, prior += out_n) {
+            b = stbi__png_load_pixel(prior, out_n);
+            d = stbi__png_load_pixel(raw, img_n);
+            stbi__png_store_pixel(cur, _mm_add_epi8(b, d), out_n);
+         }
+         break;
+
+      case STBI__F_avg:
+         a = stbi__png_load_pixel(cur - out_n, out_n);
+         for (; i < count; ++i, cur += out_n, raw += img_n, prior += out_n) {
+            // (a+b)>>1 without widening: pavgb rounds up, take the carry back
+            __m128i avg;
+            b = stbi__png_load_pixel(prior, out_n);
+            avg = _mm_avg_epu8(a, b);
+            avg = _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+            a = _mm_add_epi8(avg, stbi__png_load_pixel(raw, img_n));
+            stbi__png_store_pixel(cur, a, out_n);
+         }
+         break;
+
+      case STBI__F_paeth:
+         // same choice as stbi__paeth, in 16-bit lanes:
+         // pa = |b-c|, pb = |a-c|, pc = |a+b-2c|
+         a = _mm_unpacklo_epi8(stbi__png_load_pixel(cur - out_n, out_n), zero);
+         c = _mm_unpacklo_epi8(stbi__png_load_pixel(prior - out_n, out_n), zero);
+         lowbytes = _mm_set1_epi16(0xff);
+         for (; i < count; ++i, cur += out_n, raw += img_n, prior += out_n) {
+            __m128i pa, pb, pc, smallest, nearest;
+            b = _mm_unpacklo_epi8(stbi__png_load_pixel(prior, out_n), zero);
+            pa = _mm_sub_epi16(b, c);
+            pb = _mm_sub_epi16(a, c);
+            pc = _mm_add_epi16(pa, pb);
+            pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+            pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+            pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+            smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+            // pick a where pa is smallest, else b where pb is, else c
+            nearest = _mm_or_si128(_mm_and_si128(_mm_cmpeq_epi16(smallest, pb), b), _mm_andnot_si128(_mm_cmpeq_epi16(smallest, pb), c));
+            nearest = _mm_or_si128(_mm_and_si128(_mm_cmpeq_epi16(smallest, pa), a), _mm_andnot_si128(_mm_cmpeq_epi16(smallest, pa), nearest));
+            // stay in 16-bit lanes, the mask does the byte wraparound
+            d = _mm_unpacklo_epi8(stbi__png_load_pixel(raw, img_n), zero);
+            a = _mm_and_si128(_mm_add_epi16(nearest, d), lowbytes);
+            stbi__png_store_pixel(cur, _mm_packus_epi16(a, a), out_n);
+            c = b;
+         }
+         break;
+   }
+}
+#endif
+
 // create the png data from post-deflated data
-static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
+// with flip set, scanline j is unfiltered straight into row y-1-j
+static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color, int flip)
 {
    int bytes = (depth == 16? 2 : 1);
    stbi__context *s = a->s;
@@ -4354,7 +6215,8 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
    if (raw_len < img_len) return stbi__err("not enough pixels","Corrupt PNG");
 
    for (j=0; j < y; ++j) {
-      stbi_uc *cur = a->out + stride*j;
+      stbi__uint32 out_row = flip ? y-1-j : j;
+      stbi_uc *cur = a->out + stride*out_row;
       stbi_uc *prior;
       int filter = *raw++;
 
@@ -4367,7 +6229,9 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
          filter_bytes = 1;
          width = img_width_bytes;
       }
-      prior = cur - stride; // bugfix: need to compute this after 'cur +=' computation above
+      // bugfix: need to compute this after 'cur +=' computation above
+      // (the previous scanline sits below us when flipping)
+      prior = flip ? cur + stride : cur - stride;
 
       // if first row, use special filter that doesn't sample previous row
       if (j == 0) filter = first_row_filter[filter];
@@ -4405,6 +6269,14 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
          prior += 1;
       }
 
+#ifdef STBI_SSE2
+      if (depth == 8 && (img_n == 3 || img_n == 4) && filter >= STBI__F_sub && filter <= STBI__F_paeth && stbi__sse2_available()) {
+         stbi__png_unfilter_row_sse2(filter, cur, raw, prior, img_n, out_n, x-1);
+         raw += (x-1)*img_n;
+         continue;
+      }
+#endif
+
       // this is a little gross, so that we don't switch per-pixel or per-component
       if (depth < 8 || img_n == out_n) {
          int nk = (width - 1)*filter_bytes;
@@ -4443,7 +6315,7 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
          // the loop above sets the high byte of the pixels' alpha, but for
          // 16 bit png files we also need the low byte set. we'll do that here.
          if (depth == 16) {
-            cur = a->out + stride*j; // start at the beginning of the row again
+            cur = a->out + stride*out_row; // start at the beginning of the row again
             for (i=0; i < x; ++i,cur+=output_bytes) {
                cur[filter_bytes+1] = 255;
             }
@@ -4546,7 +6418,7 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
    stbi_uc *final;
    int p;
    if (!interlaced)
-      return stbi__create_png_image_raw(a, image_data, image_data_len, out_n, a->s->img_x, a->s->img_y, depth, color);
+      return stbi__create_png_image_raw(a, image_data, image_data_len, out_n, a->s->img_x, a->s->img_y, depth, color, a->s->flip_vertically);
 
    // de-interlacing
    final = (stbi_uc *) stbi__malloc_mad3(a->s->img_x, a->s->img_y, out_bytes, 0);
@@ -4561,19 +6433,20 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
       y = (a->s->img_y - yorig[p] + yspc[p]-1) / yspc[p];
       if (x && y) {
          stbi__uint32 img_len = ((((a->s->img_n * x * depth) + 7) >> 3) + 1) * y;
-         if (!stbi__create_png_image_raw(a, image_data, image_data_len, out_n, x, y, depth, color)) {
-            STBI_FREE(final);
+         if (!stbi__create_png_image_raw(a, image_data, image_data_len, out_n, x, y, depth, color, 0)) {
+            stbi__free(final);
             return 0;
          }
          for (j=0; j < y; ++j) {
             for (i=0; i < x; ++i) {
                int out_y = j*yspc[p]+yorig[p];
+               if (a->s->flip_vertically) out_y = a->s->img_y - 1 - out_y;
                int out_x = i*xspc[p]+xorig[p];
                memcpy(final + out_y*a->s->img_x*out_bytes + out_x*out_bytes,
                       a->out + (j*x+i)*out_bytes, out_bytes);
             }
          }
-         STBI_FREE(a->out);
+         stbi__free(a->out);
          image_data += img_len;
          image_data_len -= img_len;
       }
@@ -4662,7 +6535,7 @@ static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int
          p += 4;
       }
    }
-   STBI_FREE(a->out);
+   stbi__free(a->out);
    a->out = temp_out;
 
    STBI_NOTUSED(len);
@@ -4670,19 +6543,6 @@ static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int
    return 1;
 }
 
-static int stbi__unpremultiply_on_load = 0;
-static int stbi__de_iphone_flag = 0;
-
-STBIDEF void stbi_set_unpremultiply_on_load(int flag_true_if_should_unpremultiply)
-{
-   stbi__unpremultiply_on_load = flag_true_if_should_unpremultiply;
-}
-
-STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert)
-{
-   stbi__de_iphone_flag = flag_true_if_should_convert;
-}
-
 static void stbi__de_iphone(stbi__png *z)
 {
    stbi__context *s = z->s;
@@ -4698,7 +6558,7 @@ static void stbi__de_iphone(stbi__png *z)
       }
    } else {
       STBI_ASSERT(s->img_out_n == 4);
-      if (stbi__unpremultiply_on_load) {
+      if (s->unpremultiply) {
          // convert bgr to rgb and unpremultiply
          for (i=0; i < pixel_count; ++i) {
             stbi_uc a = p[3];
@@ -4830,7 +6690,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
                while (ioff + c.length > idata_limit)
                   idata_limit *= 2;
                STBI_NOTUSED(idata_limit_old);
-               p = (stbi_uc *) STBI_REALLOC_SIZED(z->idata, idata_limit_old, idata_limit); if (p == NULL) return stbi__err("outofmem", "Out of memory");
+               p = (stbi_uc *) stbi__realloc_sized(z->idata, idata_limit_old, idata_limit); if (p == NULL) return stbi__err("outofmem", "Out of memory");
                z->idata = p;
             }
             if (!stbi__getn(s, z->idata+ioff,c.length)) return stbi__err("outofdata","Corrupt PNG");
@@ -4848,7 +6708,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
             z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !is_iphone);
             if (z->expanded == NULL) return 0; // zlib should set error
-            STBI_FREE(z->idata); z->idata = NULL;
+            stbi__free(z->idata); z->idata = NULL;
             if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
                s->img_out_n = s->img_n+1;
             else
@@ -4861,7 +6721,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
                   if (!stbi__compute_transparency(z, tc, s->img_out_n)) return 0;
                }
             }
-            if (is_iphone && stbi__de_iphone_flag && s->img_out_n > 2)
+            if (is_iphone && s->de_iphone && s->img_out_n > 2)
                stbi__de_iphone(z);
             if (pal_img_n) {
                // pal_img_n == 3 or 4
@@ -4874,7 +6734,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
                // non-paletted image with tRNS -> source image has (constant) alpha
                ++s->img_n;
             }
-            STBI_FREE(z->expanded); z->expanded = NULL;
+            stbi__free(z->expanded); z->expanded = NULL;
             return 1;
          }
 
@@ -4923,9 +6783,9 @@ static void *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req_comp, st
       *y = p->s->img_y;
       if (n) *n = p->s->img_n;
    }
-   STBI_FREE(p->out);      p->out      = NULL;
-   STBI_FREE(p->expanded); p->expanded = NULL;
-   STBI_FREE(p->idata);    p->idata    = NULL;
+   stbi__free(p->out);      p->out      = NULL;
+   stbi__free(p->expanded); p->expanded = NULL;
+   stbi__free(p->idata);    p->idata    = NULL;
 
    return result;
 }
@@ -4934,6 +6794,7 @@ static void *stbi__png_load(stbi__context *s, int *x, int *y, int *comp, int req
 {
    stbi__png p;
    p.s = s;
+   ri->flipped = 1; // stbi__create_png_image writes the rows in flipped order
    return stbi__do_png(&p, x,y,comp,req_comp, ri);
 }
 
@@ -5148,14 +7009,16 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
    int psize=0,i,j,width;
    int flip_vertically, pad, target;
    stbi__bmp_data info;
-   STBI_NOTUSED(ri);
 
    info.all_a = 255;
    if (stbi__bmp_parse_header(s, &info) == NULL)
       return NULL; // error code already set
 
-   flip_vertically = ((int) s->img_y) > 0;
+   // bottom-up files are already in flipped order; otherwise store each row
+   // where it belongs instead of swapping rows afterwards
+   flip_vertically = (((int) s->img_y) > 0) != (s->flip_vertically != 0);
    s->img_y = abs((int) s->img_y);
+   ri->flipped = 1;
 
    mr = info.mr;
    mg = info.mg;
@@ -5185,7 +7048,7 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
    if (!out) return stbi__errpuc("outofmem", "Out of memory");
    if (info.bpp < 16) {
       int z=0;
-      if (psize == 0 || psize > 256) { STBI_FREE(out); return stbi__errpuc("invalid", "Corrupt BMP"); }
+      if (psize == 0 || psize > 256) { stbi__free(out); return stbi__errpuc("invalid", "Corrupt BMP"); }
       for (i=0; i < psize; ++i) {
          pal[i][2] = stbi__get8(s);
          pal[i][1] = stbi__get8(s);
@@ -5197,16 +7060,18 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
       if (info.bpp == 1) width = (s->img_x + 7) >> 3;
       else if (info.bpp == 4) width = (s->img_x + 1) >> 1;
       else if (info.bpp == 8) width = s->img_x;
-      else { STBI_FREE(out); return stbi__errpuc("bad bpp", "Corrupt BMP"); }
+      else { stbi__free(out); return stbi__errpuc("bad bpp", "Corrupt BMP"); }
       pad = (-width)&3;
       if (info.bpp == 1) {
          for (j=0; j < (int) s->img_y; ++j) {
             int bit_offset = 7, v = stbi__get8(s);
+            z = (flip_vertically ? (int) s->img_y-1-j : j) * (int) s->img_x * target;
             for (i=0; i < (int) s->img_x; ++i) {
                int color = (v>>bit_offset)&0x1;
                out[z++] = pal[color][0];
                out[z++] = pal[color][1];
                out[z++] = pal[color][2];
+               if (target == 4) out[z++] = 255;
                if((--bit_offset) < 0) {
                   bit_offset = 7;
                   v = stbi__get8(s);
@@ -5216,6 +7081,7 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
          }
       } else {
          for (j=0; j < (int) s->img_y; ++j) {
+            z = (flip_vertically ? (int) s->img_y-1-j : j) * (int) s->img_x * target;
             for (i=0; i < (int) s->img_x; i += 2) {
                int v=stbi__get8(s),v2=0;
                if (info.bpp == 4) {
@@ -5252,7 +7118,7 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
             easy = 2;
       }
       if (!easy) {
-         if (!mr || !mg || !mb) { STBI_FREE(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
+         if (!mr || !mg || !mb) { stbi__free(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
          // right shift amt to put high bit in position #7
          rshift = stbi__high_bit(mr)-7; rcount = stbi__bitcount(mr);
          gshift = stbi__high_bit(mg)-7; gcount = stbi__bitcount(mg);
@@ -5260,6 +7126,7 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
          ashift = stbi__high_bit(ma)-7; acount = stbi__bitcount(ma);
       }
       for (j=0; j < (int) s->img_y; ++j) {
+         z = (flip_vertically ? (int) s->img_y-1-j : j) * (int) s->img_x * target;
          if (easy) {
             for (i=0; i < (int) s->img_x; ++i) {
                unsigned char a;
@@ -5293,17 +7160,6 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
       for (i=4*s->img_x*s->img_y-1; i >= 0; i -= 4)
          out[i] = 255;
 
-   if (flip_vertically) {
-      stbi_uc t;
-      for (j=0; j < (int) s->img_y>>1; ++j) {
-         stbi_uc *p1 = out +      j     *s->img_x*target;
-         stbi_uc *p2 = out + (s->img_y-1-j)*s->img_x*target;
-         for (i=0; i < (int) s->img_x*target; ++i) {
-            t = p1[i], p1[i] = p2[i], p2[i] = t;
-         }
-      }
-   }
-
    if (req_comp && req_comp != target) {
       out = stbi__convert_format(out, target, req_comp, s->img_x, s->img_y);
       if (out == NULL) return out; // stbi__convert_format frees input on failure
@@ -5478,7 +7334,7 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
    int RLE_count = 0;
    int RLE_repeating = 0;
    int read_next_pixel = 1;
-   STBI_NOTUSED(ri);
+   int row_start, row_left;
 
    //   do a tiny bit of precessing
    if ( tga_image_type >= 8 )
@@ -5487,6 +7343,9 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
       tga_is_RLE = 1;
    }
    tga_inverted = 1 - ((tga_inverted >> 5) & 1);
+   // rows are stored straight into their final place, flipped or not
+   if (s->flip_vertically) tga_inverted = !tga_inverted;
+   ri->flipped = 1;
 
    //   If I'm paletted, then I'll use the number of bits from the palette
    if ( tga_indexed ) tga_comp = stbi__tga_get_comp(tga_palette_bits, 0, &tga_rgb16);
@@ -5524,7 +7383,7 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
          //   load the palette
          tga_palette = (unsigned char*)stbi__malloc_mad2(tga_palette_len, tga_comp, 0);
          if (!tga_palette) {
-            STBI_FREE(tga_data);
+            stbi__free(tga_data);
             return stbi__errpuc("outofmem", "Out of memory");
          }
          if (tga_rgb16) {
@@ -5535,14 +7394,21 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
                pal_entry += tga_comp;
             }
          } else if (!stbi__getn(s, tga_palette, tga_palette_len * tga_comp)) {
-               STBI_FREE(tga_data);
-               STBI_FREE(tga_palette);
+               stbi__free(tga_data);
+               stbi__free(tga_palette);
                return stbi__errpuc("bad palette", "Corrupt TGA");
          }
       }
-      //   load the data
+      //   load the data, row by row into the row it ends up in
+      row_start = 0;
+      row_left = 0;
       for (i=0; i < tga_width * tga_height; ++i)
       {
+         if (row_left == 0) {
+            int row = i / tga_width;
+            row_start = (tga_inverted ? tga_height - row - 1 : row) * tga_width * tga_comp;
+            row_left = tga_width;
+         }
          //   if I'm in RLE mode, do I need to get a RLE stbi__pngchunk?
          if ( tga_is_RLE )
          {
@@ -5592,32 +7458,17 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
 
          // copy data
          for (j = 0; j < tga_comp; ++j)
-           tga_data[i*tga_comp+j] = raw_data[j];
+           tga_data[row_start+j] = raw_data[j];
+         row_start += tga_comp;
+         --row_left;
 
          //   in case we're in RLE mode, keep counting down
          --RLE_count;
       }
-      //   do I need to invert the image?
-      if ( tga_inverted )
-      {
-         for (j = 0; j*2 < tga_height; ++j)
-         {
-            int index1 = j * tga_width * tga_comp;
-            int index2 = (tga_height - 1 - j) * tga_width * tga_comp;
-            for (i = tga_width * tga_comp; i > 0; --i)
-            {
-               unsigned char temp = tga_data[index1];
-               tga_data[index1] = tga_data[index2];
-               tga_data[index2] = temp;
-               ++index1;
-               ++index2;
-            }
-         }
-      }
       //   clear my palette, if I had one
       if ( tga_palette != NULL )
       {
-         STBI_FREE( tga_palette );
+         stbi__free( tga_palette );
       }
    }
 
@@ -5805,7 +7656,7 @@ static void *stbi__psd_load(stbi__context *s, int *x, int *y, int *comp, int req
          } else {
             // Read the RLE data.
             if (!stbi__psd_decode_rle(s, p, pixelCount)) {
-               STBI_FREE(out);
+               stbi__free(out);
                return stbi__errpuc("corrupt", "bad RLE data");
             }
          }
@@ -6092,7 +7943,7 @@ static void *stbi__pic_load(stbi__context *s,int *px,int *py,int *comp,int req_c
    memset(result, 0xff, x*y*4);
 
    if (!stbi__pic_load_core(s,x,y,comp, result)) {
-      STBI_FREE(result);
+      stbi__free(result);
       result=0;
    }
    *px = x;
@@ -6202,13 +8053,13 @@ static int stbi__gif_info_raw(stbi__context *s, int *x, int *y, int *comp)
 {
    stbi__gif* g = (stbi__gif*) stbi__malloc(sizeof(stbi__gif));
    if (!stbi__gif_header(s, g, comp, 1)) {
-      STBI_FREE(g);
+      stbi__free(g);
       stbi__rewind( s );
       return 0;
    }
    if (x) *x = g->w;
    if (y) *y = g->h;
-   STBI_FREE(g);
+   stbi__free(g);
    return 1;
 }
 
@@ -6523,9 +8374,9 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
             stride = g.w * g.h * 4;
 
             if (out) {
-               out = (stbi_uc*) STBI_REALLOC( out, layers * stride );
+               out = (stbi_uc*) stbi__realloc_sized( out, (layers - 1) * stride, layers * stride );
                if (delays) {
-                  *delays = (int*) STBI_REALLOC( *delays, sizeof(int) * layers );
+                  *delays = (int*) stbi__realloc_sized( *delays, sizeof(int) * (layers - 1), sizeof(int) * layers );
                }
             } else {
                out = (stbi_uc*)stbi__malloc( layers * stride );
@@ -6545,9 +8396,9 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
       } while (u != 0);
 
       // free temp buffer;
-      STBI_FREE(g.out);
-      STBI_FREE(g.history);
-      STBI_FREE(g.background);
+      stbi__free(g.out);
+      stbi__free(g.history);
+      stbi__free(g.background);
 
       // do the final conversion after loading everything;
       if (req_comp && req_comp != 4)
@@ -6579,8 +8430,8 @@ static void *stbi__gif_load(stbi__context *s, int *x, int *y, int *comp, int req
    }
 
    // free buffers needed for multiple frame loading;
-   STBI_FREE(g.history);
-   STBI_FREE(g.background);
+   stbi__free(g.history);
+   stbi__free(g.background);
 
    return u;
 }
@@ -6750,16 +8601,16 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
             stbi__hdr_convert(hdr_data, rgbe, req_comp);
             i = 1;
             j = 0;
-            STBI_FREE(scanline);
+            stbi__free(scanline);
             goto main_decode_loop; // yes, this makes no sense
          }
          len <<= 8;
          len |= stbi__get8(s);
-         if (len != width) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("invalid decoded scanline length", "corrupt HDR"); }
+         if (len != width) { stbi__free(hdr_data); stbi__free(scanline); return stbi__errpf("invalid decoded scanline length", "corrupt HDR"); }
          if (scanline == NULL) {
             scanline = (stbi_uc *) stbi__malloc_mad2(width, 4, 0);
             if (!scanline) {
-               STBI_FREE(hdr_data);
+               stbi__free(hdr_data);
                return stbi__errpf("outofmem", "Out of memory");
             }
          }
@@ -6773,12 +8624,12 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
                   // Run
                   value = stbi__get8(s);
                   count -= 128;
-                  if (count > nleft) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
+                  if (count > nleft) { stbi__free(hdr_data); stbi__free(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
                   for (z = 0; z < count; ++z)
                      scanline[i++ * 4 + k] = value;
                } else {
                   // Dump
-                  if (count > nleft) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
+                  if (count > nleft) { stbi__free(hdr_data); stbi__free(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
                   for (z = 0; z < count; ++z)
                      scanline[i++ * 4 + k] = stbi__get8(s);
                }
@@ -6788,7 +8639,7 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
             stbi__hdr_convert(hdr_data+(j*width + i)*req_comp, scanline + i*4, req_comp);
       }
       if (scanline)
-         STBI_FREE(scanline);
+         stbi__free(scanline);
    }
 
    return hdr_data;
@@ -6851,7 +8702,7 @@ static int stbi__bmp_info(stbi__context *s, int *x, int *y, int *comp)
    if (p == NULL)
       return 0;
    if (x) *x = s->img_x;
-   if (y) *y = s->img_y;
+   if (y) *y = abs((int) s->img_y); // negative for top-down files, as in stbi__bmp_load
    if (comp) *comp = info.ma ? 4 : 3;
    return 1;
 }
@@ -7220,6 +9071,20 @@ STBIDEF int stbi_info_from_callbacks(stbi_io_callbacks const *c, void *user, int
    return stbi__info_main(&s,x,y,comp);
 }
 
+STBIDEF int stbi_info_from_memory_with_options(stbi_uc const *buffer, int len, int *x, int *y, int *comp, stbi_load_options *options)
+{
+   stbi__context s;
+   int r;
+   stbi_allocator const *outer = stbi__begin_options_call(options);
+   stbi__options_settings(&s, options);
+   stbi__start_mem_io(&s,buffer,len);
+   r = stbi__info_main(&s,x,y,comp);
+   if (!r)
+      options->failure_reason = stbi__g_failure_reason;
+   stbi__g_allocator = outer;
+   return r;
+}
+
 STBIDEF int stbi_is_16_bit_from_memory(stbi_uc const *buffer, int len)
 {
    stbi__context s;
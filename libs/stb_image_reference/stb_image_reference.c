@@ -0,0 +1,37 @@
+#define STB_IMAGE_IMPLEMENTATION
+#define STB_IMAGE_STATIC
+#include "stb_image_v219.h"
+
+#include "stb_image_reference.h"
+
+unsigned char *reference_load_from_memory(unsigned char const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels, int flip)
+{
+   stbi_set_flip_vertically_on_load(flip);
+   return stbi_load_from_memory(buffer, len, x, y, channels_in_file, desired_channels);
+}
+
+unsigned char *reference_load(char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, int flip)
+{
+   stbi_set_flip_vertically_on_load(flip);
+   return stbi_load(filename, x, y, channels_in_file, desired_channels);
+}
+
+void reference_image_free(void *image)
+{
+   stbi_image_free(image);
+}
+
+char const *reference_failure_reason(void)
+{
+   return stbi_failure_reason();
+}
+
+char *reference_zlib_decode_malloc(char const *buffer, int len, int initial_size, int *outlen, int parse_header)
+{
+   return stbi_zlib_decode_malloc_guesssize_headerflag(buffer, len, initial_size, outlen, parse_header);
+}
+
+int reference_zlib_decode_buffer(char *obuffer, int olen, char const *ibuffer, int ilen)
+{
+   return stbi_zlib_decode_buffer(obuffer, olen, ibuffer, ilen);
+}
@@ -0,0 +1,31 @@
+#ifndef STB_IMAGE_REFERENCE_H
+#define STB_IMAGE_REFERENCE_H
+
+// stb_image v2.19 as this repository first shipped it, before the decoder
+// changes made in libs/stb_image: what the tools' benchmarks start from
+// and what their checks expect bit for bit. It is compiled static into
+// stb_image_reference.c, and without SIMD into stb_image_reference_scalar.c;
+// these are its only symbols. Not thread safe, flip goes through v2.19's
+// global setting.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+unsigned char *reference_load_from_memory(unsigned char const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels, int flip);
+unsigned char *reference_load(char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, int flip);
+void reference_image_free(void *image);
+char const *reference_failure_reason(void);
+
+// the same built with STBI_NO_SIMD: v2.19's plain C IDCT, color conversion
+// and upsampling. Free with reference_image_free
+unsigned char *reference_scalar_load_from_memory(unsigned char const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels, int flip);
+
+char *reference_zlib_decode_malloc(char const *buffer, int len, int initial_size, int *outlen, int parse_header);
+int reference_zlib_decode_buffer(char *obuffer, int olen, char const *ibuffer, int ilen);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,12 @@
+#define STB_IMAGE_IMPLEMENTATION
+#define STB_IMAGE_STATIC
+#define STBI_NO_SIMD
+#include "stb_image_v219.h"
+
+#include "stb_image_reference.h"
+
+unsigned char *reference_scalar_load_from_memory(unsigned char const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels, int flip)
+{
+   stbi_set_flip_vertically_on_load(flip);
+   return stbi_load_from_memory(buffer, len, x, y, channels_in_file, desired_channels);
+}
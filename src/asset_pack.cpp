@@ -0,0 +1,291 @@
+#include "asset_pack.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include "content_hash.hpp"
+#include "mapped_file.hpp"
+
+namespace
+{
+  // bump when the layout changes, older packs then fail to open
+  const std::uint32_t packVersion = 2;
+  const char packMagic[4] = {'A', 'P', 'A', 'K'};
+  // payloads start on this boundary, enough for any GPU upload source
+  const std::size_t payloadAlignment = 16;
+
+  // start of the file, the payloads follow
+  struct PackHeader
+  {
+    char magic[4];
+    std::uint32_t version;
+    std::uint64_t entryCount;
+    // where the records start, the name slots then the names follow them
+    std::uint64_t indexOffset;
+    std::uint64_t fileSize;
+  };
+
+  // one per entry, sorted by name
+  struct PackRecord
+  {
+    std::uint64_t sourceKey;
+    std::uint64_t offset;
+    std::uint64_t size;
+    // from the end of the slots
+    std::uint32_t nameOffset;
+    std::uint32_t nameLength;
+  };
+
+  static_assert(sizeof(PackHeader) == 32, "pack header is 32 bytes");
+  static_assert(sizeof(PackRecord) == 32, "pack records are 32 bytes");
+
+  PackRecord readRecord(const unsigned char *records, std::size_t index)
+  {
+    PackRecord record;
+    std::memcpy(&record, records + index * sizeof(record), sizeof(record));
+    return record;
+  }
+
+  // empty vectors may have no storage to pass to fwrite
+  bool writeBytes(std::FILE *file, const void *data, std::size_t size)
+  {
+    return size == 0 || std::fwrite(data, 1, size, file) == size;
+  }
+
+  // the hash table after the records: a power of two of slots, at least
+  // twice the entries, each 0 or 1 + the index of a record. A name starts
+  // probing at its hash and goes on to the next slot until an empty one
+  std::size_t slotCount(std::size_t entries)
+  {
+    std::size_t slots = 1;
+    while (slots < 2 * entries)
+      slots *= 2;
+    return slots;
+  }
+
+  std::size_t nameSlot(const char *name, std::size_t length, std::size_t slots)
+  {
+    return hashBytes(reinterpret_cast<const unsigned char *>(name), length, 0) & (slots - 1);
+  }
+
+  // strcmp over counted strings
+  int compareNames(const char *a, std::size_t aLength, const char *b, std::size_t bLength)
+  {
+    int order = std::memcmp(a, b, std::min(aLength, bLength));
+    if (order != 0)
+      return order;
+    return aLength < bLength ? -1 : aLength > bLength ? 1 : 0;
+  }
+}
+
+bool writeAssetPack(const std::string &path, const std::vector<PackEntry> &entries, std::string &error)
+{
+  std::vector<const PackEntry *> sorted;
+  for (const PackEntry &entry : entries)
+    sorted.push_back(&entry);
+  std::sort(sorted.begin(), sorted.end(), [](const PackEntry *a, const PackEntry *b)
+    {
+      return compareNames(a->name.data(), a->name.size(), b->name.data(), b->name.size()) < 0;
+    });
+  for (std::size_t i = 1; i < sorted.size(); ++i)
+    if (sorted[i - 1]->name == sorted[i]->name)
+      {
+        error = "two entries called " + sorted[i]->name;
+        return false;
+      }
+
+  std::vector<PackRecord> records;
+  std::string names;
+  std::uint64_t offset = sizeof(PackHeader);
+  for (const PackEntry *entry : sorted)
+    {
+      offset = (offset + payloadAlignment - 1) / payloadAlignment * payloadAlignment;
+      PackRecord record;
+      record.sourceKey = entry->sourceKey;
+      record.offset = offset;
+      record.size = entry->data.size();
+      record.nameOffset = static_cast<std::uint32_t>(names.size());
+      record.nameLength = static_cast<std::uint32_t>(entry->name.size());
+      records.push_back(record);
+      names += entry->name;
+      offset += entry->data.size();
+    }
+
+  PackHeader header;
+  std::memcpy(header.magic, packMagic, sizeof(packMagic));
+  header.version = packVersion;
+  header.entryCount = records.size();
+  header.indexOffset = (offset + payloadAlignment - 1) / payloadAlignment * payloadAlignment;
+  std::vector<std::uint32_t> slots(slotCount(records.size()));
+  for (std::size_t i = 0; i < sorted.size(); ++i)
+    {
+      std::size_t slot = nameSlot(sorted[i]->name.data(), sorted[i]->name.size(), slots.size());
+      while (slots[slot] != 0)
+        slot = (slot + 1) & (slots.size() - 1);
+      slots[slot] = static_cast<std::uint32_t>(i + 1);
+    }
+  header.fileSize = header.indexOffset + records.size() * sizeof(PackRecord) + slots.size() * sizeof(std::uint32_t) + names.size();
+
+  std::string temporary = path + ".tmp";
+  std::FILE *file = std::fopen(temporary.c_str(), "wb");
+  if (file == nullptr)
+    {
+      error = "can't open " + temporary + ": " + std::strerror(errno);
+      return false;
+    }
+  // padding up to the next payload or the index
+  const unsigned char zeros[payloadAlignment] = {};
+  std::uint64_t written = sizeof(header);
+  bool complete = std::fwrite(&header, sizeof(header), 1, file) == 1;
+  for (std::size_t i = 0; i < sorted.size() && complete; ++i)
+    {
+      std::size_t padding = records[i].offset - written;
+      const std::vector<unsigned char> &data = sorted[i]->data;
+      complete = writeBytes(file, zeros, padding) && writeBytes(file, data.data(), data.size());
+      written = records[i].offset + data.size();
+    }
+  std::size_t padding = header.indexOffset - written;
+  complete = complete && writeBytes(file, zeros, padding) && writeBytes(file, records.data(), records.size() * sizeof(PackRecord))
+    && writeBytes(file, slots.data(), slots.size() * sizeof(std::uint32_t)) && writeBytes(file, names.data(), names.size());
+  if (std::fclose(file) != 0 || !complete)
+    {
+      std::remove(temporary.c_str());
+      error = "can't write " + temporary;
+      return false;
+    }
+  if (!replaceFile(temporary, path))
+    {
+      error = "can't rename " + temporary + ": " + std::strerror(errno);
+      std::remove(temporary.c_str());
+      return false;
+    }
+  return true;
+}
+
+AssetPack::AssetPack()
+  : records(nullptr), slots(nullptr), names(nullptr), count(0), slotMask(0)
+{
+}
+
+AssetPack::~AssetPack()
+{
+  close();
+}
+
+bool AssetPack::open(const std::string &path)
+{
+  close();
+  auto mapping = std::make_shared<MappedFile>();
+  if (!mapping->open(path))
+    {
+      lastError = mapping->error();
+      return false;
+    }
+
+  PackHeader header;
+  std::size_t size = mapping->size();
+  if (size < sizeof(header))
+    {
+      lastError = path + ": truncated pack";
+      return false;
+    }
+  std::memcpy(&header, mapping->data(), sizeof(header));
+  if (std::memcmp(header.magic, packMagic, sizeof(packMagic)) != 0 || header.version != packVersion)
+    {
+      lastError = path + ": not an asset pack of this version";
+      return false;
+    }
+  // a record and 2 slots an entry at least
+  if (header.fileSize != size || header.indexOffset > size
+      || header.entryCount > (size - header.indexOffset) / (sizeof(PackRecord) + 2 * sizeof(std::uint32_t)))
+    {
+      lastError = path + ": truncated pack";
+      return false;
+    }
+  std::size_t entries = header.entryCount;
+  std::size_t slotsSize = slotCount(entries) * sizeof(std::uint32_t);
+  if (slotsSize > size - header.indexOffset - entries * sizeof(PackRecord))
+    {
+      lastError = path + ": truncated pack";
+      return false;
+    }
+
+  // every entry within the file once, so lookups needn't check again
+  const unsigned char *index = mapping->data() + header.indexOffset;
+  const unsigned char *table = index + entries * sizeof(PackRecord);
+  std::size_t namesSize = size - header.indexOffset - entries * sizeof(PackRecord) - slotsSize;
+  for (std::size_t i = 0; i < entries; ++i)
+    {
+      PackRecord record = readRecord(index, i);
+      if (record.offset > header.indexOffset || record.size > header.indexOffset - record.offset || record.nameOffset > namesSize
+          || record.nameLength > namesSize - record.nameOffset)
+        {
+          lastError = path + ": corrupt pack index";
+          return false;
+        }
+    }
+  for (std::size_t i = 0; i < slotsSize / sizeof(std::uint32_t); ++i)
+    {
+      std::uint32_t slot;
+      std::memcpy(&slot, table + i * sizeof(slot), sizeof(slot));
+      if (slot > entries)
+        {
+          lastError = path + ": corrupt pack index";
+          return false;
+        }
+    }
+
+  file = std::move(mapping);
+  records = index;
+  slots = table;
+  names = table + slotsSize;
+  count = entries;
+  slotMask = slotsSize / sizeof(std::uint32_t) - 1;
+  return true;
+}
+
+void AssetPack::close()
+{
+  file.reset();
+  records = nullptr;
+  slots = nullptr;
+  names = nullptr;
+  count = 0;
+  slotMask = 0;
+}
+
+AssetPack::Entry AssetPack::entry(std::size_t index) const
+{
+  PackRecord record = readRecord(records, index);
+  Entry found;
+  found.name = reinterpret_cast<const char *>(names + record.nameOffset);
+  found.nameLength = record.nameLength;
+  found.sourceKey = record.sourceKey;
+  found.data = file->data() + record.offset;
+  found.size = record.size;
+  return found;
+}
+
+bool AssetPack::find(const std::string &name, Entry &found) const
+{
+  if (count == 0)
+    return false;
+  // bounded by the table size: a corrupt table may have no empty slot
+  std::size_t slot = nameSlot(name.data(), name.size(), slotMask + 1);
+  for (std::size_t probes = 0; probes <= slotMask; ++probes, slot = (slot + 1) & slotMask)
+    {
+      std::uint32_t index;
+      std::memcpy(&index, slots + slot * sizeof(index), sizeof(index));
+      if (index == 0)
+        return false;
+      PackRecord record = readRecord(records, index - 1);
+      if (record.nameLength == name.size() && std::memcmp(names + record.nameOffset, name.data(), name.size()) == 0)
+        {
+          found = entry(index - 1);
+          return true;
+        }
+    }
+  return false;
+}
@@ -0,0 +1,79 @@
+#ifndef ASSET_PACK_H
+#define ASSET_PACK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+class MappedFile;
+
+
+// one asset as assetbake writes it into a pack
+struct PackEntry
+{
+    // the path the application asks for, "container.jpg"
+    std::string name;
+    // hash of the source file and the settings it was baked with, so a
+    // rebuild can tell which entries are still current
+    std::uint64_t sourceKey = 0;
+    std::vector<unsigned char> data;
+};
+
+// write entries into a single pack file, each payload aligned for direct
+// use from the mapping, and after them an index sorted by name with a
+// hash table over it. Written aside then renamed over, readers never see
+// half a pack. False with error set when the file can't be written
+bool writeAssetPack(const std::string &path, const std::vector<PackEntry> &entries, std::string &error);
+
+// read-only view of a pack written by writeAssetPack, mapped whole: the
+// payloads are read straight from the page cache. Lookups don't allocate
+// and are safe from any thread once open() returned
+class AssetPack
+{
+public:
+    // an asset inside the mapping, valid while the pack stays open or
+    // while a copy of storage() is held
+    struct Entry
+    {
+        const char *name = nullptr;
+        std::size_t nameLength = 0;
+        std::uint64_t sourceKey = 0;
+        const unsigned char *data = nullptr;
+        std::size_t size = 0;
+    };
+
+    AssetPack();
+    ~AssetPack();
+
+    AssetPack(const AssetPack&) = delete;
+    AssetPack& operator=(const AssetPack&) = delete;
+
+    // map path and check its index, dropping any previous pack. On
+    // failure returns false and error() tells why
+    bool open(const std::string &path);
+    void close();
+
+    bool isOpen() const { return file != nullptr; }
+    // number of entries, and the entry at index in name order
+    std::size_t size() const { return count; }
+    Entry entry(std::size_t index) const;
+    // the entry called name, false if there's none. A hash lookup, one
+    // name compared on average
+    bool find(const std::string &name, Entry &found) const;
+    // keeps the mapping alive for entries handed out of the pack
+    std::shared_ptr<const void> storage() const { return file; }
+    const std::string& error() const { return lastError; }
+
+private:
+    std::shared_ptr<MappedFile> file;
+    const unsigned char *records;
+    const unsigned char *slots;
+    const unsigned char *names;
+    std::size_t count;
+    std::size_t slotMask;
+    std::string lastError;
+};
+
+#endif
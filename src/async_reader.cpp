@@ -0,0 +1,428 @@
+#include "async_reader.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+#include "thread_pool.hpp"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+struct AsyncReader::Request
+{
+    AsyncRead read;
+    Callback done;
+    std::chrono::steady_clock::time_point submitted;
+#ifndef _WIN32
+    int fd = -1;
+    // bytes read so far
+    std::size_t offset = 0;
+    struct iovec vector;
+#endif
+};
+
+namespace
+{
+  // the most a single read asks for, the kernel caps reads near 2 GiB
+  const std::size_t maxReadBytes = std::size_t(1) << 30;
+
+#ifdef _WIN32
+  bool readWhole(const std::string &path, std::vector<unsigned char> &data, std::string &error)
+  {
+    std::FILE *file = std::fopen(path.c_str(), "rb");
+    if (file == nullptr)
+      {
+        error = "can't open " + path + ": " + std::strerror(errno);
+        return false;
+      }
+    unsigned char buffer[1 << 16];
+    for (std::size_t got; (got = std::fread(buffer, 1, sizeof(buffer), file)) != 0;)
+      data.insert(data.end(), buffer, buffer + got);
+    bool failed = std::ferror(file) != 0;
+    std::fclose(file);
+    if (failed)
+      error = "can't read " + path;
+    return !failed;
+  }
+#else
+  // open path and size data for all of it
+  bool openRead(const std::string &path, int &fd, std::vector<unsigned char> &data, std::string &error)
+  {
+    fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      {
+        error = "can't open " + path + ": " + std::strerror(errno);
+        return false;
+      }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < 0)
+      {
+        error = "can't stat " + path + ": " + std::strerror(errno);
+        return false;
+      }
+    data.resize(static_cast<std::size_t>(info.st_size));
+    return true;
+  }
+
+  bool readWhole(const std::string &path, std::vector<unsigned char> &data, std::string &error)
+  {
+    int fd;
+    bool complete = openRead(path, fd, data, error);
+    for (std::size_t offset = 0; complete && offset < data.size();)
+      {
+        ssize_t got = pread(fd, data.data() + offset, std::min(data.size() - offset, maxReadBytes), static_cast<off_t>(offset));
+        if (got < 0 && errno == EINTR)
+          continue;
+        if (got <= 0)
+          {
+            error = got < 0 ? "can't read " + path + ": " + std::strerror(errno) : "unexpected end of " + path;
+            complete = false;
+          }
+        else
+          {
+            offset += static_cast<std::size_t>(got);
+          }
+      }
+    if (fd >= 0)
+      ::close(fd);
+    return complete;
+  }
+#endif
+}
+
+#ifdef __linux__
+
+// an io_uring set up through the raw system calls: the submission and
+// completion rings shared with the kernel, and the submission entries
+struct AsyncReader::Ring
+{
+    int fd = -1;
+    void *submissionRing = MAP_FAILED;
+    std::size_t submissionRingBytes = 0;
+    void *completionRing = MAP_FAILED;
+    std::size_t completionRingBytes = 0;
+    io_uring_sqe *entries = nullptr;
+    std::size_t entriesBytes = 0;
+    unsigned *submissionTail = nullptr;
+    unsigned submissionMask = 0;
+    unsigned *submissionArray = nullptr;
+    unsigned *completionHead = nullptr;
+    unsigned *completionTail = nullptr;
+    unsigned completionMask = 0;
+    io_uring_cqe *completions = nullptr;
+    // our copy of the submission tail, and the entries before it the
+    // kernel hasn't taken yet
+    unsigned tail = 0;
+    unsigned prepared = 0;
+
+    ~Ring()
+    {
+      if (entries != nullptr)
+        munmap(entries, entriesBytes);
+      if (completionRing != MAP_FAILED && completionRing != submissionRing)
+        munmap(completionRing, completionRingBytes);
+      if (submissionRing != MAP_FAILED)
+        munmap(submissionRing, submissionRingBytes);
+      if (fd >= 0)
+        ::close(fd);
+    }
+
+    // null when the kernel has no io_uring or won't let us use it
+    static std::unique_ptr<Ring> create(unsigned depth)
+    {
+      std::unique_ptr<Ring> ring(new Ring);
+      io_uring_params params;
+      std::memset(&params, 0, sizeof(params));
+      ring->fd = static_cast<int>(syscall(__NR_io_uring_setup, depth, &params));
+      if (ring->fd < 0)
+        return nullptr;
+
+      ring->submissionRingBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+      ring->completionRingBytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+      // newer kernels map both rings at once
+      bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+      if (single)
+        ring->submissionRingBytes = ring->completionRingBytes = std::max(ring->submissionRingBytes, ring->completionRingBytes);
+      ring->submissionRing = mmap(nullptr, ring->submissionRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                                  IORING_OFF_SQ_RING);
+      if (ring->submissionRing == MAP_FAILED)
+        return nullptr;
+      ring->completionRing = single ? ring->submissionRing
+        : mmap(nullptr, ring->completionRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+      if (ring->completionRing == MAP_FAILED)
+        return nullptr;
+      ring->entriesBytes = params.sq_entries * sizeof(io_uring_sqe);
+      void *entries = mmap(nullptr, ring->entriesBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+      if (entries == MAP_FAILED)
+        return nullptr;
+      ring->entries = static_cast<io_uring_sqe *>(entries);
+
+      auto submission = static_cast<unsigned char *>(ring->submissionRing);
+      auto completion = static_cast<unsigned char *>(ring->completionRing);
+      ring->submissionTail = reinterpret_cast<unsigned *>(submission + params.sq_off.tail);
+      ring->submissionMask = *reinterpret_cast<unsigned *>(submission + params.sq_off.ring_mask);
+      ring->submissionArray = reinterpret_cast<unsigned *>(submission + params.sq_off.array);
+      ring->completionHead = reinterpret_cast<unsigned *>(completion + params.cq_off.head);
+      ring->completionTail = reinterpret_cast<unsigned *>(completion + params.cq_off.tail);
+      ring->completionMask = *reinterpret_cast<unsigned *>(completion + params.cq_off.ring_mask);
+      ring->completions = reinterpret_cast<io_uring_cqe *>(completion + params.cq_off.cqes);
+      ring->tail = *ring->submissionTail;
+      return ring;
+    }
+
+    // the next submission entry, cleared. There is always one: no more
+    // reads are in flight than the ring has entries
+    io_uring_sqe& next()
+    {
+      unsigned index = tail++ & submissionMask;
+      submissionArray[index] = index;
+      std::memset(&entries[index], 0, sizeof(io_uring_sqe));
+      ++prepared;
+      return entries[index];
+    }
+
+    // publish the prepared entries, submit them and wait for at least
+    // waitFor completions
+    bool enter(unsigned waitFor)
+    {
+      __atomic_store_n(submissionTail, tail, __ATOMIC_RELEASE);
+      for (;;)
+        {
+          long submitted = syscall(__NR_io_uring_enter, fd, prepared, waitFor, waitFor != 0 ? IORING_ENTER_GETEVENTS : 0u, nullptr, 0);
+          if (submitted >= 0)
+            {
+              prepared -= std::min(prepared, static_cast<unsigned>(submitted));
+              if (prepared == 0 || waitFor != 0)
+                return true;
+            }
+          else if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            {
+              return false;
+            }
+        }
+    }
+
+    void queueRead(Request *request)
+    {
+      io_uring_sqe &entry = next();
+      request->vector.iov_base = request->read.data.data() + request->offset;
+      request->vector.iov_len = std::min(request->read.data.size() - request->offset, maxReadBytes);
+      entry.opcode = IORING_OP_READV;
+      entry.fd = request->fd;
+      entry.off = request->offset;
+      entry.addr = reinterpret_cast<std::uintptr_t>(&request->vector);
+      entry.len = 1;
+      entry.user_data = reinterpret_cast<std::uintptr_t>(request);
+    }
+};
+
+#else
+
+struct AsyncReader::Ring
+{
+    static std::unique_ptr<Ring> create(unsigned)
+    {
+      return nullptr;
+    }
+};
+
+#endif
+
+AsyncReader::AsyncReader(ThreadPool &completionPool, unsigned queueDepth)
+  : pool(completionPool), depth(std::max(queueDepth, 1u)), inFlight(0), stopping(false), depthSamples(0), depthSum(0.0), latencySum(0.0)
+{
+  ring = Ring::create(static_cast<unsigned>(depth));
+  if (ring)
+    reaper = std::thread([this] { reap(); });
+  else
+    ioPool.reset(new ThreadPool(std::min<std::size_t>(depth, 4)));
+}
+
+AsyncReader::~AsyncReader()
+{
+  submit();
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this] { return inFlight == 0 && waiting.empty(); });
+    stopping = true;
+#ifdef __linux__
+    // a no-op completion wakes the reaper up to see it's done
+    if (ring)
+      {
+        ring->next().opcode = IORING_OP_NOP;
+        ring->enter(0);
+      }
+#endif
+  }
+  if (reaper.joinable())
+    reaper.join();
+  // the I/O threads may still be leaving complete()
+  ioPool.reset();
+}
+
+void AsyncReader::read(const std::string &path, Callback done)
+{
+  std::unique_ptr<Request> request(new Request);
+  request->read.path = path;
+  request->done = std::move(done);
+  std::lock_guard<std::mutex> lock(mutex);
+  queued.push_back(std::move(request));
+}
+
+void AsyncReader::submit()
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  if (queued.empty())
+    return;
+  auto now = std::chrono::steady_clock::now();
+  for (auto &request : queued)
+    {
+      request->submitted = now;
+      waiting.push_back(std::move(request));
+    }
+  queued.clear();
+  ++counters.batches;
+  pump(lock);
+}
+
+AsyncReadStats AsyncReader::stats() const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  AsyncReadStats stats = counters;
+  if (depthSamples != 0)
+    stats.meanQueueDepth = depthSum / static_cast<double>(depthSamples);
+  if (counters.reads != 0)
+    stats.meanLatency = latencySum / static_cast<double>(counters.reads);
+  return stats;
+}
+
+// start waiting reads while slots are free
+void AsyncReader::pump(std::unique_lock<std::mutex> &lock)
+{
+  bool started = false;
+  while (inFlight < depth && !waiting.empty())
+    {
+      Request *request = waiting.front().release();
+      waiting.pop_front();
+      ++inFlight;
+      started = true;
+      if (!ring)
+        {
+          ioPool->enqueue([this, request]
+            {
+              readWhole(request->read.path, request->read.data, request->read.error);
+              std::unique_lock<std::mutex> ioLock(mutex);
+              complete(request, ioLock);
+              pump(ioLock);
+            });
+          continue;
+        }
+#ifdef __linux__
+      if (!openRead(request->read.path, request->fd, request->read.data, request->read.error) || request->read.data.empty())
+        complete(request, lock);
+      else
+        ring->queueRead(request);
+#endif
+    }
+  if (!started)
+    return;
+  ++depthSamples;
+  depthSum += static_cast<double>(inFlight);
+  counters.maxQueueDepth = std::max(counters.maxQueueDepth, inFlight);
+#ifdef __linux__
+  if (ring && ring->prepared != 0 && !ring->enter(0))
+    {
+      // the kernel won't take them: take them back and fail them rather
+      // than wait forever
+      std::string error = std::string("io_uring: ") + std::strerror(errno);
+      for (; ring->prepared != 0; --ring->prepared)
+        {
+          auto request = reinterpret_cast<Request *>(ring->entries[--ring->tail & ring->submissionMask].user_data);
+          request->read.error = error;
+          complete(request, lock);
+        }
+      __atomic_store_n(ring->submissionTail, ring->tail, __ATOMIC_RELEASE);
+    }
+#endif
+}
+
+// hand a finished read to the pool
+void AsyncReader::complete(Request *request, std::unique_lock<std::mutex> &)
+{
+  std::shared_ptr<Request> finished(request);
+#ifndef _WIN32
+  if (finished->fd >= 0)
+    ::close(finished->fd);
+  finished->fd = -1;
+#endif
+  std::chrono::duration<double> latency = std::chrono::steady_clock::now() - finished->submitted;
+  ++counters.reads;
+  if (finished->read.error.empty())
+    counters.bytes += finished->read.data.size();
+  else
+    ++counters.failures;
+  latencySum += latency.count();
+  counters.maxLatency = std::max(counters.maxLatency, latency.count());
+  pool.enqueue([finished] { finished->done(finished->read); });
+  --inFlight;
+  if (inFlight == 0 && waiting.empty())
+    idle.notify_all();
+}
+
+// io_uring completions, on their own thread: short reads go back in for
+// the rest, the others complete
+void AsyncReader::reap()
+{
+#ifdef __linux__
+  for (;;)
+    {
+      // wait outside the lock, read() and submit() go on meanwhile
+      if (syscall(__NR_io_uring_enter, ring->fd, 0u, 1u, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR)
+        return;
+      std::unique_lock<std::mutex> lock(mutex);
+      unsigned head = *ring->completionHead;
+      unsigned tail = __atomic_load_n(ring->completionTail, __ATOMIC_ACQUIRE);
+      for (; head != tail; ++head)
+        {
+          const io_uring_cqe &completion = ring->completions[head & ring->completionMask];
+          auto request = reinterpret_cast<Request *>(completion.user_data);
+          if (request == nullptr)
+            continue;
+          int result = completion.res;
+          if (result == -EINTR || result == -EAGAIN)
+            {
+              ring->queueRead(request);
+              continue;
+            }
+          if (result < 0)
+            request->read.error = "can't read " + request->read.path + ": " + std::strerror(-result);
+          else if (result == 0)
+            request->read.error = "unexpected end of " + request->read.path;
+          else
+            request->offset += static_cast<std::size_t>(result);
+          if (result > 0 && request->offset < request->read.data.size())
+            ring->queueRead(request);
+          else
+            complete(request, lock);
+        }
+      __atomic_store_n(ring->completionHead, head, __ATOMIC_RELEASE);
+      if (stopping && inFlight == 0)
+        return;
+      pump(lock);
+      if (ring->prepared != 0)
+        ring->enter(0);
+    }
+#endif
+}
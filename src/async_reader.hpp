@@ -0,0 +1,99 @@
+#ifndef ASYNC_READER_H
+#define ASYNC_READER_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class ThreadPool;
+
+
+// counters of an AsyncReader since it was created
+struct AsyncReadStats
+{
+    // reads completed, failed ones included, and the bytes they read
+    std::size_t reads = 0;
+    std::size_t failures = 0;
+    std::size_t bytes = 0;
+    // submit() calls that had reads to submit
+    std::size_t batches = 0;
+    // reads in flight each time more went in: the largest and the mean
+    std::size_t maxQueueDepth = 0;
+    double meanQueueDepth = 0.0;
+    // seconds from submit() to a read's completion
+    double meanLatency = 0.0;
+    double maxLatency = 0.0;
+};
+
+// a whole file read by an AsyncReader
+struct AsyncRead
+{
+    std::string path;
+    std::vector<unsigned char> data;
+    // empty on success
+    std::string error;
+};
+
+// reads whole files in the background and hands them to a ThreadPool, so
+// waiting on the disk overlaps with the work done on what's already read.
+// Reads queue up until submit() sends them all at once: on Linux through
+// io_uring, one system call for the batch, elsewhere or when the kernel
+// refuses io_uring as preads on a few I/O threads of its own.
+//
+// read() and submit() are safe from any thread.
+class AsyncReader
+{
+public:
+    using Callback = std::function<void(AsyncRead&)>;
+
+    // completions run on pool, which must outlive the reader. At most
+    // queueDepth reads are in flight, the others wait for a free slot
+    explicit AsyncReader(ThreadPool &pool, unsigned queueDepth = 64);
+    // submits what's still queued and waits for every read to complete
+    ~AsyncReader();
+
+    AsyncReader(const AsyncReader&) = delete;
+    AsyncReader& operator=(const AsyncReader&) = delete;
+
+    // queue a read of the whole of path, done gets it on the pool
+    void read(const std::string &path, Callback done);
+    // start every read queued so far
+    void submit();
+
+    // whether reads go through io_uring
+    bool usesIoUring() const { return ring != nullptr; }
+    AsyncReadStats stats() const;
+
+private:
+    struct Request;
+    struct Ring;
+
+    void pump(std::unique_lock<std::mutex> &lock);
+    void complete(Request *request, std::unique_lock<std::mutex> &lock);
+    void reap();
+
+    ThreadPool &pool;
+    std::size_t depth;
+    std::unique_ptr<Ring> ring;
+    std::unique_ptr<ThreadPool> ioPool;
+    std::thread reaper;
+    // queued by read(), then submitted and waiting for a slot
+    std::deque<std::unique_ptr<Request>> queued;
+    std::deque<std::unique_ptr<Request>> waiting;
+    std::size_t inFlight;
+    bool stopping;
+    AsyncReadStats counters;
+    std::size_t depthSamples;
+    double depthSum;
+    double latencySum;
+    mutable std::mutex mutex;
+    std::condition_variable idle;
+};
+
+#endif
@@ -0,0 +1,1046 @@
+#include "block_compress.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BLOCK_COMPRESS_SSE2
+#include <emmintrin.h>
+#endif
+
+#include "thread_pool.hpp"
+
+namespace
+{
+  // the 16 texels of a block, row by row
+  struct Block
+  {
+    alignas(16) unsigned char rgba[16][4];
+  };
+
+  // a block laid out for nearestIndices: red and green interleaved, then
+  // blue and alpha
+  struct Texels
+  {
+    alignas(16) std::int16_t rg[32];
+    alignas(16) std::int16_t ba[32];
+  };
+
+  // BC7 mode 6 interpolation weights, in 64ths of the second endpoint
+  const int bc7Weights[16] = {0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64};
+
+  void fetchBlock(const unsigned char *pixels, int width, int height, int channels, std::size_t stride, int blockX, int blockY,
+                  Block &block)
+  {
+    const unsigned char *texels[16];
+    for (int y = 0; y < 4; ++y)
+      {
+        const unsigned char *row = pixels + stride * static_cast<std::size_t>(std::min(blockY * 4 + y, height - 1));
+        for (int x = 0; x < 4; ++x)
+          texels[y * 4 + x] = row + static_cast<std::size_t>(std::min(blockX * 4 + x, width - 1)) * static_cast<std::size_t>(channels);
+      }
+
+    // one loop per layout, the fast encoders spend a good part of their
+    // time here
+    switch (channels)
+      {
+      case 1:
+        for (int i = 0; i < 16; ++i)
+          {
+            block.rgba[i][0] = block.rgba[i][1] = block.rgba[i][2] = texels[i][0];
+            block.rgba[i][3] = 255;
+          }
+        break;
+      case 2:
+        for (int i = 0; i < 16; ++i)
+          {
+            block.rgba[i][0] = block.rgba[i][1] = block.rgba[i][2] = texels[i][0];
+            block.rgba[i][3] = texels[i][1];
+          }
+        break;
+      case 3:
+        for (int i = 0; i < 16; ++i)
+          {
+            std::memcpy(block.rgba[i], texels[i], 3);
+            block.rgba[i][3] = 255;
+          }
+        break;
+      default:
+        for (int i = 0; i < 16; ++i)
+          std::memcpy(block.rgba[i], texels[i], 4);
+        break;
+      }
+  }
+
+  // alpha left at 0 when only the colors matter
+  void toTexels(const Block &block, bool alpha, Texels &texels)
+  {
+    for (int i = 0; i < 16; ++i)
+      {
+        texels.rg[2 * i] = block.rgba[i][0];
+        texels.rg[2 * i + 1] = block.rgba[i][1];
+        texels.ba[2 * i] = block.rgba[i][2];
+        texels.ba[2 * i + 1] = alpha ? block.rgba[i][3] : 0;
+      }
+  }
+
+  // index of the closest palette entry for every texel, and the summed
+  // squared error. Ties go to the lower index
+  int nearestIndices(const Texels &texels, const int (*palette)[4], int count, unsigned char *indices)
+  {
+#ifdef BLOCK_COMPRESS_SSE2
+    // four texels per register, two madds give their squared distances
+    __m128i best[4];
+    __m128i bestIndex[4];
+    for (int k = 0; k < 4; ++k)
+      {
+        best[k] = _mm_set1_epi32(INT_MAX);
+        bestIndex[k] = _mm_setzero_si128();
+      }
+    for (int p = 0; p < count; ++p)
+      {
+        __m128i rg = _mm_set1_epi32(palette[p][0] | palette[p][1] << 16);
+        __m128i ba = _mm_set1_epi32(palette[p][2] | palette[p][3] << 16);
+        __m128i index = _mm_set1_epi32(p);
+        for (int k = 0; k < 4; ++k)
+          {
+            __m128i dRg = _mm_sub_epi16(_mm_load_si128(reinterpret_cast<const __m128i *>(texels.rg + 8 * k)), rg);
+            __m128i dBa = _mm_sub_epi16(_mm_load_si128(reinterpret_cast<const __m128i *>(texels.ba + 8 * k)), ba);
+            __m128i error = _mm_add_epi32(_mm_madd_epi16(dRg, dRg), _mm_madd_epi16(dBa, dBa));
+            __m128i closer = _mm_cmplt_epi32(error, best[k]);
+            best[k] = _mm_or_si128(_mm_and_si128(closer, error), _mm_andnot_si128(closer, best[k]));
+            bestIndex[k] = _mm_or_si128(_mm_and_si128(closer, index), _mm_andnot_si128(closer, bestIndex[k]));
+          }
+      }
+    alignas(16) std::int32_t errors[16];
+    alignas(16) std::int32_t found[16];
+    for (int k = 0; k < 4; ++k)
+      {
+        _mm_store_si128(reinterpret_cast<__m128i *>(errors + 4 * k), best[k]);
+        _mm_store_si128(reinterpret_cast<__m128i *>(found + 4 * k), bestIndex[k]);
+      }
+    int total = 0;
+    for (int i = 0; i < 16; ++i)
+      {
+        total += errors[i];
+        indices[i] = static_cast<unsigned char>(found[i]);
+      }
+    return total;
+#else
+    int total = 0;
+    for (int i = 0; i < 16; ++i)
+      {
+        int best = INT_MAX;
+        for (int p = 0; p < count; ++p)
+          {
+            int dr = texels.rg[2 * i] - palette[p][0];
+            int dg = texels.rg[2 * i + 1] - palette[p][1];
+            int db = texels.ba[2 * i] - palette[p][2];
+            int da = texels.ba[2 * i + 1] - palette[p][3];
+            int error = dr * dr + dg * dg + db * db + da * da;
+            if (error < best)
+              {
+                best = error;
+                indices[i] = static_cast<unsigned char>(p);
+              }
+          }
+        total += best;
+      }
+    return total;
+#endif
+  }
+
+  // principal axis of the block's first channels channels, from a few
+  // power iterations on their covariance. Zero for a flat block
+  void principalAxis(const Block &block, int channels, float *mean, float *axis)
+  {
+    for (int c = 0; c < channels; ++c)
+      {
+        mean[c] = 0.0f;
+        for (int i = 0; i < 16; ++i)
+          mean[c] += block.rgba[i][c];
+        mean[c] /= 16.0f;
+      }
+
+    float covariance[4][4] = {};
+    for (int i = 0; i < 16; ++i)
+      for (int a = 0; a < channels; ++a)
+        for (int b = a; b < channels; ++b)
+          covariance[a][b] += (block.rgba[i][a] - mean[a]) * (block.rgba[i][b] - mean[b]);
+    for (int a = 0; a < channels; ++a)
+      for (int b = 0; b < a; ++b)
+        covariance[a][b] = covariance[b][a];
+
+    // start from the channel that varies most
+    int widest = 0;
+    for (int c = 1; c < channels; ++c)
+      if (covariance[c][c] > covariance[widest][widest])
+        widest = c;
+    for (int c = 0; c < channels; ++c)
+      axis[c] = covariance[widest][c];
+
+    for (int iteration = 0; iteration < 6; ++iteration)
+      {
+        float next[4] = {};
+        float largest = 0.0f;
+        for (int a = 0; a < channels; ++a)
+          {
+            for (int b = 0; b < channels; ++b)
+              next[a] += covariance[a][b] * axis[b];
+            largest = std::max(largest, std::fabs(next[a]));
+          }
+        if (largest == 0.0f)
+          break;
+        for (int c = 0; c < channels; ++c)
+          axis[c] = next[c] / largest;
+      }
+
+    float length = 0.0f;
+    for (int c = 0; c < channels; ++c)
+      length += axis[c] * axis[c];
+    length = std::sqrt(length);
+    for (int c = 0; c < channels; ++c)
+      axis[c] = length > 0.0f ? axis[c] / length : 0.0f;
+  }
+
+  // ends of the block's extent along its principal axis
+  void axisEndpoints(const Block &block, int channels, float *low, float *high)
+  {
+    float mean[4];
+    float axis[4];
+    principalAxis(block, channels, mean, axis);
+    float lowest = 0.0f;
+    float highest = 0.0f;
+    for (int i = 0; i < 16; ++i)
+      {
+        float t = 0.0f;
+        for (int c = 0; c < channels; ++c)
+          t += (block.rgba[i][c] - mean[c]) * axis[c];
+        lowest = std::min(lowest, t);
+        highest = std::max(highest, t);
+      }
+    for (int c = 0; c < channels; ++c)
+      {
+        low[c] = mean[c] + axis[c] * lowest;
+        high[c] = mean[c] + axis[c] * highest;
+      }
+  }
+
+  // endpoints that best fit the block given the indices it picked, in the
+  // least squares sense. shares[i] is how much of end0 index i takes.
+  // False when every texel took the same share
+  bool fitEndpoints(const Block &block, int channels, const unsigned char *indices, const float *shares, float *end0, float *end1)
+  {
+    float aa = 0.0f;
+    float ab = 0.0f;
+    float bb = 0.0f;
+    float ax[4] = {};
+    float bx[4] = {};
+    for (int i = 0; i < 16; ++i)
+      {
+        float a = shares[indices[i]];
+        float b = 1.0f - a;
+        aa += a * a;
+        ab += a * b;
+        bb += b * b;
+        for (int c = 0; c < channels; ++c)
+          {
+            ax[c] += a * block.rgba[i][c];
+            bx[c] += b * block.rgba[i][c];
+          }
+      }
+    float determinant = aa * bb - ab * ab;
+    if (std::fabs(determinant) < 1e-4f)
+      return false;
+    for (int c = 0; c < channels; ++c)
+      {
+        end0[c] = (ax[c] * bb - bx[c] * ab) / determinant;
+        end1[c] = (bx[c] * aa - ax[c] * ab) / determinant;
+      }
+    return true;
+  }
+
+  // nearest of the levels levels of [0, 255]
+  int quantize(float value, int levels)
+  {
+    float scaled = value * static_cast<float>(levels - 1) / 255.0f + 0.5f;
+    return static_cast<int>(std::min(std::max(scaled, 0.0f), static_cast<float>(levels - 1)));
+  }
+
+  class BitWriter
+  {
+  public:
+    explicit BitWriter(unsigned char *block) : out(block), bit(0) {}
+
+    void put(unsigned value, int count)
+    {
+      for (int i = 0; i < count; ++i, ++bit)
+        if (value >> i & 1)
+          out[bit >> 3] = static_cast<unsigned char>(out[bit >> 3] | 1u << (bit & 7));
+    }
+
+  private:
+    unsigned char *out;
+    int bit;
+  };
+
+  class BitReader
+  {
+  public:
+    explicit BitReader(const unsigned char *block) : in(block), bit(0) {}
+
+    int get(int count)
+    {
+      int value = 0;
+      for (int i = 0; i < count; ++i, ++bit)
+        value |= (in[bit >> 3] >> (bit & 7) & 1) << i;
+      return value;
+    }
+
+  private:
+    const unsigned char *in;
+    int bit;
+  };
+
+  // BC1 colors
+
+  int expand5(int v)
+  {
+    return v << 3 | v >> 2;
+  }
+
+  int expand6(int v)
+  {
+    return v << 2 | v >> 4;
+  }
+
+  void unpack565(unsigned color, int *rgb)
+  {
+    rgb[0] = expand5(static_cast<int>(color >> 11 & 31));
+    rgb[1] = expand6(static_cast<int>(color >> 5 & 63));
+    rgb[2] = expand5(static_cast<int>(color & 31));
+  }
+
+  unsigned pack565(const float *rgb)
+  {
+    return static_cast<unsigned>(quantize(rgb[0], 32) << 11 | quantize(rgb[1], 64) << 5 | quantize(rgb[2], 32));
+  }
+
+  // the four colors of a four color mode block, alpha zeroed
+  void colorPalette(unsigned color0, unsigned color1, int (*palette)[4])
+  {
+    unpack565(color0, palette[0]);
+    unpack565(color1, palette[1]);
+    for (int c = 0; c < 3; ++c)
+      {
+        palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+        palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+      }
+    for (int p = 0; p < 4; ++p)
+      palette[p][3] = 0;
+  }
+
+  // for every 8-bit value, the pair of 5 or 6-bit endpoints whose 2/3
+  // blend comes closest to it: a flat block then lands within a step of
+  // its color instead of on the nearest 565 value
+  struct SingleColorTables
+  {
+    unsigned char match5[256][2];
+    unsigned char match6[256][2];
+  };
+
+  void fillSingleColor(unsigned char (*match)[2], int size, int (*expand)(int))
+  {
+    for (int value = 0; value < 256; ++value)
+      {
+        int bestError = INT_MAX;
+        for (int high = 0; high < size; ++high)
+          for (int low = 0; low < size; ++low)
+            {
+              int blend = (2 * expand(high) + expand(low)) / 3;
+              // close endpoints on ties, hardware blends them more alike
+              int error = std::abs(blend - value) * 256 + std::abs(high - low);
+              if (error < bestError)
+                {
+                  bestError = error;
+                  match[value][0] = static_cast<unsigned char>(high);
+                  match[value][1] = static_cast<unsigned char>(low);
+                }
+            }
+      }
+  }
+
+  const SingleColorTables &singleColorTables()
+  {
+    static const SingleColorTables tables = []
+      {
+        SingleColorTables built;
+        fillSingleColor(built.match5, 32, expand5);
+        fillSingleColor(built.match6, 64, expand6);
+        return built;
+      }();
+    return tables;
+  }
+
+  void writeColorBlock(unsigned color0, unsigned color1, unsigned char *indices, unsigned char *out)
+  {
+    // four color mode wants color0 above color1
+    if (color0 < color1)
+      {
+        std::swap(color0, color1);
+        for (int i = 0; i < 16; ++i)
+          indices[i] ^= 1;
+      }
+    else if (color0 == color1)
+      {
+        std::fill(indices, indices + 16, 0);
+      }
+    out[0] = static_cast<unsigned char>(color0);
+    out[1] = static_cast<unsigned char>(color0 >> 8);
+    out[2] = static_cast<unsigned char>(color1);
+    out[3] = static_cast<unsigned char>(color1 >> 8);
+    for (int y = 0; y < 4; ++y)
+      out[4 + y] = static_cast<unsigned char>(indices[4 * y] | indices[4 * y + 1] << 2 | indices[4 * y + 2] << 4 | indices[4 * y + 3] << 6);
+  }
+
+  void encodeColor(const Block &block, unsigned char *out)
+  {
+    unsigned char indices[16];
+    bool flat = true;
+    for (int i = 1; i < 16 && flat; ++i)
+      flat = std::memcmp(block.rgba[i], block.rgba[0], 3) == 0;
+    if (flat)
+      {
+        const SingleColorTables &tables = singleColorTables();
+        const unsigned char *r = tables.match5[block.rgba[0][0]];
+        const unsigned char *g = tables.match6[block.rgba[0][1]];
+        const unsigned char *b = tables.match5[block.rgba[0][2]];
+        std::fill(indices, indices + 16, 2);
+        writeColorBlock(static_cast<unsigned>(r[0] << 11 | g[0] << 5 | b[0]), static_cast<unsigned>(r[1] << 11 | g[1] << 5 | b[1]),
+                        indices, out);
+        return;
+      }
+
+    Texels texels;
+    toTexels(block, false, texels);
+    float low[3];
+    float high[3];
+    axisEndpoints(block, 3, low, high);
+    unsigned color0 = pack565(high);
+    unsigned color1 = pack565(low);
+    int palette[4][4];
+    colorPalette(color0, color1, palette);
+    int error = nearestIndices(texels, palette, 4, indices);
+
+    const float shares[4] = {1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f};
+    for (int iteration = 0; iteration < 2 && error > 0; ++iteration)
+      {
+        if (!fitEndpoints(block, 3, indices, shares, high, low))
+          break;
+        unsigned fitted0 = pack565(high);
+        unsigned fitted1 = pack565(low);
+        unsigned char fittedIndices[16];
+        colorPalette(fitted0, fitted1, palette);
+        int fittedError = nearestIndices(texels, palette, 4, fittedIndices);
+        if (fittedError >= error)
+          break;
+        color0 = fitted0;
+        color1 = fitted1;
+        error = fittedError;
+        std::memcpy(indices, fittedIndices, sizeof(indices));
+      }
+
+    writeColorBlock(color0, color1, indices, out);
+  }
+
+  // BC3 alpha
+
+  // the eight alphas of an alpha block: blended only when alpha0 is above
+  // alpha1, with 0 and 255 as the last two otherwise
+  void alphaPalette(int alpha0, int alpha1, int *palette)
+  {
+    palette[0] = alpha0;
+    palette[1] = alpha1;
+    if (alpha0 > alpha1)
+      {
+        for (int i = 1; i < 7; ++i)
+          palette[i + 1] = ((7 - i) * alpha0 + i * alpha1) / 7;
+      }
+    else
+      {
+        for (int i = 1; i < 5; ++i)
+          palette[i + 1] = ((5 - i) * alpha0 + i * alpha1) / 5;
+        palette[6] = 0;
+        palette[7] = 255;
+      }
+  }
+
+  void writeAlphaBlock(int alpha0, int alpha1, const unsigned char *indices, unsigned char *out)
+  {
+    out[0] = static_cast<unsigned char>(alpha0);
+    out[1] = static_cast<unsigned char>(alpha1);
+    std::uint64_t bits = 0;
+    for (int i = 0; i < 16; ++i)
+      bits |= static_cast<std::uint64_t>(indices[i]) << (3 * i);
+    for (int i = 0; i < 6; ++i)
+      out[2 + i] = static_cast<unsigned char>(bits >> (8 * i));
+  }
+
+  int nearestAlphas(const Block &block, int channel, const int *palette, unsigned char *indices)
+  {
+    int total = 0;
+    for (int i = 0; i < 16; ++i)
+      {
+        int best = INT_MAX;
+        for (int p = 0; p < 8; ++p)
+          {
+            int error = std::abs(block.rgba[i][channel] - palette[p]);
+            if (error < best)
+              {
+                best = error;
+                indices[i] = static_cast<unsigned char>(p);
+              }
+          }
+        total += best * best;
+      }
+    return total;
+  }
+
+  // an alpha block of one channel of the block: BC3's alpha, or BC4
+  void encodeAlpha(const Block &block, int channel, unsigned char *out)
+  {
+    int lowest = 255;
+    int highest = 0;
+    // the same, leaving 0 and 255 out
+    int innerLowest = 255;
+    int innerHighest = 0;
+    for (int i = 0; i < 16; ++i)
+      {
+        int alpha = block.rgba[i][channel];
+        lowest = std::min(lowest, alpha);
+        highest = std::max(highest, alpha);
+        if (alpha != 0 && alpha != 255)
+          {
+            innerLowest = std::min(innerLowest, alpha);
+            innerHighest = std::max(innerHighest, alpha);
+          }
+      }
+
+    int alpha0 = highest;
+    int alpha1 = lowest;
+    unsigned char indices[16] = {};
+    int palette[8];
+    if (highest > lowest)
+      {
+        alphaPalette(alpha0, alpha1, palette);
+        int error = nearestAlphas(block, channel, palette, indices);
+        // extremes at 0 or 255 come for free in the six alpha mode
+        if (error > 0 && (lowest == 0 || highest == 255))
+          {
+            if (innerLowest > innerHighest)
+              innerLowest = innerHighest = 0;
+            unsigned char sixIndices[16];
+            alphaPalette(innerLowest, innerHighest, palette);
+            int sixError = nearestAlphas(block, channel, palette, sixIndices);
+            if (sixError < error)
+              {
+                alpha0 = innerLowest;
+                alpha1 = innerHighest;
+                std::memcpy(indices, sixIndices, sizeof(indices));
+              }
+          }
+      }
+
+    writeAlphaBlock(alpha0, alpha1, indices, out);
+  }
+
+  // fast encoders, after J.M.P. van Waveren's "Real-Time DXT Compression":
+  // the box around the block's texels, inset a little, gives the
+  // endpoints, texels are projected onto the line between them
+
+#ifdef BLOCK_COMPRESS_SSE2
+  // an RGBA value twice, as two texels unpacked to 16 bits
+  __m128i twoTexels(const int *rgba)
+  {
+    auto word = [rgba](int c)
+      {
+        return static_cast<unsigned>(rgba[c]) & 0xffffu;
+      };
+    auto rg = static_cast<int>(word(0) | word(1) << 16);
+    auto ba = static_cast<int>(word(2) | word(3) << 16);
+    return _mm_set_epi32(ba, rg, ba, rg);
+  }
+#endif
+
+  // lowest and highest value of every channel of the block
+  void blockRange(const Block &block, int *low, int *high)
+  {
+#ifdef BLOCK_COMPRESS_SSE2
+    const __m128i *rows = reinterpret_cast<const __m128i *>(block.rgba);
+    __m128i lowest = _mm_min_epu8(_mm_min_epu8(rows[0], rows[1]), _mm_min_epu8(rows[2], rows[3]));
+    __m128i highest = _mm_max_epu8(_mm_max_epu8(rows[0], rows[1]), _mm_max_epu8(rows[2], rows[3]));
+    // then across the four texels of a row
+    lowest = _mm_min_epu8(lowest, _mm_shuffle_epi32(lowest, _MM_SHUFFLE(1, 0, 3, 2)));
+    lowest = _mm_min_epu8(lowest, _mm_shuffle_epi32(lowest, _MM_SHUFFLE(2, 3, 0, 1)));
+    highest = _mm_max_epu8(highest, _mm_shuffle_epi32(highest, _MM_SHUFFLE(1, 0, 3, 2)));
+    highest = _mm_max_epu8(highest, _mm_shuffle_epi32(highest, _MM_SHUFFLE(2, 3, 0, 1)));
+    auto lowBytes = static_cast<unsigned>(_mm_cvtsi128_si32(lowest));
+    auto highBytes = static_cast<unsigned>(_mm_cvtsi128_si32(highest));
+    for (int c = 0; c < 4; ++c)
+      {
+        low[c] = static_cast<int>(lowBytes >> (8 * c) & 255);
+        high[c] = static_cast<int>(highBytes >> (8 * c) & 255);
+      }
+#else
+    for (int c = 0; c < 4; ++c)
+      {
+        low[c] = 255;
+        high[c] = 0;
+      }
+    for (int i = 0; i < 16; ++i)
+      for (int c = 0; c < 4; ++c)
+        {
+          low[c] = std::min(low[c], static_cast<int>(block.rgba[i][c]));
+          high[c] = std::max(high[c], static_cast<int>(block.rgba[i][c]));
+        }
+#endif
+  }
+
+  // summed products of green with red and with blue around middle: their
+  // covariances, give or take a factor
+  void greenCovariance(const Block &block, const int *middle, int &withRed, int &withBlue)
+  {
+#ifdef BLOCK_COMPRESS_SSE2
+    const __m128i *rows = reinterpret_cast<const __m128i *>(block.rgba);
+    const int center[4] = {middle[0], middle[1], middle[2], 0};
+    __m128i centers = twoTexels(center);
+    __m128i zero = _mm_setzero_si128();
+    __m128i lowWords = _mm_set1_epi32(0xffff);
+    __m128i sums = zero;
+    for (int k = 0; k < 4; ++k)
+      for (__m128i texels : {_mm_unpacklo_epi8(rows[k], zero), _mm_unpackhi_epi8(rows[k], zero)})
+        {
+          // (r, g) . (g, 0) and (b, a) . (g, 0) for both texels
+          __m128i offsets = _mm_sub_epi16(texels, centers);
+          __m128i green = _mm_shufflehi_epi16(_mm_shufflelo_epi16(offsets, _MM_SHUFFLE(1, 1, 1, 1)), _MM_SHUFFLE(1, 1, 1, 1));
+          sums = _mm_add_epi32(sums, _mm_madd_epi16(offsets, _mm_and_si128(green, lowWords)));
+        }
+    alignas(16) std::int32_t lanes[4];
+    _mm_store_si128(reinterpret_cast<__m128i *>(lanes), sums);
+    withRed = lanes[0] + lanes[2];
+    withBlue = lanes[1] + lanes[3];
+#else
+    withRed = 0;
+    withBlue = 0;
+    for (int i = 0; i < 16; ++i)
+      {
+        int green = block.rgba[i][1] - middle[1];
+        withRed += green * (block.rgba[i][0] - middle[0]);
+        withBlue += green * (block.rgba[i][2] - middle[2]);
+      }
+#endif
+  }
+
+  // where every texel's color falls from end1 towards end0, rounded to
+  // thirds of the way: 3 * along / length, compared instead of divided
+  void projectThirds(const Block &block, const int *end1, const int *axis, int length, unsigned char *thirds)
+  {
+#ifdef BLOCK_COMPRESS_SSE2
+    const __m128i *rows = reinterpret_cast<const __m128i *>(block.rgba);
+    const int origin[4] = {end1[0], end1[1], end1[2], 0};
+    const int direction[4] = {axis[0], axis[1], axis[2], 0};
+    __m128i origins = twoTexels(origin);
+    __m128i directions = twoTexels(direction);
+    __m128i zero = _mm_setzero_si128();
+    __m128i first = _mm_set1_epi32(length - 1);
+    __m128i second = _mm_set1_epi32(3 * length - 1);
+    __m128i third = _mm_set1_epi32(5 * length - 1);
+    for (int k = 0; k < 4; ++k)
+      {
+        // (r, g) and (b, a) halves of the dot products of two texels each
+        __m128 low = _mm_castsi128_ps(_mm_madd_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(rows[k], zero), origins), directions));
+        __m128 high = _mm_castsi128_ps(_mm_madd_epi16(_mm_sub_epi16(_mm_unpackhi_epi8(rows[k], zero), origins), directions));
+        __m128i along = _mm_add_epi32(_mm_castps_si128(_mm_shuffle_ps(low, high, _MM_SHUFFLE(2, 0, 2, 0))),
+                                      _mm_castps_si128(_mm_shuffle_ps(low, high, _MM_SHUFFLE(3, 1, 3, 1))));
+        along = _mm_add_epi32(_mm_slli_epi32(along, 2), _mm_slli_epi32(along, 1));
+        // each comparison passed counts -1
+        __m128i passed = _mm_add_epi32(_mm_add_epi32(_mm_cmpgt_epi32(along, first), _mm_cmpgt_epi32(along, second)),
+                                       _mm_cmpgt_epi32(along, third));
+        alignas(16) std::int32_t lanes[4];
+        _mm_store_si128(reinterpret_cast<__m128i *>(lanes), passed);
+        for (int i = 0; i < 4; ++i)
+          thirds[4 * k + i] = static_cast<unsigned char>(-lanes[i]);
+      }
+#else
+    for (int i = 0; i < 16; ++i)
+      {
+        int along = 0;
+        for (int c = 0; c < 3; ++c)
+          along += (block.rgba[i][c] - end1[c]) * axis[c];
+        along *= 6;
+        thirds[i] = static_cast<unsigned char>((along >= length) + (along >= 3 * length) + (along >= 5 * length));
+      }
+#endif
+  }
+
+  void encodeColorFast(const Block &block, unsigned char *out)
+  {
+    int low[4];
+    int high[4];
+    blockRange(block, low, high);
+
+    // the box's main diagonal runs along green, red or blue falling while
+    // green rises take the other one
+    int middle[3];
+    for (int c = 0; c < 3; ++c)
+      middle[c] = (low[c] + high[c]) / 2;
+    int withRed;
+    int withBlue;
+    greenCovariance(block, middle, withRed, withBlue);
+    // endpoints past the extremes waste most of the palette
+    for (int c = 0; c < 3; ++c)
+      {
+        int inset = (high[c] - low[c]) >> 4;
+        low[c] += inset;
+        high[c] -= inset;
+      }
+    if (withRed < 0)
+      std::swap(low[0], high[0]);
+    if (withBlue < 0)
+      std::swap(low[2], high[2]);
+
+    auto pack = [](const int *rgb)
+      {
+        return static_cast<unsigned>((rgb[0] * 31 + 127) / 255 << 11 | (rgb[1] * 63 + 127) / 255 << 5 | (rgb[2] * 31 + 127) / 255);
+      };
+    unsigned color0 = pack(high);
+    unsigned color1 = pack(low);
+    int end0[3];
+    int end1[3];
+    unpack565(color0, end0);
+    unpack565(color1, end1);
+    int axis[3] = {end0[0] - end1[0], end0[1] - end1[1], end0[2] - end1[2]};
+    int length = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+
+    // thirds of the way from end1 to end0, to the index of that color
+    const unsigned char thirdIndices[4] = {1, 3, 2, 0};
+    unsigned char indices[16] = {};
+    if (length > 0)
+      {
+        projectThirds(block, end1, axis, length, indices);
+        for (int i = 0; i < 16; ++i)
+          indices[i] = thirdIndices[indices[i]];
+      }
+    writeColorBlock(color0, color1, indices, out);
+  }
+
+  void encodeAlphaFast(const Block &block, int channel, unsigned char *out)
+  {
+    int low[4];
+    int high[4];
+    blockRange(block, low, high);
+    int lowest = low[channel];
+    int highest = high[channel];
+
+    // sevenths of the way from alpha1 to alpha0, to the index of that alpha
+    const unsigned char sevenths[8] = {1, 7, 6, 5, 4, 3, 2, 0};
+    unsigned char indices[16] = {};
+    int range = highest - lowest;
+    // rounding 7 * above / range, compared instead of divided
+    if (range > 0)
+      for (int i = 0; i < 16; ++i)
+        {
+          int above = 14 * (block.rgba[i][channel] - lowest);
+          int seventh = 0;
+          for (int k = 1; k < 14; k += 2)
+            seventh += above >= k * range;
+          indices[i] = sevenths[seventh];
+        }
+    writeAlphaBlock(highest, lowest, indices, out);
+  }
+
+  // BC7
+
+  struct Mode6
+  {
+    int end0[4];
+    int end1[4];
+    int pbit0;
+    int pbit1;
+    unsigned char indices[16];
+    int error;
+  };
+
+  // 7-bit endpoint of value with the given p-bit as its lowest bit
+  int quantizeBc7(float value, int pbit)
+  {
+    float scaled = (value - static_cast<float>(pbit)) / 2.0f + 0.5f;
+    return static_cast<int>(std::min(std::max(scaled, 0.0f), 127.0f));
+  }
+
+  // both ends quantized with each p-bit pair, the best pair wins
+  void quantizeMode6(const float *end0, const float *end1, const Texels &texels, Mode6 &best)
+  {
+    best.error = INT_MAX;
+    for (int pbits = 0; pbits < 4; ++pbits)
+      {
+        Mode6 candidate;
+        candidate.pbit0 = pbits & 1;
+        candidate.pbit1 = pbits >> 1;
+        int palette[16][4];
+        int ends[2][4];
+        for (int c = 0; c < 4; ++c)
+          {
+            candidate.end0[c] = quantizeBc7(end0[c], candidate.pbit0);
+            candidate.end1[c] = quantizeBc7(end1[c], candidate.pbit1);
+            ends[0][c] = candidate.end0[c] << 1 | candidate.pbit0;
+            ends[1][c] = candidate.end1[c] << 1 | candidate.pbit1;
+          }
+        for (int i = 0; i < 16; ++i)
+          for (int c = 0; c < 4; ++c)
+            palette[i][c] = ((64 - bc7Weights[i]) * ends[0][c] + bc7Weights[i] * ends[1][c] + 32) >> 6;
+        candidate.error = nearestIndices(texels, palette, 16, candidate.indices);
+        if (candidate.error < best.error)
+          best = candidate;
+      }
+  }
+
+  void encodeBc7(const Block &block, unsigned char *out)
+  {
+    Texels texels;
+    toTexels(block, true, texels);
+    float end0[4];
+    float end1[4];
+    axisEndpoints(block, 4, end0, end1);
+    Mode6 best;
+    quantizeMode6(end0, end1, texels, best);
+
+    float shares[16];
+    for (int i = 0; i < 16; ++i)
+      shares[i] = 1.0f - static_cast<float>(bc7Weights[i]) / 64.0f;
+    for (int iteration = 0; iteration < 2 && best.error > 0; ++iteration)
+      {
+        if (!fitEndpoints(block, 4, best.indices, shares, end0, end1))
+          break;
+        Mode6 fitted;
+        quantizeMode6(end0, end1, texels, fitted);
+        if (fitted.error >= best.error)
+          break;
+        best = fitted;
+      }
+
+    // the first index is stored without its top bit
+    if (best.indices[0] & 8)
+      {
+        std::swap(best.end0, best.end1);
+        std::swap(best.pbit0, best.pbit1);
+        for (int i = 0; i < 16; ++i)
+          best.indices[i] = static_cast<unsigned char>(15 - best.indices[i]);
+      }
+
+    std::memset(out, 0, 16);
+    BitWriter bits(out);
+    bits.put(1u << 6, 7);
+    for (int c = 0; c < 4; ++c)
+      {
+        bits.put(static_cast<unsigned>(best.end0[c]), 7);
+        bits.put(static_cast<unsigned>(best.end1[c]), 7);
+      }
+    bits.put(static_cast<unsigned>(best.pbit0), 1);
+    bits.put(static_cast<unsigned>(best.pbit1), 1);
+    bits.put(best.indices[0], 3);
+    for (int i = 1; i < 16; ++i)
+      bits.put(best.indices[i], 4);
+  }
+
+  void encodeBlock(BlockFormat format, BlockQuality quality, const Block &block, unsigned char *out)
+  {
+    auto color = quality == BlockQuality::Fast ? encodeColorFast : encodeColor;
+    auto alpha = quality == BlockQuality::Fast ? encodeAlphaFast : encodeAlpha;
+    switch (format)
+      {
+      case BlockFormat::BC1:
+        color(block, out);
+        break;
+      case BlockFormat::BC3:
+        alpha(block, 3, out);
+        color(block, out + 8);
+        break;
+      case BlockFormat::BC4:
+        alpha(block, 0, out);
+        break;
+      case BlockFormat::BC7:
+        encodeBc7(block, out);
+        break;
+      }
+  }
+
+  // decoding
+
+  void decodeColor(const unsigned char *in, bool fourColor, Block &block)
+  {
+    unsigned color0 = static_cast<unsigned>(in[0] | in[1] << 8);
+    unsigned color1 = static_cast<unsigned>(in[2] | in[3] << 8);
+    int palette[4][4];
+    colorPalette(color0, color1, palette);
+    for (int p = 0; p < 4; ++p)
+      palette[p][3] = 255;
+    if (!fourColor && color0 <= color1)
+      {
+        for (int c = 0; c < 3; ++c)
+          {
+            palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+            palette[3][c] = 0;
+          }
+        palette[3][3] = 0;
+      }
+    for (int i = 0; i < 16; ++i)
+      {
+        int index = in[4 + i / 4] >> (2 * (i % 4)) & 3;
+        for (int c = 0; c < 4; ++c)
+          block.rgba[i][c] = static_cast<unsigned char>(palette[index][c]);
+      }
+  }
+
+  void decodeAlpha(const unsigned char *in, int channel, Block &block)
+  {
+    int palette[8];
+    alphaPalette(in[0], in[1], palette);
+    BitReader bits(in + 2);
+    for (int i = 0; i < 16; ++i)
+      block.rgba[i][channel] = static_cast<unsigned char>(palette[bits.get(3)]);
+  }
+
+  void decodeBc7(const unsigned char *in, Block &block)
+  {
+    BitReader bits(in);
+    if (bits.get(7) != 1 << 6)
+      {
+        std::memset(block.rgba, 0, sizeof(block.rgba));
+        return;
+      }
+    int ends[2][4];
+    for (int c = 0; c < 4; ++c)
+      {
+        ends[0][c] = bits.get(7) << 1;
+        ends[1][c] = bits.get(7) << 1;
+      }
+    int pbit0 = bits.get(1);
+    int pbit1 = bits.get(1);
+    for (int c = 0; c < 4; ++c)
+      {
+        ends[0][c] |= pbit0;
+        ends[1][c] |= pbit1;
+      }
+    for (int i = 0; i < 16; ++i)
+      {
+        int weight = bc7Weights[bits.get(i == 0 ? 3 : 4)];
+        for (int c = 0; c < 4; ++c)
+          block.rgba[i][c] = static_cast<unsigned char>(((64 - weight) * ends[0][c] + weight * ends[1][c] + 32) >> 6);
+      }
+  }
+}
+
+std::size_t blockBytes(BlockFormat format)
+{
+  return format == BlockFormat::BC1 || format == BlockFormat::BC4 ? 8 : 16;
+}
+
+std::size_t compressedSize(BlockFormat format, int width, int height)
+{
+  return static_cast<std::size_t>((width + 3) / 4) * static_cast<std::size_t>((height + 3) / 4) * blockBytes(format);
+}
+
+void compressImage(BlockFormat format, const unsigned char *pixels, int width, int height, int channels, std::size_t stride,
+                   unsigned char *blocks, ThreadPool *pool, BlockQuality quality)
+{
+  int blocksWide = (width + 3) / 4;
+  int blocksHigh = (height + 3) / 4;
+  std::size_t rowBytes = static_cast<std::size_t>(blocksWide) * blockBytes(format);
+  auto encodeRow = [=](std::size_t row)
+    {
+      Block block;
+      unsigned char *out = blocks + rowBytes * row;
+      for (int x = 0; x < blocksWide; ++x, out += blockBytes(format))
+        {
+          fetchBlock(pixels, width, height, channels, stride, x, static_cast<int>(row), block);
+          encodeBlock(format, quality, block, out);
+        }
+    };
+
+  if (pool != nullptr)
+    pool->parallelFor(static_cast<std::size_t>(blocksHigh), encodeRow);
+  else
+    for (std::size_t row = 0; row < static_cast<std::size_t>(blocksHigh); ++row)
+      encodeRow(row);
+}
+
+CompressedImage compressMipChain(BlockFormat format, const unsigned char *chain, const std::vector<MipLevel> &levels, int channels,
+                                 ThreadPool *pool, BlockQuality quality)
+{
+  CompressedImage image;
+  image.format = format;
+  if (levels.empty())
+    return image;
+  image.width = levels[0].width;
+  image.height = levels[0].height;
+
+  std::size_t offset = 0;
+  for (const MipLevel &level : levels)
+    {
+      MipLevel compressed = level;
+      compressed.offset = offset;
+      compressed.bytes = compressedSize(format, level.width, level.height);
+      image.levels.push_back(compressed);
+      offset += compressed.bytes;
+    }
+  auto blocks = std::make_shared<std::vector<unsigned char>>(offset);
+
+  for (std::size_t l = 0; l < levels.size(); ++l)
+    compressImage(format, chain + levels[l].offset, levels[l].width, levels[l].height, channels,
+                  static_cast<std::size_t>(levels[l].width) * static_cast<std::size_t>(channels), blocks->data() + image.levels[l].offset,
+                  pool, quality);
+  image.blocks = blocks->data();
+  image.storage = blocks;
+  return image;
+}
+
+void decompressImage(BlockFormat format, const unsigned char *blocks, int width, int height, unsigned char *rgba)
+{
+  int blocksWide = (width + 3) / 4;
+  int blocksHigh = (height + 3) / 4;
+  Block block;
+  for (int blockY = 0; blockY < blocksHigh; ++blockY)
+    for (int blockX = 0; blockX < blocksWide; ++blockX, blocks += blockBytes(format))
+      {
+        switch (format)
+          {
+          case BlockFormat::BC1:
+            decodeColor(blocks, false, block);
+            break;
+          case BlockFormat::BC3:
+            decodeColor(blocks + 8, true, block);
+            decodeAlpha(blocks, 3, block);
+            break;
+          case BlockFormat::BC4:
+            for (int i = 0; i < 16; ++i)
+              {
+                block.rgba[i][1] = block.rgba[i][2] = 0;
+                block.rgba[i][3] = 255;
+              }
+            decodeAlpha(blocks, 0, block);
+            break;
+          case BlockFormat::BC7:
+            decodeBc7(blocks, block);
+            break;
+          }
+        for (int y = 0; y < 4 && blockY * 4 + y < height; ++y)
+          for (int x = 0; x < 4 && blockX * 4 + x < width; ++x)
+            std::memcpy(rgba + (static_cast<std::size_t>(blockY * 4 + y) * static_cast<std::size_t>(width) + static_cast<std::size_t>(blockX * 4 + x)) * 4,
+                        block.rgba[y * 4 + x], 4);
+      }
+}
@@ -0,0 +1,69 @@
+#ifndef BLOCK_COMPRESS_H
+#define BLOCK_COMPRESS_H
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "mip_chain.hpp"
+
+class ThreadPool;
+
+
+// GPU block compression formats, all of them 4x4 texel blocks
+enum class BlockFormat
+{
+    // RGB at 4 bits per texel, no alpha
+    BC1,
+    // BC1 colors and a separate alpha block, 8 bits per texel
+    BC3,
+    // a single channel at 4 bits per texel, the first one
+    BC4,
+    // RGBA at 8 bits per texel, much closer to the source than BC1/BC3.
+    // Only mode 6 is produced
+    BC7,
+};
+
+// how hard the encoders search. Fast takes the bounding box of each block
+// and projects texels onto it, many times quicker at some quality cost,
+// for textures compressed at run time. BC7 always searches
+enum class BlockQuality
+{
+    Best,
+    Fast,
+};
+
+// bytes of one 4x4 block
+std::size_t blockBytes(BlockFormat format);
+// bytes of a width x height image, partial blocks at the edges included
+std::size_t compressedSize(BlockFormat format, int width, int height);
+
+// a block-compressed texture and its mip levels. MipLevel offsets and
+// sizes count bytes from blocks, which storage keeps alive: the buffer the
+// levels were compressed into, or the mapping of the file they came from
+struct CompressedImage
+{
+    BlockFormat format = BlockFormat::BC1;
+    int width = 0;
+    int height = 0;
+    std::vector<MipLevel> levels;
+    const unsigned char *blocks = nullptr;
+    std::shared_ptr<const void> storage;
+};
+
+// compress a width x height image of 1 to 4 channels into blocks, rows
+// stride bytes apart. Edge blocks repeat the last row and column. Gray
+// images are treated as RGB, images without alpha as opaque. Block rows
+// are spread over pool's workers when there is one
+void compressImage(BlockFormat format, const unsigned char *pixels, int width, int height, int channels, std::size_t stride,
+                   unsigned char *blocks, ThreadPool *pool = nullptr, BlockQuality quality = BlockQuality::Best);
+// compress every level of a mip chain built with buildMipChain
+CompressedImage compressMipChain(BlockFormat format, const unsigned char *chain, const std::vector<MipLevel> &levels, int channels,
+                                 ThreadPool *pool = nullptr, BlockQuality quality = BlockQuality::Best);
+
+// decode blocks back to tightly packed RGBA, to measure what compression
+// lost. BC4 decodes to red, BC7 blocks in modes other than 6 to
+// transparent black
+void decompressImage(BlockFormat format, const unsigned char *blocks, int width, int height, unsigned char *rgba);
+
+#endif
@@ -0,0 +1,30 @@
+#include "content_hash.hpp"
+
+#include <cstring>
+
+std::uint64_t hashMix(std::uint64_t x)
+{
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdull;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ull;
+  x ^= x >> 33;
+  return x;
+}
+
+std::uint64_t hashBytes(const unsigned char *data, std::size_t size, std::uint64_t seed)
+{
+  const std::uint64_t prime = 0x9e3779b97f4a7c15ull;
+  std::uint64_t hash = seed ^ (size * prime);
+  std::size_t i = 0;
+  for (; i + 8 <= size; i += 8)
+    {
+      std::uint64_t word;
+      std::memcpy(&word, data + i, sizeof(word));
+      hash = (hash ^ hashMix(word)) * prime;
+    }
+  std::uint64_t tail = 0;
+  for (std::size_t shift = 0; i < size; ++i, shift += 8)
+    tail |= static_cast<std::uint64_t>(data[i]) << shift;
+  return hashMix(hash ^ hashMix(tail));
+}
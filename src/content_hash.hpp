@@ -0,0 +1,15 @@
+#ifndef CONTENT_HASH_H
+#define CONTENT_HASH_H
+
+#include <cstddef>
+#include <cstdint>
+
+
+// final mix of murmur3's 64-bit hash, spreads every input bit over the
+// whole word
+std::uint64_t hashMix(std::uint64_t x);
+// 64-bit hash of a file's bytes, a word at a time. Not cryptographic: it
+// tells changed or duplicate content apart, it doesn't resist forgery
+std::uint64_t hashBytes(const unsigned char *data, std::size_t size, std::uint64_t seed);
+
+#endif
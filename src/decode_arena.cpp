@@ -0,0 +1,270 @@
+#include "decode_arena.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+// sits right before every block, keeps the payload 16-byte aligned for the
+// SIMD decode paths
+struct alignas(16) DecodeArena::BlockHeader
+{
+  DecodeArena *owner;
+  std::size_t sizeClass;
+};
+
+namespace
+{
+  // class 4n holds blocks of smallestBlock << n bytes, the three after it
+  // a quarter of that more each
+  const std::size_t smallestBlock = 64;
+
+  std::size_t classBytes(std::size_t sizeClass)
+  {
+    std::size_t octave = smallestBlock << (sizeClass / 4);
+    return octave + octave / 4 * (sizeClass % 4);
+  }
+
+  std::size_t classOf(std::size_t size)
+  {
+    if (size <= smallestBlock)
+      return 0;
+    std::size_t octave = 0;
+    while ((smallestBlock << (octave + 1)) < size)
+      ++octave;
+    std::size_t quarter = (smallestBlock << octave) / 4;
+    return octave * 4 + (size - (smallestBlock << octave) + quarter - 1) / quarter;
+  }
+
+  void* stbiMalloc(void *user, std::size_t size)
+  {
+    return static_cast<DecodeArena*>(user)->allocate(size);
+  }
+
+  void* stbiRealloc(void *user, void *block, std::size_t oldSize, std::size_t newSize)
+  {
+    return static_cast<DecodeArena*>(user)->reallocate(block, oldSize, newSize);
+  }
+
+  void stbiFree(void *, void *block)
+  {
+    DecodeArena::release(block);
+  }
+
+  // arenas handed out by forThisThread(), for totalStats(), and their limit
+  std::mutex registryMutex;
+  std::vector<std::weak_ptr<DecodeArena>> registry;
+  std::size_t threadCacheLimit = DecodeArena::defaultMaxCachedBytes;
+}
+
+const std::size_t DecodeArena::defaultMaxCachedBytes;
+
+DecodeArena::DecodeArena(std::size_t maxCachedBytes)
+  : maxCached(maxCachedBytes)
+{
+  stbiAllocator.malloc = stbiMalloc;
+  stbiAllocator.realloc = stbiRealloc;
+  stbiAllocator.free = stbiFree;
+  stbiAllocator.user = this;
+}
+
+DecodeArena::~DecodeArena()
+{
+  trim();
+}
+
+void* DecodeArena::allocate(std::size_t size)
+{
+  // stb_image never asks for more than INT_MAX bytes
+  if (size > (std::size_t(1) << 40))
+    return nullptr;
+
+  std::size_t sizeClass = classOf(size);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (sizeClass < freeBlocks.size() && !freeBlocks[sizeClass].empty())
+      {
+        BlockHeader *header = freeBlocks[sizeClass].back();
+        freeBlocks[sizeClass].pop_back();
+        counters.cachedBytes -= classBytes(sizeClass);
+        ++counters.reusedBlocks;
+        ++counters.liveBlocks;
+        return header + 1;
+      }
+  }
+
+  // another thread's arena may have one cached, otherwise the heap
+  BlockHeader *header = perThread ? borrow(sizeClass) : nullptr;
+  bool borrowed = header != nullptr;
+  if (header == nullptr)
+    {
+      header = static_cast<BlockHeader*>(std::malloc(sizeof(BlockHeader) + classBytes(sizeClass)));
+      if (header == nullptr)
+        return nullptr;
+      header->sizeClass = sizeClass;
+    }
+  header->owner = this;
+  std::lock_guard<std::mutex> lock(mutex);
+  if (borrowed)
+    {
+      ++counters.reusedBlocks;
+      ++counters.borrowedBlocks;
+    }
+  else
+    {
+      ++counters.heapAllocations;
+      counters.heapBytes += classBytes(sizeClass);
+    }
+  ++counters.liveBlocks;
+  return header + 1;
+}
+
+DecodeArena::BlockHeader* DecodeArena::borrow(std::size_t sizeClass)
+{
+  // one arena locked at a time, after the registry as everywhere else
+  std::lock_guard<std::mutex> registryLock(registryMutex);
+  for (auto &entry : registry)
+    {
+      auto arena = entry.lock();
+      if (!arena || arena.get() == this)
+        continue;
+      std::lock_guard<std::mutex> lock(arena->mutex);
+      auto &blocks = arena->freeBlocks;
+      if (sizeClass < blocks.size() && !blocks[sizeClass].empty())
+        {
+          BlockHeader *header = blocks[sizeClass].back();
+          blocks[sizeClass].pop_back();
+          arena->counters.cachedBytes -= classBytes(sizeClass);
+          return header;
+        }
+    }
+  return nullptr;
+}
+
+void* DecodeArena::reallocate(void *block, std::size_t oldSize, std::size_t newSize)
+{
+  if (block == nullptr)
+    return allocate(newSize);
+
+  // growing within the block's size class is free
+  auto header = static_cast<BlockHeader*>(block) - 1;
+  if (newSize <= classBytes(header->sizeClass))
+    return block;
+
+  void *grown = allocate(newSize);
+  if (grown == nullptr)
+    return nullptr;
+  std::memcpy(grown, block, oldSize < newSize ? oldSize : newSize);
+  release(block);
+  return grown;
+}
+
+void DecodeArena::release(void *block)
+{
+  if (block == nullptr)
+    return;
+  auto header = static_cast<BlockHeader*>(block) - 1;
+  header->owner->giveBack(header);
+}
+
+void DecodeArena::giveBack(BlockHeader *header)
+{
+  std::size_t bytes = classBytes(header->sizeClass);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    --counters.liveBlocks;
+    if (counters.cachedBytes + bytes <= maxCached)
+      {
+        if (freeBlocks.size() <= header->sizeClass)
+          freeBlocks.resize(header->sizeClass + 1);
+        freeBlocks[header->sizeClass].push_back(header);
+        counters.cachedBytes += bytes;
+        return;
+      }
+  }
+  std::free(header);
+}
+
+void DecodeArena::trim()
+{
+  std::vector<std::vector<BlockHeader*>> released;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    released.swap(freeBlocks);
+    counters.cachedBytes = 0;
+  }
+  for (auto &blocks : released)
+    for (auto header : blocks)
+      std::free(header);
+}
+
+void DecodeArena::setMaxCachedBytes(std::size_t maxCachedBytes)
+{
+  // the largest blocks go first, they are the rarest to be asked for
+  std::vector<BlockHeader*> released;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    maxCached = maxCachedBytes;
+    for (std::size_t sizeClass = freeBlocks.size(); sizeClass-- > 0 && counters.cachedBytes > maxCached;)
+      while (!freeBlocks[sizeClass].empty() && counters.cachedBytes > maxCached)
+        {
+          released.push_back(freeBlocks[sizeClass].back());
+          freeBlocks[sizeClass].pop_back();
+          counters.cachedBytes -= classBytes(sizeClass);
+        }
+  }
+  for (auto header : released)
+    std::free(header);
+}
+
+DecodeArenaStats DecodeArena::stats() const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return counters;
+}
+
+std::shared_ptr<DecodeArena> DecodeArena::forThisThread()
+{
+  // images released after the thread exits keep the arena alive through
+  // their deleter, hence the shared_ptr
+  thread_local std::shared_ptr<DecodeArena> arena;
+  if (!arena)
+    {
+      std::lock_guard<std::mutex> lock(registryMutex);
+      arena = std::make_shared<DecodeArena>(threadCacheLimit);
+      arena->perThread = true;
+      registry.erase(std::remove_if(registry.begin(), registry.end(),
+                                    [](const std::weak_ptr<DecodeArena> &entry) { return entry.expired(); }),
+                     registry.end());
+      registry.push_back(arena);
+    }
+  return arena;
+}
+
+void DecodeArena::setThreadCacheLimit(std::size_t maxCachedBytes)
+{
+  std::lock_guard<std::mutex> lock(registryMutex);
+  threadCacheLimit = maxCachedBytes;
+  for (auto &entry : registry)
+    if (auto arena = entry.lock())
+      arena->setMaxCachedBytes(maxCachedBytes);
+}
+
+DecodeArenaStats DecodeArena::totalStats()
+{
+  DecodeArenaStats total;
+  std::lock_guard<std::mutex> lock(registryMutex);
+  for (auto &entry : registry)
+    {
+      if (auto arena = entry.lock())
+        {
+          DecodeArenaStats one = arena->stats();
+          total.heapAllocations += one.heapAllocations;
+          total.heapBytes += one.heapBytes;
+          total.reusedBlocks += one.reusedBlocks;
+          total.borrowedBlocks += one.borrowedBlocks;
+          total.liveBlocks += one.liveBlocks;
+          total.cachedBytes += one.cachedBytes;
+        }
+    }
+  return total;
+}
@@ -0,0 +1,92 @@
+#ifndef DECODE_ARENA_H
+#define DECODE_ARENA_H
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <stb_image.h>
+
+
+// allocation counters of one or more DecodeArenas
+struct DecodeArenaStats
+{
+    // blocks that had to come from the heap
+    std::size_t heapAllocations = 0;
+    std::size_t heapBytes = 0;
+    // blocks served from the arena's free lists
+    std::size_t reusedBlocks = 0;
+    // of those, blocks taken over from another thread's arena
+    std::size_t borrowedBlocks = 0;
+    // blocks handed out and not released yet
+    std::size_t liveBlocks = 0;
+    // free blocks kept around for the next decode
+    std::size_t cachedBytes = 0;
+};
+
+// size-class pool plugged into stb_image through stbi_allocator. Decode
+// scratch (JPEG planes, zlib output, PNG rows) and the returned images are
+// recycled instead of going back to the heap, so once a worker has seen its
+// largest texture, further loads don't allocate at all. Classes are a
+// quarter of a power of two apart, a block is at most 25% larger than
+// asked for.
+//
+// Blocks remember their arena, so an image can be released from any thread,
+// typically the GL thread after the upload. The arenas forThisThread()
+// hands out take a free block from one another before going to the heap,
+// so a worker decoding an image for the first time reuses what the others
+// cached for it.
+class DecodeArena
+{
+public:
+    // free blocks beyond maxCachedBytes go back to the heap. The default
+    // keeps a 4096 x 4096 RGBA image, or a 2048 x 2048 one with its scratch
+    static const std::size_t defaultMaxCachedBytes = std::size_t(64) << 20;
+
+    explicit DecodeArena(std::size_t maxCachedBytes = defaultMaxCachedBytes);
+    ~DecodeArena();
+
+    DecodeArena(const DecodeArena&) = delete;
+    DecodeArena& operator=(const DecodeArena&) = delete;
+
+    // hook for stbi_load_options::allocator
+    const stbi_allocator* allocator() const { return &stbiAllocator; }
+
+    void* allocate(std::size_t size);
+    void* reallocate(void *block, std::size_t oldSize, std::size_t newSize);
+    // return a block to the arena that allocated it, null is ignored
+    static void release(void *block);
+
+    // hand every cached block back to the heap
+    void trim();
+    // change the limit, handing back what's cached over it
+    void setMaxCachedBytes(std::size_t maxCachedBytes);
+    DecodeArenaStats stats() const;
+
+    // the calling thread's arena, created on first use
+    static std::shared_ptr<DecodeArena> forThisThread();
+    // limit of the arenas forThisThread() hands out, those already created
+    // included. Each decode worker keeps up to that much
+    static void setThreadCacheLimit(std::size_t maxCachedBytes);
+    // sum over every arena created by forThisThread() still alive
+    static DecodeArenaStats totalStats();
+
+private:
+    struct BlockHeader;
+
+    void giveBack(BlockHeader *header);
+    // a free block of sizeClass taken over from another forThisThread()
+    // arena, null when none has one
+    BlockHeader* borrow(std::size_t sizeClass);
+
+    std::size_t maxCached;
+    // made by forThisThread(), borrows from and lends to the others
+    bool perThread = false;
+    std::vector<std::vector<BlockHeader*>> freeBlocks;
+    DecodeArenaStats counters;
+    mutable std::mutex mutex;
+    stbi_allocator stbiAllocator;
+};
+
+#endif
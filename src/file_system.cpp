@@ -0,0 +1,153 @@
+#include "file_system.hpp"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <sys/stat.h>
+
+#include "content_hash.hpp"
+#include "mapped_file.hpp"
+
+namespace
+{
+  // whether path names a regular file, looked up without opening it,
+  // with its size and modification time in seconds
+  bool statFile(const std::string &path, std::uint64_t &size, std::uint64_t &modified)
+  {
+#ifdef _WIN32
+    struct _stat info;
+    if (_stat(path.c_str(), &info) != 0 || (info.st_mode & _S_IFREG) == 0)
+      return false;
+#else
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+      return false;
+#endif
+    size = static_cast<std::uint64_t>(info.st_size);
+    modified = static_cast<std::uint64_t>(info.st_mtime);
+    return true;
+  }
+
+  bool isFile(const std::string &path)
+  {
+    std::uint64_t size, modified;
+    return statFile(path, size, modified);
+  }
+}
+
+FileSystem::FileSystem()
+  : packReads(0), looseReads(0)
+{
+}
+
+bool FileSystem::mount(const std::string &path)
+{
+  return assets.open(path);
+}
+
+void FileSystem::addDirectory(const std::string &directory)
+{
+  if (!directory.empty() && directory.back() != '/' && directory.back() != '\\')
+    directories.push_back(directory + "/");
+  else
+    directories.push_back(directory);
+}
+
+bool FileSystem::open(const std::string &path, FileView &file, std::string &error) const
+{
+  AssetPack::Entry entry;
+  if (assets.find(path, entry))
+    {
+      file.bytes = entry.data;
+      file.length = entry.size;
+      file.storage = assets.storage();
+      ++packReads;
+      return true;
+    }
+
+  auto mapping = std::make_shared<MappedFile>();
+  if (directories.empty())
+    {
+      if (!mapping->open(path))
+        {
+          error = mapping->error();
+          return false;
+        }
+    }
+  else
+    {
+      // the first directory's error: the others are fallbacks
+      std::string firstError;
+      bool opened = false;
+      for (std::size_t i = 0; i < directories.size() && !opened; ++i)
+        {
+          opened = mapping->open(directories[i] + path);
+          if (!opened && i == 0)
+            firstError = mapping->error();
+        }
+      if (!opened)
+        {
+          error = firstError;
+          return false;
+        }
+    }
+  file.bytes = mapping->data();
+  file.length = mapping->size();
+  file.storage = std::move(mapping);
+  ++looseReads;
+  return true;
+}
+
+bool FileSystem::locate(const std::string &path, std::string &location) const
+{
+  AssetPack::Entry entry;
+  if (assets.find(path, entry))
+    return false;
+  if (directories.empty())
+    {
+      location = path;
+      return true;
+    }
+  for (const std::string &directory : directories)
+    {
+      if (!isFile(directory + path))
+        continue;
+      location = directory + path;
+      return true;
+    }
+  return false;
+}
+
+bool FileSystem::identify(const std::string &path, std::uint64_t &identity, std::string &error) const
+{
+  AssetPack::Entry entry;
+  if (assets.find(path, entry))
+    {
+      // packs baked without source keys still tell their entries apart
+      identity = entry.sourceKey != 0 ? entry.sourceKey : hashMix(reinterpret_cast<std::uintptr_t>(entry.data));
+      return true;
+    }
+
+  std::vector<std::string> candidates;
+  if (directories.empty())
+    candidates.push_back(path);
+  for (const std::string &directory : directories)
+    candidates.push_back(directory + path);
+  // the first directory's error, like open()
+  std::string firstError;
+  for (const std::string &location : candidates)
+    {
+      std::uint64_t size, modified;
+      errno = 0;
+      if (statFile(location, size, modified))
+        {
+          auto name = reinterpret_cast<const unsigned char*>(location.data());
+          identity = hashMix(hashBytes(name, location.size(), size) ^ hashMix(modified));
+          return true;
+        }
+      if (firstError.empty())
+        firstError = "can't open " + location + ": " + (errno != 0 ? std::strerror(errno) : "not a regular file");
+    }
+  error = firstError;
+  return false;
+}
@@ -0,0 +1,73 @@
+#ifndef FILE_SYSTEM_H
+#define FILE_SYSTEM_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "asset_pack.hpp"
+
+
+// the bytes of a file opened through a FileSystem, read in place from a
+// mapping: the pack's, or the file's own for loose files
+struct FileView
+{
+    const unsigned char* data() const { return bytes; }
+    std::size_t size() const { return length; }
+
+    const unsigned char *bytes = nullptr;
+    std::size_t length = 0;
+    // keeps the mapping alive, hand a copy to whatever outlives the view
+    std::shared_ptr<const void> storage;
+};
+
+// where the application reads its data from, by asset path ("wall.jpg"):
+// the entries of an asset pack, mapped once at startup, then the loose
+// files of a list of directories for what the pack doesn't hold, so
+// assets being worked on load without baking a pack. Opening doesn't
+// copy and is safe from any thread once set up
+class FileSystem
+{
+public:
+    FileSystem();
+
+    FileSystem(const FileSystem&) = delete;
+    FileSystem& operator=(const FileSystem&) = delete;
+
+    // map the pack at path, replacing any mounted before. On failure
+    // returns false and error() tells why, loose files still open
+    bool mount(const std::string &path);
+    // look for paths the pack doesn't hold in directory, after the
+    // directories added before it. With none, paths are opened as they are
+    void addDirectory(const std::string &directory);
+
+    // the bytes of path, from the pack when it holds it. False with error
+    // set when neither the pack nor any directory has it
+    bool open(const std::string &path, FileView &file, std::string &error) const;
+
+    // the loose file path stands for, for reading it some other way than
+    // open(). False when the pack holds path or no directory has it
+    bool locate(const std::string &path, std::string &location) const;
+    // a number that changes with the bytes open() gives for path, without
+    // reading them: the pack entry's source key, or the loose file's
+    // location, size and modification time. False with error set when
+    // neither the pack nor any directory has path
+    bool identify(const std::string &path, std::uint64_t &identity, std::string &error) const;
+
+    const AssetPack& pack() const { return assets; }
+    const std::string& error() const { return assets.error(); }
+    // files opened from the pack and from the directories so far
+    std::size_t packedOpens() const { return packReads; }
+    std::size_t looseOpens() const { return looseReads; }
+
+private:
+    AssetPack assets;
+    std::vector<std::string> directories;
+    mutable std::atomic<std::size_t> packReads;
+    mutable std::atomic<std::size_t> looseReads;
+};
+
+#endif
@@ -2,7 +2,16 @@
 #include <GLFW/glfw3.h>
 #include <iostream>
 #include <cmath>
-#include <stb_image.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "async_reader.hpp"
+#include "file_system.hpp"
+#include "thread_pool.hpp"
+#include "texture_cache.hpp"
+#include "texture_loader.hpp"
+#include "texture_manager.hpp"
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 {
@@ -83,7 +92,8 @@ int main() {
       "uniform sampler2D ourTexture2;\n"                \
       "void main()\n"				        \
       "{\n"						\
-      "FragColor = mix(texture(ourTexture, TexCoord), texture(ourTexture2, vec2(1.0 - TexCoord.x, TexCoord.y)), 0.2);\n"	\
+      "vec4 face = 0.2 * texture(ourTexture2, vec2(1.0 - TexCoord.x, TexCoord.y));\n" \
+      "FragColor = face + (1.0 - face.a) * texture(ourTexture, TexCoord);\n"	\
       "} \n"						\
       };
 
@@ -116,49 +126,52 @@ int main() {
 
   // Images
 
-  unsigned int texture1;
-  glGenTextures(1, &texture1);
-  glBindTexture(GL_TEXTURE_2D, texture1);
-
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-  int width, height, nrChannels;
-  stbi_set_flip_vertically_on_load(true);
-  unsigned char *data = stbi_load("ressources/container.jpg", &width, &height, &nrChannels, 0);
-  if (data)
-    {
-      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-      glGenerateMipmap(GL_TEXTURE_2D);
-    }
-  else
-    {
-      std::cout << "Failed to load texture" << std::endl;
-    }
-  stbi_image_free(data);
-
-  unsigned int texture2;
-  glGenTextures(1, &texture2);
-  glBindTexture(GL_TEXTURE_2D, texture2);
-
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-  data = stbi_load("ressources/awesomeface.png", &width, &height, &nrChannels, 0);
-  if (data)
-    {
-      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-      glGenerateMipmap(GL_TEXTURE_2D);
-    }
-  else
-    {
-      std::cout << "Failed to load texture" << std::endl;
-    }
-  stbi_image_free(data);
+  // assets by their path in data/: out of the pack, baked by assetbake
+  // and ready to upload, else loose next to the binary or, in a
+  // development build, from the source tree
+  FileSystem files;
+  if (!files.mount("ressources/assets.pack"))
+    std::cout << "No asset pack, decoding source images: " << files.error() << std::endl;
+  files.addDirectory("ressources");
+#ifdef SANDBOX_DATA_DIRECTORY
+  files.addDirectory(SANDBOX_DATA_DIRECTORY);
+#endif
+  ThreadPool decodePool;
+  // loose files are read in the background, all at once, and decode
+  // concurrently as they arrive, their decoded texels kept next to the
+  // binary so later runs skip the decode
+  AsyncReader reader(decodePool);
+  TextureCache textureCache("cache/textures");
+  // every image loaded once, however many ask for it. Deleted before
+  // the context goes
+  std::unique_ptr<TextureManager> textures(new TextureManager(decodePool, &textureCache, &files, &reader));
+
+  TextureOptions flipped;
+  flipped.flipVertically = true;
+  // upload bands of rows while the rest of the image decodes, padded to
+  // RGBA so GL gets 4 byte texels rather than repacking 3 byte ones
+  flipped.streamRows = true;
+  flipped.desiredChannels = 4;
+  // the face is a cutout: its mip levels come from the CPU, filtered in
+  // linear light and keeping the face's outline as it shrinks. It is
+  // premultiplied, drawn over the container at 20% in one multiply-add,
+  // and its transparent texels don't fringe the outline
+  TextureOptions cutout;
+  cutout.flipVertically = true;
+  cutout.buildMips = true;
+  cutout.mipOptions.srgb = true;
+  cutout.mipOptions.alphaCutoff = 0.5f;
+  cutout.premultiplyAlpha = true;
+  cutout.texelFormat = TexelFormat::BGRA;
+
+  TextureHandle container = textures->request("container.jpg", flipped);
+  TextureHandle face = textures->request("awesomeface.png", cutout);
+  textures->finish();
+  for (auto texture : {&container, &face})
+    if (texture->texture() == 0)
+      std::cout << "Failed to load texture " << texture->path() << ": " << texture->error() << std::endl;
+  unsigned int texture1 = container.texture();
+  unsigned int texture2 = face.texture();
 
 
 
@@ -229,6 +242,7 @@ int main() {
   glDeleteVertexArrays(1, &VAO);
   glDeleteBuffers(1, &VBO);
   glDeleteBuffers(1, &EBO);
+  textures.reset();
 
   glfwTerminate();
 
@@ -0,0 +1,164 @@
+#include "mapped_file.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <utility>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile()
+  : bytes(nullptr), length(0)
+#ifdef _WIN32
+  , mapping(nullptr)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+  close();
+}
+
+MappedFile::MappedFile(MappedFile &&other) noexcept
+  : MappedFile()
+{
+  *this = std::move(other);
+}
+
+MappedFile& MappedFile::operator=(MappedFile &&other) noexcept
+{
+  if (this != &other)
+    {
+      close();
+      std::swap(bytes, other.bytes);
+      std::swap(length, other.length);
+      std::swap(lastError, other.lastError);
+#ifdef _WIN32
+      std::swap(mapping, other.mapping);
+#endif
+    }
+  return *this;
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open(const std::string &path)
+{
+  close();
+
+  HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (file == INVALID_HANDLE_VALUE)
+    {
+      lastError = "can't open " + path;
+      return false;
+    }
+
+  LARGE_INTEGER fileSize;
+  if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+    {
+      CloseHandle(file);
+      lastError = "empty or unreadable file " + path;
+      return false;
+    }
+
+  mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  // the mapping keeps the file alive
+  CloseHandle(file);
+  if (mapping == nullptr)
+    {
+      lastError = "can't map " + path;
+      return false;
+    }
+
+  bytes = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+  if (bytes == nullptr)
+    {
+      CloseHandle(mapping);
+      mapping = nullptr;
+      lastError = "can't map " + path;
+      return false;
+    }
+  length = static_cast<std::size_t>(fileSize.QuadPart);
+  return true;
+}
+
+void MappedFile::close()
+{
+  if (bytes != nullptr)
+    UnmapViewOfFile(bytes);
+  if (mapping != nullptr)
+    CloseHandle(mapping);
+  bytes = nullptr;
+  mapping = nullptr;
+  length = 0;
+}
+
+#else
+
+bool MappedFile::open(const std::string &path)
+{
+  close();
+
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    {
+      lastError = "can't open " + path + ": " + std::strerror(errno);
+      return false;
+    }
+
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size <= 0)
+    {
+      ::close(fd);
+      lastError = "empty or unreadable file " + path;
+      return false;
+    }
+
+  auto fileSize = static_cast<std::size_t>(info.st_size);
+  void *view = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+  // the mapping keeps its own reference to the file
+  ::close(fd);
+  if (view == MAP_FAILED)
+    {
+      lastError = "can't map " + path + ": " + std::strerror(errno);
+      return false;
+    }
+
+  // decoders walk the file front to back, once: read ahead aggressively
+  madvise(view, fileSize, MADV_SEQUENTIAL);
+  madvise(view, fileSize, MADV_WILLNEED);
+
+  bytes = static_cast<const unsigned char*>(view);
+  length = fileSize;
+  return true;
+}
+
+void MappedFile::close()
+{
+  if (bytes != nullptr)
+    munmap(const_cast<unsigned char*>(bytes), length);
+  bytes = nullptr;
+  length = 0;
+}
+
+#endif
+
+bool replaceFile(const std::string &from, const std::string &to)
+{
+#ifdef _WIN32
+  return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+  return std::rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
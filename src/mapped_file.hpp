@@ -0,0 +1,44 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <string>
+
+
+// read-only view of a whole file mapped into memory. Decoders read straight
+// from the page cache, no read() calls and no intermediate copies
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    MappedFile(MappedFile &&other) noexcept;
+    MappedFile& operator=(MappedFile &&other) noexcept;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // map path, dropping any previous mapping. On failure returns false and
+    // error() tells why
+    bool open(const std::string &path);
+    void close();
+
+    bool isOpen() const { return bytes != nullptr; }
+    const unsigned char* data() const { return bytes; }
+    std::size_t size() const { return length; }
+    const std::string& error() const { return lastError; }
+
+private:
+    const unsigned char *bytes;
+    std::size_t length;
+    std::string lastError;
+#ifdef _WIN32
+    void *mapping;
+#endif
+};
+
+// move the file from over to, replacing it in one step where to exists:
+// readers see the old file or the new one, never neither
+bool replaceFile(const std::string &from, const std::string &to);
+
+#endif
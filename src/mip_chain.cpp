@@ -0,0 +1,566 @@
+#include "mip_chain.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <functional>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MIP_CHAIN_SSE2
+#include <emmintrin.h>
+#endif
+// the AVX column filter is compiled for that target on its own and only
+// runs once CPUID says the CPU and the OS support AVX
+#if defined(MIP_CHAIN_SSE2) && (defined(_MSC_VER) || defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define MIP_CHAIN_AVX
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define MIP_CHAIN_AVX_TARGET
+#else
+#define MIP_CHAIN_AVX_TARGET __attribute__((target("avx")))
+#endif
+#endif
+
+#include "thread_pool.hpp"
+
+namespace
+{
+  // rows per parallelFor index
+  const int bandRows = 16;
+  // Kaiser filter reach, in texels of the level being built, and shape
+  const double kaiserRadius = 3.0;
+  const double kaiserAlpha = 4.0;
+  const double pi = 3.14159265358979323846;
+  // alpha histogram resolution of the coverage search
+  const int coverageBins = 1024;
+
+  // body(first, end) over bands of [0, rows), on pool when there is one
+  void forBands(ThreadPool *pool, int rows, const std::function<void(int, int)> &body)
+  {
+    auto bands = static_cast<std::size_t>((rows + bandRows - 1) / bandRows);
+    auto band = [rows, &body](std::size_t index)
+      {
+        int first = static_cast<int>(index) * bandRows;
+        body(first, std::min(first + bandRows, rows));
+      };
+    if (pool != nullptr && bands > 1)
+      pool->parallelFor(bands, band);
+    else
+      for (std::size_t index = 0; index < bands; ++index)
+        band(index);
+  }
+
+  // rows [first, end) of a level from the level above with a 2x2 box
+  void boxRows(const unsigned char *source, const MipLevel &above, unsigned char *out, const MipLevel &level, int channels, int first,
+               int end)
+  {
+    auto pixelBytes = static_cast<std::size_t>(channels);
+    auto sourceRow = static_cast<std::size_t>(above.width) * pixelBytes;
+    auto rowBytes = static_cast<std::size_t>(level.width) * pixelBytes;
+
+    for (int y = first; y < end; ++y)
+      {
+        // odd sizes leave their last row and column out
+        const unsigned char *row0 = source + sourceRow * static_cast<std::size_t>(2 * y);
+        const unsigned char *row1 = source + sourceRow * static_cast<std::size_t>(std::min(2 * y + 1, above.height - 1));
+        unsigned char *outRow = out + rowBytes * static_cast<std::size_t>(y);
+        int x = 0;
+#ifdef MIP_CHAIN_SSE2
+        // 16 bytes of both rows at a time, pairs of neighbours summed in
+        // 16-bit lanes: the same sums and rounding as below
+        if (channels != 3 && above.width > 1)
+          {
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i two = _mm_set1_epi16(2);
+            const __m128i ones = _mm_set1_epi16(1);
+            int step = 8 / channels;
+            for (; 2 * static_cast<std::size_t>(x) * pixelBytes + 16 <= sourceRow && x + step <= level.width; x += step)
+              {
+                auto offset = 2 * static_cast<std::size_t>(x) * pixelBytes;
+                __m128i r0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row0 + offset));
+                __m128i r1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row1 + offset));
+                __m128i low = _mm_add_epi16(_mm_unpacklo_epi8(r0, zero), _mm_unpacklo_epi8(r1, zero));
+                __m128i high = _mm_add_epi16(_mm_unpackhi_epi8(r0, zero), _mm_unpackhi_epi8(r1, zero));
+                __m128i sums;
+                if (channels == 4)
+                  {
+                    sums = _mm_add_epi16(_mm_unpacklo_epi64(low, high), _mm_unpackhi_epi64(low, high));
+                  }
+                else if (channels == 2)
+                  {
+                    __m128 lowFloats = _mm_castsi128_ps(low);
+                    __m128 highFloats = _mm_castsi128_ps(high);
+                    sums = _mm_add_epi16(_mm_castps_si128(_mm_shuffle_ps(lowFloats, highFloats, _MM_SHUFFLE(2, 0, 2, 0))),
+                                         _mm_castps_si128(_mm_shuffle_ps(lowFloats, highFloats, _MM_SHUFFLE(3, 1, 3, 1))));
+                  }
+                else
+                  {
+                    sums = _mm_packs_epi32(_mm_madd_epi16(low, ones), _mm_madd_epi16(high, ones));
+                  }
+                __m128i averages = _mm_srli_epi16(_mm_add_epi16(sums, two), 2);
+                _mm_storel_epi64(reinterpret_cast<__m128i *>(outRow + static_cast<std::size_t>(x) * pixelBytes), _mm_packus_epi16(averages, averages));
+              }
+          }
+#endif
+        unsigned char *texel = outRow + static_cast<std::size_t>(x) * pixelBytes;
+        for (; x < level.width; ++x)
+          {
+            auto x0 = static_cast<std::size_t>(2 * x) * pixelBytes;
+            auto x1 = static_cast<std::size_t>(std::min(2 * x + 1, above.width - 1)) * pixelBytes;
+            for (std::size_t c = 0; c < pixelBytes; ++c)
+              *texel++ = static_cast<unsigned char>((row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) / 4);
+          }
+      }
+  }
+
+  // the source texels each texel of a level takes along one axis, and
+  // their weights. Every texel has count taps, zero weights padding
+  struct Taps
+  {
+    int count = 0;
+    std::vector<int> first;
+    std::vector<float> weights;
+  };
+
+  // modified Bessel function of the first kind, order 0
+  double besselI0(double x)
+  {
+    double sum = 1.0;
+    double term = 1.0;
+    for (int k = 1; term > sum * 1e-12; ++k)
+      {
+        double half = x / (2.0 * k);
+        term *= half * half;
+        sum += term;
+      }
+    return sum;
+  }
+
+  // Kaiser-windowed sinc at t texels of the level being built
+  double kaiser(double t)
+  {
+    if (std::fabs(t) >= kaiserRadius)
+      return 0.0;
+    double sinc = t == 0.0 ? 1.0 : std::sin(pi * t) / (pi * t);
+    double ratio = t / kaiserRadius;
+    return sinc * besselI0(kaiserAlpha * std::sqrt(1.0 - ratio * ratio)) / besselI0(kaiserAlpha);
+  }
+
+  Taps axisTaps(MipFilter filter, int source, int size)
+  {
+    Taps taps;
+    if (source == size)
+      {
+        // an axis already down to 1 texel
+        taps.count = 1;
+        taps.first.assign(static_cast<std::size_t>(size), 0);
+        taps.weights.assign(static_cast<std::size_t>(size), 1.0f);
+        return taps;
+      }
+
+    double scale = static_cast<double>(source) / size;
+    double reach = filter == MipFilter::Box ? scale / 2.0 : kaiserRadius * scale;
+    std::vector<std::vector<double>> weights(static_cast<std::size_t>(size));
+    for (int x = 0; x < size; ++x)
+      {
+        double center = (x + 0.5) * scale;
+        int low = static_cast<int>(std::floor(center - reach));
+        // the box stops where the next texel starts
+        int high = static_cast<int>(std::ceil(center + reach)) - (filter == MipFilter::Box ? 1 : 0);
+        int first = std::max(low, 0);
+        int last = std::min(high, source - 1);
+        std::vector<double> &texel = weights[static_cast<std::size_t>(x)];
+        texel.assign(static_cast<std::size_t>(last - first + 1), 0.0);
+        double total = 0.0;
+        for (int i = low; i <= high; ++i)
+          {
+            double weight;
+            if (filter == MipFilter::Box)
+              weight = std::max(0.0, std::min(i + 1.0, center + reach) - std::max(static_cast<double>(i), center - reach));
+            else
+              weight = kaiser((i + 0.5 - center) / scale);
+            // texels past the edges repeat the edge texel
+            texel[static_cast<std::size_t>(std::min(std::max(i, first), last) - first)] += weight;
+            total += weight;
+          }
+        for (double &weight : texel)
+          weight /= total;
+        taps.first.push_back(first);
+        taps.count = std::max(taps.count, static_cast<int>(texel.size()));
+      }
+
+    taps.weights.assign(static_cast<std::size_t>(size) * static_cast<std::size_t>(taps.count), 0.0f);
+    for (std::size_t x = 0; x < weights.size(); ++x)
+      {
+        // texels with fewer taps at the end of the axis pad before their
+        // first one, so every tap stays within the axis
+        auto shift = static_cast<std::size_t>(std::max(taps.first[x] + taps.count - source, 0));
+        taps.first[x] -= static_cast<int>(shift);
+        for (std::size_t k = 0; k < weights[x].size(); ++k)
+          taps.weights[x * static_cast<std::size_t>(taps.count) + shift + k] = static_cast<float>(weights[x][k]);
+      }
+    return taps;
+  }
+
+  bool hasAlpha(int channels)
+  {
+    return channels == 2 || channels == 4;
+  }
+
+  // bytes to 0-1 floats, sRGB color channels to linear light
+  struct Decoder
+  {
+    float table[256];
+    float srgbTable[256];
+
+    Decoder()
+    {
+      for (int i = 0; i < 256; ++i)
+        {
+          double value = i / 255.0;
+          table[i] = static_cast<float>(value);
+          srgbTable[i] = static_cast<float>(value <= 0.04045 ? value / 12.92 : std::pow((value + 0.055) / 1.055, 2.4));
+        }
+    }
+  };
+
+  // 0-1 floats to bytes, linear light back to sRGB through a table fine
+  // enough that the steep start of the curve rounds right
+  struct Encoder
+  {
+    static const int steps = 65535;
+    unsigned char srgbTable[steps + 1];
+
+    Encoder()
+    {
+      for (int i = 0; i <= steps; ++i)
+        {
+          double value = static_cast<double>(i) / steps;
+          double encoded = value <= 0.0031308 ? value * 12.92 : 1.055 * std::pow(value, 1.0 / 2.4) - 0.055;
+          srgbTable[i] = static_cast<unsigned char>(encoded * 255.0 + 0.5);
+        }
+    }
+  };
+
+  const Decoder &decoder()
+  {
+    static const Decoder instance;
+    return instance;
+  }
+
+  const Encoder &encoder()
+  {
+    static const Encoder instance;
+    return instance;
+  }
+
+  float clampUnit(float value)
+  {
+    return std::min(std::max(value, 0.0f), 1.0f);
+  }
+
+  // one row of source texels through the horizontal taps
+  void filterRow(const float *source, float *out, const Taps &taps, int width, int channels)
+  {
+    auto pixelFloats = static_cast<std::size_t>(channels);
+    for (int x = 0; x < width; ++x)
+      {
+        const float *weights = &taps.weights[static_cast<std::size_t>(x) * static_cast<std::size_t>(taps.count)];
+        const float *texel = source + static_cast<std::size_t>(taps.first[static_cast<std::size_t>(x)]) * pixelFloats;
+        float *result = out + static_cast<std::size_t>(x) * pixelFloats;
+#ifdef MIP_CHAIN_SSE2
+        if (channels == 4)
+          {
+            __m128 sum = _mm_setzero_ps();
+            for (int k = 0; k < taps.count; ++k, texel += 4)
+              sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weights[k]), _mm_loadu_ps(texel)));
+            _mm_storeu_ps(result, sum);
+            continue;
+          }
+#endif
+        for (std::size_t c = 0; c < pixelFloats; ++c)
+          result[c] = 0.0f;
+        for (int k = 0; k < taps.count; ++k, texel += channels)
+          for (std::size_t c = 0; c < pixelFloats; ++c)
+            result[c] += weights[k] * texel[c];
+      }
+  }
+
+#ifdef MIP_CHAIN_AVX
+  std::atomic<bool> avxEnabled(true);
+
+  bool avxAvailable()
+  {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    // AVX, OSXSAVE, and the OS saving the YMM registers
+    return (info[2] & 0x18000000) == 0x18000000 && (_xgetbv(0) & 6) == 6;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx") != 0;
+#endif
+  }
+
+  // filterColumn over whole runs of 8 floats, returns how many it did. The
+  // same multiplies and adds as the SSE2 loop, so the same results
+  MIP_CHAIN_AVX_TARGET std::size_t filterColumnAvx(const float *const *rows, const float *weights, int taps, float *out, std::size_t count)
+  {
+    std::size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+      {
+        __m256 sum = _mm256_setzero_ps();
+        for (int k = 0; k < taps; ++k)
+          sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(weights[k]), _mm256_loadu_ps(rows[k] + i)));
+        _mm256_storeu_ps(out + i, _mm256_min_ps(_mm256_max_ps(sum, _mm256_setzero_ps()), _mm256_set1_ps(1.0f)));
+      }
+    return i;
+  }
+#endif
+
+  // out = sum of rows[k] * weights[k], count floats long, clamped to 0-1
+  void filterColumn(const float *const *rows, const float *weights, int taps, float *out, std::size_t count)
+  {
+    std::size_t i = 0;
+#ifdef MIP_CHAIN_AVX
+    static const bool avx = avxAvailable();
+    if (avx && avxEnabled.load(std::memory_order_relaxed))
+      i = filterColumnAvx(rows, weights, taps, out, count);
+#endif
+#ifdef MIP_CHAIN_SSE2
+    for (; i + 4 <= count; i += 4)
+      {
+        __m128 sum = _mm_setzero_ps();
+        for (int k = 0; k < taps; ++k)
+          sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weights[k]), _mm_loadu_ps(rows[k] + i)));
+        _mm_storeu_ps(out + i, _mm_min_ps(_mm_max_ps(sum, _mm_setzero_ps()), _mm_set1_ps(1.0f)));
+      }
+#endif
+    for (; i < count; ++i)
+      {
+        float sum = 0.0f;
+        for (int k = 0; k < taps; ++k)
+          sum += weights[k] * rows[k][i];
+        out[i] = clampUnit(sum);
+      }
+  }
+
+  // share of level 0 texels whose alpha passes cutoff
+  double alphaCoverage(const unsigned char *texels, std::size_t count, int channels, float cutoff)
+  {
+    std::size_t passing = 0;
+    auto threshold = cutoff * 255.0f;
+    auto alpha = static_cast<std::size_t>(channels - 1);
+    for (std::size_t i = 0; i < count; ++i)
+      if (texels[i * static_cast<std::size_t>(channels) + alpha] > threshold)
+        ++passing;
+    return static_cast<double>(passing) / static_cast<double>(count);
+  }
+
+  // what to multiply a level's alpha by for coverage of its texels to pass
+  // cutoff: the alpha above which that many texels lie, read off a
+  // histogram, has to land on cutoff
+  float coverageScale(const float *texels, std::size_t count, int channels, float cutoff, double coverage)
+  {
+    std::vector<std::size_t> histogram(coverageBins, 0);
+    auto alpha = static_cast<std::size_t>(channels - 1);
+    for (std::size_t i = 0; i < count; ++i)
+      {
+        auto bin = static_cast<std::size_t>(texels[i * static_cast<std::size_t>(channels) + alpha] * (coverageBins - 1) + 0.5f);
+        ++histogram[bin];
+      }
+    auto wanted = static_cast<std::size_t>(coverage * static_cast<double>(count) + 0.5);
+    if (wanted == 0)
+      return 1.0f;
+    std::size_t passing = 0;
+    int bin = coverageBins - 1;
+    for (; bin > 0; --bin)
+      {
+        passing += histogram[static_cast<std::size_t>(bin)];
+        if (passing >= wanted)
+          break;
+      }
+    // just under the bin's alpha, so that bin passes
+    float threshold = (static_cast<float>(bin) - 0.5f) / (coverageBins - 1);
+    return threshold > 0.0f ? cutoff / threshold : 1.0f;
+  }
+
+  void buildFiltered(unsigned char *chain, const std::vector<MipLevel> &levels, int channels, const MipOptions &options, ThreadPool *pool)
+  {
+    if (levels.size() < 2)
+      return;
+    const Decoder &decode = decoder();
+    const Encoder &encode = encoder();
+    auto pixelFloats = static_cast<std::size_t>(channels);
+    std::size_t colors = hasAlpha(channels) ? pixelFloats - 1 : pixelFloats;
+    bool coverage = options.alphaCutoff > 0.0f && hasAlpha(channels);
+    // colors stay weighted by alpha while filtering: premultiplied, in
+    // linear light with srgb
+    bool premultiplied = options.premultipliedAlpha && hasAlpha(channels);
+    double levelCoverage = 0.0;
+    if (coverage)
+      levelCoverage = alphaCoverage(chain, levels[0].bytes / pixelFloats, channels, options.alphaCutoff);
+
+    // the level above, unrounded, and the horizontally filtered rows of
+    // the level being built
+    std::vector<float> above;
+    std::vector<float> rows;
+    std::vector<float> current;
+    for (std::size_t l = 1; l < levels.size(); ++l)
+      {
+        const MipLevel &source = levels[l - 1];
+        const MipLevel &level = levels[l];
+        Taps across = axisTaps(options.filter, source.width, level.width);
+        Taps down = axisTaps(options.filter, source.height, level.height);
+        auto sourceRow = static_cast<std::size_t>(source.width) * pixelFloats;
+        auto rowFloats = static_cast<std::size_t>(level.width) * pixelFloats;
+
+        rows.resize(rowFloats * static_cast<std::size_t>(source.height));
+        forBands(pool, source.height, [&](int first, int end)
+          {
+            std::vector<float> decoded;
+            for (int y = first; y < end; ++y)
+              {
+                const float *texels;
+                if (l == 1)
+                  {
+                    // level 0 is only there as bytes
+                    decoded.resize(sourceRow);
+                    const unsigned char *bytes = chain + sourceRow * static_cast<std::size_t>(y);
+                    const float *colorTable = options.srgb ? decode.srgbTable : decode.table;
+                    for (std::size_t i = 0; i < sourceRow; i += pixelFloats)
+                      {
+                        if (premultiplied && options.srgb)
+                          {
+                            // back to the straight color to linearize it,
+                            // then weighted again
+                            unsigned alpha = bytes[i + colors];
+                            for (std::size_t c = 0; c < colors; ++c)
+                              decoded[i + c] = alpha == 0 ? 0.0f
+                                : colorTable[std::min((bytes[i + c] * 255u + alpha / 2) / alpha, 255u)] * decode.table[alpha];
+                          }
+                        else
+                          {
+                            for (std::size_t c = 0; c < colors; ++c)
+                              decoded[i + c] = colorTable[bytes[i + c]];
+                          }
+                        if (colors < pixelFloats)
+                          decoded[i + colors] = decode.table[bytes[i + colors]];
+                      }
+                    texels = decoded.data();
+                  }
+                else
+                  {
+                    texels = above.data() + sourceRow * static_cast<std::size_t>(y);
+                  }
+                filterRow(texels, rows.data() + rowFloats * static_cast<std::size_t>(y), across, level.width, channels);
+              }
+          });
+
+        current.resize(rowFloats * static_cast<std::size_t>(level.height));
+        forBands(pool, level.height, [&](int first, int end)
+          {
+            std::vector<const float *> taps(static_cast<std::size_t>(down.count));
+            for (int y = first; y < end; ++y)
+              {
+                for (int k = 0; k < down.count; ++k)
+                  taps[static_cast<std::size_t>(k)] = rows.data() + rowFloats * static_cast<std::size_t>(down.first[static_cast<std::size_t>(y)] + k);
+                filterColumn(taps.data(), &down.weights[static_cast<std::size_t>(y) * static_cast<std::size_t>(down.count)], down.count,
+                             current.data() + rowFloats * static_cast<std::size_t>(y), rowFloats);
+              }
+          });
+
+        // the next level filters from the unscaled alpha
+        float alphaScale = coverage ? coverageScale(current.data(), level.bytes / pixelFloats, channels, options.alphaCutoff, levelCoverage) : 1.0f;
+        unsigned char *out = chain + level.offset;
+        forBands(pool, level.height, [&](int first, int end)
+          {
+            for (std::size_t i = rowFloats * static_cast<std::size_t>(first); i < rowFloats * static_cast<std::size_t>(end); i += pixelFloats)
+              {
+                float alpha = colors < pixelFloats ? current[i + colors] : 1.0f;
+                if (colors < pixelFloats)
+                  out[i + colors] = static_cast<unsigned char>(std::min(alpha * alphaScale, 1.0f) * 255.0f + 0.5f);
+                for (std::size_t c = 0; c < colors; ++c)
+                  {
+                    if (!premultiplied)
+                      {
+                        out[i + c] = options.srgb ? encode.srgbTable[static_cast<int>(current[i + c] * Encoder::steps + 0.5f)]
+                          : static_cast<unsigned char>(current[i + c] * 255.0f + 0.5f);
+                        continue;
+                      }
+                    // the straight color times the alpha stored, so the
+                    // coverage scale applies to both and colors never
+                    // exceed alpha. sRGB encodes the straight color, then
+                    // rounds like premultiplyAlpha
+                    float color = alpha > 0.0f ? std::min(current[i + c] / alpha, 1.0f) : 0.0f;
+                    unsigned stored = out[i + colors];
+                    if (options.srgb)
+                      out[i + c] = static_cast<unsigned char>((encode.srgbTable[static_cast<int>(color * Encoder::steps + 0.5f)] * stored + 127) / 255);
+                    else
+                      out[i + c] = static_cast<unsigned char>(color * static_cast<float>(stored) + 0.5f);
+                  }
+              }
+          });
+        above.swap(current);
+      }
+  }
+}
+
+std::vector<MipLevel> mipChainLayout(int width, int height, int channels)
+{
+  std::vector<MipLevel> levels;
+  if (width <= 0 || height <= 0 || channels <= 0)
+    return levels;
+
+  std::size_t offset = 0;
+  for (;;)
+    {
+      MipLevel level;
+      level.width = width;
+      level.height = height;
+      level.offset = offset;
+      level.bytes = static_cast<std::size_t>(width) * static_cast<std::size_t>(height) * static_cast<std::size_t>(channels);
+      levels.push_back(level);
+      offset += level.bytes;
+      if (width == 1 && height == 1)
+        return levels;
+      width = std::max(width / 2, 1);
+      height = std::max(height / 2, 1);
+    }
+}
+
+std::size_t mipChainBytes(const std::vector<MipLevel> &levels)
+{
+  return levels.empty() ? 0 : levels.back().offset + levels.back().bytes;
+}
+
+void buildMipChain(unsigned char *chain, const std::vector<MipLevel> &levels, int channels, const MipOptions &options, ThreadPool *pool)
+{
+  // the byte box averages premultiplied colors as they are, which weights
+  // them by alpha already
+  if (options.filter != MipFilter::Box || options.srgb || (options.alphaCutoff > 0.0f && hasAlpha(channels)))
+    {
+      buildFiltered(chain, levels, channels, options, pool);
+      return;
+    }
+
+  for (std::size_t l = 1; l < levels.size(); ++l)
+    {
+      const MipLevel &above = levels[l - 1];
+      const MipLevel &level = levels[l];
+      forBands(pool, level.height, [&](int first, int end)
+        {
+          boxRows(chain + above.offset, above, chain + level.offset, level, channels, first, end);
+        });
+    }
+}
+
+void setMipChainAvx(bool enabled)
+{
+#ifdef MIP_CHAIN_AVX
+  avxEnabled.store(enabled, std::memory_order_relaxed);
+#else
+  (void)enabled;
+#endif
+}
@@ -0,0 +1,71 @@
+#ifndef MIP_CHAIN_H
+#define MIP_CHAIN_H
+
+#include <cstddef>
+#include <vector>
+
+class ThreadPool;
+
+
+// one level of a mip chain stored level after level in a single buffer,
+// rows tightly packed
+struct MipLevel
+{
+    int width = 0;
+    int height = 0;
+    // bytes from the start of the chain
+    std::size_t offset = 0;
+    std::size_t bytes = 0;
+};
+
+// how each level is filtered from the one above
+enum class MipFilter
+{
+    // average of the texels a texel covers, 2x2 for even sizes
+    Box,
+    // Kaiser-windowed sinc reaching 3 texels of the level each way:
+    // sharper than the box and without its aliasing, at some ringing
+    Kaiser,
+};
+
+struct MipOptions
+{
+    MipFilter filter = MipFilter::Box;
+    // color channels are sRGB encoded: filter them in linear light, so
+    // levels don't darken. Alpha is always linear
+    bool srgb = false;
+    // for cutout textures drawn with an alpha test at this value (0 to 1):
+    // scale the alpha of each level so the same share of texels passes the
+    // test as in level 0, instead of the cutout thinning out with
+    // distance. 0 leaves alpha alone. Only images with 2 or 4 channels
+    // have alpha
+    float alphaCutoff = 0.0f;
+    // colors are premultiplied by alpha, level 0 included (see
+    // premultiplyAlpha), for GL_ONE, GL_ONE_MINUS_SRC_ALPHA blending.
+    // Every level comes out premultiplied as well, filtered weighting each
+    // texel's color by its alpha, so transparent texels don't bleed into
+    // the edges. With srgb the weighting is done in linear light. Only
+    // images with 2 or 4 channels have alpha
+    bool premultipliedAlpha = false;
+};
+
+// every level of a width x height image down to 1x1, sized the way GL
+// sizes them (half of the level above, rounded down, at least 1)
+std::vector<MipLevel> mipChainLayout(int width, int height, int channels);
+// bytes the whole chain takes
+std::size_t mipChainBytes(const std::vector<MipLevel> &levels);
+
+// fill levels 1 and up of chain from level 0, rows spread over pool's
+// workers when there is one. The default 2x2 box in gamma space leaves the
+// last row and column of odd sizes out and runs on bytes; the other
+// options filter in floats, each level from the unrounded one above, and
+// clamp at the edges
+void buildMipChain(unsigned char *chain, const std::vector<MipLevel> &levels, int channels, const MipOptions &options = MipOptions(),
+                   ThreadPool *pool = nullptr);
+
+// whether the float filters may use AVX where the CPU has it, as they do
+// by default. The output is the same either way: this is for checking
+// that and timing the SSE2 path
+void setMipChainAvx(bool enabled);
+
+#endif
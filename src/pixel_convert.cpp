@@ -0,0 +1,196 @@
+#include "pixel_convert.hpp"
+
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PIXEL_CONVERT_SSE2
+#include <emmintrin.h>
+#endif
+// the SSSE3 kernels are compiled for that target on their own and only
+// run once CPUID reports SSSE3, so the build keeps its SSE2 baseline
+#if defined(PIXEL_CONVERT_SSE2) && (defined(_MSC_VER) || defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define PIXEL_CONVERT_SSSE3
+#include <tmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define PIXEL_CONVERT_SSSE3_TARGET
+#else
+#define PIXEL_CONVERT_SSSE3_TARGET __attribute__((target("ssse3")))
+#endif
+#endif
+
+namespace
+{
+  // round(value * 31 / 255) and round(value * 63 / 255), exact for bytes
+  // and small enough for 16 bit lanes
+  inline unsigned to5(unsigned value)
+  {
+    return (value * 249 + 1014) >> 11;
+  }
+
+  inline unsigned to6(unsigned value)
+  {
+    return (value * 253 + 505) >> 10;
+  }
+
+  // round(value / 255) for value up to 255 * 255
+  inline unsigned divide255(unsigned value)
+  {
+    return (value + 127) / 255;
+  }
+
+#ifdef PIXEL_CONVERT_SSE2
+  // same in 16 bit lanes, without a division: exact over the same range
+  inline __m128i divide255(__m128i value)
+  {
+    __m128i rounded = _mm_add_epi16(value, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(rounded, _mm_srli_epi16(rounded, 8)), 8);
+  }
+#endif
+
+#ifdef PIXEL_CONVERT_SSSE3
+  bool ssse3Available()
+  {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] >> 9 & 1) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3") != 0;
+#endif
+  }
+
+  // same in 16 bit lanes
+  PIXEL_CONVERT_SSSE3_TARGET inline __m128i to5(__m128i value)
+  {
+    return _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(value, _mm_set1_epi16(249)), _mm_set1_epi16(1014)), 11);
+  }
+
+  PIXEL_CONVERT_SSSE3_TARGET inline __m128i to6(__m128i value)
+  {
+    return _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(value, _mm_set1_epi16(253)), _mm_set1_epi16(505)), 10);
+  }
+
+  // channel c of 8 pixels in 16 bit lanes: pixels 0-3 from the first 12
+  // bytes of low, 4-7 from the last 12 of high
+  PIXEL_CONVERT_SSSE3_TARGET inline __m128i channel(__m128i low, __m128i high, char c)
+  {
+    const char z = -1;
+    __m128i first = _mm_shuffle_epi8(low, _mm_setr_epi8(c, z, static_cast<char>(c + 3), z, static_cast<char>(c + 6), z,
+                                                        static_cast<char>(c + 9), z, z, z, z, z, z, z, z, z));
+    __m128i second = _mm_shuffle_epi8(high, _mm_setr_epi8(z, z, z, z, z, z, z, z, static_cast<char>(c + 4), z, static_cast<char>(c + 7), z,
+                                                          static_cast<char>(c + 10), z, static_cast<char>(c + 13), z));
+    return _mm_or_si128(first, second);
+  }
+
+  // packRgbTo565 of whole runs of 8 pixels, returns how many it did
+  PIXEL_CONVERT_SSSE3_TARGET std::size_t packRgbTo565Ssse3(const unsigned char *src, std::uint16_t *dst, std::size_t pixels)
+  {
+    std::size_t i = 0;
+    // 8 pixels out of 24 bytes, in two loads that stay within them
+    for (; i + 8 <= pixels; i += 8)
+      {
+        const unsigned char *row = src + 3 * i;
+        __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row));
+        __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + 8));
+        __m128i packed = _mm_or_si128(_mm_or_si128(_mm_slli_epi16(to5(channel(low, high, 0)), 11), _mm_slli_epi16(to6(channel(low, high, 1)), 5)),
+                                      to5(channel(low, high, 2)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), packed);
+      }
+    return i;
+  }
+#endif
+}
+
+void swizzleRgbaToBgra(const unsigned char *src, unsigned char *dst, std::size_t pixels)
+{
+  std::size_t i = 0;
+#ifdef PIXEL_CONVERT_SSE2
+  // green and alpha stay, red and blue trade places within each pixel
+  const __m128i greenAlpha = _mm_set1_epi32(static_cast<int>(0xff00ff00u));
+  for (; i + 4 <= pixels; i += 4)
+    {
+      __m128i texels = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 4 * i));
+      __m128i redBlue = _mm_andnot_si128(greenAlpha, texels);
+      __m128i swapped = _mm_or_si128(_mm_slli_epi32(redBlue, 16), _mm_srli_epi32(redBlue, 16));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 4 * i), _mm_or_si128(_mm_and_si128(texels, greenAlpha), swapped));
+    }
+#endif
+  for (; i < pixels; ++i)
+    {
+      unsigned char red = src[4 * i];
+      dst[4 * i] = src[4 * i + 2];
+      dst[4 * i + 1] = src[4 * i + 1];
+      dst[4 * i + 2] = red;
+      dst[4 * i + 3] = src[4 * i + 3];
+    }
+}
+
+void packRgbTo565(const unsigned char *src, std::uint16_t *dst, std::size_t pixels)
+{
+  std::size_t i = 0;
+#ifdef PIXEL_CONVERT_SSSE3
+  static const bool ssse3 = ssse3Available();
+  if (ssse3)
+    i = packRgbTo565Ssse3(src, dst, pixels);
+#endif
+  for (; i < pixels; ++i)
+    {
+      const unsigned char *texel = src + 3 * i;
+      dst[i] = static_cast<std::uint16_t>(to5(texel[0]) << 11 | to6(texel[1]) << 5 | to5(texel[2]));
+    }
+}
+
+void premultiplyAlpha(const unsigned char *src, unsigned char *dst, int channels, std::size_t pixels)
+{
+  if (channels != 2 && channels != 4)
+    {
+      if (src != dst)
+        std::memmove(dst, src, pixels * static_cast<std::size_t>(channels));
+      return;
+    }
+
+  std::size_t i = 0;
+#ifdef PIXEL_CONVERT_SSE2
+  const __m128i zero = _mm_setzero_si128();
+  if (channels == 4)
+    {
+      // 2 pixels per register in 16 bit lanes, each times its own alpha
+      // broadcast; alpha itself is put back as it was
+      const __m128i alphaBytes = _mm_set1_epi32(static_cast<int>(0xff000000u));
+      for (; i + 4 <= pixels; i += 4)
+        {
+          __m128i texels = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 4 * i));
+          __m128i low = _mm_unpacklo_epi8(texels, zero);
+          __m128i high = _mm_unpackhi_epi8(texels, zero);
+          __m128i lowAlpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(low, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+          __m128i highAlpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(high, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+          __m128i products = _mm_packus_epi16(divide255(_mm_mullo_epi16(low, lowAlpha)), divide255(_mm_mullo_epi16(high, highAlpha)));
+          _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 4 * i),
+                           _mm_or_si128(_mm_andnot_si128(alphaBytes, products), _mm_and_si128(texels, alphaBytes)));
+        }
+    }
+  else
+    {
+      // gray and alpha share a 16 bit lane
+      const __m128i grayBytes = _mm_set1_epi16(0xff);
+      for (; i + 8 <= pixels; i += 8)
+        {
+          __m128i texels = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 2 * i));
+          __m128i gray = divide255(_mm_mullo_epi16(_mm_and_si128(texels, grayBytes), _mm_srli_epi16(texels, 8)));
+          _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 2 * i), _mm_or_si128(gray, _mm_andnot_si128(grayBytes, texels)));
+        }
+    }
+#endif
+  auto pixelBytes = static_cast<std::size_t>(channels);
+  for (; i < pixels; ++i)
+    {
+      const unsigned char *texel = src + pixelBytes * i;
+      unsigned char *out = dst + pixelBytes * i;
+      unsigned alpha = texel[pixelBytes - 1];
+      for (std::size_t c = 0; c + 1 < pixelBytes; ++c)
+        out[c] = static_cast<unsigned char>(divide255(texel[c] * alpha));
+      out[pixelBytes - 1] = static_cast<unsigned char>(alpha);
+    }
+}
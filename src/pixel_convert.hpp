@@ -0,0 +1,26 @@
+#ifndef PIXEL_CONVERT_H
+#define PIXEL_CONVERT_H
+
+#include <cstddef>
+#include <cstdint>
+
+
+// texel layout conversions for uploads, SIMD with a scalar tail. Each
+// converts a run of pixels: a tightly packed row, or a whole level.
+// Expanding gray or RGB to RGBA is left to stb_image, through
+// desiredChannels
+
+// RGBA to BGRA, the layout many drivers keep 8 bit textures in. src and
+// dst may be the same
+void swizzleRgbaToBgra(const unsigned char *src, unsigned char *dst, std::size_t pixels);
+
+// RGB to 16 bits as GL_UNSIGNED_SHORT_5_6_5 reads them: red in the top 5
+// bits, blue in the low 5, each channel rounded to the nearest step
+void packRgbTo565(const unsigned char *src, std::uint16_t *dst, std::size_t pixels);
+
+// colors times alpha, rounded to the nearest step like (color * alpha +
+// 127) / 255, for images with 2 or 4 channels, alpha last. Others have no
+// alpha and are copied. src and dst may be the same
+void premultiplyAlpha(const unsigned char *src, unsigned char *dst, int channels, std::size_t pixels);
+
+#endif
@@ -0,0 +1,383 @@
+#include "texture_cache.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <utime.h>
+#endif
+
+#include "content_hash.hpp"
+#include "mapped_file.hpp"
+#include "mip_chain.hpp"
+
+namespace
+{
+  // bump when the entry layout or the mip filter changes, older entries
+  // then count as invalid
+  const std::uint32_t cacheVersion = 1;
+  const char entryMagic[4] = {'T', 'X', 'C', 'E'};
+  const char entrySuffix[] = ".tex";
+
+  // start of every entry, the mip chain follows
+  struct EntryHeader
+  {
+    char magic[4];
+    std::uint32_t version;
+    std::uint64_t key;
+    std::int32_t width;
+    std::int32_t height;
+    std::int32_t channels;
+    std::int32_t levels;
+    std::uint64_t texelBytes;
+  };
+
+  bool parseKey(const std::string &name, std::uint64_t &key)
+  {
+    const std::size_t digits = 16;
+    if (name.size() != digits + sizeof(entrySuffix) - 1 || name.compare(digits, std::string::npos, entrySuffix) != 0)
+      return false;
+    key = 0;
+    for (std::size_t i = 0; i < digits; ++i)
+      {
+        char c = name[i];
+        std::uint64_t digit;
+        if (c >= '0' && c <= '9')
+          digit = static_cast<std::uint64_t>(c - '0');
+        else if (c >= 'a' && c <= 'f')
+          digit = static_cast<std::uint64_t>(c - 'a' + 10);
+        else
+          return false;
+        key = key << 4 | digit;
+      }
+    return true;
+  }
+
+  using DirectoryVisitor = std::function<void(const std::string &name, std::size_t size, std::uint64_t modified)>;
+
+#ifdef _WIN32
+
+  bool makeDirectory(const std::string &path)
+  {
+    return CreateDirectoryA(path.c_str(), nullptr) || GetLastError() == ERROR_ALREADY_EXISTS;
+  }
+
+  // regular files of a directory, with their size and modification time
+  // in seconds
+  void listDirectory(const std::string &path, const DirectoryVisitor &visit)
+  {
+    WIN32_FIND_DATAA found;
+    HANDLE search = FindFirstFileA((path + "\\*").c_str(), &found);
+    if (search == INVALID_HANDLE_VALUE)
+      return;
+    do
+      {
+        if (found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+          continue;
+        auto size = static_cast<std::uint64_t>(found.nFileSizeHigh) << 32 | found.nFileSizeLow;
+        auto written = static_cast<std::uint64_t>(found.ftLastWriteTime.dwHighDateTime) << 32 | found.ftLastWriteTime.dwLowDateTime;
+        // 100ns ticks since 1601
+        visit(found.cFileName, static_cast<std::size_t>(size), written / 10000000 - 11644473600ull);
+      }
+    while (FindNextFileA(search, &found));
+    FindClose(search);
+  }
+
+  void touch(const std::string &path)
+  {
+    HANDLE file = CreateFileA(path.c_str(), FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                              nullptr, OPEN_EXISTING, 0, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+      return;
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    SetFileTime(file, nullptr, nullptr, &now);
+    CloseHandle(file);
+  }
+
+#else
+
+  bool makeDirectory(const std::string &path)
+  {
+    struct stat info;
+    return mkdir(path.c_str(), 0755) == 0 || (stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode));
+  }
+
+  // regular files of a directory, with their size and modification time
+  // in seconds
+  void listDirectory(const std::string &path, const DirectoryVisitor &visit)
+  {
+    DIR *dir = opendir(path.c_str());
+    if (dir == nullptr)
+      return;
+    while (dirent *found = readdir(dir))
+      {
+        std::string name = found->d_name;
+        struct stat info;
+        if (stat((path + "/" + name).c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+          continue;
+        visit(name, static_cast<std::size_t>(info.st_size), static_cast<std::uint64_t>(info.st_mtime));
+      }
+    closedir(dir);
+  }
+
+  void touch(const std::string &path)
+  {
+    utime(path.c_str(), nullptr);
+  }
+
+#endif
+
+  // every missing directory of path, parents first
+  bool makeDirectories(const std::string &path)
+  {
+    for (std::size_t slash = path.find_first_of("/\\", 1); slash != std::string::npos; slash = path.find_first_of("/\\", slash + 1))
+      makeDirectory(path.substr(0, slash));
+    return makeDirectory(path);
+  }
+
+  bool writeFile(const std::string &path, const EntryHeader &header, const std::vector<unsigned char> &texels)
+  {
+    std::FILE *file = std::fopen(path.c_str(), "wb");
+    if (file == nullptr)
+      return false;
+    bool written = std::fwrite(&header, sizeof(header), 1, file) == 1
+      && std::fwrite(texels.data(), 1, texels.size(), file) == texels.size();
+    return std::fclose(file) == 0 && written;
+  }
+}
+
+TextureCache::TextureCache(const std::string &cacheDirectory, std::size_t cacheMaxBytes)
+  : directory(cacheDirectory), maxBytes(cacheMaxBytes), clock(static_cast<std::uint64_t>(std::time(nullptr)))
+{
+  makeDirectories(directory);
+
+  // least recently used first as of the last run: hits touch their entry
+  std::vector<std::string> leftovers;
+  listDirectory(directory, [this, &leftovers](const std::string &name, std::size_t size, std::uint64_t modified)
+    {
+      std::uint64_t entryKey;
+      if (!parseKey(name, entryKey))
+        {
+          // a store that didn't get to its rename
+          if (name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0)
+            leftovers.push_back(name);
+          return;
+        }
+      entries[entryKey] = Entry{size, modified};
+      counters.bytes += size;
+      clock = std::max(clock, modified);
+    });
+  for (auto &name : leftovers)
+    std::remove((directory + "/" + name).c_str());
+  trim();
+}
+
+std::uint64_t TextureCache::key(const unsigned char *data, std::size_t size, const TextureOptions &options)
+{
+  // the options that change the texels, streamRows and the like don't.
+  // Upload formats are converted to after the lookup, one entry serves
+  // them all
+  int scale = options.jpegScaleDenom == 2 || options.jpegScaleDenom == 4 || options.jpegScaleDenom == 8 ? options.jpegScaleDenom : 1;
+  auto shape = static_cast<std::uint64_t>(options.flipVertically) | static_cast<std::uint64_t>(options.desiredChannels) << 1
+    | static_cast<std::uint64_t>(scale) << 4 | static_cast<std::uint64_t>(options.premultiplyAlpha) << 22;
+  // streamed rows get no chain of their own, their entry holds the
+  // default one like any request without buildMips
+  if (options.buildMips && !options.streamRows)
+    {
+      auto cutoff = static_cast<std::uint64_t>(std::min(std::max(options.mipOptions.alphaCutoff, 0.0f), 1.0f) * 255.0f + 0.5f);
+      shape |= 1u << 8 | static_cast<std::uint64_t>(options.mipOptions.filter) << 9 | static_cast<std::uint64_t>(options.mipOptions.srgb) << 11
+        | cutoff << 12 | static_cast<std::uint64_t>(options.mipOptions.premultipliedAlpha) << 23;
+    }
+  return hashMix(hashBytes(data, size, cacheVersion) ^ hashMix(shape + 1));
+}
+
+bool TextureCache::lookup(std::uint64_t entryKey, DecodedImage &image)
+{
+  std::string entryPath = path(entryKey);
+  auto file = std::make_shared<MappedFile>();
+  EntryHeader header;
+  bool mapped = file->open(entryPath);
+  bool valid = mapped && file->size() >= sizeof(header);
+  std::vector<MipLevel> levels;
+
+  if (valid)
+    {
+      std::memcpy(&header, file->data(), sizeof(header));
+      levels = mipChainLayout(header.width, header.height, header.channels);
+      valid = std::memcmp(header.magic, entryMagic, sizeof(entryMagic)) == 0 && header.version == cacheVersion
+        && header.key == entryKey && !levels.empty() && header.levels == static_cast<std::int32_t>(levels.size())
+        && header.texelBytes == mipChainBytes(levels) && file->size() - sizeof(header) == header.texelBytes;
+    }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!valid)
+    {
+      if (mapped)
+        {
+          ++counters.invalid;
+          file->close();
+          remove(entryKey);
+        }
+      else
+        {
+          // removed behind our back
+          auto found = entries.find(entryKey);
+          if (found != entries.end())
+            {
+              counters.bytes -= found->second.bytes;
+              entries.erase(found);
+            }
+        }
+      ++counters.misses;
+      return false;
+    }
+
+  ++counters.hits;
+  entries[entryKey] = Entry{file->size(), ++clock};
+  touch(entryPath);
+
+  image.width = header.width;
+  image.height = header.height;
+  image.channels = header.channels;
+  // GL only reads from it, the mapping stays read-only
+  image.data = const_cast<unsigned char *>(file->data() + sizeof(header));
+  image.stride = static_cast<std::size_t>(image.width) * static_cast<std::size_t>(image.channels);
+  image.mips = std::move(levels);
+  image.texels = std::move(file);
+  image.pixels.reset();
+  image.error.clear();
+  return true;
+}
+
+bool TextureCache::store(std::uint64_t entryKey, DecodedImage &image)
+{
+  if (image.data == nullptr)
+    return false;
+
+  auto levels = mipChainLayout(image.width, image.height, image.channels);
+  if (levels.empty())
+    return false;
+  auto chain = std::make_shared<std::vector<unsigned char>>(mipChainBytes(levels));
+  auto rowBytes = static_cast<std::size_t>(image.width) * static_cast<std::size_t>(image.channels);
+  if (image.mips.size() == levels.size())
+    {
+      // built with the request's filtering already
+      std::memcpy(chain->data(), image.data - image.mips[0].offset, chain->size());
+    }
+  else
+    {
+      for (int y = 0; y < image.height; ++y)
+        std::memcpy(chain->data() + rowBytes * static_cast<std::size_t>(y), image.data + image.stride * static_cast<std::size_t>(y), rowBytes);
+      buildMipChain(chain->data(), levels, image.channels);
+    }
+
+  EntryHeader header;
+  std::memcpy(header.magic, entryMagic, sizeof(entryMagic));
+  header.version = cacheVersion;
+  header.key = entryKey;
+  header.width = image.width;
+  header.height = image.height;
+  header.channels = image.channels;
+  header.levels = static_cast<std::int32_t>(levels.size());
+  header.texelBytes = chain->size();
+
+  // written aside then renamed over, readers never see half an entry
+  std::string entryPath = path(entryKey);
+  std::string temporary = entryPath + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()))
+    + "." + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + ".tmp";
+  bool stored = writeFile(temporary, header, *chain) && replaceFile(temporary, entryPath);
+  if (!stored)
+    std::remove(temporary.c_str());
+
+  if (stored)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto found = entries.find(entryKey);
+      if (found != entries.end())
+        counters.bytes -= found->second.bytes;
+      entries[entryKey] = Entry{sizeof(header) + chain->size(), ++clock};
+      counters.bytes += sizeof(header) + chain->size();
+      ++counters.stores;
+      trim();
+    }
+
+  // the chain is built either way, upload from it
+  image.data = chain->data();
+  image.stride = rowBytes;
+  image.mips = std::move(levels);
+  image.texels = std::move(chain);
+  image.pixels.reset();
+  return stored;
+}
+
+void TextureCache::invalidate(std::uint64_t entryKey)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  remove(entryKey);
+}
+
+void TextureCache::clear()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  while (!entries.empty())
+    remove(entries.begin()->first);
+}
+
+TextureCacheStats TextureCache::stats() const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return counters;
+}
+
+std::string TextureCache::path(std::uint64_t entryKey) const
+{
+  char name[17];
+  std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(entryKey));
+  return directory + "/" + name + entrySuffix;
+}
+
+// under the lock
+void TextureCache::remove(std::uint64_t entryKey)
+{
+  std::remove(path(entryKey).c_str());
+  auto found = entries.find(entryKey);
+  if (found == entries.end())
+    return;
+  counters.bytes -= found->second.bytes;
+  entries.erase(found);
+}
+
+// under the lock
+void TextureCache::trim()
+{
+  while (counters.bytes > maxBytes && !entries.empty())
+    {
+      std::uint64_t oldest = 0;
+      std::uint64_t oldestUse = UINT64_MAX;
+      for (auto &entry : entries)
+        if (entry.second.lastUse <= oldestUse)
+          {
+            oldest = entry.first;
+            oldestUse = entry.second.lastUse;
+          }
+      remove(oldest);
+      ++counters.evictions;
+    }
+}
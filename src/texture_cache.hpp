@@ -0,0 +1,82 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "texture_loader.hpp"
+
+
+// counters of a TextureCache since it was created
+struct TextureCacheStats
+{
+    std::size_t hits = 0;
+    std::size_t misses = 0;
+    // entries written, and entries removed to stay under the size cap
+    std::size_t stores = 0;
+    std::size_t evictions = 0;
+    // entries dropped because they were unreadable, truncated or from
+    // another cache version
+    std::size_t invalid = 0;
+    // size of the entries on disk
+    std::size_t bytes = 0;
+};
+
+// decoded textures kept on disk between runs, with their whole mip chain,
+// so a hit is one mmap and an upload instead of a decode. Entries are keyed
+// by the source file's content and the options that shape the texels, so
+// an edited file or different options simply miss; stale entries age out.
+// Once the entries take more than maxBytes, the least recently used go.
+//
+// Safe to use from several decode workers at once.
+class TextureCache
+{
+public:
+    // directory is created if needed, its entries are picked up
+    explicit TextureCache(const std::string &directory, std::size_t maxBytes = std::size_t(256) << 20);
+
+    TextureCache(const TextureCache&) = delete;
+    TextureCache& operator=(const TextureCache&) = delete;
+
+    // key of an encoded image decoded with these options
+    static std::uint64_t key(const unsigned char *data, std::size_t size, const TextureOptions &options);
+
+    // map the entry for key into image: data, mips and texels point into
+    // the mapping. False on a miss
+    bool lookup(std::uint64_t key, DecodedImage &image);
+    // write image with its mip chain under key, then trim to the size
+    // cap: the chain it carries when it was built on the worker, one
+    // built here otherwise. On success image is switched over to the
+    // chain, so its upload needn't build mipmaps again
+    bool store(std::uint64_t key, DecodedImage &image);
+
+    // drop the entry for key, or every entry
+    void invalidate(std::uint64_t key);
+    void clear();
+
+    TextureCacheStats stats() const;
+
+private:
+    struct Entry
+    {
+        std::size_t bytes;
+        // larger is more recent
+        std::uint64_t lastUse;
+    };
+
+    std::string path(std::uint64_t key) const;
+    void remove(std::uint64_t key);
+    void trim();
+
+    std::string directory;
+    std::size_t maxBytes;
+    std::unordered_map<std::uint64_t, Entry> entries;
+    std::uint64_t clock;
+    TextureCacheStats counters;
+    mutable std::mutex mutex;
+};
+
+#endif
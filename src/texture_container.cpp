@@ -0,0 +1,627 @@
+#include "texture_container.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+namespace
+{
+  const std::uint32_t ddsMagic = 0x20534444; // "DDS "
+
+  // DDS_HEADER::dwFlags
+  const std::uint32_t ddsdCaps = 0x1;
+  const std::uint32_t ddsdHeight = 0x2;
+  const std::uint32_t ddsdWidth = 0x4;
+  const std::uint32_t ddsdPixelFormat = 0x1000;
+  const std::uint32_t ddsdMipMapCount = 0x20000;
+  const std::uint32_t ddsdLinearSize = 0x80000;
+  // DDS_PIXELFORMAT::dwFlags
+  const std::uint32_t ddpfAlphaPixels = 0x1;
+  const std::uint32_t ddpfFourCC = 0x4;
+  const std::uint32_t ddpfRgb = 0x40;
+  const std::uint32_t ddpfLuminance = 0x20000;
+  // DDS_HEADER::dwCaps
+  const std::uint32_t ddscapsComplex = 0x8;
+  const std::uint32_t ddscapsTexture = 0x1000;
+  const std::uint32_t ddscapsMipMap = 0x400000;
+  // DDS_HEADER::dwCaps2
+  const std::uint32_t ddscaps2Cubemap = 0x200;
+  const std::uint32_t ddscaps2Volume = 0x200000;
+  // DDS_HEADER_DXT10
+  const std::uint32_t dxgiFormatR8G8B8A8Unorm = 28;
+  const std::uint32_t dxgiFormatR8G8B8A8UnormSrgb = 29;
+  const std::uint32_t dxgiFormatR8G8Unorm = 49;
+  const std::uint32_t dxgiFormatR8Unorm = 61;
+  const std::uint32_t dxgiFormatBc1Unorm = 71;
+  const std::uint32_t dxgiFormatBc1UnormSrgb = 72;
+  const std::uint32_t dxgiFormatBc3Unorm = 77;
+  const std::uint32_t dxgiFormatBc3UnormSrgb = 78;
+  const std::uint32_t dxgiFormatBc4Unorm = 80;
+  const std::uint32_t dxgiFormatBc7Unorm = 98;
+  const std::uint32_t dxgiFormatBc7UnormSrgb = 99;
+  const std::uint32_t resourceDimensionTexture2D = 3;
+  const std::uint32_t resourceMiscTextureCube = 0x4;
+
+  const unsigned char ktx2Identifier[12] = {0xAB, 0x4B, 0x54, 0x58, 0x20, 0x32, 0x30, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A};
+  // VkFormat
+  const std::uint32_t vkFormatR8Unorm = 9;
+  const std::uint32_t vkFormatR8Srgb = 15;
+  const std::uint32_t vkFormatR8G8Unorm = 16;
+  const std::uint32_t vkFormatR8G8Srgb = 22;
+  const std::uint32_t vkFormatR8G8B8Unorm = 23;
+  const std::uint32_t vkFormatR8G8B8Srgb = 29;
+  const std::uint32_t vkFormatR8G8B8A8Unorm = 37;
+  const std::uint32_t vkFormatR8G8B8A8Srgb = 43;
+  const std::uint32_t vkFormatBc1RgbUnorm = 131;
+  const std::uint32_t vkFormatBc1RgbaSrgb = 134;
+  const std::uint32_t vkFormatBc3Unorm = 137;
+  const std::uint32_t vkFormatBc3Srgb = 138;
+  const std::uint32_t vkFormatBc4Unorm = 139;
+  const std::uint32_t vkFormatBc7Unorm = 145;
+  const std::uint32_t vkFormatBc7Srgb = 146;
+
+  // Khronos data format descriptor: color models, channels and the
+  // linear transfer of UNORM formats
+  const unsigned char dfModelRgbsda = 1;
+  const unsigned char dfModelBc1a = 128;
+  const unsigned char dfModelBc3 = 130;
+  const unsigned char dfModelBc4 = 131;
+  const unsigned char dfModelBc7 = 134;
+  const unsigned char dfChannelAlpha = 15;
+  const unsigned char dfPrimariesBt709 = 1;
+  const unsigned char dfTransferLinear = 1;
+
+  // wider than any texture GL takes, small enough that level sizes can't
+  // overflow
+  const std::uint32_t maxExtent = 1u << 16;
+
+  std::uint32_t fourCC(const char *code)
+  {
+    return static_cast<std::uint32_t>(code[0]) | static_cast<std::uint32_t>(code[1]) << 8 | static_cast<std::uint32_t>(code[2]) << 16
+      | static_cast<std::uint32_t>(code[3]) << 24;
+  }
+
+  struct DdsPixelFormat
+  {
+    std::uint32_t size;
+    std::uint32_t flags;
+    std::uint32_t fourCC;
+    std::uint32_t rgbBitCount;
+    std::uint32_t masks[4];
+  };
+
+  struct DdsHeader
+  {
+    std::uint32_t size;
+    std::uint32_t flags;
+    std::uint32_t height;
+    std::uint32_t width;
+    std::uint32_t pitchOrLinearSize;
+    std::uint32_t depth;
+    std::uint32_t mipMapCount;
+    std::uint32_t reserved1[11];
+    DdsPixelFormat pixelFormat;
+    std::uint32_t caps[4];
+    std::uint32_t reserved2;
+  };
+
+  struct DdsHeaderDx10
+  {
+    std::uint32_t dxgiFormat;
+    std::uint32_t resourceDimension;
+    std::uint32_t miscFlag;
+    std::uint32_t arraySize;
+    std::uint32_t miscFlags2;
+  };
+
+  struct Ktx2Header
+  {
+    unsigned char identifier[12];
+    std::uint32_t vkFormat;
+    std::uint32_t typeSize;
+    std::uint32_t pixelWidth;
+    std::uint32_t pixelHeight;
+    std::uint32_t pixelDepth;
+    std::uint32_t layerCount;
+    std::uint32_t faceCount;
+    std::uint32_t levelCount;
+    std::uint32_t supercompressionScheme;
+    std::uint32_t dfdByteOffset;
+    std::uint32_t dfdByteLength;
+    std::uint32_t kvdByteOffset;
+    std::uint32_t kvdByteLength;
+    std::uint64_t sgdByteOffset;
+    std::uint64_t sgdByteLength;
+  };
+
+  struct Ktx2Level
+  {
+    std::uint64_t byteOffset;
+    std::uint64_t byteLength;
+    std::uint64_t uncompressedByteLength;
+  };
+
+  static_assert(sizeof(DdsHeader) == 124, "DDS_HEADER is 124 bytes");
+  static_assert(sizeof(DdsHeaderDx10) == 20, "DDS_HEADER_DXT10 is 20 bytes");
+  static_assert(sizeof(Ktx2Header) == 80, "the KTX2 header and index are 80 bytes");
+  static_assert(sizeof(Ktx2Level) == 24, "a KTX2 level index entry is 24 bytes");
+
+  void setBlocks(TextureContainer &container, BlockFormat format)
+  {
+    container.compressed = true;
+    container.format = format;
+    container.channels = format == BlockFormat::BC1 ? 3 : format == BlockFormat::BC4 ? 1 : 4;
+  }
+
+  void setRaw(TextureContainer &container, int channels)
+  {
+    container.compressed = false;
+    container.channels = channels;
+  }
+
+  // bytes a level of the container takes
+  std::size_t levelBytes(const TextureContainer &container, int width, int height)
+  {
+    if (container.compressed)
+      return compressedSize(container.format, width, height);
+    return static_cast<std::size_t>(width) * static_cast<std::size_t>(height) * static_cast<std::size_t>(container.channels);
+  }
+
+  // the size of every level below width x height, down to at most
+  // levelCount levels and no further than 1x1. False for more levels than
+  // that
+  bool layoutLevels(TextureContainer &container, std::uint32_t width, std::uint32_t height, std::uint32_t levelCount, std::string &error)
+  {
+    if (width == 0 || height == 0 || width > maxExtent || height > maxExtent)
+      {
+        error = "bad texture size";
+        return false;
+      }
+    container.width = static_cast<int>(width);
+    container.height = static_cast<int>(height);
+    container.levels.clear();
+    int levelWidth = container.width;
+    int levelHeight = container.height;
+    for (std::uint32_t l = 0; l < std::max(levelCount, 1u); ++l)
+      {
+        if (l != 0)
+          {
+            if (levelWidth == 1 && levelHeight == 1)
+              {
+                error = "more mip levels than the texture has";
+                return false;
+              }
+            levelWidth = std::max(levelWidth / 2, 1);
+            levelHeight = std::max(levelHeight / 2, 1);
+          }
+        MipLevel level;
+        level.width = levelWidth;
+        level.height = levelHeight;
+        level.bytes = levelBytes(container, levelWidth, levelHeight);
+        container.levels.push_back(level);
+      }
+    return true;
+  }
+
+  bool rawDdsFormat(const DdsPixelFormat &format, TextureContainer &container)
+  {
+    // only byte orders GL takes as they are: red first
+    bool alpha = (format.flags & ddpfAlphaPixels) != 0;
+    if ((format.flags & ddpfRgb) != 0 && format.rgbBitCount == 32 && alpha && format.masks[0] == 0xff && format.masks[1] == 0xff00
+        && format.masks[2] == 0xff0000 && format.masks[3] == 0xff000000)
+      setRaw(container, 4);
+    else if ((format.flags & ddpfRgb) != 0 && format.rgbBitCount == 24 && !alpha && format.masks[0] == 0xff && format.masks[1] == 0xff00
+             && format.masks[2] == 0xff0000)
+      setRaw(container, 3);
+    else if ((format.flags & ddpfLuminance) != 0 && format.rgbBitCount == 16 && alpha && format.masks[0] == 0xff
+             && format.masks[3] == 0xff00)
+      setRaw(container, 2);
+    else if ((format.flags & ddpfLuminance) != 0 && format.rgbBitCount == 8 && !alpha && format.masks[0] == 0xff)
+      setRaw(container, 1);
+    else
+      return false;
+    return true;
+  }
+
+  bool dxgiFormat(std::uint32_t format, TextureContainer &container)
+  {
+    switch (format)
+      {
+      case dxgiFormatR8G8B8A8Unorm:
+      case dxgiFormatR8G8B8A8UnormSrgb:
+        setRaw(container, 4);
+        return true;
+      case dxgiFormatR8G8Unorm:
+        setRaw(container, 2);
+        return true;
+      case dxgiFormatR8Unorm:
+        setRaw(container, 1);
+        return true;
+      case dxgiFormatBc1Unorm:
+      case dxgiFormatBc1UnormSrgb:
+        setBlocks(container, BlockFormat::BC1);
+        return true;
+      case dxgiFormatBc3Unorm:
+      case dxgiFormatBc3UnormSrgb:
+        setBlocks(container, BlockFormat::BC3);
+        return true;
+      case dxgiFormatBc4Unorm:
+        setBlocks(container, BlockFormat::BC4);
+        return true;
+      case dxgiFormatBc7Unorm:
+      case dxgiFormatBc7UnormSrgb:
+        setBlocks(container, BlockFormat::BC7);
+        return true;
+      default:
+        return false;
+      }
+  }
+
+  bool vkFormat(std::uint32_t format, TextureContainer &container)
+  {
+    switch (format)
+      {
+      case vkFormatR8Unorm:
+      case vkFormatR8Srgb:
+        setRaw(container, 1);
+        return true;
+      case vkFormatR8G8Unorm:
+      case vkFormatR8G8Srgb:
+        setRaw(container, 2);
+        return true;
+      case vkFormatR8G8B8Unorm:
+      case vkFormatR8G8B8Srgb:
+        setRaw(container, 3);
+        return true;
+      case vkFormatR8G8B8A8Unorm:
+      case vkFormatR8G8B8A8Srgb:
+        setRaw(container, 4);
+        return true;
+      case vkFormatBc3Unorm:
+      case vkFormatBc3Srgb:
+        setBlocks(container, BlockFormat::BC3);
+        return true;
+      case vkFormatBc4Unorm:
+        setBlocks(container, BlockFormat::BC4);
+        return true;
+      case vkFormatBc7Unorm:
+      case vkFormatBc7Srgb:
+        setBlocks(container, BlockFormat::BC7);
+        return true;
+      default:
+        // the four BC1 variants, the alpha bit of the RGBA ones is dropped
+        if (format < vkFormatBc1RgbUnorm || format > vkFormatBc1RgbaSrgb)
+          return false;
+        setBlocks(container, BlockFormat::BC1);
+        return true;
+      }
+  }
+
+  bool parseDds(const unsigned char *data, std::size_t size, TextureContainer &container, std::string &error)
+  {
+    DdsHeader header;
+    if (size < sizeof(ddsMagic) + sizeof(header))
+      {
+        error = "truncated DDS header";
+        return false;
+      }
+    std::memcpy(&header, data + sizeof(ddsMagic), sizeof(header));
+    std::size_t offset = sizeof(ddsMagic) + sizeof(header);
+    if (header.size != sizeof(header) || header.pixelFormat.size != sizeof(header.pixelFormat))
+      {
+        error = "bad DDS header";
+        return false;
+      }
+    if ((header.caps[1] & (ddscaps2Cubemap | ddscaps2Volume)) != 0 || header.depth > 1)
+      {
+        error = "DDS cube maps and volumes aren't supported";
+        return false;
+      }
+
+    if ((header.pixelFormat.flags & ddpfFourCC) != 0 && header.pixelFormat.fourCC == fourCC("DX10"))
+      {
+        DdsHeaderDx10 dx10;
+        if (size < offset + sizeof(dx10))
+          {
+            error = "truncated DDS header";
+            return false;
+          }
+        std::memcpy(&dx10, data + offset, sizeof(dx10));
+        offset += sizeof(dx10);
+        if (dx10.resourceDimension != resourceDimensionTexture2D || dx10.arraySize > 1 || (dx10.miscFlag & resourceMiscTextureCube) != 0)
+          {
+            error = "DDS arrays, cube maps and volumes aren't supported";
+            return false;
+          }
+        if (!dxgiFormat(dx10.dxgiFormat, container))
+          {
+            error = "unsupported DXGI format " + std::to_string(dx10.dxgiFormat);
+            return false;
+          }
+      }
+    else if ((header.pixelFormat.flags & ddpfFourCC) != 0)
+      {
+        std::uint32_t code = header.pixelFormat.fourCC;
+        if (code == fourCC("DXT1"))
+          setBlocks(container, BlockFormat::BC1);
+        else if (code == fourCC("DXT5"))
+          setBlocks(container, BlockFormat::BC3);
+        else if (code == fourCC("ATI1") || code == fourCC("BC4U"))
+          setBlocks(container, BlockFormat::BC4);
+        else
+          {
+            error = "unsupported DDS FourCC";
+            return false;
+          }
+      }
+    else if (!rawDdsFormat(header.pixelFormat, container))
+      {
+        error = "unsupported DDS pixel format";
+        return false;
+      }
+
+    // writers don't all set DDSD_MIPMAPCOUNT, a count of 0 is one level
+    if (!layoutLevels(container, header.width, header.height, header.mipMapCount, error))
+      return false;
+    // levels follow the headers, largest first
+    for (MipLevel &level : container.levels)
+      {
+        if (level.bytes > size - offset)
+          {
+            error = "truncated DDS file";
+            return false;
+          }
+        level.offset = offset;
+        offset += level.bytes;
+      }
+    return true;
+  }
+
+  bool parseKtx2(const unsigned char *data, std::size_t size, TextureContainer &container, std::string &error)
+  {
+    Ktx2Header header;
+    if (size < sizeof(header))
+      {
+        error = "truncated KTX2 header";
+        return false;
+      }
+    std::memcpy(&header, data, sizeof(header));
+    if (header.pixelDepth != 0 || header.layerCount > 1 || header.faceCount != 1)
+      {
+        error = "KTX2 arrays, cube maps and volumes aren't supported";
+        return false;
+      }
+    if (header.supercompressionScheme != 0)
+      {
+        error = "supercompressed KTX2 isn't supported";
+        return false;
+      }
+    if (!vkFormat(header.vkFormat, container))
+      {
+        error = "unsupported VkFormat " + std::to_string(header.vkFormat);
+        return false;
+      }
+    if (!layoutLevels(container, header.pixelWidth, header.pixelHeight, header.levelCount, error))
+      return false;
+
+    // the level index follows the header, largest level first even though
+    // the levels themselves are usually stored smallest first
+    if (container.levels.size() > (size - sizeof(header)) / sizeof(Ktx2Level))
+      {
+        error = "truncated KTX2 level index";
+        return false;
+      }
+    for (std::size_t l = 0; l < container.levels.size(); ++l)
+      {
+        Ktx2Level entry;
+        std::memcpy(&entry, data + sizeof(header) + l * sizeof(entry), sizeof(entry));
+        MipLevel &level = container.levels[l];
+        if (entry.byteLength != level.bytes)
+          {
+            error = "KTX2 level " + std::to_string(l) + " has the wrong size";
+            return false;
+          }
+        if (entry.byteOffset > size || entry.byteLength > size - entry.byteOffset)
+          {
+            error = "truncated KTX2 file";
+            return false;
+          }
+        level.offset = entry.byteOffset;
+      }
+    return true;
+  }
+}
+
+std::vector<unsigned char> ktx2File(const TextureContainer &container, const unsigned char *texels)
+{
+  // one sample per channel of the raw formats, per block half of BC3
+  struct Sample
+  {
+    std::uint16_t bitOffset;
+    std::uint8_t bitLength;
+    std::uint8_t channel;
+  };
+  std::vector<Sample> samples;
+  std::uint32_t format;
+  unsigned char model = dfModelRgbsda;
+  std::size_t blockSize;
+  if (container.compressed)
+    {
+      blockSize = blockBytes(container.format);
+      switch (container.format)
+        {
+        case BlockFormat::BC1:
+          format = vkFormatBc1RgbUnorm;
+          model = dfModelBc1a;
+          samples.push_back({0, 63, 0});
+          break;
+        case BlockFormat::BC3:
+          format = vkFormatBc3Unorm;
+          model = dfModelBc3;
+          samples.push_back({0, 63, dfChannelAlpha});
+          samples.push_back({64, 63, 0});
+          break;
+        case BlockFormat::BC4:
+          format = vkFormatBc4Unorm;
+          model = dfModelBc4;
+          samples.push_back({0, 63, 0});
+          break;
+        default:
+          format = vkFormatBc7Unorm;
+          model = dfModelBc7;
+          samples.push_back({0, 127, 0});
+          break;
+        }
+    }
+  else
+    {
+      const std::uint32_t formats[] = {vkFormatR8Unorm, vkFormatR8G8Unorm, vkFormatR8G8B8Unorm, vkFormatR8G8B8A8Unorm};
+      format = formats[container.channels - 1];
+      blockSize = static_cast<std::size_t>(container.channels);
+      for (int c = 0; c < container.channels; ++c)
+        samples.push_back({static_cast<std::uint16_t>(8 * c), 7, c == 3 ? dfChannelAlpha : static_cast<unsigned char>(c)});
+    }
+
+  auto levelCount = container.levels.size();
+  auto blockLength = static_cast<std::uint32_t>(24 + 16 * samples.size());
+  std::size_t dfdOffset = sizeof(Ktx2Header) + levelCount * sizeof(Ktx2Level);
+  std::size_t dfdLength = 4 + blockLength;
+  std::vector<unsigned char> file(dfdOffset + dfdLength);
+
+  // the basic descriptor block
+  unsigned char *dfd = file.data() + dfdOffset;
+  auto put32 = [](unsigned char *out, std::uint32_t value)
+    {
+      std::memcpy(out, &value, sizeof(value));
+    };
+  put32(dfd, static_cast<std::uint32_t>(dfdLength));
+  put32(dfd + 4, 0);
+  put32(dfd + 8, 2 | blockLength << 16);
+  dfd[12] = model;
+  dfd[13] = dfPrimariesBt709;
+  dfd[14] = dfTransferLinear;
+  dfd[15] = 0;
+  if (container.compressed)
+    dfd[16] = dfd[17] = 3;
+  dfd[20] = static_cast<unsigned char>(blockSize);
+  unsigned char *sample = dfd + 28;
+  for (const Sample &channel : samples)
+    {
+      std::memcpy(sample, &channel.bitOffset, sizeof(channel.bitOffset));
+      sample[2] = channel.bitLength;
+      sample[3] = channel.channel;
+      put32(sample + 8, 0);
+      put32(sample + 12, container.compressed ? 0xffffffff : 255);
+      sample += 16;
+    }
+
+  // levels smallest first, each aligned to both its blocks and 4 bytes
+  std::size_t alignment = blockSize % 4 == 0 ? blockSize : blockSize * (blockSize % 2 == 0 ? 2 : 4);
+  std::vector<Ktx2Level> index(levelCount);
+  for (std::size_t l = levelCount; l-- > 0;)
+    {
+      const MipLevel &level = container.levels[l];
+      file.resize((file.size() + alignment - 1) / alignment * alignment);
+      index[l].byteOffset = file.size();
+      index[l].byteLength = level.bytes;
+      index[l].uncompressedByteLength = level.bytes;
+      file.insert(file.end(), texels + level.offset, texels + level.offset + level.bytes);
+    }
+
+  Ktx2Header header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.identifier, ktx2Identifier, sizeof(ktx2Identifier));
+  header.vkFormat = format;
+  header.typeSize = 1;
+  header.pixelWidth = static_cast<std::uint32_t>(container.width);
+  header.pixelHeight = static_cast<std::uint32_t>(container.height);
+  header.faceCount = 1;
+  header.levelCount = static_cast<std::uint32_t>(levelCount);
+  header.dfdByteOffset = static_cast<std::uint32_t>(dfdOffset);
+  header.dfdByteLength = static_cast<std::uint32_t>(dfdLength);
+  std::memcpy(file.data(), &header, sizeof(header));
+  std::memcpy(file.data() + sizeof(header), index.data(), levelCount * sizeof(Ktx2Level));
+  return file;
+}
+
+bool isTextureContainer(const unsigned char *data, std::size_t size)
+{
+  return (size >= sizeof(ddsMagic) && std::memcmp(data, &ddsMagic, sizeof(ddsMagic)) == 0)
+    || (size >= sizeof(ktx2Identifier) && std::memcmp(data, ktx2Identifier, sizeof(ktx2Identifier)) == 0);
+}
+
+bool parseTextureContainer(const unsigned char *data, std::size_t size, TextureContainer &container, std::string &error)
+{
+  if (size >= sizeof(ddsMagic) && std::memcmp(data, &ddsMagic, sizeof(ddsMagic)) == 0)
+    return parseDds(data, size, container, error);
+  if (size >= sizeof(ktx2Identifier) && std::memcmp(data, ktx2Identifier, sizeof(ktx2Identifier)) == 0)
+    return parseKtx2(data, size, container, error);
+  error = "not a DDS or KTX2 file";
+  return false;
+}
+
+bool writeDds(const std::string &path, const CompressedImage &image, std::string &error)
+{
+  if (image.levels.empty())
+    {
+      error = "no mip levels";
+      return false;
+    }
+
+  DdsHeader header;
+  std::memset(&header, 0, sizeof(header));
+  header.size = sizeof(header);
+  header.flags = ddsdCaps | ddsdHeight | ddsdWidth | ddsdPixelFormat | ddsdLinearSize;
+  header.height = static_cast<std::uint32_t>(image.height);
+  header.width = static_cast<std::uint32_t>(image.width);
+  header.pitchOrLinearSize = static_cast<std::uint32_t>(image.levels[0].bytes);
+  header.mipMapCount = static_cast<std::uint32_t>(image.levels.size());
+  header.pixelFormat.size = sizeof(header.pixelFormat);
+  header.pixelFormat.flags = ddpfFourCC;
+  header.caps[0] = ddscapsTexture;
+  if (image.levels.size() > 1)
+    {
+      header.flags |= ddsdMipMapCount;
+      header.caps[0] |= ddscapsComplex | ddscapsMipMap;
+    }
+
+  DdsHeaderDx10 dx10;
+  std::memset(&dx10, 0, sizeof(dx10));
+  switch (image.format)
+    {
+    case BlockFormat::BC1:
+      header.pixelFormat.fourCC = fourCC("DXT1");
+      break;
+    case BlockFormat::BC3:
+      header.pixelFormat.fourCC = fourCC("DXT5");
+      break;
+    case BlockFormat::BC4:
+      header.pixelFormat.fourCC = fourCC("BC4U");
+      break;
+    case BlockFormat::BC7:
+      header.pixelFormat.fourCC = fourCC("DX10");
+      dx10.dxgiFormat = dxgiFormatBc7Unorm;
+      dx10.resourceDimension = resourceDimensionTexture2D;
+      dx10.arraySize = 1;
+      break;
+    }
+
+  std::FILE *file = std::fopen(path.c_str(), "wb");
+  if (file == nullptr)
+    {
+      error = "can't open " + path + ": " + std::strerror(errno);
+      return false;
+    }
+  bool written = std::fwrite(&ddsMagic, sizeof(ddsMagic), 1, file) == 1 && std::fwrite(&header, sizeof(header), 1, file) == 1
+    && (image.format != BlockFormat::BC7 || std::fwrite(&dx10, sizeof(dx10), 1, file) == 1);
+  for (const MipLevel &level : image.levels)
+    written = written && std::fwrite(image.blocks + level.offset, 1, level.bytes, file) == level.bytes;
+  if (std::fclose(file) != 0 || !written)
+    {
+      error = "can't write " + path;
+      return false;
+    }
+  return true;
+}
@@ -0,0 +1,48 @@
+#ifndef TEXTURE_CONTAINER_H
+#define TEXTURE_CONTAINER_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "block_compress.hpp"
+#include "mip_chain.hpp"
+
+
+// what a DDS or KTX2 file holds and where each of its mip levels sits,
+// offsets counting from the start of the file
+struct TextureContainer
+{
+    int width = 0;
+    int height = 0;
+    // channels once uploaded: those of the raw texels, or 3 for BC1, 1 for
+    // BC4, 4 for BC3 and BC7
+    int channels = 0;
+    // blocks of format, raw texels with tightly packed rows otherwise
+    bool compressed = false;
+    BlockFormat format = BlockFormat::BC1;
+    std::vector<MipLevel> levels;
+};
+
+// whether data starts like a DDS or a KTX2 file
+bool isTextureContainer(const unsigned char *data, std::size_t size);
+// read the header and level index of a DDS or KTX2 file, checking that
+// every level lies within size, without touching the texels. False with
+// error set for what can't be uploaded as stored: cube maps, arrays,
+// volumes, supercompressed KTX2, and formats other than 8-bit R, RG, RGB
+// and RGBA, BC1, BC3, BC4 and BC7. sRGB formats read as their UNORM
+// counterparts, like every other texture here
+bool parseTextureContainer(const unsigned char *data, std::size_t size, TextureContainer &container, std::string &error);
+
+// a KTX2 file holding container's levels, read from texels at their
+// offsets. Written in the VkFormat parseTextureContainer maps to the same
+// description, with a basic data format descriptor and the levels
+// smallest first as the format asks
+std::vector<unsigned char> ktx2File(const TextureContainer &container, const unsigned char *texels);
+
+// write image with all its mip levels as a DirectDraw Surface: BC1, BC3
+// and BC4 as DXT1, DXT5 and BC4U, BC7 with the DX10 header. False with
+// error set when the file can't be written
+bool writeDds(const std::string &path, const CompressedImage &image, std::string &error);
+
+#endif
@@ -0,0 +1,811 @@
+#include "texture_loader.hpp"
+
+#include <glad/glad.h>
+#include <stb_image.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+#include "async_reader.hpp"
+#include "file_system.hpp"
+#include "pixel_convert.hpp"
+#include "texture_cache.hpp"
+#include "texture_container.hpp"
+
+// block formats outside GL 3.3 core
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+#ifndef GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+#ifndef GL_COMPRESSED_RGBA_BPTC_UNORM
+#define GL_COMPRESSED_RGBA_BPTC_UNORM 0x8E8C
+#endif
+
+void ImageDeleter::operator()(unsigned char *pixels) const
+{
+  if (arena)
+    DecodeArena::release(pixels);
+  else
+    stbi_image_free(pixels);
+}
+
+TextureLoader::TextureLoader(ThreadPool &decodePool, TextureCache *textureCache, const FileSystem *fileSystem, AsyncReader *asyncReader)
+  : pool(decodePool), cache(textureCache), files(fileSystem), reader(asyncReader), nextId(0), inFlight(0)
+{
+}
+
+TextureLoader::~TextureLoader()
+{
+  // the queued tasks reference this loader, let them run out first
+  if (reader != nullptr)
+    reader->submit();
+  std::unique_lock<std::mutex> lock(mutex);
+  decoded.wait(lock, [this] { return inFlight == 0; });
+}
+
+std::size_t TextureLoader::request(const std::string &path, const TextureOptions &options)
+{
+  std::size_t id;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    id = nextId++;
+    ++inFlight;
+  }
+  std::string location = path;
+  if (reader != nullptr && (files == nullptr || files->locate(path, location)))
+    {
+      // decoded on the pool once read
+      reader->read(location, [this, id, path, options](AsyncRead &read) { decode(id, path, options, &read); });
+      return id;
+    }
+  pool.enqueue([this, id, path, options] { decode(id, path, options, nullptr); });
+  return id;
+}
+
+std::size_t TextureLoader::poll(const ReadyCallback &onReady)
+{
+  return poll(RowsCallback(), onReady);
+}
+
+std::size_t TextureLoader::poll(const RowsCallback &onRows, const ReadyCallback &onReady)
+{
+  // the reads of the requests made since the last poll, in one go
+  if (reader != nullptr)
+    reader->submit();
+  std::deque<std::pair<std::size_t, DecodedRows>> bands;
+  std::deque<std::pair<std::size_t, DecodedImage>> batch;
+  std::size_t remaining;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    bands.swap(rows);
+    batch.swap(ready);
+    remaining = inFlight;
+  }
+  // run the callbacks unlocked, uploads can take a while. Bands are queued
+  // before their image, so they go first
+  if (onRows)
+    for (auto &entry : bands)
+      onRows(entry.first, entry.second);
+  for (auto &entry : batch)
+    onReady(entry.first, entry.second);
+  return remaining;
+}
+
+void TextureLoader::finish(const ReadyCallback &onReady)
+{
+  finish(RowsCallback(), onReady);
+}
+
+void TextureLoader::finish(const RowsCallback &onRows, const ReadyCallback &onReady)
+{
+  if (reader != nullptr)
+    reader->submit();
+  for (;;)
+    {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        decoded.wait(lock, [this] { return inFlight == 0 || !ready.empty() || !rows.empty(); });
+      }
+      if (poll(onRows, onReady) == 0)
+        return;
+    }
+}
+
+struct TextureLoader::RowSink
+{
+  TextureLoader *loader;
+  std::size_t id;
+  // a copy of the whole image when it goes into the cache
+  std::vector<unsigned char> *image;
+  // channels of the bands when they get premultiplied, 0 otherwise
+  int premultiplyChannels;
+};
+
+void TextureLoader::rowsReady(void *user, const unsigned char *pixels, std::size_t stride, int firstRow, int rowCount)
+{
+  auto sink = static_cast<RowSink *>(user);
+  DecodedRows band;
+  band.firstRow = firstRow;
+  band.rowCount = rowCount;
+  band.stride = stride;
+  // the decoder reuses its band as soon as this returns
+  band.pixels.assign(pixels, pixels + stride * static_cast<std::size_t>(rowCount));
+  if (sink->premultiplyChannels != 0)
+    for (int y = 0; y < rowCount; ++y)
+      {
+        unsigned char *row = band.pixels.data() + stride * static_cast<std::size_t>(y);
+        premultiplyAlpha(row, row, sink->premultiplyChannels, stride / static_cast<std::size_t>(sink->premultiplyChannels));
+      }
+  if (sink->image)
+    {
+      auto end = stride * static_cast<std::size_t>(firstRow + rowCount);
+      if (sink->image->size() < end)
+        sink->image->resize(end);
+      std::copy(band.pixels.begin(), band.pixels.end(), sink->image->begin() + static_cast<std::ptrdiff_t>(stride * static_cast<std::size_t>(firstRow)));
+    }
+
+  std::lock_guard<std::mutex> lock(sink->loader->mutex);
+  sink->loader->rows.emplace_back(sink->id, std::move(band));
+  sink->loader->decoded.notify_all();
+}
+
+namespace
+{
+  // stb_image's stbi_parallel_for, on the decode pool
+  void parallelFor(void *pool, int count, void (*task)(void *, int), void *taskUser)
+  {
+    static_cast<ThreadPool *>(pool)->parallelFor(static_cast<std::size_t>(count), [task, taskUser](std::size_t index)
+      {
+        task(taskUser, static_cast<int>(index));
+      });
+  }
+
+  // header of a mapped file no larger than INT_MAX, as a load with
+  // stbiOptions decodes it
+  bool readHeader(const FileView &file, stbi_load_options &stbiOptions, int desiredChannels, ImageHeader &header)
+  {
+    if (!stbi_info_from_memory_with_options(file.data(), static_cast<int>(file.size()),
+                                            &header.width, &header.height, &header.channels, &stbiOptions))
+      {
+        header.error = stbiOptions.failure_reason ? stbiOptions.failure_reason : "unknown image type";
+        return false;
+      }
+    if (desiredChannels != 0)
+      header.channels = desiredChannels;
+    return true;
+  }
+
+  // the levels of a DDS or KTX2 file straight from the mapping storage
+  // keeps alive, nothing is copied or decoded. False with image.error set
+  // when the file can't be loaded or its levels take more than maxBytes
+  bool loadContainer(const unsigned char *data, std::size_t size, std::shared_ptr<const void> storage, std::size_t maxBytes,
+                     DecodedImage &image)
+  {
+    TextureContainer container;
+    if (!parseTextureContainer(data, size, container, image.error))
+      return false;
+    std::size_t bytes = 0;
+    for (const MipLevel &level : container.levels)
+      bytes += level.bytes;
+    if (maxBytes != 0 && bytes > maxBytes)
+      {
+        image.error = "decoded image over budget";
+        return false;
+      }
+
+    image.width = container.width;
+    image.height = container.height;
+    image.channels = container.channels;
+    if (container.compressed)
+      {
+        image.compressed.format = container.format;
+        image.compressed.width = container.width;
+        image.compressed.height = container.height;
+        image.compressed.levels = container.levels;
+        image.compressed.blocks = data;
+        image.compressed.storage = std::move(storage);
+        return true;
+      }
+    // GL only reads from it, the mapping stays read-only
+    image.data = const_cast<unsigned char *>(data + container.levels[0].offset);
+    image.stride = static_cast<std::size_t>(image.width) * static_cast<std::size_t>(image.channels);
+    // a lone level gets its mipmaps from GL like any other image
+    if (container.levels.size() > 1)
+      image.mips = container.levels;
+    image.texels = std::move(storage);
+    return true;
+  }
+
+  // path through files, as it is without one
+  bool openFile(const FileSystem *files, const std::string &path, FileView &file, std::string &error)
+  {
+    static const FileSystem loose;
+    return (files != nullptr ? *files : loose).open(path, file, error);
+  }
+
+  // the bytes of a completed read, without copying them
+  bool readFile(AsyncRead &read, FileView &file, std::string &error)
+  {
+    if (!read.error.empty() || read.data.empty())
+      {
+        error = read.error.empty() ? "empty file " + read.path : read.error;
+        return false;
+      }
+    auto bytes = std::make_shared<std::vector<unsigned char>>(std::move(read.data));
+    file.bytes = bytes->data();
+    file.length = bytes->size();
+    file.storage = std::move(bytes);
+    return true;
+  }
+
+  // the header of a DDS or KTX2 file
+  bool readContainerHeader(const unsigned char *data, std::size_t size, ImageHeader &header)
+  {
+    TextureContainer container;
+    if (!parseTextureContainer(data, size, container, header.error))
+      return false;
+    header.width = container.width;
+    header.height = container.height;
+    header.channels = container.channels;
+    return true;
+  }
+
+  // BC1 for colors without alpha, BC4 for a single channel, false for the
+  // rest: two channels, or an alpha channel that isn't all opaque
+  bool blockFormatFor(const DecodedImage &image, BlockFormat &format)
+  {
+    switch (image.channels)
+      {
+      case 1:
+        format = BlockFormat::BC4;
+        return true;
+      case 3:
+        format = BlockFormat::BC1;
+        return true;
+      case 4:
+        for (int y = 0; y < image.height; ++y)
+          {
+            const unsigned char *row = image.data + image.stride * static_cast<std::size_t>(y);
+            for (int x = 0; x < image.width; ++x)
+              if (row[4 * x + 3] != 255)
+                return false;
+          }
+        format = BlockFormat::BC1;
+        return true;
+      default:
+        return false;
+      }
+  }
+
+  // copy the image into a mip chain and fill its other levels, the image
+  // then points into the chain
+  void attachMipChain(DecodedImage &image, const MipOptions &options, ThreadPool *pool)
+  {
+    std::vector<MipLevel> levels = mipChainLayout(image.width, image.height, image.channels);
+    auto chain = std::make_shared<std::vector<unsigned char>>(mipChainBytes(levels));
+    auto rowBytes = static_cast<std::size_t>(image.width) * static_cast<std::size_t>(image.channels);
+    for (int y = 0; y < image.height; ++y)
+      std::memcpy(chain->data() + rowBytes * static_cast<std::size_t>(y), image.data + image.stride * static_cast<std::size_t>(y), rowBytes);
+    buildMipChain(chain->data(), levels, image.channels, options, pool);
+
+    image.data = chain->data();
+    image.stride = rowBytes;
+    image.mips = std::move(levels);
+    image.texels = std::move(chain);
+    image.pixels.reset();
+  }
+
+  // swap the image's texels for blocks, mip chain included: GL doesn't
+  // build mipmaps of compressed textures
+  void compressForUpload(DecodedImage &image)
+  {
+    BlockFormat format;
+    if (!blockFormatFor(image, format))
+      return;
+
+    if (image.mips.empty())
+      attachMipChain(image, MipOptions(), nullptr);
+    image.compressed = compressMipChain(format, image.data - image.mips[0].offset, image.mips, image.channels, nullptr, BlockQuality::Fast);
+
+    image.data = nullptr;
+    image.stride = 0;
+    image.mips.clear();
+    image.texels.reset();
+    image.pixels.reset();
+  }
+
+  // copy the image's texels, mip levels included, into a chain of their
+  // own laid out as format says, the image then points into it. Images
+  // without the channels format takes are left alone
+  void convertForUpload(DecodedImage &image, TexelFormat format)
+  {
+    std::size_t texelBytes;
+    if (format == TexelFormat::BGRA && image.channels == 4)
+      texelBytes = 4;
+    else if (format == TexelFormat::RGB565 && image.channels == 3)
+      texelBytes = 2;
+    else
+      return;
+
+    std::vector<MipLevel> source = image.mips;
+    if (source.empty())
+      {
+        MipLevel level;
+        level.width = image.width;
+        level.height = image.height;
+        source.push_back(level);
+      }
+    std::vector<MipLevel> levels = source;
+    std::size_t bytes = 0;
+    for (MipLevel &level : levels)
+      {
+        level.offset = bytes;
+        level.bytes = static_cast<std::size_t>(level.width) * static_cast<std::size_t>(level.height) * texelBytes;
+        bytes += level.bytes;
+      }
+
+    auto chain = std::make_shared<std::vector<unsigned char>>(bytes);
+    const unsigned char *base = image.data - source[0].offset;
+    auto channels = static_cast<std::size_t>(image.channels);
+    for (std::size_t index = 0; index < levels.size(); ++index)
+      {
+        // only the first level can have padded rows, tightly packed ones
+        // convert in one go
+        auto width = static_cast<std::size_t>(levels[index].width);
+        auto rows = static_cast<std::size_t>(levels[index].height);
+        std::size_t stride = index == 0 ? image.stride : width * channels;
+        if (stride == width * channels)
+          {
+            width *= rows;
+            rows = 1;
+          }
+        for (std::size_t y = 0; y < rows; ++y)
+          {
+            const unsigned char *row = base + source[index].offset + stride * y;
+            unsigned char *out = chain->data() + levels[index].offset + width * texelBytes * y;
+            if (format == TexelFormat::BGRA)
+              swizzleRgbaToBgra(row, out, width);
+            else
+              packRgbTo565(row, reinterpret_cast<std::uint16_t *>(out), width);
+          }
+      }
+
+    image.data = chain->data();
+    image.stride = static_cast<std::size_t>(image.width) * texelBytes;
+    image.format = format;
+    // without levels of its own GL builds the mipmaps, as before
+    if (!image.mips.empty())
+      image.mips = std::move(levels);
+    image.texels = std::move(chain);
+    image.pixels.reset();
+  }
+}
+
+std::size_t ImageHeader::bytes() const
+{
+  return static_cast<std::size_t>(width) * static_cast<std::size_t>(height) * static_cast<std::size_t>(channels);
+}
+
+bool probeImage(const std::string &path, const TextureOptions &options, ImageHeader &header, const FileSystem *files)
+{
+  FileView file;
+  if (!openFile(files, path, file, header.error))
+    return false;
+  if (isTextureContainer(file.data(), file.size()))
+    return readContainerHeader(file.data(), file.size(), header);
+  if (file.size() > static_cast<std::size_t>(std::numeric_limits<int>::max()))
+    {
+      header.error = "file too large";
+      return false;
+    }
+  stbi_load_options stbiOptions;
+  stbi_load_options_init(&stbiOptions);
+  stbiOptions.jpeg_scale_denom = options.jpegScaleDenom;
+  return readHeader(file, stbiOptions, options.desiredChannels, header);
+}
+
+void TextureLoader::decode(std::size_t id, const std::string &path, const TextureOptions &options, AsyncRead *read)
+{
+  // the reentrant stb_image entry point: workers don't share any settings
+  stbi_load_options stbiOptions;
+  stbi_load_options_init(&stbiOptions);
+  stbiOptions.flip_vertically = options.flipVertically;
+  stbiOptions.desired_channels = options.desiredChannels;
+  stbiOptions.jpeg_scale_denom = options.jpegScaleDenom;
+  if (options.parallelDecode)
+    {
+      stbiOptions.parallel_for = parallelFor;
+      stbiOptions.parallel_user = &pool;
+    }
+  // stb_image's scratch and results are recycled per worker: in steady
+  // state the decode itself doesn't touch the heap. What the loader does
+  // with the result still does (row bands, mip chains, conversions and the
+  // copy of streamed images)
+  auto arena = DecodeArena::forThisThread();
+  stbiOptions.allocator = arena->allocator();
+  // the cache holds the whole image, streamed or not
+  bool cached = cache != nullptr && options.destination == nullptr;
+  std::vector<unsigned char> streamedImage;
+  RowSink sink = {this, id, cached ? &streamedImage : nullptr, 0};
+  if (options.streamRows)
+    {
+      stbiOptions.rows_ready = rowsReady;
+      stbiOptions.rows_user = &sink;
+    }
+  else
+    {
+      stbiOptions.output = options.destination;
+      stbiOptions.output_stride = options.destinationStride;
+      stbiOptions.output_size = options.destinationSize;
+    }
+
+  DecodedImage image;
+  image.path = path;
+  image.pixels.get_deleter().arena = arena;
+
+  // decode straight out of the page cache instead of stdio's small reads
+  FileView file;
+  ImageHeader header;
+  bool streamed = false;
+  // texels that need no decoding: a cache hit or a texture file
+  bool stored = false;
+  std::uint64_t cacheKey = 0;
+  if (read != nullptr ? !readFile(*read, file, image.error) : !openFile(files, path, file, image.error))
+    {
+      // nothing to decode, the error is set
+    }
+  else if (isTextureContainer(file.data(), file.size()))
+    {
+      // baked ahead, the pack's entries are uploaded as they are
+      stored = loadContainer(file.data(), file.size(), file.storage, options.maxDecodedBytes, image);
+    }
+  else if (file.size() > static_cast<std::size_t>(std::numeric_limits<int>::max()))
+    {
+      image.error = "file too large";
+    }
+  else if (options.maxDecodedBytes != 0 && !readHeader(file, stbiOptions, options.desiredChannels, header))
+    {
+      image.error = header.error;
+    }
+  else if (options.maxDecodedBytes != 0 && header.bytes() > options.maxDecodedBytes)
+    {
+      image.error = "decoded image over budget";
+    }
+  else if (cached && cache->lookup(cacheKey = TextureCache::key(file.data(), file.size(), options), image))
+    {
+      // no decode at all
+      stored = true;
+    }
+  else if (options.streamRows)
+    {
+      // the bands don't say how many channels they have, and only those
+      // with alpha change
+      if (options.premultiplyAlpha && (header.channels != 0 || readHeader(file, stbiOptions, options.desiredChannels, header))
+          && (header.channels == 2 || header.channels == 4))
+        sink.premultiplyChannels = header.channels;
+      streamed = stbi_stream_from_memory_with_options(file.data(), static_cast<int>(file.size()),
+                                                      &image.width, &image.height, &image.channels, &stbiOptions) != 0;
+    }
+  else
+    {
+      image.data = stbi_load_from_memory_with_options(file.data(), static_cast<int>(file.size()),
+                                                      &image.width, &image.height, &image.channels, &stbiOptions);
+    }
+
+  if (!stored && (image.data || streamed))
+    {
+      if (options.desiredChannels != 0)
+        image.channels = options.desiredChannels;
+      image.stride = static_cast<std::size_t>(image.width) * static_cast<std::size_t>(image.channels);
+      if (streamed && cached && streamedImage.size() == image.stride * static_cast<std::size_t>(image.height))
+        {
+          // the bands went out already, only the cache still wants the image
+          DecodedImage whole;
+          whole.width = image.width;
+          whole.height = image.height;
+          whole.channels = image.channels;
+          whole.data = streamedImage.data();
+          whole.stride = image.stride;
+          cache->store(cacheKey, whole);
+        }
+      if (streamed)
+        {
+          image.stride = 0;
+        }
+      else
+        {
+          if (options.destination == nullptr)
+            image.pixels.reset(image.data);
+          else if (options.destinationStride != 0)
+            image.stride = options.destinationStride;
+          if (options.premultiplyAlpha)
+            for (int y = 0; y < image.height; ++y)
+              {
+                unsigned char *row = image.data + image.stride * static_cast<std::size_t>(y);
+                premultiplyAlpha(row, row, image.channels, static_cast<std::size_t>(image.width));
+              }
+          // on the pool's idle workers as well, like the decode
+          if (options.buildMips && options.destination == nullptr)
+            {
+              MipOptions mipOptions = options.mipOptions;
+              mipOptions.premultipliedAlpha = mipOptions.premultipliedAlpha || options.premultiplyAlpha;
+              attachMipChain(image, mipOptions, &pool);
+            }
+          // the upload then uses the mip chain built for the cache
+          if (cached)
+            cache->store(cacheKey, image);
+        }
+    }
+  else if (!stored && stbiOptions.failure_reason)
+    {
+      image.error = stbiOptions.failure_reason;
+    }
+
+  if (image.data && options.compressBlocks && options.destination == nullptr && !options.streamRows)
+    {
+      // once the pool falls behind, a raw upload gets the texture on
+      // screen sooner than making the queue wait for encodes
+      bool overloaded;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        overloaded = inFlight > 2 * pool.size();
+      }
+      if (!overloaded)
+        compressForUpload(image);
+    }
+  // after the cache, which keeps the texels as decoded
+  if (image.data && image.compressed.levels.empty() && options.texelFormat != TexelFormat::Decoded && options.destination == nullptr
+      && !options.streamRows)
+    convertForUpload(image, options.texelFormat);
+
+  // notify under the lock: once inFlight drops to 0 the destructor may run
+  std::lock_guard<std::mutex> lock(mutex);
+  ready.emplace_back(id, std::move(image));
+  --inFlight;
+  decoded.notify_all();
+}
+
+namespace
+{
+  GLenum pixelFormat(int channels)
+  {
+    switch (channels)
+      {
+      case 1: return GL_RED;
+      case 2: return GL_RG;
+      case 3: return GL_RGB;
+      default: return GL_RGBA;
+      }
+  }
+
+  // format and type of the texels of an image, as glTexImage2D takes them
+  GLenum uploadFormat(const DecodedImage &image)
+  {
+    return image.format == TexelFormat::BGRA ? GL_BGRA : pixelFormat(image.channels);
+  }
+
+  GLenum uploadType(const DecodedImage &image)
+  {
+    return image.format == TexelFormat::RGB565 ? GL_UNSIGNED_SHORT_5_6_5 : GL_UNSIGNED_BYTE;
+  }
+
+  int texelBytes(const DecodedImage &image)
+  {
+    return image.format == TexelFormat::RGB565 ? 2 : image.channels;
+  }
+
+  // describe a row pitch to GL, false if it can't be expressed
+  bool setUnpackLayout(int width, int pixelBytes, std::size_t stride)
+  {
+    auto texel = static_cast<std::size_t>(pixelBytes);
+    auto rowBytes = static_cast<std::size_t>(width) * texel;
+
+    if (stride % texel == 0)
+      {
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, stride == rowBytes ? 0 : static_cast<GLint>(stride / texel));
+        return true;
+      }
+    // padded rows are fine as long as the padding is GL's row alignment
+    for (std::size_t alignment = 2; alignment <= 8; alignment *= 2)
+      {
+        if ((rowBytes + alignment - 1) / alignment * alignment == stride)
+          {
+            glPixelStorei(GL_UNPACK_ALIGNMENT, static_cast<GLint>(alignment));
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+            return true;
+          }
+      }
+    return false;
+  }
+
+  void resetUnpackLayout()
+  {
+    // back to GL's defaults
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  }
+
+  void setSampling()
+  {
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  }
+
+  // levels 1 and up of the bound texture: the image's own when it carries
+  // them, built by GL otherwise. define creates the levels, the storage
+  // exists already otherwise
+  void uploadMipmaps(const DecodedImage &image, bool define)
+  {
+    if (image.mips.empty())
+      {
+        glGenerateMipmap(GL_TEXTURE_2D);
+        return;
+      }
+    const unsigned char *base = image.data - image.mips[0].offset;
+    GLenum internalFormat = pixelFormat(image.channels);
+    GLenum format = uploadFormat(image);
+    GLenum type = uploadType(image);
+    int pixelBytes = texelBytes(image);
+    for (std::size_t level = 1; level < image.mips.size(); ++level)
+      {
+        const MipLevel &mip = image.mips[level];
+        setUnpackLayout(mip.width, pixelBytes, static_cast<std::size_t>(mip.width) * static_cast<std::size_t>(pixelBytes));
+        if (define)
+          glTexImage2D(GL_TEXTURE_2D, static_cast<GLint>(level), static_cast<GLint>(internalFormat), mip.width, mip.height, 0, format, type,
+                       base + mip.offset);
+        else
+          glTexSubImage2D(GL_TEXTURE_2D, static_cast<GLint>(level), 0, 0, mip.width, mip.height, format, type, base + mip.offset);
+      }
+    // a file may stop short of 1x1
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, static_cast<GLint>(image.mips.size()) - 1);
+  }
+
+  GLenum compressedFormat(BlockFormat format)
+  {
+    switch (format)
+      {
+      case BlockFormat::BC1: return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+      case BlockFormat::BC3: return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+      case BlockFormat::BC4: return GL_COMPRESSED_RED_RGTC1;
+      default: return GL_COMPRESSED_RGBA_BPTC_UNORM;
+      }
+  }
+
+  // every level of a block compressed image into the bound texture,
+  // replacing whatever storage it had
+  void uploadCompressed(const CompressedImage &image)
+  {
+    GLenum format = compressedFormat(image.format);
+    for (std::size_t level = 0; level < image.levels.size(); ++level)
+      {
+        const MipLevel &mip = image.levels[level];
+        glCompressedTexImage2D(GL_TEXTURE_2D, static_cast<GLint>(level), format, mip.width, mip.height, 0, static_cast<GLsizei>(mip.bytes),
+                               image.blocks + mip.offset);
+      }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, static_cast<GLint>(image.levels.size()) - 1);
+  }
+}
+
+bool blockCompressionSupported()
+{
+  GLint count = 0;
+  glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+  for (GLint i = 0; i < count; ++i)
+    {
+      auto name = reinterpret_cast<const char *>(glGetStringi(GL_EXTENSIONS, static_cast<GLuint>(i)));
+      if (name != nullptr && std::strcmp(name, "GL_EXT_texture_compression_s3tc") == 0)
+        return true;
+    }
+  return false;
+}
+
+unsigned int createTexture(const DecodedImage &image)
+{
+  if (!image.compressed.levels.empty())
+    {
+      unsigned int texture;
+      glGenTextures(1, &texture);
+      glBindTexture(GL_TEXTURE_2D, texture);
+      setSampling();
+      uploadCompressed(image.compressed);
+      return texture;
+    }
+  if (image.data == nullptr || !setUnpackLayout(image.width, texelBytes(image), image.stride))
+    return 0;
+
+  unsigned int texture;
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  setSampling();
+
+  glTexImage2D(GL_TEXTURE_2D, 0, static_cast<GLint>(pixelFormat(image.channels)), image.width, image.height, 0, uploadFormat(image),
+               uploadType(image), image.data);
+  uploadMipmaps(image, true);
+
+  resetUnpackLayout();
+  return texture;
+}
+
+unsigned int allocateTexture(const ImageHeader &header)
+{
+  if (header.width <= 0 || header.height <= 0 || header.channels <= 0)
+    return 0;
+
+  unsigned int texture;
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  setSampling();
+
+  // GL 3.3 has no glTexStorage2D: define every level up front instead, and
+  // cap the chain so the texture is complete from the start
+  GLenum format = pixelFormat(header.channels);
+  int width = header.width;
+  int height = header.height;
+  int level = 0;
+  for (;;)
+    {
+      glTexImage2D(GL_TEXTURE_2D, level, static_cast<GLint>(format), width, height, 0, format, GL_UNSIGNED_BYTE, nullptr);
+      if (width == 1 && height == 1)
+        break;
+      width = std::max(width / 2, 1);
+      height = std::max(height / 2, 1);
+      ++level;
+    }
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, level);
+  return texture;
+}
+
+bool uploadTexture(unsigned int texture, const ImageHeader &header, const DecodedImage &image)
+{
+  if (!image.compressed.levels.empty())
+    {
+      if (image.width != header.width || image.height != header.height || image.channels != header.channels)
+        return false;
+      glBindTexture(GL_TEXTURE_2D, texture);
+      uploadCompressed(image.compressed);
+      return true;
+    }
+  if (image.data == nullptr || image.width != header.width || image.height != header.height
+      || image.channels != header.channels || !setUnpackLayout(image.width, texelBytes(image), image.stride))
+    return false;
+
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, image.width, image.height, uploadFormat(image), uploadType(image), image.data);
+  uploadMipmaps(image, false);
+
+  resetUnpackLayout();
+  return true;
+}
+
+bool uploadRows(unsigned int texture, const ImageHeader &header, const DecodedRows &rows)
+{
+  if (rows.firstRow < 0 || rows.rowCount <= 0 || rows.rowCount > header.height - rows.firstRow
+      || rows.pixels.size() < rows.stride * static_cast<std::size_t>(rows.rowCount - 1) + static_cast<std::size_t>(header.width) * static_cast<std::size_t>(header.channels)
+      || !setUnpackLayout(header.width, header.channels, rows.stride))
+    return false;
+
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, rows.firstRow, header.width, rows.rowCount, pixelFormat(header.channels), GL_UNSIGNED_BYTE, rows.pixels.data());
+
+  resetUnpackLayout();
+  return true;
+}
+
+bool completeTexture(unsigned int texture, const ImageHeader &header, const DecodedImage &image)
+{
+  if (image.data != nullptr || !image.compressed.levels.empty())
+    return uploadTexture(texture, header, image);
+  if (!image.error.empty() || image.width != header.width || image.height != header.height || image.channels != header.channels)
+    return false;
+
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glGenerateMipmap(GL_TEXTURE_2D);
+  return true;
+}
@@ -0,0 +1,268 @@
+#ifndef TEXTURE_LOADER_H
+#define TEXTURE_LOADER_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "block_compress.hpp"
+#include "decode_arena.hpp"
+#include "mip_chain.hpp"
+#include "thread_pool.hpp"
+
+class AsyncReader;
+struct AsyncRead;
+class FileSystem;
+class TextureCache;
+
+
+// releases pixels returned by stb_image, back to the decoding worker's
+// arena when there is one
+struct ImageDeleter
+{
+    std::shared_ptr<DecodeArena> arena;
+
+    void operator()(unsigned char *pixels) const;
+};
+
+// how the texels of an uncompressed image are laid out for GL
+enum class TexelFormat
+{
+    // as decoded: 1 to 4 bytes per texel, GL_RED to GL_RGBA
+    Decoded,
+    // 4 channels swizzled to GL_BGRA, the order many drivers keep 8 bit
+    // textures in: uploads are then copied without converting
+    BGRA,
+    // 3 channels packed to GL_UNSIGNED_SHORT_5_6_5: uploads move two
+    // thirds of the bytes, at less precision. The texture is still GL_RGB,
+    // the driver decides how it stores it
+    RGB565,
+};
+
+// pixels decoded on a worker, waiting to be uploaded by the GL thread
+struct DecodedImage
+{
+    std::string path;
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+    // owned result, stays null when decoding into TextureOptions::destination
+    std::unique_ptr<unsigned char, ImageDeleter> pixels;
+    // first row of the image, in pixels or in the caller's destination.
+    // Null when decoding failed, when the rows were streamed, or when the
+    // image was block compressed
+    unsigned char *data = nullptr;
+    // bytes from one row to the next
+    std::size_t stride = 0;
+    // layout of the texels at data and of the mip levels
+    TexelFormat format = TexelFormat::Decoded;
+    // every mip level when the texels come from a TextureCache or a DDS or
+    // KTX2 file, level 0 at data. Offsets count from data - mips[0].offset,
+    // as KTX2 files store the smaller levels first. Empty otherwise, GL
+    // builds the mipmaps
+    std::vector<MipLevel> mips;
+    // keeps whatever data points into alive when it isn't pixels: a
+    // cache entry's or a texture file's mapping, or the mip chain built
+    // for it
+    std::shared_ptr<const void> texels;
+    // the whole mip chain in blocks, as stored in a DDS or KTX2 file or
+    // for a compressBlocks request that got compressed (BC1 or BC4). No
+    // levels otherwise
+    CompressedImage compressed;
+    // stb_image's failure reason when data is null
+    std::string error;
+};
+
+// a band of rows of a TextureOptions::streamRows request, copied out of
+// the decoder while the rest of the image decodes
+struct DecodedRows
+{
+    // rows [firstRow, firstRow + rowCount) of the image, counted like
+    // DecodedImage's rows
+    int firstRow = 0;
+    int rowCount = 0;
+    // bytes from one row to the next
+    std::size_t stride = 0;
+    std::vector<unsigned char> pixels;
+};
+
+// per-request decode settings, nothing is shared between requests. DDS
+// and KTX2 files load as stored, mip levels included, without decoding:
+// flipVertically, desiredChannels, jpegScaleDenom and premultiplyAlpha
+// don't apply to them (bake them flipped, texbake --flip) and they skip
+// the cache
+struct TextureOptions
+{
+    // first row of the result is the bottom of the image, as GL expects
+    bool flipVertically = false;
+    // follows stbi_load: 0 keeps the file's channel count
+    int desiredChannels = 0;
+    // decode into this caller-owned memory (a texture atlas slot, a mapped
+    // pixel unpack buffer...) instead of allocating. It must stay valid
+    // until the image is handed back. Rows are destinationStride bytes
+    // apart, 0 meaning tightly packed
+    unsigned char *destination = nullptr;
+    std::size_t destinationStride = 0;
+    std::size_t destinationSize = 0;
+    // JPEG only: decode at 1/2, 1/4 or 1/8 of the size for lower quality
+    // tiers, thumbnails or mip tails, much cheaper than a full decode.
+    // Other values, and other formats, load at full size
+    int jpegScaleDenom = 1;
+    // spread the decoding of a single large JPEG over the pool's idle
+    // workers as well, for the big textures that would otherwise keep one
+    // worker busy long after the others are done
+    bool parallelDecode = true;
+    // reject the request without decoding when the decoded pixels would
+    // take more than this many bytes, 0 meaning no limit. Only the header
+    // is read to tell
+    std::size_t maxDecodedBytes = 0;
+    // hand the pixels over in bands of rows as they decode instead of as
+    // one image, so uploads start before the decode is done and the whole
+    // image is never held (JPEG; other formats decode whole and come as a
+    // single band). The DecodedImage that follows carries no pixels.
+    // destination is ignored. A TextureCache hit still comes back whole
+    bool streamRows = false;
+    // compress the image and its mip chain into blocks on the worker
+    // before handing it over, so the texture takes 4 to 8 times less
+    // memory: BC1 for RGB or opaque RGBA, BC4 for a single channel, with
+    // the fast encoders. Other images, and requests that find the pool
+    // falling behind (more than two per worker still queued or decoding),
+    // come back uncompressed. Only ask when blockCompressionSupported().
+    // Ignored with destination or streamRows
+    bool compressBlocks = false;
+    // build the mip chain on the worker, filtered as mipOptions say,
+    // instead of leaving it to glGenerateMipmap: its filtering is up to the
+    // driver, and software GL is slow at it. Ignored with destination or
+    // streamRows
+    bool buildMips = false;
+    MipOptions mipOptions;
+    // multiply colors by alpha on the worker, SIMD, for GL_ONE,
+    // GL_ONE_MINUS_SRC_ALPHA blending: filtering the texture then doesn't
+    // bleed the colors of transparent texels into the edges. buildMips
+    // filters the chain premultiplied, as if mipOptions.premultipliedAlpha
+    // were set. Images with 2 or 4 channels only, streamed bands and
+    // destinations included
+    bool premultiplyAlpha = false;
+    // convert the texels, mip chain included, on the worker before handing
+    // them over. Only applies to images with the channels the format
+    // takes, others and block compressed ones come back as they are: ask
+    // for desiredChannels 4 as well to get gray and RGB files in BGRA.
+    // Ignored with destination or streamRows
+    TexelFormat texelFormat = TexelFormat::Decoded;
+};
+
+// what a request would decode to, read from the file's header alone
+struct ImageHeader
+{
+    int width = 0;
+    int height = 0;
+    // channels of the decoded pixels: TextureOptions::desiredChannels, or
+    // the file's when that is 0
+    int channels = 0;
+    // stb_image's failure reason when the header couldn't be read
+    std::string error;
+
+    // size of the decoded pixels, tightly packed
+    std::size_t bytes() const;
+};
+
+// read the header of an image file as request() with the same options
+// would decode it, to allocate storage or order and budget loads before
+// paying for the decode. Only touches the start of the file. Paths are
+// opened through files like the loader does, as they are without it
+bool probeImage(const std::string &path, const TextureOptions &options, ImageHeader &header, const FileSystem *files = nullptr);
+
+// decodes image files concurrently on a ThreadPool and hands the results
+// back to the thread that owns the GL context
+class TextureLoader
+{
+public:
+    using ReadyCallback = std::function<void(std::size_t, DecodedImage&)>;
+    using RowsCallback = std::function<void(std::size_t, DecodedRows&)>;
+
+    // with a cache, requests that don't decode into a destination are
+    // looked up there first and stored there once decoded. Paths are
+    // opened through files, which must outlive the loader: baked textures
+    // of its pack load as they are. Without it paths are opened as they are.
+    // With a reader completing on pool, loose files are read through it:
+    // the requests made up to the next poll() or finish() go to the disk
+    // in one batch and each decodes as soon as its read completes
+    explicit TextureLoader(ThreadPool &pool, TextureCache *cache = nullptr, const FileSystem *files = nullptr,
+                           AsyncReader *reader = nullptr);
+    // waits for reads and decodes still in flight, their results are
+    // dropped
+    ~TextureLoader();
+
+    TextureLoader(const TextureLoader&) = delete;
+    TextureLoader& operator=(const TextureLoader&) = delete;
+
+    // queue a file for decoding, returns the id handed back to the callback
+    std::size_t request(const std::string &path, const TextureOptions &options = TextureOptions());
+
+    // GL thread: hand every image decoded so far to onReady, without
+    // blocking. Returns the number of requests still being decoded
+    std::size_t poll(const ReadyCallback &onReady);
+    // GL thread: same, also handing the bands of streamRows requests
+    // decoded so far to onRows. A request's bands all come before its image
+    std::size_t poll(const RowsCallback &onRows, const ReadyCallback &onReady);
+    // GL thread: like poll() but blocks until every request was handed over
+    void finish(const ReadyCallback &onReady);
+    void finish(const RowsCallback &onRows, const ReadyCallback &onReady);
+
+private:
+    struct RowSink;
+
+    // the file's bytes come from read, opened through files without it
+    void decode(std::size_t id, const std::string &path, const TextureOptions &options, AsyncRead *read);
+    // stb_image's rows_ready, queues a copy of the band for the GL thread
+    static void rowsReady(void *user, const unsigned char *pixels, std::size_t stride, int firstRow, int rowCount);
+
+    ThreadPool &pool;
+    TextureCache *cache;
+    const FileSystem *files;
+    AsyncReader *reader;
+    std::size_t nextId;
+    std::size_t inFlight;
+    std::deque<std::pair<std::size_t, DecodedImage>> ready;
+    std::deque<std::pair<std::size_t, DecodedRows>> rows;
+    std::mutex mutex;
+    std::condition_variable decoded;
+};
+
+// GL thread: whether the context takes the blocks of compressBlocks
+// requests. BC4 is core, BC1 needs S3TC
+bool blockCompressionSupported();
+
+// GL thread: create a 2D texture from a decoded image and build its mipmaps,
+// or upload them when the image carries them or is block compressed, one
+// call per level and no more levels than it carries.
+// Returns 0 when the image failed to decode or its row pitch can't be
+// expressed with GL_UNPACK_ROW_LENGTH/GL_UNPACK_ALIGNMENT
+unsigned int createTexture(const DecodedImage &image);
+
+// GL thread: create a 2D texture with storage for the whole mip chain of
+// an image with this header, so the allocation happens while the image is
+// still decoding. Returns 0 for an empty header
+unsigned int allocateTexture(const ImageHeader &header);
+// GL thread: fill a texture from allocateTexture with the decoded image
+// and build its mipmaps, or upload them when the image carries them. A
+// block compressed image replaces the texture's levels instead. False when
+// the image failed to decode, doesn't match the texture's header, or has a
+// row pitch GL can't express
+bool uploadTexture(unsigned int texture, const ImageHeader &header, const DecodedImage &image);
+// GL thread: copy a band of a streamRows request into a texture from
+// allocateTexture. False when the band doesn't fit the texture's header
+bool uploadRows(unsigned int texture, const ImageHeader &header, const DecodedRows &rows);
+// GL thread: build the mipmaps of a texture filled by uploadRows once the
+// request's image came back, or upload the whole image when it wasn't
+// streamed after all (a cache hit). False when the decode failed or
+// doesn't match the texture's header
+bool completeTexture(unsigned int texture, const ImageHeader &header, const DecodedImage &image);
+
+#endif
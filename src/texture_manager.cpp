@@ -0,0 +1,261 @@
+#include "texture_manager.hpp"
+
+#include <glad/glad.h>
+
+#include <iterator>
+#include <mutex>
+#include <utility>
+
+#include "content_hash.hpp"
+#include "file_system.hpp"
+#include "mip_chain.hpp"
+#include "texture_cache.hpp"
+
+// one GL texture, shared by every request for the same image
+struct TextureHandle::Texture
+{
+    unsigned int name = 0;
+    bool loading = true;
+    std::string error;
+    // texels with mipmaps, counted in TextureManagerStats::bytes
+    std::size_t bytes = 0;
+};
+
+// one path asked for with some options
+struct TextureHandle::Request
+{
+    std::string path;
+    TextureOptions options;
+    // the texture it got, none when the file wasn't found
+    std::shared_ptr<Texture> texture;
+    // when the file wasn't found
+    std::string error;
+};
+
+// textures that lost their last handle, for the GL thread to delete
+struct TextureManager::Released
+{
+    std::mutex mutex;
+    // name and bytes of each
+    std::vector<std::pair<unsigned int, std::size_t>> textures;
+    // once the manager deleted every texture itself
+    bool closed = false;
+};
+
+namespace
+{
+  // what sets two requests' textures apart besides the options the cache
+  // keys on: the upload format, block compression, streaming, the memory
+  // decoded into, and the decode budget, which decides whether there is a
+  // texture at all
+  std::uint64_t uploadKey(const TextureOptions &options)
+  {
+    auto shape = static_cast<std::uint64_t>(options.texelFormat) | static_cast<std::uint64_t>(options.compressBlocks) << 2
+      | static_cast<std::uint64_t>(options.streamRows) << 3;
+    std::uint64_t key = hashMix(shape + 1) ^ static_cast<std::uint64_t>(options.maxDecodedBytes);
+    key = hashMix(key) ^ reinterpret_cast<std::uintptr_t>(options.destination);
+    key = hashMix(key) ^ static_cast<std::uint64_t>(options.destinationStride);
+    return hashMix(hashMix(key) ^ static_cast<std::uint64_t>(options.destinationSize));
+  }
+}
+
+double TextureManagerStats::hitRate() const
+{
+  return requests == 0 ? 0.0 : static_cast<double>(pathHits + contentHits) / static_cast<double>(requests);
+}
+
+unsigned int TextureHandle::texture() const
+{
+  return request && request->texture ? request->texture->name : 0;
+}
+
+bool TextureHandle::loading() const
+{
+  if (!request || !request->error.empty())
+    return false;
+  return !request->texture || request->texture->loading;
+}
+
+const std::string& TextureHandle::error() const
+{
+  static const std::string none;
+  if (!request)
+    return none;
+  return request->texture ? request->texture->error : request->error;
+}
+
+const std::string& TextureHandle::path() const
+{
+  static const std::string none;
+  return request ? request->path : none;
+}
+
+TextureManager::TextureManager(ThreadPool &pool, TextureCache *cache, const FileSystem *fileSystem, AsyncReader *reader)
+  : files(fileSystem), loader(pool, cache, fileSystem, reader), released(std::make_shared<Released>())
+{
+}
+
+TextureManager::~TextureManager()
+{
+  collect();
+  {
+    std::lock_guard<std::mutex> lock(released->mutex);
+    released->closed = true;
+  }
+  for (auto &entry : contents)
+    {
+      auto texture = entry.second.lock();
+      if (texture && texture->name != 0)
+        {
+          glDeleteTextures(1, &texture->name);
+          texture->name = 0;
+        }
+    }
+}
+
+TextureHandle TextureManager::request(const std::string &path, const TextureOptions &options)
+{
+  ++counters.requests;
+  TextureHandle handle;
+  // the options that shape the texture, with no bytes
+  std::uint64_t shape = hashMix(TextureCache::key(nullptr, 0, options) ^ uploadKey(options));
+  std::string pathKey = path + '\n' + std::to_string(shape);
+  auto known = paths.find(pathKey);
+  if (known != paths.end() && (handle.request = known->second.lock()))
+    {
+      ++counters.pathHits;
+      return handle;
+    }
+
+  handle.request = std::make_shared<Request>();
+  handle.request->path = path;
+  handle.request->options = options;
+  paths[pathKey] = handle.request;
+  // files are told apart by what the file system knows of them without
+  // reading: the loader reads each once, with the rest of its batch
+  static const FileSystem loose;
+  std::uint64_t identity;
+  if ((files != nullptr ? *files : loose).identify(path, identity, handle.request->error))
+    resolve(*handle.request, hashMix(identity ^ shape));
+  return handle;
+}
+
+std::size_t TextureManager::poll()
+{
+  loader.poll([this](std::size_t id, DecodedRows &rows) { rowsDecoded(id, rows); },
+              [this](std::size_t id, DecodedImage &image) { imageDecoded(id, image); });
+  collect();
+  return loading.size();
+}
+
+void TextureManager::finish()
+{
+  loader.finish([this](std::size_t id, DecodedRows &rows) { rowsDecoded(id, rows); },
+                [this](std::size_t id, DecodedImage &image) { imageDecoded(id, image); });
+  collect();
+}
+
+TextureManagerStats TextureManager::stats() const
+{
+  return counters;
+}
+
+// a texture for a request of the file and options key stands for: one
+// already there when there is, a new one loading otherwise
+void TextureManager::resolve(Request &request, std::uint64_t key)
+{
+  auto known = contents.find(key);
+  if (known != contents.end() && (request.texture = known->second.lock()))
+    {
+      ++counters.contentHits;
+      return;
+    }
+
+  std::shared_ptr<Released> graveyard = released;
+  request.texture.reset(new Texture, [graveyard](Texture *texture)
+    {
+      {
+        std::lock_guard<std::mutex> lock(graveyard->mutex);
+        if (!graveyard->closed && texture->name != 0)
+          graveyard->textures.emplace_back(texture->name, texture->bytes);
+      }
+      delete texture;
+    });
+  contents[key] = request.texture;
+
+  Loading load;
+  load.texture = request.texture;
+  if (request.options.streamRows)
+    {
+      // the bands upload into storage allocated while they decode
+      if (!probeImage(request.path, request.options, load.header, files))
+        {
+          request.texture->loading = false;
+          request.texture->error = load.header.error;
+          return;
+        }
+      request.texture->name = allocateTexture(load.header);
+    }
+  ++counters.loads;
+  loading[loader.request(request.path, request.options)] = std::move(load);
+}
+
+void TextureManager::rowsDecoded(std::size_t id, DecodedRows &rows)
+{
+  auto found = loading.find(id);
+  if (found != loading.end() && found->second.texture->name != 0)
+    uploadRows(found->second.texture->name, found->second.header, rows);
+}
+
+void TextureManager::imageDecoded(std::size_t id, DecodedImage &image)
+{
+  auto found = loading.find(id);
+  if (found == loading.end())
+    return;
+  Loading load = std::move(found->second);
+  loading.erase(found);
+  Texture &texture = *load.texture;
+  texture.loading = false;
+  if (texture.name == 0)
+    {
+      texture.name = createTexture(image);
+    }
+  else if (!completeTexture(texture.name, load.header, image))
+    {
+      glDeleteTextures(1, &texture.name);
+      texture.name = 0;
+    }
+  if (texture.name == 0)
+    {
+      texture.error = image.error.empty() ? "can't upload " + image.path : image.error;
+      return;
+    }
+  // in the format uploaded: 565 packs a texel in 2 bytes
+  int texelBytes = image.format == TexelFormat::RGB565 ? 2 : image.channels;
+  texture.bytes = image.compressed.levels.empty() ? mipChainBytes(mipChainLayout(image.width, image.height, texelBytes))
+    : mipChainBytes(image.compressed.levels);
+  ++counters.textures;
+  counters.bytes += texture.bytes;
+}
+
+// delete the textures that lost their last handle, and forget them
+void TextureManager::collect()
+{
+  std::vector<std::pair<unsigned int, std::size_t>> textures;
+  {
+    std::lock_guard<std::mutex> lock(released->mutex);
+    textures.swap(released->textures);
+  }
+  if (textures.empty())
+    return;
+  for (auto &texture : textures)
+    {
+      glDeleteTextures(1, &texture.first);
+      --counters.textures;
+      counters.bytes -= texture.second;
+    }
+  for (auto entry = contents.begin(); entry != contents.end();)
+    entry = entry->second.expired() ? contents.erase(entry) : std::next(entry);
+  for (auto entry = paths.begin(); entry != paths.end();)
+    entry = entry->second.expired() ? paths.erase(entry) : std::next(entry);
+}
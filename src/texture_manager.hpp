@@ -0,0 +1,119 @@
+#ifndef TEXTURE_MANAGER_H
+#define TEXTURE_MANAGER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "texture_loader.hpp"
+
+class AsyncReader;
+class FileSystem;
+class TextureCache;
+class ThreadPool;
+
+
+// counters of a TextureManager since it was created
+struct TextureManagerStats
+{
+    std::size_t requests = 0;
+    // requests served by a texture already loaded or loading: one asked
+    // for by the same path with the same options, or one of the same file
+    // or pack contents with the same options under another path
+    std::size_t pathHits = 0;
+    std::size_t contentHits = 0;
+    // decodes started
+    std::size_t loads = 0;
+    // textures alive now, and the bytes of their texels with mipmaps
+    std::size_t textures = 0;
+    std::size_t bytes = 0;
+
+    // share of the requests that cost no decode and no memory
+    double hitRate() const;
+};
+
+// shared reference to a texture of a TextureManager, cheap to copy. The
+// texture lives as long as a handle to it does. GL thread only
+class TextureHandle
+{
+public:
+    // the GL texture, 0 while loading or when loading failed
+    unsigned int texture() const;
+    bool loading() const;
+    // why loading failed, empty otherwise
+    const std::string& error() const;
+    const std::string& path() const;
+
+    explicit operator bool() const { return request != nullptr; }
+
+private:
+    friend class TextureManager;
+    struct Texture;
+    struct Request;
+
+    std::shared_ptr<Request> request;
+};
+
+// loads every texture once: requests for a texture already loaded or on
+// its way get a handle to it instead of a decode and an upload of their
+// own. Requests are matched on the spot, without reading the file: by
+// path and options, then by what the FileSystem identifies the file by,
+// the pack entry's source key or the loose file's location, size and
+// modification time. Textures nothing refers to anymore are deleted on
+// the next poll().
+//
+// request() and poll() are for the GL thread.
+class TextureManager
+{
+public:
+    // decodes on pool, through a TextureLoader with the cache, files and
+    // reader given, which must all outlive the manager
+    explicit TextureManager(ThreadPool &pool, TextureCache *cache = nullptr, const FileSystem *files = nullptr, AsyncReader *reader = nullptr);
+    // deletes every texture, handles still held then refer to none
+    ~TextureManager();
+
+    TextureManager(const TextureManager&) = delete;
+    TextureManager& operator=(const TextureManager&) = delete;
+
+    // handle to the texture of path loaded with options, loading it when
+    // it isn't yet
+    TextureHandle request(const std::string &path, const TextureOptions &options = TextureOptions());
+
+    // upload what decoded so far and delete the textures that lost their
+    // last handle, without blocking. Returns the number of textures still
+    // loading
+    std::size_t poll();
+    // like poll() but blocks until every texture requested is loaded
+    void finish();
+
+    TextureManagerStats stats() const;
+
+private:
+    using Texture = TextureHandle::Texture;
+    using Request = TextureHandle::Request;
+    struct Released;
+    // a texture being decoded, by loader request
+    struct Loading
+    {
+        std::shared_ptr<Texture> texture;
+        ImageHeader header;
+    };
+
+    void resolve(Request &request, std::uint64_t key);
+    void rowsDecoded(std::size_t id, DecodedRows &rows);
+    void imageDecoded(std::size_t id, DecodedImage &image);
+    void collect();
+
+    const FileSystem *files;
+    TextureLoader loader;
+    std::shared_ptr<Released> released;
+    std::unordered_map<std::string, std::weak_ptr<Request>> paths;
+    std::unordered_map<std::uint64_t, std::weak_ptr<Texture>> contents;
+    std::unordered_map<std::size_t, Loading> loading;
+    TextureManagerStats counters;
+};
+
+#endif
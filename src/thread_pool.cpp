@@ -0,0 +1,112 @@
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <utility>
+
+namespace
+{
+  // indices of one parallelFor, shared with helpers that may only get to
+  // run after it returned
+  struct ParallelJob
+  {
+    const std::function<void(std::size_t)> *body;
+    std::size_t count;
+    std::atomic<std::size_t> next;
+    std::size_t done;
+    std::mutex mutex;
+    std::condition_variable finished;
+
+    ParallelJob(const std::function<void(std::size_t)> &jobBody, std::size_t jobCount)
+      : body(&jobBody), count(jobCount), next(0), done(0)
+    {
+    }
+
+    void run()
+    {
+      std::size_t ran = 0;
+      // body is only touched while an index is left, i.e. while the
+      // caller still waits
+      for (std::size_t i; (i = next++) < count; ++ran)
+        (*body)(i);
+      if (ran == 0)
+        return;
+      std::lock_guard<std::mutex> lock(mutex);
+      done += ran;
+      if (done == count)
+        finished.notify_all();
+    }
+  };
+}
+
+ThreadPool::ThreadPool(std::size_t threadCount)
+  : stopping(false)
+{
+  if (threadCount == 0)
+    threadCount = std::thread::hardware_concurrency();
+  // hardware_concurrency() is allowed to return 0 when it can't tell
+  if (threadCount == 0)
+    threadCount = 1;
+
+  workers.reserve(threadCount);
+  for (std::size_t i = 0; i < threadCount; ++i)
+    workers.emplace_back([this] { workerLoop(); });
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wakeUp.notify_all();
+  // workers drain the queue before leaving, so every queued task still runs
+  for (auto &worker : workers)
+    worker.join();
+}
+
+void ThreadPool::enqueue(std::function<void()> task)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    tasks.push(std::move(task));
+  }
+  wakeUp.notify_one();
+}
+
+void ThreadPool::parallelFor(std::size_t count, const std::function<void(std::size_t)> &body)
+{
+  if (count == 0)
+    return;
+  auto job = std::make_shared<ParallelJob>(body, count);
+  std::size_t helpers = std::min(workers.size(), count - 1);
+  for (std::size_t i = 0; i < helpers; ++i)
+    enqueue([job] { job->run(); });
+  job->run();
+
+  std::unique_lock<std::mutex> lock(job->mutex);
+  job->finished.wait(lock, [&job] { return job->done == job->count; });
+}
+
+std::size_t ThreadPool::size() const
+{
+  return workers.size();
+}
+
+void ThreadPool::workerLoop()
+{
+  for (;;)
+    {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wakeUp.wait(lock, [this] { return stopping || !tasks.empty(); });
+        if (tasks.empty())
+          return;
+        task = std::move(tasks.front());
+        tasks.pop();
+      }
+      task();
+    }
+}
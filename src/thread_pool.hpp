@@ -0,0 +1,44 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+
+// fixed set of worker threads pulling tasks from a shared queue
+class ThreadPool
+{
+public:
+    // threadCount == 0 means one worker per hardware thread
+    explicit ThreadPool(std::size_t threadCount = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // queue a task, it will run on one of the workers
+    void enqueue(std::function<void()> task);
+    // run body(i) for every i in [0, count) on the calling thread and on
+    // idle workers, returning once all of them are done. Safe to call from
+    // a task: the caller never waits for a worker that hasn't picked any
+    // index up, it takes the remaining ones itself
+    void parallelFor(std::size_t count, const std::function<void(std::size_t)> &body);
+    // number of worker threads
+    std::size_t size() const;
+
+private:
+    void workerLoop();
+
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable wakeUp;
+    bool stopping;
+};
+
+#endif
@@ -0,0 +1,126 @@
+// arenabench: heap allocations of decodes recycled through DecodeArenas.
+//
+//   arenabench [-r rounds] [-j threads] [-c cache MiB] [image...]
+//
+// Decodes the images (data/container.jpg, data/wall.jpg and
+// data/awesomeface.png by default) threads times each per round, on the
+// calling thread and a pool of that many workers, each through its
+// DecodeArena::forThisThread() as the texture loader does. Prints what
+// DecodeArena::totalStats() moved by in each round. Which thread decodes
+// which image changes from round to round; a thread new to an image
+// borrows the blocks another one cached for it. So later rounds only take
+// from the heap when more decodes of one size run at once than did
+// before, or when the cache limit (-c) is too low to keep what a decode
+// needs, and the last rounds take nothing.
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <stb_image.h>
+
+#include "decode_arena.hpp"
+#include "mapped_file.hpp"
+#include "thread_pool.hpp"
+
+namespace
+{
+  struct Settings
+  {
+    int rounds = 10;
+    std::size_t threads = 4;
+    std::size_t cacheBytes = DecodeArena::defaultMaxCachedBytes;
+    std::vector<std::string> images;
+  };
+
+  bool parseArguments(int argc, char **argv, Settings &settings)
+  {
+    for (int i = 1; i < argc; ++i)
+      {
+        std::string argument = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (argument == "-r" && hasValue)
+          settings.rounds = std::max(std::atoi(argv[++i]), 2);
+        else if (argument == "-j" && hasValue)
+          settings.threads = static_cast<std::size_t>(std::max(std::atoi(argv[++i]), 1));
+        else if (argument == "-c" && hasValue)
+          settings.cacheBytes = static_cast<std::size_t>(std::max(std::atoi(argv[++i]), 0)) << 20;
+        else if (!argument.empty() && argument[0] != '-')
+          settings.images.push_back(argument);
+        else
+          return false;
+      }
+    if (settings.images.empty())
+      settings.images = {"data/container.jpg", "data/wall.jpg", "data/awesomeface.png"};
+    return true;
+  }
+
+  void report(int round, const DecodeArenaStats &stats, const DecodeArenaStats &before)
+  {
+    std::cout << "round " << round << ": " << stats.heapAllocations - before.heapAllocations << " heap allocations ("
+              << static_cast<double>(stats.heapBytes - before.heapBytes) / 1048576.0 << " MiB), "
+              << stats.reusedBlocks - before.reusedBlocks << " blocks reused (" << stats.borrowedBlocks - before.borrowedBlocks
+              << " from another thread), " << stats.liveBlocks << " live, "
+              << static_cast<double>(stats.cachedBytes) / 1048576.0 << " MiB cached" << std::endl;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  Settings settings;
+  if (!parseArguments(argc, argv, settings))
+    {
+      std::cout << "usage: arenabench [-r rounds] [-j threads] [-c cache MiB] [image...]" << std::endl;
+      return 2;
+    }
+
+  std::vector<MappedFile> files(settings.images.size());
+  for (std::size_t i = 0; i < files.size(); ++i)
+    if (!files[i].open(settings.images[i]))
+      {
+        std::cout << files[i].error() << std::endl;
+        return 1;
+      }
+
+  DecodeArena::setThreadCacheLimit(settings.cacheBytes);
+  ThreadPool pool(settings.threads);
+  auto round = [&]
+    {
+      pool.parallelFor(files.size() * settings.threads, [&](std::size_t index)
+        {
+          const MappedFile &file = files[index % files.size()];
+          auto arena = DecodeArena::forThisThread();
+          stbi_load_options options;
+          stbi_load_options_init(&options);
+          options.allocator = arena->allocator();
+          int width, height, channels;
+          stbi_uc *image = stbi_load_from_memory_with_options(file.data(), static_cast<int>(file.size()), &width, &height, &channels, &options);
+          if (image == nullptr)
+            {
+              std::cout << settings.images[index % files.size()] << ": " << options.failure_reason << std::endl;
+              std::exit(1);
+            }
+          stbi_image_free_with_options(image, &options);
+        });
+    };
+
+  std::cout << files.size() << " images, " << settings.threads << " threads, " << settings.cacheBytes / 1048576 << " MiB cached at most per thread"
+            << std::endl;
+  DecodeArenaStats before;
+  double best = 0.0;
+  for (int run = 0; run < settings.rounds; ++run)
+    {
+      auto begin = std::chrono::steady_clock::now();
+      round();
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+      if (run > 0)
+        best = run == 1 ? elapsed.count() : std::min(best, elapsed.count());
+      DecodeArenaStats after = DecodeArena::totalStats();
+      report(run + 1, after, before);
+      before = after;
+    }
+  std::cout << "best later round: " << best * 1000.0 << " ms" << std::endl;
+  return 0;
+}
@@ -0,0 +1,350 @@
+// assetbake: bakes the images listed in a manifest into a single asset
+// pack the application maps at startup, each one as a KTX2 texture with
+// its mip chain, ready to upload.
+//
+//   assetbake [-o pack] [-p prefix] [-j threads] [--force] manifest
+//
+// Every manifest line names an image, relative to the manifest, and how
+// to bake it:
+//
+//   container.jpg    flip compress=bc1
+//   awesomeface.png  flip srgb cutoff=0.5 premultiply
+//
+//   flip             first row at the bottom, as GL expects
+//   channels=1..4    convert to that many channels
+//   premultiply      colors times alpha, mips filtered premultiplied
+//   filter=box|kaiser, srgb, cutoff=alpha
+//                    mip filtering, see MipOptions
+//   nomips           level 0 alone
+//   compress=bc1|bc3|bc4|bc7
+//                    block compress every level, best quality
+//
+// Entries are named prefix + the image's path in the manifest. Images
+// whose bytes and settings didn't change since the pack was last written
+// are copied over from it instead of being baked again.
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <stb_image.h>
+
+#include "asset_pack.hpp"
+#include "block_compress.hpp"
+#include "content_hash.hpp"
+#include "mapped_file.hpp"
+#include "mip_chain.hpp"
+#include "pixel_convert.hpp"
+#include "texture_container.hpp"
+#include "thread_pool.hpp"
+
+namespace
+{
+  // bump when baking changes for the same settings, every entry is then
+  // baked again
+  const std::uint64_t bakeVersion = 1;
+
+  struct Settings
+  {
+    std::string pack = "assets.pack";
+    std::string prefix;
+    std::size_t threads = 0;
+    bool force = false;
+    std::string manifest;
+  };
+
+  // one manifest line
+  struct Asset
+  {
+    std::string source;
+    std::string name;
+    // the settings as written, part of the entry's key
+    std::string settings;
+    bool flip = false;
+    int channels = 0;
+    bool mips = true;
+    MipOptions mipOptions;
+    bool compress = false;
+    BlockFormat format = BlockFormat::BC1;
+  };
+
+  // what happened to an asset, printed once all are done
+  struct Outcome
+  {
+    PackEntry entry;
+    bool baked = false;
+    double seconds = 0.0;
+    std::string error;
+  };
+
+  bool parseArguments(int argc, char **argv, Settings &settings)
+  {
+    for (int i = 1; i < argc; ++i)
+      {
+        std::string argument = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (argument == "-o" && hasValue)
+          {
+            settings.pack = argv[++i];
+          }
+        else if (argument == "-p" && hasValue)
+          {
+            settings.prefix = argv[++i];
+          }
+        else if (argument == "-j" && hasValue)
+          {
+            settings.threads = static_cast<std::size_t>(std::max(std::atoi(argv[++i]), 1));
+          }
+        else if (argument == "--force")
+          {
+            settings.force = true;
+          }
+        else if (!argument.empty() && argument[0] == '-')
+          {
+            return false;
+          }
+        else if (settings.manifest.empty())
+          {
+            settings.manifest = argument;
+          }
+        else
+          {
+            return false;
+          }
+      }
+    return !settings.manifest.empty();
+  }
+
+  bool parseSetting(const std::string &setting, Asset &asset)
+  {
+    std::size_t equals = setting.find('=');
+    std::string key = setting.substr(0, equals);
+    std::string value = equals == std::string::npos ? std::string() : setting.substr(equals + 1);
+    if (setting == "flip")
+      asset.flip = true;
+    else if (setting == "nomips")
+      asset.mips = false;
+    else if (setting == "srgb")
+      asset.mipOptions.srgb = true;
+    else if (setting == "premultiply")
+      asset.mipOptions.premultipliedAlpha = true;
+    else if (key == "channels" && value.size() == 1 && value[0] >= '1' && value[0] <= '4')
+      asset.channels = value[0] - '0';
+    else if (key == "filter" && (value == "box" || value == "kaiser"))
+      asset.mipOptions.filter = value == "box" ? MipFilter::Box : MipFilter::Kaiser;
+    else if (key == "cutoff" && !value.empty())
+      asset.mipOptions.alphaCutoff = std::min(std::max(static_cast<float>(std::atof(value.c_str())), 0.0f), 1.0f);
+    else if (key == "compress" && value == "bc1")
+      asset.format = BlockFormat::BC1;
+    else if (key == "compress" && value == "bc3")
+      asset.format = BlockFormat::BC3;
+    else if (key == "compress" && value == "bc4")
+      asset.format = BlockFormat::BC4;
+    else if (key == "compress" && value == "bc7")
+      asset.format = BlockFormat::BC7;
+    else
+      return false;
+    asset.compress = asset.compress || key == "compress";
+    return true;
+  }
+
+  bool readManifest(const Settings &settings, std::vector<Asset> &assets)
+  {
+    std::ifstream manifest(settings.manifest);
+    if (!manifest)
+      {
+        std::cout << "can't open " << settings.manifest << std::endl;
+        return false;
+      }
+    std::size_t slash = settings.manifest.find_last_of("/\\");
+    std::string directory = slash == std::string::npos ? std::string() : settings.manifest.substr(0, slash + 1);
+
+    std::string line;
+    for (int number = 1; std::getline(manifest, line); ++number)
+      {
+        line = line.substr(0, line.find('#'));
+        std::istringstream words(line);
+        Asset asset;
+        std::string path;
+        if (!(words >> path))
+          continue;
+        asset.source = directory + path;
+        asset.name = settings.prefix + path;
+        for (std::string setting; words >> setting;)
+          {
+            if (!parseSetting(setting, asset))
+              {
+                std::cout << settings.manifest << ":" << number << ": unknown setting " << setting << std::endl;
+                return false;
+              }
+            asset.settings += setting + " ";
+          }
+        assets.push_back(asset);
+      }
+    return true;
+  }
+
+  // decode, convert and filter an image, then compress it if asked: a
+  // KTX2 file the loader uploads as it is
+  bool bake(const Asset &asset, const MappedFile &file, ThreadPool *pool, std::vector<unsigned char> &texture, std::string &error)
+  {
+    if (file.size() > static_cast<std::size_t>(std::numeric_limits<int>::max()))
+      {
+        error = "file too large";
+        return false;
+      }
+    stbi_load_options options;
+    stbi_load_options_init(&options);
+    options.flip_vertically = asset.flip;
+    options.desired_channels = asset.channels;
+    int width;
+    int height;
+    int channels;
+    unsigned char *pixels = stbi_load_from_memory_with_options(file.data(), static_cast<int>(file.size()), &width, &height, &channels, &options);
+    if (pixels == nullptr)
+      {
+        error = options.failure_reason ? options.failure_reason : "unknown image type";
+        return false;
+      }
+    if (asset.channels != 0)
+      channels = asset.channels;
+
+    TextureContainer container;
+    container.width = width;
+    container.height = height;
+    container.channels = channels;
+    container.levels = mipChainLayout(width, height, channels);
+    if (!asset.mips)
+      container.levels.resize(1);
+    std::vector<unsigned char> chain(mipChainBytes(container.levels));
+    if (asset.mipOptions.premultipliedAlpha)
+      premultiplyAlpha(pixels, chain.data(), channels, container.levels[0].bytes / static_cast<std::size_t>(channels));
+    else
+      std::memcpy(chain.data(), pixels, container.levels[0].bytes);
+    stbi_image_free_with_options(pixels, &options);
+    buildMipChain(chain.data(), container.levels, channels, asset.mipOptions, pool);
+
+    if (!asset.compress)
+      {
+        texture = ktx2File(container, chain.data());
+        return true;
+      }
+    CompressedImage image = compressMipChain(asset.format, chain.data(), container.levels, channels, pool);
+    TextureContainer compressed;
+    compressed.width = width;
+    compressed.height = height;
+    compressed.channels = asset.format == BlockFormat::BC1 ? 3 : asset.format == BlockFormat::BC4 ? 1 : 4;
+    compressed.compressed = true;
+    compressed.format = asset.format;
+    compressed.levels = image.levels;
+    texture = ktx2File(compressed, image.blocks);
+    return true;
+  }
+
+  // the up to date entry of asset, from the previous pack when it holds one
+  Outcome process(const Asset &asset, const AssetPack &previous, bool force, ThreadPool *pool)
+  {
+    Outcome outcome;
+    outcome.entry.name = asset.name;
+    MappedFile file;
+    if (!file.open(asset.source))
+      {
+        outcome.error = file.error();
+        return outcome;
+      }
+    std::uint64_t settingsKey = hashBytes(reinterpret_cast<const unsigned char *>(asset.settings.data()), asset.settings.size(), bakeVersion);
+    outcome.entry.sourceKey = hashBytes(file.data(), file.size(), settingsKey);
+
+    AssetPack::Entry baked;
+    if (!force && previous.find(asset.name, baked) && baked.sourceKey == outcome.entry.sourceKey)
+      {
+        outcome.entry.data.assign(baked.data, baked.data + baked.size);
+        return outcome;
+      }
+
+    auto start = std::chrono::steady_clock::now();
+    outcome.baked = bake(asset, file, pool, outcome.entry.data, outcome.error);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    outcome.seconds = elapsed.count();
+    return outcome;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  Settings settings;
+  if (!parseArguments(argc, argv, settings))
+    {
+      std::cout << "usage: assetbake [-o pack] [-p prefix] [-j threads] [--force] manifest" << std::endl;
+      return 2;
+    }
+  std::vector<Asset> assets;
+  if (!readManifest(settings, assets))
+    return 1;
+
+  // a missing or outdated pack just means baking everything
+  AssetPack previous;
+  previous.open(settings.pack);
+
+  // assets side by side, each spreading its mips and blocks over the
+  // pool as well
+  std::unique_ptr<ThreadPool> pool;
+  if (settings.threads != 1)
+    pool.reset(new ThreadPool(settings.threads == 0 ? 0 : settings.threads - 1));
+  std::vector<Outcome> outcomes(assets.size());
+  auto processAsset = [&](std::size_t i)
+    {
+      outcomes[i] = process(assets[i], previous, settings.force, pool.get());
+    };
+  if (pool)
+    pool->parallelFor(assets.size(), processAsset);
+  else
+    for (std::size_t i = 0; i < assets.size(); ++i)
+      processAsset(i);
+
+  bool failed = false;
+  std::size_t baked = 0;
+  std::vector<PackEntry> entries;
+  for (std::size_t i = 0; i < outcomes.size(); ++i)
+    {
+      Outcome &outcome = outcomes[i];
+      if (!outcome.error.empty())
+        {
+          std::cout << assets[i].source << ": " << outcome.error << std::endl;
+          failed = true;
+          continue;
+        }
+      if (outcome.baked)
+        {
+          ++baked;
+          std::cout << assets[i].source << " -> " << outcome.entry.name << ", " << outcome.entry.data.size() / 1024 << " KiB in "
+                    << static_cast<int>(outcome.seconds * 1000.0) << " ms" << std::endl;
+        }
+      entries.push_back(std::move(outcome.entry));
+    }
+  if (failed)
+    return 1;
+
+  if (baked == 0 && previous.isOpen() && previous.size() == entries.size())
+    {
+      std::cout << settings.pack << " is up to date" << std::endl;
+      return 0;
+    }
+  previous.close();
+  std::string error;
+  if (!writeAssetPack(settings.pack, entries, error))
+    {
+      std::cout << error << std::endl;
+      return 1;
+    }
+  std::cout << settings.pack << ": " << entries.size() << " assets, " << baked << " baked, " << entries.size() - baked << " up to date"
+            << std::endl;
+  return 0;
+}
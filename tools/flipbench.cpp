@@ -0,0 +1,297 @@
+// flipbench: what a flipped load costs over a plain one, with stb_image's
+// decoders writing rows bottom-up and with stb_image v2.19's flip pass
+// after decoding (libs/stb_image_reference).
+//
+//   flipbench [-s size] [-r runs] [image...]
+//
+// Writes a size x size RGBA drawing (4096 x 4096 by default) as a PNG, a
+// bottom-up BMP and a bottom-up TGA, and a size x size photo-like image as
+// a 4:2:0 baseline JPEG, and adds the images given (data/container.jpg and
+// data/wall.jpg by default). Each is loaded flipped and not by both
+// decoders; the flipped image must be the plain one with its rows
+// reversed. Prints the best of runs loads of each
+// kind and what flipping adds to each decoder's time: the difference is
+// what a flipped texture load saves now.
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <stb_image.h>
+#include <stb_image_reference.h>
+
+#include "jpeg_writer.hpp"
+
+namespace
+{
+  struct Settings
+  {
+    int size = 4096;
+    int runs = 5;
+    std::vector<std::string> images;
+  };
+
+  bool parseArguments(int argc, char **argv, Settings &settings)
+  {
+    for (int i = 1; i < argc; ++i)
+      {
+        std::string argument = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (argument == "-s" && hasValue)
+          settings.size = std::max(std::atoi(argv[++i]), 1);
+        else if (argument == "-r" && hasValue)
+          settings.runs = std::max(std::atoi(argv[++i]), 1);
+        else if (!argument.empty() && argument[0] != '-')
+          settings.images.push_back(argument);
+        else
+          return false;
+      }
+    if (settings.images.empty())
+      settings.images = {"data/container.jpg", "data/wall.jpg"};
+    return true;
+  }
+
+  // best time of body over runs, in seconds
+  double bestTime(int runs, const std::function<void()> &body)
+  {
+    double best = 0.0;
+    for (int run = 0; run < runs; ++run)
+      {
+        auto start = std::chrono::steady_clock::now();
+        body();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = run == 0 ? elapsed.count() : std::min(best, elapsed.count());
+      }
+    return best;
+  }
+
+  bool readFile(const std::string &path, std::vector<unsigned char> &bytes)
+  {
+    std::FILE *file = std::fopen(path.c_str(), "rb");
+    if (file == nullptr)
+      return false;
+    unsigned char buffer[65536];
+    std::size_t read;
+    while ((read = std::fread(buffer, 1, sizeof(buffer), file)) != 0)
+      bytes.insert(bytes.end(), buffer, buffer + read);
+    return std::fclose(file) == 0;
+  }
+
+  // shapes and gradients like a UI texture, top row first
+  std::vector<unsigned char> drawing(int size)
+  {
+    auto stride = static_cast<std::size_t>(size) * 4;
+    std::vector<unsigned char> pixels(stride * static_cast<std::size_t>(size));
+    for (int y = 0; y < size; ++y)
+      for (int x = 0; x < size; ++x)
+        {
+          unsigned char *texel = pixels.data() + stride * static_cast<std::size_t>(y) + 4 * static_cast<std::size_t>(x);
+          int dx = x - size / 2, dy = y - size / 2;
+          bool inside = static_cast<long>(dx) * dx + static_cast<long>(dy) * dy < static_cast<long>(size) * size / 9;
+          texel[0] = static_cast<unsigned char>(inside ? 240 : x * 255 / size);
+          texel[1] = static_cast<unsigned char>(inside ? 200 : y * 255 / size);
+          texel[2] = static_cast<unsigned char>((x / 64 + y / 64) % 2 != 0 ? 40 : 90);
+          texel[3] = static_cast<unsigned char>(inside ? 255 : std::abs(dx) / 8 % 3 == 0 ? 128 : 0);
+        }
+    return pixels;
+  }
+
+  void putLittle(std::vector<unsigned char> &file, std::uint32_t value, int bytes)
+  {
+    for (int i = 0; i < bytes; ++i)
+      file.push_back(static_cast<unsigned char>(value >> (8 * i)));
+  }
+
+  void putBig(std::vector<unsigned char> &file, std::uint32_t value)
+  {
+    for (int shift = 24; shift >= 0; shift -= 8)
+      file.push_back(static_cast<unsigned char>(value >> shift));
+  }
+
+  std::uint32_t crc32(const unsigned char *data, std::size_t size)
+  {
+    std::uint32_t crc = 0xffffffffu;
+    for (std::size_t i = 0; i < size; ++i)
+      {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; ++bit)
+          crc = crc >> 1 ^ (0xedb88320u & (0u - (crc & 1)));
+      }
+    return ~crc;
+  }
+
+  void putChunk(std::vector<unsigned char> &file, const char *type, const std::vector<unsigned char> &data)
+  {
+    putBig(file, static_cast<std::uint32_t>(data.size()));
+    std::size_t start = file.size();
+    file.insert(file.end(), type, type + 4);
+    file.insert(file.end(), data.begin(), data.end());
+    putBig(file, crc32(file.data() + start, data.size() + 4));
+  }
+
+  // an RGBA PNG, rows Sub filtered and deflated as stored blocks: the
+  // unfiltering is what PNG decoding does per row
+  std::vector<unsigned char> pngFile(const std::vector<unsigned char> &pixels, int size)
+  {
+    auto stride = static_cast<std::size_t>(size) * 4;
+    std::vector<unsigned char> raw;
+    raw.reserve((stride + 1) * static_cast<std::size_t>(size));
+    for (std::size_t y = 0; y < static_cast<std::size_t>(size); ++y)
+      {
+        const unsigned char *row = pixels.data() + stride * y;
+        raw.push_back(1);
+        for (std::size_t i = 0; i < stride; ++i)
+          raw.push_back(static_cast<unsigned char>(row[i] - (i >= 4 ? row[i - 4] : 0)));
+      }
+
+    std::vector<unsigned char> compressed = {0x78, 0x01};
+    std::uint32_t a = 1, b = 0;
+    for (unsigned char byte : raw)
+      {
+        a = (a + byte) % 65521;
+        b = (b + a) % 65521;
+      }
+    for (std::size_t at = 0; at < raw.size() || at == 0; at += 65535)
+      {
+        std::size_t length = std::min<std::size_t>(raw.size() - at, 65535);
+        compressed.push_back(at + length >= raw.size() ? 1 : 0);
+        putLittle(compressed, static_cast<std::uint32_t>(length), 2);
+        putLittle(compressed, static_cast<std::uint32_t>(~length & 0xffff), 2);
+        compressed.insert(compressed.end(), raw.begin() + static_cast<std::ptrdiff_t>(at), raw.begin() + static_cast<std::ptrdiff_t>(at + length));
+      }
+    putBig(compressed, b << 16 | a);
+
+    std::vector<unsigned char> file = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    std::vector<unsigned char> header;
+    putBig(header, static_cast<std::uint32_t>(size));
+    putBig(header, static_cast<std::uint32_t>(size));
+    header.insert(header.end(), {8, 6, 0, 0, 0});
+    putChunk(file, "IHDR", header);
+    putChunk(file, "IDAT", compressed);
+    putChunk(file, "IEND", std::vector<unsigned char>());
+    return file;
+  }
+
+  // a 32 bit BGRA BMP, bottom row first as most are
+  std::vector<unsigned char> bmpFile(const std::vector<unsigned char> &pixels, int size)
+  {
+    auto stride = static_cast<std::size_t>(size) * 4;
+    std::vector<unsigned char> file = {'B', 'M'};
+    putLittle(file, static_cast<std::uint32_t>(54 + pixels.size()), 4);
+    putLittle(file, 0, 4);
+    putLittle(file, 54, 4);
+    putLittle(file, 40, 4);
+    putLittle(file, static_cast<std::uint32_t>(size), 4);
+    putLittle(file, static_cast<std::uint32_t>(size), 4);
+    putLittle(file, 1, 2);
+    putLittle(file, 32, 2);
+    putLittle(file, 0, 4);
+    putLittle(file, static_cast<std::uint32_t>(pixels.size()), 4);
+    putLittle(file, 2835, 4);
+    putLittle(file, 2835, 4);
+    putLittle(file, 0, 4);
+    putLittle(file, 0, 4);
+    for (std::size_t y = static_cast<std::size_t>(size); y-- > 0;)
+      for (std::size_t i = stride * y; i < stride * (y + 1); i += 4)
+        file.insert(file.end(), {pixels[i + 2], pixels[i + 1], pixels[i], pixels[i + 3]});
+    return file;
+  }
+
+  // an uncompressed 32 bit TGA, bottom row first as the format defaults to
+  std::vector<unsigned char> tgaFile(const std::vector<unsigned char> &pixels, int size)
+  {
+    auto stride = static_cast<std::size_t>(size) * 4;
+    std::vector<unsigned char> file = {0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    putLittle(file, static_cast<std::uint32_t>(size), 2);
+    putLittle(file, static_cast<std::uint32_t>(size), 2);
+    file.insert(file.end(), {32, 8});
+    for (std::size_t y = static_cast<std::size_t>(size); y-- > 0;)
+      for (std::size_t i = stride * y; i < stride * (y + 1); i += 4)
+        file.insert(file.end(), {pixels[i + 2], pixels[i + 1], pixels[i], pixels[i + 3]});
+    return file;
+  }
+
+  typedef std::function<unsigned char*(const std::vector<unsigned char>&, int flip, int &width, int &height, int &channels)> Loader;
+
+  // time plain and flipped loads through load, false when the flipped
+  // image isn't the plain one upside down
+  bool benchFlip(const std::string &name, const char *decoder, const std::vector<unsigned char> &file, const Loader &load,
+                 void (*release)(void*), int runs)
+  {
+    int width, height, channels, flippedWidth, flippedHeight, flippedChannels;
+    unsigned char *plain = load(file, 0, width, height, channels);
+    unsigned char *flipped = load(file, 1, flippedWidth, flippedHeight, flippedChannels);
+    bool same = plain != nullptr && flipped != nullptr && width == flippedWidth && height == flippedHeight && channels == flippedChannels;
+    auto stride = static_cast<std::size_t>(width) * static_cast<std::size_t>(channels);
+    for (std::size_t y = 0; same && y < static_cast<std::size_t>(height); ++y)
+      same = std::memcmp(plain + stride * y, flipped + stride * (static_cast<std::size_t>(height) - 1 - y), stride) == 0;
+    release(plain);
+    release(flipped);
+    if (!same)
+      {
+        std::cout << name << ", " << decoder << ": differs from the reference" << std::endl;
+        return false;
+      }
+
+    double plainTime = bestTime(runs, [&] { release(load(file, 0, width, height, channels)); });
+    double flippedTime = bestTime(runs, [&] { release(load(file, 1, width, height, channels)); });
+    std::cout << name << ", " << decoder << ": " << plainTime * 1000.0 << " ms, flipped " << flippedTime * 1000.0 << " ms, flipping adds "
+              << (flippedTime - plainTime) * 1000.0 << " ms" << std::endl;
+    return true;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  Settings settings;
+  if (!parseArguments(argc, argv, settings))
+    {
+      std::cout << "usage: flipbench [-s size] [-r runs] [image...]" << std::endl;
+      return 2;
+    }
+
+  std::vector<std::pair<std::string, std::vector<unsigned char>>> images;
+  {
+    std::vector<unsigned char> pixels = drawing(settings.size);
+    std::string size = std::to_string(settings.size) + " x " + std::to_string(settings.size);
+    images.emplace_back(size + " PNG", pngFile(pixels, settings.size));
+    images.emplace_back(size + " BMP", bmpFile(pixels, settings.size));
+    images.emplace_back(size + " TGA", tgaFile(pixels, settings.size));
+    std::mt19937 random(1);
+    images.emplace_back(size + " JPEG", jpegFile(photo(settings.size, settings.size, random), {settings.size, settings.size, 2, 2, 4}));
+  }
+  for (const std::string &path : settings.images)
+    {
+      std::vector<unsigned char> bytes;
+      if (!readFile(path, bytes))
+        {
+          std::cout << "can't read " << path << std::endl;
+          return 1;
+        }
+      images.emplace_back(path, std::move(bytes));
+    }
+
+  Loader current = [](const std::vector<unsigned char> &file, int flip, int &width, int &height, int &channels)
+    {
+      stbi_load_options options;
+      stbi_load_options_init(&options);
+      options.flip_vertically = flip;
+      return stbi_load_from_memory_with_options(file.data(), static_cast<int>(file.size()), &width, &height, &channels, &options);
+    };
+  Loader reference = [](const std::vector<unsigned char> &file, int flip, int &width, int &height, int &channels)
+    {
+      return reference_load_from_memory(file.data(), static_cast<int>(file.size()), &width, &height, &channels, 0, flip);
+    };
+  for (auto &image : images)
+    if (!benchFlip(image.first, "v2.19", image.second, reference, reference_image_free, settings.runs)
+        || !benchFlip(image.first, "now", image.second, current, stbi_image_free, settings.runs))
+      return 1;
+  return 0;
+}
@@ -0,0 +1,491 @@
+#include "jpeg_writer.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+
+namespace
+{
+  int randomInt(std::mt19937 &random, int low, int high)
+  {
+    return std::uniform_int_distribution<int>(low, high)(random);
+  }
+
+  // the order coefficients are stored in, zigzag over the 8x8 block
+  std::vector<int> zigzag()
+  {
+    std::vector<int> order;
+    for (int diagonal = 0; diagonal < 15; ++diagonal)
+      for (int i = 0; i <= diagonal; ++i)
+        {
+          int row = diagonal % 2 != 0 ? i : diagonal - i;
+          int column = diagonal - row;
+          if (row < 8 && column < 8)
+            order.push_back(row * 8 + column);
+        }
+    return order;
+  }
+
+  // the JPEG standard's example luma table, or a chroma one coarser away
+  // from DC, times scale / 8
+  std::vector<int> quantization(bool chroma, int scale)
+  {
+    static const int luma[64] = {16, 11, 10, 16, 24, 40, 51, 61, 12, 12, 14, 19, 26, 58, 60, 55, 14, 13, 16, 24, 40, 57, 69, 56,
+                                 14, 17, 22, 29, 51, 87, 80, 62, 18, 22, 37, 56, 68, 109, 103, 77, 24, 35, 55, 64, 81, 104, 113, 92,
+                                 49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99};
+    std::vector<int> table(64, 99);
+    for (int i = 0; i < 64; ++i)
+      if (!chroma)
+        table[static_cast<std::size_t>(i)] = luma[i];
+      else if (i % 8 < 4 && i / 8 < 4 && i % 8 + i / 8 < 4)
+        table[static_cast<std::size_t>(i)] = std::min(17 + 8 * (i % 8 + i / 8) * (i % 8 + i / 8), 99);
+    for (int &value : table)
+      value = std::min(std::max(value * scale / 8, 1), 255);
+    return table;
+  }
+
+  // bits out most significant first, 0xff bytes followed by a 0
+  class BitWriter
+  {
+  public:
+    explicit BitWriter(std::vector<unsigned char> &output) : bytes(output) {}
+
+    void put(std::uint32_t value, int count)
+    {
+      for (int bit = count - 1; bit >= 0; --bit)
+        {
+          current = static_cast<unsigned char>(current << 1 | (value >> bit & 1));
+          if (++filled == 8)
+            flushByte();
+        }
+    }
+
+    // pad the last byte with ones
+    void finish()
+    {
+      while (filled != 0)
+        put(1, 1);
+    }
+
+    // finish the byte and put restart marker RSTn, n modulo 8
+    void restart(int n)
+    {
+      finish();
+      bytes.push_back(0xff);
+      bytes.push_back(static_cast<unsigned char>(0xd0 + n % 8));
+    }
+
+  private:
+    void flushByte()
+    {
+      bytes.push_back(current);
+      if (current == 0xff)
+        bytes.push_back(0);
+      current = 0;
+      filled = 0;
+    }
+
+    std::vector<unsigned char> &bytes;
+    unsigned char current = 0;
+    int filled = 0;
+  };
+
+  // a Huffman table fit to how often each symbol comes up, the way the
+  // JPEG standard's Annex K.2 builds one: codes at most 16 bits long and
+  // none of all ones
+  struct HuffmanTable
+  {
+    std::vector<long> counts = std::vector<long>(256, 0);
+    std::vector<std::uint32_t> codes = std::vector<std::uint32_t>(256, 0);
+    std::vector<int> lengths = std::vector<int>(256, 0);
+    // symbols by code length, and how many have each length from 1 to 16
+    std::vector<unsigned char> symbols;
+    int perLength[17] = {};
+
+    void build()
+    {
+      // Huffman's code sizes with a symbol 256 counted once standing in
+      // for the code of all ones, then the longest ones cut down to 16 bits
+      std::vector<long> frequency(counts);
+      frequency.push_back(1);
+      std::vector<int> size(257, 0), next(257, -1);
+      for (;;)
+        {
+          int least = -1, second = -1;
+          for (int i = 0; i < 257; ++i)
+            if (frequency[static_cast<std::size_t>(i)] > 0
+                && (least < 0 || frequency[static_cast<std::size_t>(i)] <= frequency[static_cast<std::size_t>(least)]))
+              least = i;
+          for (int i = 0; i < 257; ++i)
+            if (i != least && frequency[static_cast<std::size_t>(i)] > 0
+                && (second < 0 || frequency[static_cast<std::size_t>(i)] <= frequency[static_cast<std::size_t>(second)]))
+              second = i;
+          if (second < 0)
+            break;
+          frequency[static_cast<std::size_t>(least)] += frequency[static_cast<std::size_t>(second)];
+          frequency[static_cast<std::size_t>(second)] = 0;
+          for (;; least = next[static_cast<std::size_t>(least)])
+            {
+              ++size[static_cast<std::size_t>(least)];
+              if (next[static_cast<std::size_t>(least)] < 0)
+                break;
+            }
+          next[static_cast<std::size_t>(least)] = second;
+          for (; second >= 0; second = next[static_cast<std::size_t>(second)])
+            ++size[static_cast<std::size_t>(second)];
+        }
+      int bits[33] = {};
+      for (int length : size)
+        if (length > 0)
+          ++bits[length];
+      for (int i = 32; i > 16; --i)
+        while (bits[i] > 0)
+          {
+            int j = i - 2;
+            while (bits[j] == 0)
+              --j;
+            bits[i] -= 2;
+            ++bits[i - 1];
+            bits[j + 1] += 2;
+            --bits[j];
+          }
+      int longest = 16;
+      while (longest > 0 && bits[longest] == 0)
+        --longest;
+      if (longest == 0)
+        return;
+      --bits[longest];
+
+      // lengths handed out shortest first in the order of the sizes, the
+      // stand-in last, then canonical codes
+      for (int length = 1; length <= 32; ++length)
+        for (std::size_t symbol = 0; symbol < 256; ++symbol)
+          if (size[symbol] == length)
+            symbols.push_back(static_cast<unsigned char>(symbol));
+      std::uint32_t code = 0;
+      std::size_t i = 0;
+      for (int length = 1; length <= 16; ++length, code <<= 1)
+        for (perLength[length] = bits[length]; bits[length] > 0; --bits[length], ++code, ++i)
+          {
+            codes[symbols[i]] = code;
+            lengths[symbols[i]] = length;
+          }
+    }
+
+    // count symbol when out is null, write its code otherwise
+    void code(std::size_t symbol, BitWriter *out)
+    {
+      if (out == nullptr)
+        ++counts[symbol];
+      else
+        out->put(codes[symbol], lengths[symbol]);
+    }
+  };
+
+  // magnitude category of a coefficient, and its bits as JPEG stores them
+  int category(int value)
+  {
+    int bits = 0;
+    for (int magnitude = std::abs(value); magnitude != 0; magnitude >>= 1)
+      ++bits;
+    return bits;
+  }
+
+  std::uint32_t magnitudeBits(int value, int bits)
+  {
+    return static_cast<std::uint32_t>(value < 0 ? value + (1 << bits) - 1 : value);
+  }
+
+  // symbols of one block's coefficients first to last, in zigzag order:
+  // counted when out is null, written otherwise
+  void codeBlock(const int *coefficients, int first, int last, int &previousDc, HuffmanTable &dc, HuffmanTable &ac, BitWriter *out)
+  {
+    if (first == 0)
+      {
+        int difference = coefficients[0] - previousDc;
+        previousDc = coefficients[0];
+        int bits = category(difference);
+        dc.code(static_cast<std::size_t>(bits), out);
+        if (out != nullptr)
+          out->put(magnitudeBits(difference, bits), bits);
+      }
+    int run = 0;
+    for (int i = std::max(first, 1); i <= last; ++i)
+      {
+        if (coefficients[i] == 0)
+          {
+            ++run;
+            continue;
+          }
+        for (; run >= 16; run -= 16)
+          ac.code(0xf0, out);
+        int bits = category(coefficients[i]);
+        ac.code(static_cast<std::size_t>(run << 4 | bits), out);
+        if (out != nullptr)
+          out->put(magnitudeBits(coefficients[i], bits), bits);
+        run = 0;
+      }
+    if (run > 0)
+      ac.code(0, out);
+  }
+
+  void putMarker(std::vector<unsigned char> &file, unsigned char marker, const std::vector<unsigned char> &segment)
+  {
+    file.insert(file.end(), {0xff, marker, static_cast<unsigned char>((segment.size() + 2) >> 8), static_cast<unsigned char>(segment.size() + 2)});
+    file.insert(file.end(), segment.begin(), segment.end());
+  }
+
+  // calls block(c, left, top) for every block in the order a baseline scan
+  // holds them: MCU by MCU, the luma blocks of each row by row, then Cb and
+  // Cr. left and top count the component's samples
+  template<typename Block>
+  void forEachBlock(const JpegShape &shape, Block block)
+  {
+    int mcusAcross = (shape.width + 8 * shape.across - 1) / (8 * shape.across);
+    int mcusDown = (shape.height + 8 * shape.down - 1) / (8 * shape.down);
+    for (int my = 0; my < mcusDown; ++my)
+      for (int mx = 0; mx < mcusAcross; ++mx)
+        {
+          for (int by = 0; by < shape.down; ++by)
+            for (int bx = 0; bx < shape.across; ++bx)
+              block(0, 8 * (mx * shape.across + bx), 8 * (my * shape.down + by));
+          block(1, mx * 8, my * 8);
+          block(2, mx * 8, my * 8);
+        }
+  }
+
+  // where forEachBlock's order has block x, y of component c
+  std::size_t blockAt(const JpegShape &shape, int c, int x, int y)
+  {
+    int mcusAcross = (shape.width + 8 * shape.across - 1) / (8 * shape.across);
+    int across = c == 0 ? shape.across : 1, down = c == 0 ? shape.down : 1;
+    int inMcu = c == 0 ? y % down * across + x % across : shape.across * shape.down + c - 1;
+    return static_cast<std::size_t>((y / down * mcusAcross + x / across) * (shape.across * shape.down + 2) + inMcu);
+  }
+
+  // one scan: its SOS segment, the blocks it codes in order and the
+  // coefficients it codes of each
+  struct Scan
+  {
+    std::vector<unsigned char> header;
+    std::vector<std::size_t> blocks;
+    std::size_t blocksPerMcu;
+    int first;
+    int last;
+    std::vector<unsigned char> data;
+  };
+
+  // a baseline file's one scan of everything, or a progressive one's scan
+  // of every DC coefficient and then one of each component's AC ones. A
+  // scan of one component covers the blocks the image reaches only, not
+  // the padding of the last MCUs
+  std::vector<Scan> scansOf(const JpegShape &shape, std::size_t blockCount)
+  {
+    Scan all;
+    all.header = {3, 1, 0x00, 2, 0x11, 3, 0x11, 0, static_cast<unsigned char>(shape.progressive ? 0 : 63), 0};
+    for (std::size_t block = 0; block < blockCount; ++block)
+      all.blocks.push_back(block);
+    all.blocksPerMcu = static_cast<std::size_t>(shape.across * shape.down + 2);
+    all.first = 0;
+    all.last = shape.progressive ? 0 : 63;
+    std::vector<Scan> scans = {all};
+    for (int c = 0; c < 3 && shape.progressive; ++c)
+      {
+        Scan ac;
+        ac.header = {1, static_cast<unsigned char>(c + 1), static_cast<unsigned char>(c == 0 ? 0x00 : 0x11), 1, 63, 0};
+        int width = c == 0 ? shape.width : (shape.width + shape.across - 1) / shape.across;
+        int height = c == 0 ? shape.height : (shape.height + shape.down - 1) / shape.down;
+        for (int y = 0; y < (height + 7) / 8; ++y)
+          for (int x = 0; x < (width + 7) / 8; ++x)
+            ac.blocks.push_back(blockAt(shape, c, x, y));
+        ac.blocksPerMcu = 1;
+        ac.first = 1;
+        ac.last = 63;
+        scans.push_back(ac);
+      }
+    return scans;
+  }
+
+  // the file of quantized coefficients, 64 a block in zigzag order and the
+  // blocks in forEachBlock's order, and the tables they were quantized by
+  std::vector<unsigned char> encode(const JpegShape &shape, const std::vector<int> (&tables)[2], const std::vector<int> &coefficients)
+  {
+    // symbols counted, then tables built and the scans written
+    std::vector<Scan> scans = scansOf(shape, coefficients.size() / 64);
+    HuffmanTable huffman[4];
+    auto lumaBlocks = static_cast<std::size_t>(shape.across * shape.down);
+    auto restartInterval = static_cast<std::size_t>(shape.restartInterval);
+    for (int pass = 0; pass < 2; ++pass)
+      {
+        for (Scan &scan : scans)
+          {
+            BitWriter out(scan.data);
+            int previousDc[3] = {};
+            for (std::size_t i = 0; i < scan.blocks.size(); ++i)
+              {
+                std::size_t mcu = i / scan.blocksPerMcu;
+                if (restartInterval != 0 && i % scan.blocksPerMcu == 0 && mcu != 0 && mcu % restartInterval == 0)
+                  {
+                    if (pass != 0)
+                      out.restart(static_cast<int>(mcu / restartInterval - 1));
+                    std::fill(previousDc, previousDc + 3, 0);
+                  }
+                std::size_t block = scan.blocks[i], inMcu = block % (lumaBlocks + 2);
+                int c = inMcu < lumaBlocks ? 0 : static_cast<int>(inMcu - lumaBlocks) + 1, table = c == 0 ? 0 : 2;
+                codeBlock(coefficients.data() + 64 * block, scan.first, scan.last, previousDc[c], huffman[table], huffman[table + 1],
+                          pass == 0 ? nullptr : &out);
+              }
+            out.finish();
+          }
+        if (pass == 0)
+          for (HuffmanTable &table : huffman)
+            table.build();
+      }
+
+    std::vector<unsigned char> file = {0xff, 0xd8};
+    std::vector<unsigned char> segment;
+    std::vector<int> order = zigzag();
+    for (unsigned char id = 0; id < 2; ++id)
+      {
+        segment.push_back(id);
+        for (int index : order)
+          segment.push_back(static_cast<unsigned char>(tables[id][static_cast<std::size_t>(index)]));
+      }
+    putMarker(file, 0xdb, segment);
+    segment = {8, static_cast<unsigned char>(shape.height >> 8), static_cast<unsigned char>(shape.height), static_cast<unsigned char>(shape.width >> 8),
+               static_cast<unsigned char>(shape.width), 3, 1, static_cast<unsigned char>(shape.across << 4 | shape.down), 0, 2, 0x11, 1, 3, 0x11, 1};
+    putMarker(file, shape.progressive ? 0xc2 : 0xc0, segment);
+    segment.clear();
+    const unsigned char classes[4] = {0x00, 0x10, 0x01, 0x11};
+    for (int table = 0; table < 4; ++table)
+      {
+        const HuffmanTable &huffmanTable = huffman[table];
+        segment.push_back(classes[table]);
+        for (int length = 1; length <= 16; ++length)
+          segment.push_back(static_cast<unsigned char>(huffmanTable.perLength[length]));
+        segment.insert(segment.end(), huffmanTable.symbols.begin(), huffmanTable.symbols.end());
+      }
+    putMarker(file, 0xc4, segment);
+    if (shape.restartInterval != 0)
+      putMarker(file, 0xdd, {static_cast<unsigned char>(shape.restartInterval >> 8), static_cast<unsigned char>(shape.restartInterval)});
+    for (const Scan &scan : scans)
+      {
+        putMarker(file, 0xda, scan.header);
+        file.insert(file.end(), scan.data.begin(), scan.data.end());
+      }
+    file.insert(file.end(), {0xff, 0xd9});
+    return file;
+  }
+}
+
+// a JPEG of rgb, 3 bytes a pixel, top row first
+std::vector<unsigned char> jpegFile(const std::vector<unsigned char> &rgb, const JpegShape &shape)
+{
+  // YCbCr planes padded out to whole MCUs by repeating the last row and
+  // column, then chroma averaged down
+  int mcuWidth = 8 * shape.across, mcuHeight = 8 * shape.down;
+  int mcusAcross = (shape.width + mcuWidth - 1) / mcuWidth, mcusDown = (shape.height + mcuHeight - 1) / mcuHeight;
+  int paddedWidth = mcusAcross * mcuWidth, paddedHeight = mcusDown * mcuHeight;
+  std::vector<float> planes[3];
+  for (auto &plane : planes)
+    plane.resize(static_cast<std::size_t>(paddedWidth) * static_cast<std::size_t>(paddedHeight));
+  for (int y = 0; y < paddedHeight; ++y)
+    for (int x = 0; x < paddedWidth; ++x)
+      {
+        auto from = 3 * (static_cast<std::size_t>(std::min(y, shape.height - 1)) * static_cast<std::size_t>(shape.width)
+                         + static_cast<std::size_t>(std::min(x, shape.width - 1)));
+        float r = rgb[from], g = rgb[from + 1], b = rgb[from + 2];
+        auto to = static_cast<std::size_t>(y) * static_cast<std::size_t>(paddedWidth) + static_cast<std::size_t>(x);
+        planes[0][to] = 0.299f * r + 0.587f * g + 0.114f * b;
+        planes[1][to] = -0.168736f * r - 0.331264f * g + 0.5f * b + 128.0f;
+        planes[2][to] = 0.5f * r - 0.418688f * g - 0.081312f * b + 128.0f;
+      }
+  int chromaWidth = paddedWidth / shape.across, chromaHeight = paddedHeight / shape.down;
+  for (int c = 1; c < 3; ++c)
+    {
+      std::vector<float> small(static_cast<std::size_t>(chromaWidth) * static_cast<std::size_t>(chromaHeight));
+      for (int y = 0; y < chromaHeight; ++y)
+        for (int x = 0; x < chromaWidth; ++x)
+          {
+            float sum = 0.0f;
+            for (int dy = 0; dy < shape.down; ++dy)
+              for (int dx = 0; dx < shape.across; ++dx)
+                sum += planes[c][static_cast<std::size_t>(y * shape.down + dy) * static_cast<std::size_t>(paddedWidth)
+                                 + static_cast<std::size_t>(x * shape.across + dx)];
+            small[static_cast<std::size_t>(y) * static_cast<std::size_t>(chromaWidth) + static_cast<std::size_t>(x)]
+              = sum / static_cast<float>(shape.across * shape.down);
+          }
+      planes[c] = std::move(small);
+    }
+
+  // forward DCT and quantization of every block, in the order the scan
+  // holds them
+  float cosines[8][8];
+  for (int x = 0; x < 8; ++x)
+    for (int u = 0; u < 8; ++u)
+      cosines[x][u] = static_cast<float>(std::cos((2 * x + 1) * u * 3.14159265358979 / 16.0) * (u == 0 ? std::sqrt(0.125) : 0.5));
+  std::vector<int> order = zigzag();
+  std::vector<int> tables[2] = {quantization(false, shape.quality), quantization(true, shape.quality)};
+  std::vector<int> coefficients;
+  forEachBlock(shape, [&](int c, int left, int top)
+    {
+      const std::vector<float> &plane = planes[c];
+      int width = c == 0 ? paddedWidth : chromaWidth;
+      float rows[8][8];
+      for (int y = 0; y < 8; ++y)
+        for (int u = 0; u < 8; ++u)
+          {
+            float sum = 0.0f;
+            for (int x = 0; x < 8; ++x)
+              sum += (plane[static_cast<std::size_t>(top + y) * static_cast<std::size_t>(width) + static_cast<std::size_t>(left + x)] - 128.0f)
+                * cosines[x][u];
+            rows[y][u] = sum;
+          }
+      const std::vector<int> &table = tables[c == 0 ? 0 : 1];
+      for (std::size_t i = 0; i < 64; ++i)
+        {
+          int v = order[i] / 8, u = order[i] % 8;
+          float sum = 0.0f;
+          for (int y = 0; y < 8; ++y)
+            sum += rows[y][u] * cosines[y][v];
+          coefficients.push_back(static_cast<int>(std::lround(sum / static_cast<float>(table[static_cast<std::size_t>(order[i])]))));
+        }
+    });
+  return encode(shape, tables, coefficients);
+}
+
+// random quantized coefficients in place of an image's
+std::vector<unsigned char> noiseJpegFile(const JpegShape &shape, int limit, std::mt19937 &random)
+{
+  std::vector<int> tables[2] = {quantization(false, shape.quality), quantization(true, shape.quality)};
+  std::vector<int> coefficients;
+  limit = std::min(std::max(limit, 1), 1023);
+  forEachBlock(shape, [&](int, int, int)
+    {
+      for (int i = 0; i < 64; ++i)
+        coefficients.push_back(i == 0 || randomInt(random, 0, 3) == 0 ? randomInt(random, -limit, limit) : 0);
+    });
+  return encode(shape, tables, coefficients);
+}
+
+// smooth shading, edges and grain, something like a photo
+std::vector<unsigned char> photo(int width, int height, std::mt19937 &random)
+{
+  std::vector<unsigned char> rgb(3 * static_cast<std::size_t>(width) * static_cast<std::size_t>(height));
+  double fx = randomInt(random, 1, 40) / 1000.0, fy = randomInt(random, 1, 40) / 1000.0;
+  int grain = randomInt(random, 0, 24);
+  for (int y = 0; y < height; ++y)
+    for (int x = 0; x < width; ++x)
+      {
+        unsigned char *texel = rgb.data() + 3 * (static_cast<std::size_t>(y) * static_cast<std::size_t>(width) + static_cast<std::size_t>(x));
+        bool edge = (x / 37 + y / 23) % 3 == 0;
+        double shade = 127.5 + 127.5 * std::sin(x * fx + y * fy);
+        for (int c = 0; c < 3; ++c)
+          {
+            double value = (edge ? 255.0 - shade : shade) * (c == 0 ? 1.0 : c == 1 ? 0.8 : 0.6) + randomInt(random, -grain, grain);
+            texel[c] = static_cast<unsigned char>(std::min(std::max(value, 0.0), 255.0));
+          }
+      }
+  return rgb;
+}
@@ -0,0 +1,39 @@
+#ifndef JPEG_WRITER_H
+#define JPEG_WRITER_H
+
+#include <random>
+#include <vector>
+
+
+// baseline and progressive JPEG files for the benchmarks to decode: a naive
+// float DCT and Huffman tables fit to the symbols each file uses
+
+struct JpegShape
+{
+    int width;
+    int height;
+    // luma samples per chroma sample across and down: 1 or 2
+    int across;
+    int down;
+    // the quantization tables' scale, 8 for the standard's example ones
+    int quality;
+    // MCUs between restart markers, 0 for none
+    int restartInterval = 0;
+    // a scan of every DC coefficient, then one of each component's AC ones,
+    // instead of a single baseline scan
+    bool progressive = false;
+};
+
+// a JPEG of rgb, 3 bytes a pixel, top row first
+std::vector<unsigned char> jpegFile(const std::vector<unsigned char> &rgb, const JpegShape &shape);
+
+// a JPEG of random quantized coefficients instead of an image's: every DC
+// one and a quarter of the AC ones drawn from -limit to limit (at most
+// 1023). With a high limit and quality scale the IDCT gets inputs far
+// past what an image gives it, up to the wrap of 16-bit dequantized values
+std::vector<unsigned char> noiseJpegFile(const JpegShape &shape, int limit, std::mt19937 &random);
+
+// smooth shading, edges and grain, something like a photo, 3 bytes a pixel
+std::vector<unsigned char> photo(int width, int height, std::mt19937 &random);
+
+#endif
@@ -0,0 +1,484 @@
+// jpegbench: stb_image's JPEG decoding, with its AVX2 IDCT of two blocks at
+// once, color conversion and upsampling where the CPU has AVX2, against
+// stb_image v2.19's SSE2 and plain C paths (libs/stb_image_reference):
+// bit for bit over generated files, then timed.
+//
+//   jpegbench [-n files] [-s size] [-r runs] [jpeg...]
+//
+// Writes n JPEG files (200 by default) of random sizes, content and
+// quantization, with chroma at full resolution, halved across (4:2:2) or
+// halved both ways (4:2:0, what the 2x2 upsampler is for), a third of them
+// progressive and a third with restart markers every few MCUs. All three
+// decoders load each as stored and as RGBA and must give the same bytes.
+// A quarter of the files hold random coefficients, up to the largest a
+// JPEG codes: on those v2.19's SSE2 IDCT wraps where its plain C one
+// doesn't, and stb_image must match the SSE2 one.
+// Then times the best of runs loads of a size x size photo-like image
+// (2048 by default) at 4:2:0 and 4:4:4, and of each jpeg given, which
+// must match too. Next, stb_image decodes each of those at 1/2, 1/4 and
+// 1/8 scale: timed against the full decode, with the PSNR of each against
+// the full decode averaged down the same way. The scaled decode averages
+// before clamping, so hard edges at full strength score lower. Then
+// data/container.jpg and data/wall.jpg, blown up to 4096 x 4096 and
+// written again at the finest quantization, are decoded by all three for
+// the compressed megabytes each gets through a second, and by stb_image at
+// 1/8 scale, which is mostly the Huffman decoding. Last, a 7680 x 4320
+// image, written with restart markers and without, is decoded serially
+// and with stbi_load_options::parallel_for on a ThreadPool, into the
+// result and through rows_ready: both must match the serial decode
+// bit for bit, and all three are timed.
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <stb_image.h>
+#include <stb_image_reference.h>
+
+#include "jpeg_writer.hpp"
+#include "thread_pool.hpp"
+
+namespace
+{
+  struct Settings
+  {
+    int files = 200;
+    int size = 2048;
+    int runs = 5;
+    std::vector<std::string> images;
+  };
+
+  bool parseArguments(int argc, char **argv, Settings &settings)
+  {
+    for (int i = 1; i < argc; ++i)
+      {
+        std::string argument = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (argument == "-n" && hasValue)
+          settings.files = std::max(std::atoi(argv[++i]), 0);
+        else if (argument == "-s" && hasValue)
+          settings.size = std::max(std::atoi(argv[++i]), 1);
+        else if (argument == "-r" && hasValue)
+          settings.runs = std::max(std::atoi(argv[++i]), 1);
+        else if (!argument.empty() && argument[0] != '-')
+          settings.images.push_back(argument);
+        else
+          return false;
+      }
+    return true;
+  }
+
+  // best time of body over runs, in seconds
+  double bestTime(int runs, const std::function<void()> &body)
+  {
+    double best = 0.0;
+    for (int run = 0; run < runs; ++run)
+      {
+        auto start = std::chrono::steady_clock::now();
+        body();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = run == 0 ? elapsed.count() : std::min(best, elapsed.count());
+      }
+    return best;
+  }
+
+  int randomInt(std::mt19937 &random, int low, int high)
+  {
+    return std::uniform_int_distribution<int>(low, high)(random);
+  }
+
+  bool readFile(const std::string &path, std::vector<unsigned char> &bytes)
+  {
+    std::FILE *file = std::fopen(path.c_str(), "rb");
+    if (file == nullptr)
+      return false;
+    unsigned char buffer[65536];
+    std::size_t read;
+    while ((read = std::fread(buffer, 1, sizeof(buffer), file)) != 0)
+      bytes.insert(bytes.end(), buffer, buffer + read);
+    return std::fclose(file) == 0;
+  }
+
+  struct Decoder
+  {
+    const char *name;
+    std::function<unsigned char*(const std::vector<unsigned char>&, int desiredChannels, int &width, int &height, int &channels)> load;
+    void (*release)(void*);
+  };
+
+  const Decoder decoders[3] = {
+    {"v2.19, plain C", [](const std::vector<unsigned char> &file, int desiredChannels, int &width, int &height, int &channels)
+      {
+        return reference_scalar_load_from_memory(file.data(), static_cast<int>(file.size()), &width, &height, &channels, desiredChannels, 0);
+      }, reference_image_free},
+    {"v2.19, SSE2", [](const std::vector<unsigned char> &file, int desiredChannels, int &width, int &height, int &channels)
+      {
+        return reference_load_from_memory(file.data(), static_cast<int>(file.size()), &width, &height, &channels, desiredChannels, 0);
+      }, reference_image_free},
+    {"now", [](const std::vector<unsigned char> &file, int desiredChannels, int &width, int &height, int &channels)
+      {
+        return stbi_load_from_memory(file.data(), static_cast<int>(file.size()), &width, &height, &channels, desiredChannels);
+      }, stbi_image_free}};
+
+  // load file with each decoder from decoders[from] on as stored and as
+  // RGBA, false when one fails or they differ
+  bool sameDecodes(const std::vector<unsigned char> &file, std::size_t from, std::string &difference)
+  {
+    for (int desiredChannels : {0, 4})
+      {
+        std::vector<unsigned char> first;
+        int firstWidth = 0, firstHeight = 0, firstChannels = 0;
+        for (const Decoder &decoder : decoders)
+          {
+            if (&decoder < decoders + from)
+              continue;
+            int width, height, channels;
+            unsigned char *image = decoder.load(file, desiredChannels, width, height, channels);
+            std::string as = desiredChannels != 0 ? " as RGBA" : " as stored";
+            if (image == nullptr)
+              {
+                difference = decoder.name + as + ", fails";
+                return false;
+              }
+            auto size = static_cast<std::size_t>(width) * static_cast<std::size_t>(height)
+              * static_cast<std::size_t>(desiredChannels != 0 ? desiredChannels : channels);
+            std::vector<unsigned char> pixels(image, image + size);
+            decoder.release(image);
+            if (&decoder == decoders + from)
+              {
+                first = std::move(pixels);
+                firstWidth = width, firstHeight = height, firstChannels = channels;
+              }
+            else if (width != firstWidth || height != firstHeight || channels != firstChannels || pixels != first)
+              {
+                difference = decoder.name + as;
+                return false;
+              }
+          }
+      }
+    return true;
+  }
+
+  // the image as stored, decoded at 1/denominator scale
+  unsigned char *scaledLoad(const std::vector<unsigned char> &file, int denominator, int &width, int &height, int &channels)
+  {
+    stbi_load_options options;
+    stbi_load_options_init(&options);
+    options.jpeg_scale_denom = denominator;
+    return stbi_load_from_memory_with_options(file.data(), static_cast<int>(file.size()), &width, &height, &channels, &options);
+  }
+
+  // PSNR in dB of image, width x height, against the full size one
+  // averaged over the denominator x denominator pixels each stands for
+  double boxPsnr(const unsigned char *full, int fullWidth, int fullHeight, const unsigned char *image, int width, int height, int channels,
+                 int denominator)
+  {
+    auto pixelBytes = static_cast<std::size_t>(channels);
+    double squares = 0.0;
+    for (int y = 0; y < height; ++y)
+      for (int x = 0; x < width; ++x)
+        for (std::size_t c = 0; c < pixelBytes; ++c)
+          {
+            double sum = 0.0;
+            int count = 0;
+            for (int fy = y * denominator; fy < std::min((y + 1) * denominator, fullHeight); ++fy)
+              for (int fx = x * denominator; fx < std::min((x + 1) * denominator, fullWidth); ++fx, ++count)
+                sum += full[(static_cast<std::size_t>(fy) * static_cast<std::size_t>(fullWidth) + static_cast<std::size_t>(fx)) * pixelBytes + c];
+            double error = sum / count - image[(static_cast<std::size_t>(y) * static_cast<std::size_t>(width) + static_cast<std::size_t>(x)) * pixelBytes + c];
+            squares += error * error;
+          }
+    double mean = squares / (static_cast<double>(width) * static_cast<double>(height) * static_cast<double>(channels));
+    return mean == 0.0 ? 99.0 : 10.0 * std::log10(255.0 * 255.0 / mean);
+  }
+
+  // time decodes at 1/2, 1/4 and 1/8 scale against the full one, and
+  // compare each with the full decode box filtered down; false when one
+  // fails or comes out the wrong size
+  bool benchScales(const std::string &name, const std::vector<unsigned char> &file, int runs)
+  {
+    int fullWidth, fullHeight, fullChannels;
+    unsigned char *full = scaledLoad(file, 1, fullWidth, fullHeight, fullChannels);
+    if (full == nullptr)
+      {
+        std::cout << name << ": " << stbi_failure_reason() << std::endl;
+        return false;
+      }
+    double fullTime = bestTime(runs, [&] { stbi_image_free(scaledLoad(file, 1, fullWidth, fullHeight, fullChannels)); });
+    std::cout << name << ", scaled: full " << fullTime * 1000.0 << " ms";
+    bool fine = true;
+    for (int denominator : {2, 4, 8})
+      {
+        int width, height, channels;
+        unsigned char *image = scaledLoad(file, denominator, width, height, channels);
+        fine = image != nullptr && width == (fullWidth + denominator - 1) / denominator && height == (fullHeight + denominator - 1) / denominator
+          && channels == fullChannels;
+        if (!fine)
+          {
+            stbi_image_free(image);
+            std::cout << ", 1/" << denominator << " differs from the reference";
+            break;
+          }
+        double psnr = boxPsnr(full, fullWidth, fullHeight, image, width, height, channels, denominator);
+        stbi_image_free(image);
+        double seconds = bestTime(runs, [&] { stbi_image_free(scaledLoad(file, denominator, width, height, channels)); });
+        std::cout << ", 1/" << denominator << " " << seconds * 1000.0 << " ms (" << psnr << " dB)";
+      }
+    std::cout << std::endl;
+    stbi_image_free(full);
+    return fine;
+  }
+
+  // stb_image's stbi_parallel_for, on pool
+  void parallelFor(void *pool, int count, void (*task)(void *, int), void *taskUser)
+  {
+    static_cast<ThreadPool *>(pool)->parallelFor(static_cast<std::size_t>(count), [task, taskUser](std::size_t index)
+      {
+        task(taskUser, static_cast<int>(index));
+      });
+  }
+
+  // the image as stored, rows handed over through rows_ready with
+  // parallelFor on pool
+  bool streamedLoad(const std::vector<unsigned char> &file, ThreadPool &pool, std::vector<unsigned char> &image, int &width, int &height,
+                    int &channels)
+  {
+    stbi_load_options options;
+    stbi_load_options_init(&options);
+    options.parallel_for = parallelFor;
+    options.parallel_user = &pool;
+    options.rows_ready = [](void *user, const stbi_uc *rows, std::size_t stride, int firstRow, int count)
+      {
+        auto *pixels = static_cast<std::vector<unsigned char> *>(user);
+        auto at = stride * static_cast<std::size_t>(firstRow);
+        if (pixels->size() < at + stride * static_cast<std::size_t>(count))
+          pixels->resize(at + stride * static_cast<std::size_t>(count));
+        std::memcpy(pixels->data() + at, rows, stride * static_cast<std::size_t>(count));
+      };
+    options.rows_user = &image;
+    return stbi_stream_from_memory_with_options(file.data(), static_cast<int>(file.size()), &width, &height, &channels, &options) != 0;
+  }
+
+  // the JPEG at path blown up to size x size, bilinear, and written again
+  // at 4:2:0, false when it can't be read
+  bool upscaledJpeg(const std::string &path, int size, std::vector<unsigned char> &file)
+  {
+    std::vector<unsigned char> bytes;
+    int width, height, channels;
+    unsigned char *image = readFile(path, bytes)
+      ? stbi_load_from_memory(bytes.data(), static_cast<int>(bytes.size()), &width, &height, &channels, 3) : nullptr;
+    if (image == nullptr)
+      return false;
+    std::vector<unsigned char> rgb(3 * static_cast<std::size_t>(size) * static_cast<std::size_t>(size));
+    for (int y = 0; y < size; ++y)
+      for (int x = 0; x < size; ++x)
+        {
+          float fx = std::max((static_cast<float>(x) + 0.5f) * static_cast<float>(width) / static_cast<float>(size) - 0.5f, 0.0f);
+          float fy = std::max((static_cast<float>(y) + 0.5f) * static_cast<float>(height) / static_cast<float>(size) - 0.5f, 0.0f);
+          int left = std::min(static_cast<int>(fx), width - 1), top = std::min(static_cast<int>(fy), height - 1);
+          int right = std::min(left + 1, width - 1), bottom = std::min(top + 1, height - 1);
+          float ax = fx - static_cast<float>(left), ay = fy - static_cast<float>(top);
+          for (int c = 0; c < 3; ++c)
+            {
+              auto at = [&](int px, int py) { return static_cast<float>(image[3 * (py * width + px) + c]); };
+              float value = (at(left, top) * (1.0f - ax) + at(right, top) * ax) * (1.0f - ay) + (at(left, bottom) * (1.0f - ax) + at(right, bottom) * ax) * ay;
+              rgb[3 * (static_cast<std::size_t>(y) * static_cast<std::size_t>(size) + static_cast<std::size_t>(x)) + static_cast<std::size_t>(c)]
+                = static_cast<unsigned char>(std::lround(value));
+            }
+        }
+    stbi_image_free(image);
+    file = jpegFile(rgb, {size, size, 2, 2, 1});
+    return true;
+  }
+
+  // compressed bytes each decoder gets through a second, and stb_image at
+  // 1/8 scale: there every coefficient is still Huffman decoded but the
+  // IDCT only takes DC and there is 1/64 of the pixels to convert, so it
+  // comes close to the entropy decoding alone
+  bool benchEntropy(const std::string &name, const std::vector<unsigned char> &file, int runs)
+  {
+    std::string difference;
+    if (!sameDecodes(file, 0, difference))
+      {
+        std::cout << name << ", " << difference << ": differs from the reference" << std::endl;
+        return false;
+      }
+    auto megabytes = static_cast<double>(file.size()) / 1e6;
+    std::cout << name << ", " << megabytes << " MB:";
+    for (const Decoder &decoder : decoders)
+      {
+        int width, height, channels;
+        double seconds = bestTime(runs, [&] { decoder.release(decoder.load(file, 0, width, height, channels)); });
+        std::cout << (&decoder == decoders ? " " : ", ") << decoder.name << " " << megabytes / seconds << " MB/s";
+      }
+    int width, height, channels;
+    double seconds = bestTime(runs, [&] { stbi_image_free(scaledLoad(file, 8, width, height, channels)); });
+    std::cout << ", now at 1/8 scale " << megabytes / seconds << " MB/s" << std::endl;
+    return true;
+  }
+
+  // decode serially, then with parallelFor on pool into the result and
+  // through rows_ready; false when one fails or differs from the serial
+  // decode. Prints the time of each
+  bool benchParallel(const std::string &name, const std::vector<unsigned char> &file, ThreadPool &pool, int runs)
+  {
+    stbi_load_options options;
+    stbi_load_options_init(&options);
+    int width, height, channels, parallelWidth, parallelHeight, parallelChannels, streamedWidth, streamedHeight, streamedChannels;
+    unsigned char *serial = stbi_load_from_memory_with_options(file.data(), static_cast<int>(file.size()), &width, &height, &channels, &options);
+    options.parallel_for = parallelFor;
+    options.parallel_user = &pool;
+    unsigned char *parallel = stbi_load_from_memory_with_options(file.data(), static_cast<int>(file.size()), &parallelWidth, &parallelHeight,
+                                                                 &parallelChannels, &options);
+    std::vector<unsigned char> streamed;
+    bool streamedFine = streamedLoad(file, pool, streamed, streamedWidth, streamedHeight, streamedChannels);
+    bool same = serial != nullptr && parallel != nullptr && streamedFine;
+    if (same)
+      {
+        auto size = static_cast<std::size_t>(width) * static_cast<std::size_t>(height) * static_cast<std::size_t>(channels);
+        same = parallelWidth == width && parallelHeight == height && parallelChannels == channels && std::memcmp(serial, parallel, size) == 0
+          && streamedWidth == width && streamedHeight == height && streamedChannels == channels && streamed.size() == size
+          && std::memcmp(serial, streamed.data(), size) == 0;
+      }
+    stbi_image_free(serial);
+    stbi_image_free(parallel);
+    if (!same)
+      {
+        std::cout << name << ", parallel: differs from the reference" << std::endl;
+        return false;
+      }
+
+    double parallelTime = bestTime(runs, [&]
+      {
+        stbi_image_free(stbi_load_from_memory_with_options(file.data(), static_cast<int>(file.size()), &width, &height, &channels, &options));
+      });
+    options.parallel_for = nullptr;
+    double serialTime = bestTime(runs, [&]
+      {
+        stbi_image_free(stbi_load_from_memory_with_options(file.data(), static_cast<int>(file.size()), &width, &height, &channels, &options));
+      });
+    double streamedTime = bestTime(runs, [&] { streamedLoad(file, pool, streamed, width, height, channels); });
+    std::cout << name << ": serial " << serialTime * 1000.0 << " ms, parallel " << parallelTime * 1000.0 << " ms, parallel through rows_ready "
+              << streamedTime * 1000.0 << " ms" << std::endl;
+    return true;
+  }
+
+  bool cpuHasAvx2()
+  {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    return __builtin_cpu_supports("avx2") != 0;
+#else
+    return false;
+#endif
+  }
+}
+
+int main(int argc, char **argv)
+{
+  Settings settings;
+  if (!parseArguments(argc, argv, settings))
+    {
+      std::cout << "usage: jpegbench [-n files] [-s size] [-r runs] [jpeg...]" << std::endl;
+      return 2;
+    }
+
+  std::mt19937 random(1);
+  for (int i = 0; i < settings.files; ++i)
+    {
+      JpegShape shape;
+      shape.width = randomInt(random, 0, 3) == 0 ? randomInt(random, 1, 300) : randomInt(random, 1, 48);
+      shape.height = randomInt(random, 1, 48);
+      shape.across = randomInt(random, 1, 2);
+      shape.down = shape.across == 2 ? randomInt(random, 1, 2) : 1;
+      shape.quality = 1 << randomInt(random, 0, 5);
+      shape.restartInterval = randomInt(random, 0, 2) == 0 ? randomInt(random, 1, 8) : 0;
+      shape.progressive = randomInt(random, 0, 2) == 0;
+      // random coefficients overflow the 16 bits the SSE2 IDCT works in
+      // where the plain C one's 32 don't, v2.19 differs from itself on
+      // those: the paired AVX2 IDCT must match its SSE2 one
+      bool noise = randomInt(random, 0, 3) == 0;
+      std::vector<unsigned char> file = noise ? noiseJpegFile(shape, 1 << randomInt(random, 0, 10), random)
+                                              : jpegFile(photo(shape.width, shape.height, random), shape);
+      std::string difference;
+      if (!sameDecodes(file, noise ? 1 : 0, difference))
+        {
+          std::cout << "file " << i << ", " << shape.width << " x " << shape.height << " sampled " << shape.across << "x" << shape.down
+                    << (shape.progressive ? ", progressive" : "") << (noise ? ", random coefficients" : "") << ", " << difference
+                    << ": differs from the reference" << std::endl;
+          return 1;
+        }
+    }
+  std::cout << settings.files << " generated files decode the same" << std::endl;
+
+  std::vector<std::pair<std::string, std::vector<unsigned char>>> images;
+  {
+    std::vector<unsigned char> rgb = photo(settings.size, settings.size, random);
+    std::string size = std::to_string(settings.size) + " x " + std::to_string(settings.size);
+    images.emplace_back(size + ", 4:2:0", jpegFile(rgb, {settings.size, settings.size, 2, 2, 4}));
+    images.emplace_back(size + ", 4:4:4", jpegFile(rgb, {settings.size, settings.size, 1, 1, 4}));
+  }
+  for (const std::string &path : settings.images)
+    {
+      std::vector<unsigned char> bytes;
+      if (!readFile(path, bytes))
+        {
+          std::cout << "can't read " << path << std::endl;
+          return 1;
+        }
+      images.emplace_back(path, std::move(bytes));
+    }
+
+  std::cout << "the CPU " << (cpuHasAvx2() ? "has" : "lacks") << " AVX2, best of " << settings.runs << " runs" << std::endl;
+  for (auto &image : images)
+    {
+      std::string difference;
+      if (!sameDecodes(image.second, 0, difference))
+        {
+          std::cout << image.first << ", " << difference << ": differs from the reference" << std::endl;
+          return 1;
+        }
+      std::cout << image.first << ":";
+      for (const Decoder &decoder : decoders)
+        {
+          int width = 0, height = 0, channels;
+          double seconds = bestTime(settings.runs, [&] { decoder.release(decoder.load(image.second, 0, width, height, channels)); });
+          std::cout << (&decoder == decoders ? " " : ", ") << decoder.name << " "
+                    << static_cast<double>(width) * static_cast<double>(height) / seconds / 1e6 << " Mpixels/s";
+        }
+      std::cout << std::endl;
+    }
+  for (auto &image : images)
+    if (!benchScales(image.first, image.second, settings.runs))
+      return 1;
+
+  // entropy decoding over real pictures, big enough to time
+  std::cout << "compressed data decoded a second" << std::endl;
+  for (const char *path : {"data/container.jpg", "data/wall.jpg"})
+    {
+      std::vector<unsigned char> file;
+      if (!upscaledJpeg(path, 4096, file))
+        {
+          std::cout << "can't read " << path << std::endl;
+          return 1;
+        }
+      if (!benchEntropy(std::string(path) + " at 4096 x 4096", file, settings.runs))
+        return 1;
+    }
+
+  // 8K, past the size stb_image decodes in parallel from, with restart
+  // markers to split the scan at and without
+  ThreadPool pool;
+  std::cout << "8K decodes, a pool of " << pool.size() << " and the caller" << std::endl;
+  std::vector<unsigned char> rgb = photo(7680, 4320, random);
+  if (!benchParallel("7680 x 4320, 4:2:0", jpegFile(rgb, {7680, 4320, 2, 2, 4}), pool, settings.runs)
+      || !benchParallel("7680 x 4320, 4:2:0, restart every 64 MCUs", jpegFile(rgb, {7680, 4320, 2, 2, 4, 64}), pool, settings.runs))
+    return 1;
+  return 0;
+}
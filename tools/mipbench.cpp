@@ -0,0 +1,159 @@
+// mipbench: buildMipChain with AVX and without, on the calling thread and
+// on a ThreadPool, checked against each other and timed.
+//
+//   mipbench [-s size] [-t threads] [-r runs]
+//
+// Builds the chains of a random size x size image (1024 by default) and
+// of an odd sized one about half as big, with 1 to 4 channels, through
+// the 2x2 box and the float filters. The SSE2 build on the calling thread
+// is the reference: with AVX where the CPU has it, and on a pool of
+// threads (4 by default) with and without, every chain must come out the
+// same bytes. Then times the four ways for the RGBA image with each
+// filter.
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "mip_chain.hpp"
+#include "thread_pool.hpp"
+
+namespace
+{
+  struct Settings
+  {
+    int size = 1024;
+    int threads = 4;
+    int runs = 5;
+  };
+
+  bool parseArguments(int argc, char **argv, Settings &settings)
+  {
+    for (int i = 1; i < argc; ++i)
+      {
+        std::string argument = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (argument == "-s" && hasValue)
+          settings.size = std::max(std::atoi(argv[++i]), 4);
+        else if (argument == "-t" && hasValue)
+          settings.threads = std::max(std::atoi(argv[++i]), 1);
+        else if (argument == "-r" && hasValue)
+          settings.runs = std::max(std::atoi(argv[++i]), 1);
+        else
+          return false;
+      }
+    return true;
+  }
+
+  // best time of body over runs, in seconds
+  double bestTime(int runs, const std::function<void()> &body)
+  {
+    double best = 0.0;
+    for (int run = 0; run < runs; ++run)
+      {
+        auto start = std::chrono::steady_clock::now();
+        body();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = run == 0 ? elapsed.count() : std::min(best, elapsed.count());
+      }
+    return best;
+  }
+
+  struct Filter
+  {
+    const char *name;
+    MipOptions options;
+  };
+
+  std::vector<Filter> filters()
+  {
+    MipOptions box, srgbBox, kaiser, srgbKaiser, cutout, premultiplied;
+    srgbBox.srgb = true;
+    kaiser.filter = MipFilter::Kaiser;
+    srgbKaiser = kaiser;
+    srgbKaiser.srgb = true;
+    cutout = srgbKaiser;
+    cutout.alphaCutoff = 0.5f;
+    premultiplied = srgbKaiser;
+    premultiplied.premultipliedAlpha = true;
+    return {{"box", box}, {"sRGB box", srgbBox}, {"Kaiser", kaiser}, {"sRGB Kaiser", srgbKaiser}, {"sRGB Kaiser, cutoff 0.5", cutout},
+            {"sRGB Kaiser, premultiplied", premultiplied}};
+  }
+
+  bool cpuHasAvx()
+  {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    return __builtin_cpu_supports("avx") != 0;
+#else
+    return false;
+#endif
+  }
+
+  // the chain of image, level 0 first
+  std::vector<unsigned char> chainOf(const std::vector<unsigned char> &image, int width, int height, int channels, const MipOptions &options,
+                                     bool avx, ThreadPool *pool)
+  {
+    std::vector<MipLevel> levels = mipChainLayout(width, height, channels);
+    std::vector<unsigned char> chain(mipChainBytes(levels));
+    std::memcpy(chain.data(), image.data(), levels[0].bytes);
+    setMipChainAvx(avx);
+    buildMipChain(chain.data(), levels, channels, options, pool);
+    setMipChainAvx(true);
+    return chain;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  Settings settings;
+  if (!parseArguments(argc, argv, settings))
+    {
+      std::cout << "usage: mipbench [-s size] [-t threads] [-r runs]" << std::endl;
+      return 2;
+    }
+
+  ThreadPool pool(static_cast<std::size_t>(settings.threads));
+  std::mt19937 random(1);
+  auto texels = static_cast<std::size_t>(settings.size) * static_cast<std::size_t>(settings.size);
+  std::vector<unsigned char> image(4 * texels);
+  for (unsigned char &byte : image)
+    byte = static_cast<unsigned char>(random());
+
+  const int sizes[2][2] = {{settings.size, settings.size}, {settings.size / 2 + 1, settings.size / 2 - 1}};
+  const std::vector<Filter> all = filters();
+  for (const auto &size : sizes)
+    for (int channels = 1; channels <= 4; ++channels)
+      for (const Filter &filter : all)
+        {
+          std::vector<unsigned char> expected = chainOf(image, size[0], size[1], channels, filter.options, false, nullptr);
+          for (int way = 1; way < 4; ++way)
+            if (chainOf(image, size[0], size[1], channels, filter.options, way % 2 != 0, way >= 2 ? &pool : nullptr) != expected)
+              {
+                std::cout << filter.name << ", " << size[0] << " x " << size[1] << " x " << channels << (way % 2 != 0 ? ", AVX" : ", SSE2")
+                          << (way >= 2 ? " on the pool" : "") << ": differs from the reference" << std::endl;
+                return 1;
+              }
+        }
+  std::cout << "AVX and pool chains match the SSE2 ones" << std::endl;
+
+  std::cout << settings.size << " x " << settings.size << " RGBA, the CPU " << (cpuHasAvx() ? "has" : "lacks") << " AVX, a pool of "
+            << settings.threads << ", best of " << settings.runs << " runs" << std::endl;
+  for (const Filter &filter : all)
+    {
+      std::cout << filter.name << ":";
+      for (int way = 0; way < 4; ++way)
+        {
+          bool avx = way % 2 != 0;
+          ThreadPool *on = way >= 2 ? &pool : nullptr;
+          double seconds = bestTime(settings.runs, [&] { chainOf(image, settings.size, settings.size, 4, filter.options, avx, on); });
+          std::cout << (way == 0 ? " " : ", ") << (avx ? "AVX" : "SSE2") << (on != nullptr ? " on the pool " : " ") << seconds * 1000.0 << " ms";
+        }
+      std::cout << std::endl;
+    }
+  return 0;
+}
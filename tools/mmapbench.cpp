@@ -0,0 +1,178 @@
+// mmapbench: images decoded through stbi_load's stdio path against a
+// MappedFile and stbi_load_from_memory_with_options, as TextureLoader
+// does.
+//
+//   mmapbench [-r runs] [image...]
+//
+// Loads each image (data/container.jpg and data/wall.jpg by default) both
+// ways, checks they give the same pixels, and prints the best of runs
+// loads' time, file open included. stbi_load refills a 128 byte buffer
+// with one fread per refill: those are counted once through callbacks
+// doing what its own do. Where /proc/self/io exists, the read() calls
+// under a load are counted too; the mapping makes none, its page faults
+// are in the time. The files are in the page cache after the first run,
+// so this is the copying and the calls, not the disk.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <stb_image.h>
+
+#include "mapped_file.hpp"
+
+namespace
+{
+  struct Settings
+  {
+    int runs = 20;
+    std::vector<std::string> images;
+  };
+
+  bool parseArguments(int argc, char **argv, Settings &settings)
+  {
+    for (int i = 1; i < argc; ++i)
+      {
+        std::string argument = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (argument == "-r" && hasValue)
+          settings.runs = std::max(std::atoi(argv[++i]), 1);
+        else if (!argument.empty() && argument[0] != '-')
+          settings.images.push_back(argument);
+        else
+          return false;
+      }
+    if (settings.images.empty())
+      settings.images = {"data/container.jpg", "data/wall.jpg"};
+    return true;
+  }
+
+  // best time of body over runs, in seconds
+  double bestTime(int runs, const std::function<void()> &body)
+  {
+    double best = 0.0;
+    for (int run = 0; run < runs; ++run)
+      {
+        auto start = std::chrono::steady_clock::now();
+        body();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = run == 0 ? elapsed.count() : std::min(best, elapsed.count());
+      }
+    return best;
+  }
+
+  // read() calls the process made so far, -1 without /proc/self/io
+  long readCalls()
+  {
+    std::FILE *file = std::fopen("/proc/self/io", "r");
+    if (file == nullptr)
+      return -1;
+    long calls = -1;
+    char line[128];
+    while (std::fgets(line, sizeof(line), file) != nullptr)
+      if (std::strncmp(line, "syscr:", 6) == 0)
+        calls = std::atol(line + 6);
+    std::fclose(file);
+    return calls;
+  }
+
+  // read() calls made by body, less those of reading /proc/self/io
+  long readCallsOf(const std::function<void()> &body)
+  {
+    long start = readCalls();
+    long probe = readCalls() - start;
+    start = readCalls();
+    body();
+    long end = readCalls();
+    return start < 0 || end < 0 ? -1 : end - start - probe;
+  }
+
+  // stbi_load's callbacks, counting the freads
+  struct CountingFile
+  {
+    std::FILE *file;
+    long reads;
+  };
+
+  stbi_uc *countedLoad(const std::string &path, long &reads, int &width, int &height, int &channels)
+  {
+    CountingFile counting = {std::fopen(path.c_str(), "rb"), 0};
+    if (counting.file == nullptr)
+      return nullptr;
+    stbi_io_callbacks callbacks;
+    callbacks.read = [](void *user, char *data, int size)
+      {
+        auto *file = static_cast<CountingFile*>(user);
+        ++file->reads;
+        return static_cast<int>(std::fread(data, 1, static_cast<std::size_t>(size), file->file));
+      };
+    callbacks.skip = [](void *user, int n) { std::fseek(static_cast<CountingFile*>(user)->file, n, SEEK_CUR); };
+    callbacks.eof = [](void *user) { return std::feof(static_cast<CountingFile*>(user)->file); };
+    stbi_uc *image = stbi_load_from_callbacks(&callbacks, &counting, &width, &height, &channels, 0);
+    std::fclose(counting.file);
+    reads = counting.reads;
+    return image;
+  }
+
+  stbi_uc *mappedLoad(const std::string &path, int &width, int &height, int &channels)
+  {
+    MappedFile file;
+    if (!file.open(path))
+      return nullptr;
+    stbi_load_options options;
+    stbi_load_options_init(&options);
+    return stbi_load_from_memory_with_options(file.data(), static_cast<int>(file.size()), &width, &height, &channels, &options);
+  }
+
+  std::string calls(long count)
+  {
+    return count < 0 ? "n/a" : std::to_string(count);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  Settings settings;
+  if (!parseArguments(argc, argv, settings))
+    {
+      std::cout << "usage: mmapbench [-r runs] [image...]" << std::endl;
+      return 2;
+    }
+
+  for (const std::string &path : settings.images)
+    {
+      int width, height, channels, mappedWidth, mappedHeight, mappedChannels;
+      long freads = 0;
+      stbi_uc *counted = countedLoad(path, freads, width, height, channels);
+      stbi_uc *mapped = mappedLoad(path, mappedWidth, mappedHeight, mappedChannels);
+      if (counted == nullptr || mapped == nullptr)
+        {
+          std::cout << path << ": " << stbi_failure_reason() << std::endl;
+          return 1;
+        }
+      auto size = static_cast<std::size_t>(width) * static_cast<std::size_t>(height) * static_cast<std::size_t>(channels);
+      bool same = width == mappedWidth && height == mappedHeight && channels == mappedChannels && std::memcmp(counted, mapped, size) == 0;
+      stbi_image_free(counted);
+      stbi_image_free(mapped);
+      if (!same)
+        {
+          std::cout << path << ": differs from the reference" << std::endl;
+          return 1;
+        }
+
+      auto stdioLoad = [&] { stbi_image_free(stbi_load(path.c_str(), &width, &height, &channels, 0)); };
+      auto mmapLoad = [&] { stbi_image_free(mappedLoad(path, width, height, channels)); };
+      long stdioReads = readCallsOf(stdioLoad);
+      long mappedReads = readCallsOf(mmapLoad);
+      double stdioTime = bestTime(settings.runs, stdioLoad);
+      double mappedTime = bestTime(settings.runs, mmapLoad);
+      std::cout << path << ", " << width << " x " << height << ": stdio " << stdioTime * 1000.0 << " ms, " << freads << " freads, "
+                << calls(stdioReads) << " read calls; mapped " << mappedTime * 1000.0 << " ms, " << calls(mappedReads) << " read calls" << std::endl;
+    }
+  return 0;
+}
@@ -0,0 +1,282 @@
+// packbench: time opening and reading many small assets at startup, as
+// loose files and out of an asset pack, with the page cache cold and warm.
+//
+//   packbench [-n assets] [-s bytes] [-r runs] [directory]
+//
+// Writes the assets (random bytes, 1000 of 4 KiB by default) into
+// directory/loose/ and directory/bench.pack, then for each layout times a
+// FileSystem set up as the sandbox does it and opening and summing every
+// asset. The loose files are also read in one batch through an AsyncReader,
+// whose queue depth and latency are printed with the time. Cold runs evict
+// the files from the page cache first (Linux only), each layout's best run
+// is printed.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "asset_pack.hpp"
+#include "async_reader.hpp"
+#include "file_system.hpp"
+#include "thread_pool.hpp"
+
+namespace
+{
+  struct Settings
+  {
+    std::size_t assets = 1000;
+    std::size_t bytes = 4096;
+    int runs = 5;
+    std::string directory = "packbench";
+  };
+
+  bool parseArguments(int argc, char **argv, Settings &settings)
+  {
+    for (int i = 1; i < argc; ++i)
+      {
+        std::string argument = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (argument == "-n" && hasValue)
+          settings.assets = static_cast<std::size_t>(std::max(std::atoi(argv[++i]), 1));
+        else if (argument == "-s" && hasValue)
+          settings.bytes = static_cast<std::size_t>(std::max(std::atoi(argv[++i]), 1));
+        else if (argument == "-r" && hasValue)
+          settings.runs = std::max(std::atoi(argv[++i]), 1);
+        else if (!argument.empty() && argument[0] != '-')
+          settings.directory = argument;
+        else
+          return false;
+      }
+    return true;
+  }
+
+  void makeDirectory(const std::string &path)
+  {
+#ifdef _WIN32
+    _mkdir(path.c_str());
+#else
+    mkdir(path.c_str(), 0755);
+#endif
+  }
+
+  std::string assetName(std::size_t index)
+  {
+    char name[32];
+    std::snprintf(name, sizeof(name), "asset%04zu.bin", index);
+    return name;
+  }
+
+  bool writeFile(const std::string &path, const std::vector<unsigned char> &data)
+  {
+    std::FILE *file = std::fopen(path.c_str(), "wb");
+    if (file == nullptr)
+      return false;
+    bool complete = std::fwrite(data.data(), 1, data.size(), file) == data.size();
+    return std::fclose(file) == 0 && complete;
+  }
+
+  // drop path's pages from the page cache, false where that isn't possible
+  bool evict(const std::string &path)
+  {
+#ifdef __linux__
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+    bool dropped = fdatasync(fd) == 0 && posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+    ::close(fd);
+    return dropped;
+#else
+    (void)path;
+    return false;
+#endif
+  }
+
+  // one startup: set up files, open and read every asset. The sum keeps
+  // the reads from being optimized out
+  unsigned long startup(const std::function<void(FileSystem&)> &setUp, const std::vector<std::string> &names, std::size_t &opens)
+  {
+    FileSystem files;
+    setUp(files);
+    unsigned long sum = 0;
+    for (const std::string &name : names)
+      {
+        FileView file;
+        std::string error;
+        if (!files.open(name, file, error))
+          {
+            std::cout << error << std::endl;
+            std::exit(1);
+          }
+        for (std::size_t i = 0; i < file.size(); ++i)
+          sum += file.data()[i];
+      }
+    opens = files.looseOpens() + (files.pack().isOpen() ? 1 : 0);
+    return sum;
+  }
+
+  // the same for loose files read through an AsyncReader, all submitted
+  // at once and summed on pool as they complete
+  unsigned long asyncStartup(ThreadPool &pool, const std::vector<std::string> &paths, AsyncReadStats &stats, bool &ioUring)
+  {
+    std::atomic<unsigned long> sum(0);
+    std::size_t completed = 0;
+    std::mutex mutex;
+    std::condition_variable done;
+    AsyncReader reader(pool);
+    for (const std::string &path : paths)
+      reader.read(path, [&](AsyncRead &read)
+        {
+          if (!read.error.empty())
+            {
+              std::cout << read.error << std::endl;
+              std::exit(1);
+            }
+          unsigned long part = 0;
+          for (unsigned char byte : read.data)
+            part += byte;
+          sum += part;
+          std::lock_guard<std::mutex> lock(mutex);
+          if (++completed == paths.size())
+            done.notify_all();
+        });
+    reader.submit();
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&] { return completed == paths.size(); });
+    stats = reader.stats();
+    ioUring = reader.usesIoUring();
+    return sum;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  Settings settings;
+  if (!parseArguments(argc, argv, settings))
+    {
+      std::cout << "usage: packbench [-n assets] [-s bytes] [-r runs] [directory]" << std::endl;
+      return 2;
+    }
+
+  std::string looseDirectory = settings.directory + "/loose";
+  std::string packPath = settings.directory + "/bench.pack";
+  makeDirectory(settings.directory);
+  makeDirectory(looseDirectory);
+  std::mt19937 random(1);
+  std::vector<std::string> names;
+  std::vector<PackEntry> entries;
+  for (std::size_t i = 0; i < settings.assets; ++i)
+    {
+      PackEntry entry;
+      entry.name = assetName(i);
+      entry.data.resize(settings.bytes);
+      for (unsigned char &byte : entry.data)
+        byte = static_cast<unsigned char>(random());
+      if (!writeFile(looseDirectory + "/" + entry.name, entry.data))
+        {
+          std::cout << "can't write " << looseDirectory << "/" << entry.name << std::endl;
+          return 1;
+        }
+      names.push_back(entry.name);
+      entries.push_back(std::move(entry));
+    }
+  std::string error;
+  if (!writeAssetPack(packPath, entries, error))
+    {
+      std::cout << error << std::endl;
+      return 1;
+    }
+  std::cout << settings.assets << " assets of " << settings.bytes << " bytes" << std::endl;
+
+  struct Layout
+  {
+    const char *name;
+    std::function<void(FileSystem&)> setUp;
+    std::vector<std::string> files;
+    // read files through an AsyncReader instead of setUp's FileSystem
+    bool async = false;
+  };
+  std::vector<Layout> layouts(3);
+  layouts[0].name = "loose";
+  layouts[0].setUp = [&](FileSystem &files) { files.addDirectory(looseDirectory); };
+  for (const std::string &name : names)
+    layouts[0].files.push_back(looseDirectory + "/" + name);
+  layouts[1].name = "pack";
+  layouts[1].setUp = [&](FileSystem &files)
+    {
+      if (!files.mount(packPath))
+        {
+          std::cout << files.error() << std::endl;
+          std::exit(1);
+        }
+    };
+  layouts[1].files.push_back(packPath);
+  layouts[2].name = "loose, async";
+  layouts[2].files = layouts[0].files;
+  layouts[2].async = true;
+
+  ThreadPool pool;
+  AsyncReadStats reads;
+  bool ioUring = false;
+  auto run = [&](const Layout &layout, std::size_t &opens)
+    {
+      if (!layout.async)
+        return startup(layout.setUp, names, opens);
+      opens = layout.files.size();
+      return asyncStartup(pool, layout.files, reads, ioUring);
+    };
+
+  unsigned long expected = 0;
+  for (bool cold : {true, false})
+    for (const Layout &layout : layouts)
+      {
+        double best = 0.0;
+        std::size_t opens = 0;
+        bool evicted = true;
+        for (int attempt = 0; attempt < settings.runs; ++attempt)
+          {
+            if (cold)
+              for (const std::string &file : layout.files)
+                evicted = evict(file) && evicted;
+            else if (attempt == 0)
+              run(layout, opens);
+            auto start = std::chrono::steady_clock::now();
+            unsigned long sum = run(layout, opens);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            if (expected == 0)
+              expected = sum;
+            if (sum != expected)
+              {
+                std::cout << layout.name << ": read different bytes" << std::endl;
+                return 1;
+              }
+            best = attempt == 0 ? elapsed.count() : std::min(best, elapsed.count());
+          }
+        if (cold && !evicted)
+          {
+            std::cout << layout.name << " cold: can't evict files from the page cache here" << std::endl;
+            continue;
+          }
+        std::cout << layout.name << (cold ? " cold: " : " warm: ") << best * 1000.0 << " ms, " << opens << " file opens" << std::endl;
+        if (layout.async)
+          std::cout << "  " << (ioUring ? "through io_uring" : "through preads") << ", queue depth " << reads.meanQueueDepth << " mean "
+                    << reads.maxQueueDepth << " max, latency " << reads.meanLatency * 1000.0 << " ms mean " << reads.maxLatency * 1000.0
+                    << " ms max" << std::endl;
+      }
+  return 0;
+}
@@ -0,0 +1,240 @@
+// pixelbench: throughput of the texel conversions done for uploads, each
+// checked against a plain per-pixel loop first.
+//
+//   pixelbench [-w width] [-h height] [-r runs]
+//
+// Converts a random width x height image (2048 x 2048 by default) with
+// each kernel and prints the best run's GB/s, counting the bytes read.
+// Expanding RGB and gray to RGBA is stb_image's, while loading: it is timed
+// as the difference between a load of a binary PNM with desired_channels 4
+// and one as stored. The premultiply check covers every color with every
+// alpha.
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <stb_image.h>
+
+#include "pixel_convert.hpp"
+
+namespace
+{
+  struct Settings
+  {
+    int width = 2048;
+    int height = 2048;
+    int runs = 10;
+  };
+
+  bool parseArguments(int argc, char **argv, Settings &settings)
+  {
+    for (int i = 1; i < argc; ++i)
+      {
+        std::string argument = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (argument == "-w" && hasValue)
+          settings.width = std::max(std::atoi(argv[++i]), 1);
+        else if (argument == "-h" && hasValue)
+          settings.height = std::max(std::atoi(argv[++i]), 1);
+        else if (argument == "-r" && hasValue)
+          settings.runs = std::max(std::atoi(argv[++i]), 1);
+        else
+          return false;
+      }
+    return true;
+  }
+
+  // best time of body over runs, in seconds
+  double bestTime(int runs, const std::function<void()> &body)
+  {
+    double best = 0.0;
+    for (int run = 0; run < runs; ++run)
+      {
+        auto start = std::chrono::steady_clock::now();
+        body();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = run == 0 ? elapsed.count() : std::min(best, elapsed.count());
+      }
+    return best;
+  }
+
+  void report(const char *kernel, std::size_t bytes, double seconds)
+  {
+    std::cout << kernel << ": " << static_cast<double>(bytes) / seconds / 1e9 << " GB/s" << std::endl;
+  }
+
+  // what the kernels must match
+  void referenceBgra(const unsigned char *src, unsigned char *dst, std::size_t pixels)
+  {
+    for (std::size_t i = 0; i < pixels; ++i)
+      {
+        dst[4 * i] = src[4 * i + 2];
+        dst[4 * i + 1] = src[4 * i + 1];
+        dst[4 * i + 2] = src[4 * i];
+        dst[4 * i + 3] = src[4 * i + 3];
+      }
+  }
+
+  void reference565(const unsigned char *src, std::uint16_t *dst, std::size_t pixels)
+  {
+    // round(value * steps / 255)
+    auto scale = [](unsigned value, unsigned steps) { return (value * steps * 2 + 255) / 510; };
+    for (std::size_t i = 0; i < pixels; ++i)
+      dst[i] = static_cast<std::uint16_t>(scale(src[3 * i], 31) << 11 | scale(src[3 * i + 1], 63) << 5 | scale(src[3 * i + 2], 31));
+  }
+
+  void referencePremultiply(const unsigned char *src, unsigned char *dst, int channels, std::size_t pixels)
+  {
+    auto stride = static_cast<std::size_t>(channels);
+    for (std::size_t i = 0; i < pixels * stride; i += stride)
+      {
+        unsigned alpha = src[i + stride - 1];
+        for (std::size_t c = 0; c + 1 < stride; ++c)
+          dst[i + c] = static_cast<unsigned char>((src[i + c] * alpha + 127) / 255);
+        dst[i + stride - 1] = static_cast<unsigned char>(alpha);
+      }
+  }
+
+  // every color with every alpha, then the rest of the image's pixels:
+  // the kernel must match the reference bit for bit
+  bool benchPremultiply(const char *kernel, const Settings &settings, int channels, const std::vector<unsigned char> &random)
+  {
+    auto stride = static_cast<std::size_t>(channels);
+    std::vector<unsigned char> pixels(random.begin(), random.begin() + static_cast<std::ptrdiff_t>(random.size() / 4 * stride));
+    std::size_t count = pixels.size() / stride;
+    for (std::size_t i = 0; i < std::min<std::size_t>(count, 65536); ++i)
+      {
+        for (std::size_t c = 0; c + 1 < stride; ++c)
+          pixels[i * stride + c] = static_cast<unsigned char>(i >> 8);
+        pixels[i * stride + stride - 1] = static_cast<unsigned char>(i);
+      }
+    std::vector<unsigned char> expected(pixels.size());
+    std::vector<unsigned char> premultiplied(pixels.size());
+    referencePremultiply(pixels.data(), expected.data(), channels, count);
+    premultiplyAlpha(pixels.data(), premultiplied.data(), channels, count);
+    if (premultiplied != expected)
+      {
+        std::cout << kernel << ": differs from the reference" << std::endl;
+        return false;
+      }
+    std::string plain = std::string(kernel) + ", plain loop";
+    report(plain.c_str(), pixels.size(),
+           bestTime(settings.runs, [&] { referencePremultiply(pixels.data(), premultiplied.data(), channels, count); }));
+    report(kernel, pixels.size(), bestTime(settings.runs, [&] { premultiplyAlpha(pixels.data(), premultiplied.data(), channels, count); }));
+    return true;
+  }
+
+  void referenceRgba(const unsigned char *src, int channels, unsigned char *dst, std::size_t pixels)
+  {
+    auto stride = static_cast<std::size_t>(channels);
+    for (std::size_t i = 0; i < pixels; ++i)
+      {
+        const unsigned char *texel = src + stride * i;
+        dst[4 * i] = texel[0];
+        dst[4 * i + 1] = texel[channels == 3 ? 1 : 0];
+        dst[4 * i + 2] = texel[channels == 3 ? 2 : 0];
+        dst[4 * i + 3] = 255;
+      }
+  }
+
+  // a binary PGM (1 channel) or PPM (3) holding pixels
+  std::vector<unsigned char> pnmFile(const Settings &settings, int channels, const std::vector<unsigned char> &pixels)
+  {
+    std::string header = (channels == 1 ? "P5\n" : "P6\n") + std::to_string(settings.width) + " " + std::to_string(settings.height) + "\n255\n";
+    std::vector<unsigned char> file(header.begin(), header.end());
+    file.insert(file.end(), pixels.begin(), pixels.end());
+    return file;
+  }
+
+  // time stb_image's expansion of channels to RGBA, false when its result
+  // is wrong
+  bool benchExpand(const char *kernel, const Settings &settings, int channels, const std::vector<unsigned char> &pixels)
+  {
+    auto count = static_cast<std::size_t>(settings.width) * static_cast<std::size_t>(settings.height);
+    std::vector<unsigned char> file = pnmFile(settings, channels, pixels);
+    auto load = [&](int desiredChannels)
+      {
+        int width, height, fileChannels;
+        stbi_uc *image = stbi_load_from_memory(file.data(), static_cast<int>(file.size()), &width, &height, &fileChannels, desiredChannels);
+        if (image == nullptr)
+          {
+            std::cout << kernel << ": " << stbi_failure_reason() << std::endl;
+            std::exit(1);
+          }
+        return image;
+      };
+
+    std::vector<unsigned char> expected(4 * count);
+    referenceRgba(pixels.data(), channels, expected.data(), count);
+    stbi_uc *image = load(4);
+    bool matches = std::memcmp(image, expected.data(), expected.size()) == 0;
+    stbi_image_free(image);
+    if (!matches)
+      {
+        std::cout << kernel << ": differs from the reference" << std::endl;
+        return false;
+      }
+
+    double stored = bestTime(settings.runs, [&] { stbi_image_free(load(0)); });
+    double expanded = bestTime(settings.runs, [&] { stbi_image_free(load(4)); });
+    report(kernel, pixels.size(), std::max(expanded - stored, 1e-9));
+    return true;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  Settings settings;
+  if (!parseArguments(argc, argv, settings))
+    {
+      std::cout << "usage: pixelbench [-w width] [-h height] [-r runs]" << std::endl;
+      return 2;
+    }
+
+  auto count = static_cast<std::size_t>(settings.width) * static_cast<std::size_t>(settings.height);
+  std::mt19937 random(1);
+  std::vector<unsigned char> rgba(4 * count);
+  for (unsigned char &byte : rgba)
+    byte = static_cast<unsigned char>(random());
+  std::vector<unsigned char> rgb(rgba.begin(), rgba.begin() + static_cast<std::ptrdiff_t>(3 * count));
+  std::vector<unsigned char> gray(rgba.begin(), rgba.begin() + static_cast<std::ptrdiff_t>(count));
+  std::cout << settings.width << " x " << settings.height << ", best of " << settings.runs << " runs" << std::endl;
+
+  std::vector<unsigned char> bgra(4 * count);
+  std::vector<unsigned char> expectedBgra(4 * count);
+  referenceBgra(rgba.data(), expectedBgra.data(), count);
+  swizzleRgbaToBgra(rgba.data(), bgra.data(), count);
+  if (bgra != expectedBgra)
+    {
+      std::cout << "RGBA to BGRA: differs from the reference" << std::endl;
+      return 1;
+    }
+  report("RGBA to BGRA, plain loop", rgba.size(), bestTime(settings.runs, [&] { referenceBgra(rgba.data(), bgra.data(), count); }));
+  report("RGBA to BGRA", rgba.size(), bestTime(settings.runs, [&] { swizzleRgbaToBgra(rgba.data(), bgra.data(), count); }));
+
+  std::vector<std::uint16_t> packed(count);
+  std::vector<std::uint16_t> expectedPacked(count);
+  reference565(rgb.data(), expectedPacked.data(), count);
+  packRgbTo565(rgb.data(), packed.data(), count);
+  if (packed != expectedPacked)
+    {
+      std::cout << "RGB to RGB565: differs from the reference" << std::endl;
+      return 1;
+    }
+  report("RGB to RGB565, plain loop", rgb.size(), bestTime(settings.runs, [&] { reference565(rgb.data(), packed.data(), count); }));
+  report("RGB to RGB565", rgb.size(), bestTime(settings.runs, [&] { packRgbTo565(rgb.data(), packed.data(), count); }));
+
+  if (!benchPremultiply("premultiply RGBA", settings, 4, rgba) || !benchPremultiply("premultiply gray and alpha", settings, 2, rgba))
+    return 1;
+
+  if (!benchExpand("RGB to RGBA (stb_image)", settings, 3, rgb) || !benchExpand("gray to RGBA (stb_image)", settings, 1, gray))
+    return 1;
+  return 0;
+}
@@ -0,0 +1,798 @@
+// pngbench: stb_image's PNG decoding and zlib inflate against stb_image
+// v2.19, the version first shipped (libs/stb_image_reference): bit for bit
+// over generated files and streams, then timed.
+//
+//   pngbench [-n files] [-r runs] [png...]
+//
+// Writes n PNG files (1000 by default) of every color type and bit depth,
+// interlaced or not, with random scanlines under each filter type, and
+// deflates them with stored, fixed and dynamic Huffman blocks of random
+// code lengths and matches of every length and distance. Both decoders
+// load each as stored, as RGBA and flipped, and must give the same bytes.
+// Then n zlib streams of runs, repeats, text and noise go through each
+// stbi_zlib_decode_* call of both, which must give back what was deflated,
+// and again with a few bits flipped, where both must fail or agree; only
+// stb_image checks for reading past the input or its tables, so it may
+// fail alone there.
+// The timing is the best of runs inflates of a 64 MiB stream, and loads of
+// each png given (a 2048 x 2048 RGBA drawing by default), with either
+// decoder.
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <stb_image.h>
+#include <stb_image_reference.h>
+
+namespace
+{
+  struct Settings
+  {
+    int files = 1000;
+    int runs = 10;
+    std::vector<std::string> images;
+  };
+
+  bool parseArguments(int argc, char **argv, Settings &settings)
+  {
+    for (int i = 1; i < argc; ++i)
+      {
+        std::string argument = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (argument == "-n" && hasValue)
+          settings.files = std::max(std::atoi(argv[++i]), 0);
+        else if (argument == "-r" && hasValue)
+          settings.runs = std::max(std::atoi(argv[++i]), 1);
+        else if (!argument.empty() && argument[0] != '-')
+          settings.images.push_back(argument);
+        else
+          return false;
+      }
+    return true;
+  }
+
+  // best time of body over runs, in seconds
+  double bestTime(int runs, const std::function<void()> &body)
+  {
+    double best = 0.0;
+    for (int run = 0; run < runs; ++run)
+      {
+        auto start = std::chrono::steady_clock::now();
+        body();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = run == 0 ? elapsed.count() : std::min(best, elapsed.count());
+      }
+    return best;
+  }
+
+  int randomInt(std::mt19937 &random, int low, int high)
+  {
+    return std::uniform_int_distribution<int>(low, high)(random);
+  }
+
+  // bits out least significant first, as deflate packs them
+  class BitWriter
+  {
+  public:
+    void put(std::uint32_t value, int count)
+    {
+      buffer |= static_cast<std::uint64_t>(value) << filled;
+      filled += count;
+      for (; filled >= 8; filled -= 8, buffer >>= 8)
+        bytes.push_back(static_cast<unsigned char>(buffer));
+    }
+
+    // Huffman codes go most significant bit first
+    void putCode(std::uint32_t code, int length)
+    {
+      std::uint32_t reversed = 0;
+      for (int i = 0; i < length; ++i)
+        reversed |= (code >> i & 1) << (length - 1 - i);
+      put(reversed, length);
+    }
+
+    void alignToByte()
+    {
+      if (filled > 0)
+        put(0, 8 - filled);
+    }
+
+    std::vector<unsigned char> bytes;
+
+  private:
+    std::uint64_t buffer = 0;
+    int filled = 0;
+  };
+
+  // a literal when length is 0, a match otherwise
+  struct Token
+  {
+    int length;
+    int distance;
+    unsigned char literal;
+  };
+
+  const int lengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+  const int lengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+  const int distanceBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769,
+                                1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+  const int distanceExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+  // order of the code length code's lengths in a dynamic block header
+  const int lengthOrder[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+  int lengthCode(int length)
+  {
+    int code = 28;
+    while (lengthBase[code] > length)
+      --code;
+    return code;
+  }
+
+  int distanceCode(int distance)
+  {
+    int code = 29;
+    while (distanceBase[code] > distance)
+      --code;
+    return code;
+  }
+
+  // canonical codes for lengths, as deflate assigns them
+  std::vector<std::uint32_t> canonicalCodes(const std::vector<int> &lengths)
+  {
+    int counts[16] = {};
+    for (int length : lengths)
+      ++counts[length];
+    counts[0] = 0;
+    std::uint32_t next[16] = {};
+    std::uint32_t code = 0;
+    for (int bits = 1; bits < 16; ++bits)
+      next[bits] = code = (code + static_cast<std::uint32_t>(counts[bits - 1])) << 1;
+    std::vector<std::uint32_t> codes(lengths.size());
+    for (std::size_t symbol = 0; symbol < lengths.size(); ++symbol)
+      if (lengths[symbol] != 0)
+        codes[symbol] = next[lengths[symbol]]++;
+    return codes;
+  }
+
+  // a complete prefix code of random shape over the symbols used, none
+  // longer than maxLength: leaves split at random until there are enough
+  std::vector<int> randomLengths(const std::vector<bool> &used, int maxLength, std::mt19937 &random)
+  {
+    std::vector<std::size_t> symbols;
+    for (std::size_t symbol = 0; symbol < used.size(); ++symbol)
+      if (used[symbol])
+        symbols.push_back(symbol);
+    std::vector<int> leaves = {1, 1};
+    while (leaves.size() < symbols.size())
+      {
+        std::size_t leaf;
+        do
+          leaf = static_cast<std::size_t>(randomInt(random, 0, static_cast<int>(leaves.size()) - 1));
+        while (leaves[leaf] == maxLength);
+        leaves.push_back(++leaves[leaf]);
+      }
+    std::shuffle(leaves.begin(), leaves.end(), random);
+    std::vector<int> lengths(used.size(), 0);
+    for (std::size_t i = 0; i < symbols.size(); ++i)
+      lengths[symbols[i]] = leaves[i];
+    return lengths;
+  }
+
+  // the fixed codes' lengths, literal/length then distance
+  std::vector<int> fixedLengths()
+  {
+    std::vector<int> lengths(288 + 30, 5);
+    std::fill(lengths.begin(), lengths.begin() + 144, 8);
+    std::fill(lengths.begin() + 144, lengths.begin() + 256, 9);
+    std::fill(lengths.begin() + 256, lengths.begin() + 280, 7);
+    std::fill(lengths.begin() + 280, lengths.begin() + 288, 8);
+    return lengths;
+  }
+
+  void putTokens(BitWriter &out, const std::vector<Token> &tokens, const std::vector<int> &literalLengths, const std::vector<int> &distanceLengths)
+  {
+    std::vector<std::uint32_t> literalCodes = canonicalCodes(literalLengths);
+    std::vector<std::uint32_t> distanceCodes = canonicalCodes(distanceLengths);
+    for (const Token &token : tokens)
+      {
+        if (token.length == 0)
+          {
+            out.putCode(literalCodes[token.literal], literalLengths[token.literal]);
+            continue;
+          }
+        int length = lengthCode(token.length);
+        auto symbol = static_cast<std::size_t>(257 + length);
+        out.putCode(literalCodes[symbol], literalLengths[symbol]);
+        out.put(static_cast<std::uint32_t>(token.length - lengthBase[length]), lengthExtra[length]);
+        auto distance = static_cast<std::size_t>(distanceCode(token.distance));
+        out.putCode(distanceCodes[distance], distanceLengths[distance]);
+        out.put(static_cast<std::uint32_t>(token.distance - distanceBase[distance]), distanceExtra[distance]);
+      }
+    out.putCode(literalCodes[256], literalLengths[256]);
+  }
+
+  // a dynamic Huffman block: random codes over the symbols tokens use,
+  // their lengths run-length coded with a random code length code
+  void putDynamicBlock(BitWriter &out, const std::vector<Token> &tokens, std::mt19937 &random)
+  {
+    std::vector<bool> literals(286, false);
+    std::vector<bool> distances(30, false);
+    literals[256] = true;
+    for (const Token &token : tokens)
+      if (token.length == 0)
+        {
+          literals[token.literal] = true;
+        }
+      else
+        {
+          literals[static_cast<std::size_t>(257 + lengthCode(token.length))] = true;
+          distances[static_cast<std::size_t>(distanceCode(token.distance))] = true;
+        }
+    // a code needs two symbols; extra ones leave gaps of zeros to code
+    for (int extra = randomInt(random, 1, 3); extra > 0; --extra)
+      {
+        literals[static_cast<std::size_t>(randomInt(random, 0, 285))] = true;
+        distances[static_cast<std::size_t>(randomInt(random, 0, 29))] = true;
+      }
+    std::vector<int> literalLengths = randomLengths(literals, 15, random);
+    std::vector<int> distanceLengths = randomLengths(distances, 15, random);
+    std::size_t literalCount = 286;
+    while (literalLengths[literalCount - 1] == 0)
+      --literalCount;
+    std::size_t distanceCount = 30;
+    while (distanceLengths[distanceCount - 1] == 0)
+      --distanceCount;
+
+    // both lengths in one run, 16 repeats the previous one, 17 and 18 are
+    // runs of zeros
+    std::vector<int> all(literalLengths.begin(), literalLengths.begin() + static_cast<std::ptrdiff_t>(literalCount));
+    all.insert(all.end(), distanceLengths.begin(), distanceLengths.begin() + static_cast<std::ptrdiff_t>(distanceCount));
+    std::vector<std::pair<int, int>> runs;
+    for (std::size_t i = 0; i < all.size();)
+      {
+        std::size_t run = 1;
+        while (i + run < all.size() && all[i + run] == all[i])
+          ++run;
+        if (all[i] == 0 && run >= 11)
+          run = std::min<std::size_t>(run, 138), runs.emplace_back(18, static_cast<int>(run - 11));
+        else if (all[i] == 0 && run >= 3)
+          run = std::min<std::size_t>(run, 10), runs.emplace_back(17, static_cast<int>(run - 3));
+        else if (i > 0 && all[i] == all[i - 1] && run >= 3)
+          run = std::min<std::size_t>(run, 6), runs.emplace_back(16, static_cast<int>(run - 3));
+        else
+          run = 1, runs.emplace_back(all[i], 0);
+        i += run;
+      }
+    std::vector<bool> lengthSymbols(19, false);
+    for (auto &entry : runs)
+      lengthSymbols[static_cast<std::size_t>(entry.first)] = true;
+    lengthSymbols[static_cast<std::size_t>(randomInt(random, 0, 18))] = true;
+    lengthSymbols[static_cast<std::size_t>(randomInt(random, 0, 18))] = true;
+    if (std::count(lengthSymbols.begin(), lengthSymbols.end(), true) < 2)
+      lengthSymbols[lengthSymbols[0] ? 1 : 0] = true;
+    std::vector<int> lengthLengths = randomLengths(lengthSymbols, 7, random);
+    std::vector<std::uint32_t> lengthCodes = canonicalCodes(lengthLengths);
+    int orderCount = 19;
+    while (lengthLengths[static_cast<std::size_t>(lengthOrder[orderCount - 1])] == 0)
+      --orderCount;
+    orderCount = std::max(orderCount, 4);
+
+    out.put(2, 2);
+    out.put(static_cast<std::uint32_t>(literalCount - 257), 5);
+    out.put(static_cast<std::uint32_t>(distanceCount - 1), 5);
+    out.put(static_cast<std::uint32_t>(orderCount - 4), 4);
+    for (int i = 0; i < orderCount; ++i)
+      out.put(static_cast<std::uint32_t>(lengthLengths[static_cast<std::size_t>(lengthOrder[i])]), 3);
+    const int repeatBits[19] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 3, 7};
+    for (auto &entry : runs)
+      {
+        auto symbol = static_cast<std::size_t>(entry.first);
+        out.putCode(lengthCodes[symbol], lengthLengths[symbol]);
+        out.put(static_cast<std::uint32_t>(entry.second), repeatBits[symbol]);
+      }
+    putTokens(out, tokens, literalLengths, distanceLengths);
+  }
+
+  // greedy matches against the last place each 3 bytes were seen, skipped
+  // now and then so literals show up between them too
+  std::vector<Token> tokenize(const std::vector<unsigned char> &data, std::mt19937 &random)
+  {
+    std::vector<Token> tokens;
+    std::vector<int> last(1 << 16, -1);
+    auto hash = [&](std::size_t i) { return (data[i] * 506832829u ^ data[i + 1] * 2654435761u ^ data[i + 2]) >> 8 & 0xffff; };
+    for (std::size_t i = 0; i < data.size();)
+      {
+        Token token = {0, 0, data[i]};
+        if (i + 3 <= data.size())
+          {
+            auto slot = hash(i);
+            int found = last[slot];
+            last[slot] = static_cast<int>(i);
+            if (found >= 0 && i - static_cast<std::size_t>(found) <= 32768 && randomInt(random, 0, 15) != 0)
+              {
+                auto from = static_cast<std::size_t>(found);
+                std::size_t length = 0;
+                while (length < 258 && i + length < data.size() && data[from + length] == data[i + length])
+                  ++length;
+                if (length >= 3)
+                  token = {static_cast<int>(length), static_cast<int>(i - from), 0};
+              }
+          }
+        tokens.push_back(token);
+        i += token.length == 0 ? 1 : static_cast<std::size_t>(token.length);
+      }
+    return tokens;
+  }
+
+  std::uint32_t adler32(const std::vector<unsigned char> &data)
+  {
+    std::uint32_t a = 1, b = 0;
+    for (unsigned char byte : data)
+      {
+        a = (a + byte) % 65521;
+        b = (b + a) % 65521;
+      }
+    return b << 16 | a;
+  }
+
+  // data as a zlib stream of random blocks: stored, fixed or dynamic
+  std::vector<unsigned char> deflate(const std::vector<unsigned char> &data, std::mt19937 &random)
+  {
+    BitWriter out;
+    out.put(0x78, 8);
+    out.put(0x01, 8);
+    std::vector<Token> tokens = tokenize(data, random);
+    std::size_t position = 0;
+    for (std::size_t first = 0; first < tokens.size() || first == 0;)
+      {
+        std::size_t count = std::min(tokens.size() - first, static_cast<std::size_t>(randomInt(random, 1, 4000)));
+        std::vector<Token> block(tokens.begin() + static_cast<std::ptrdiff_t>(first), tokens.begin() + static_cast<std::ptrdiff_t>(first + count));
+        std::size_t bytes = 0;
+        for (const Token &token : block)
+          bytes += token.length == 0 ? 1 : static_cast<std::size_t>(token.length);
+        first += count;
+        out.put(first >= tokens.size() ? 1 : 0, 1);
+        int type = randomInt(random, 0, 2);
+        if (type == 0 && bytes <= 65535)
+          {
+            out.put(0, 2);
+            out.alignToByte();
+            out.put(static_cast<std::uint32_t>(bytes), 16);
+            out.put(static_cast<std::uint32_t>(~bytes & 0xffff), 16);
+            for (std::size_t i = 0; i < bytes; ++i)
+              out.put(data[position + i], 8);
+          }
+        else if (type == 1)
+          {
+            out.put(1, 2);
+            std::vector<int> lengths = fixedLengths();
+            putTokens(out, block, std::vector<int>(lengths.begin(), lengths.begin() + 288), std::vector<int>(lengths.begin() + 288, lengths.end()));
+          }
+        else
+          {
+            putDynamicBlock(out, block, random);
+          }
+        position += bytes;
+        if (tokens.empty())
+          break;
+      }
+    out.alignToByte();
+    std::uint32_t check = adler32(data);
+    for (int shift = 24; shift >= 0; shift -= 8)
+      out.put(check >> shift & 0xff, 8);
+    return out.bytes;
+  }
+
+  std::uint32_t crc32(const unsigned char *data, std::size_t size, std::uint32_t crc)
+  {
+    crc = ~crc;
+    for (std::size_t i = 0; i < size; ++i)
+      {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; ++bit)
+          crc = crc >> 1 ^ (0xedb88320u & (0u - (crc & 1)));
+      }
+    return ~crc;
+  }
+
+  void putChunk(std::vector<unsigned char> &file, const char *type, const std::vector<unsigned char> &data)
+  {
+    std::size_t start = file.size();
+    for (int shift = 24; shift >= 0; shift -= 8)
+      file.push_back(static_cast<unsigned char>(data.size() >> shift));
+    file.insert(file.end(), type, type + 4);
+    file.insert(file.end(), data.begin(), data.end());
+    std::uint32_t crc = crc32(file.data() + start + 4, data.size() + 4, 0);
+    for (int shift = 24; shift >= 0; shift -= 8)
+      file.push_back(static_cast<unsigned char>(crc >> shift));
+  }
+
+  struct PngShape
+  {
+    int width;
+    int height;
+    // 0 gray, 2 RGB, 4 gray and alpha, 6 RGBA
+    int colorType;
+    int depth;
+    bool interlaced;
+  };
+
+  // a PNG of shape, its scanlines' filtered bytes given by row(width in
+  // bytes, pass, y, bytes) and their filter by filter(y)
+  std::vector<unsigned char> pngFile(const PngShape &shape, const std::function<unsigned char(int)> &filter,
+                                     const std::function<void(std::size_t, int, int, unsigned char*)> &row, std::mt19937 &random)
+  {
+    static const int passX[7] = {0, 4, 0, 2, 0, 1, 0}, passY[7] = {0, 0, 4, 0, 2, 0, 1};
+    static const int stepX[7] = {8, 8, 4, 4, 2, 2, 1}, stepY[7] = {8, 8, 8, 4, 4, 2, 2};
+    int channels = shape.colorType == 2 ? 3 : shape.colorType == 4 ? 2 : shape.colorType == 6 ? 4 : 1;
+    std::vector<unsigned char> raw;
+    for (int pass = 0; pass < (shape.interlaced ? 7 : 1); ++pass)
+      {
+        int width = shape.interlaced ? (shape.width - passX[pass] + stepX[pass] - 1) / stepX[pass] : shape.width;
+        int height = shape.interlaced ? (shape.height - passY[pass] + stepY[pass] - 1) / stepY[pass] : shape.height;
+        if (width <= 0 || height <= 0)
+          continue;
+        auto bytes = (static_cast<std::size_t>(width) * static_cast<std::size_t>(channels * shape.depth) + 7) / 8;
+        for (int y = 0; y < height; ++y)
+          {
+            raw.push_back(filter(y));
+            raw.resize(raw.size() + bytes);
+            row(bytes, pass, y, raw.data() + raw.size() - bytes);
+          }
+      }
+
+    std::vector<unsigned char> file = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    std::vector<unsigned char> header(13, 0);
+    for (int i = 0; i < 4; ++i)
+      {
+        header[static_cast<std::size_t>(i)] = static_cast<unsigned char>(shape.width >> (24 - 8 * i));
+        header[static_cast<std::size_t>(4 + i)] = static_cast<unsigned char>(shape.height >> (24 - 8 * i));
+      }
+    header[8] = static_cast<unsigned char>(shape.depth);
+    header[9] = static_cast<unsigned char>(shape.colorType);
+    header[12] = shape.interlaced ? 1 : 0;
+    putChunk(file, "IHDR", header);
+    // split over several IDAT chunks now and then
+    std::vector<unsigned char> compressed = deflate(raw, random);
+    std::size_t chunk = randomInt(random, 0, 1) != 0 ? compressed.size() : static_cast<std::size_t>(randomInt(random, 1, 4096));
+    for (std::size_t at = 0; at < compressed.size(); at += chunk)
+      putChunk(file, "IDAT", std::vector<unsigned char>(compressed.begin() + static_cast<std::ptrdiff_t>(at),
+                                                        compressed.begin() + static_cast<std::ptrdiff_t>(std::min(at + chunk, compressed.size()))));
+    putChunk(file, "IEND", std::vector<unsigned char>());
+    return file;
+  }
+
+  // a random file: random scanlines under one filter or a mix of them
+  std::vector<unsigned char> randomPng(std::mt19937 &random, PngShape &shape)
+  {
+    static const int colorTypes[4] = {0, 2, 4, 6};
+    // RGB and RGBA at 8 bits are what the SIMD unfiltering covers, so they
+    // come up most; low depths are gray only
+    shape.colorType = randomInt(random, 0, 1) == 0 ? colorTypes[randomInt(random, 0, 3)] : randomInt(random, 0, 1) != 0 ? 2 : 6;
+    shape.depth = randomInt(random, 0, 3) == 0 ? 16 : 8;
+    if (shape.colorType == 0 && randomInt(random, 0, 3) == 0)
+      shape.depth = 1 << randomInt(random, 0, 2);
+    shape.width = randomInt(random, 0, 3) == 0 ? randomInt(random, 1, 300) : randomInt(random, 1, 40);
+    shape.height = randomInt(random, 1, 24);
+    shape.interlaced = randomInt(random, 0, 7) == 0;
+    int filter = randomInt(random, 0, 5);
+    return pngFile(shape, [&](int) { return static_cast<unsigned char>(filter == 5 ? randomInt(random, 0, 4) : filter); },
+                   [&](std::size_t bytes, int, int, unsigned char *row)
+                     {
+                       for (std::size_t i = 0; i < bytes; ++i)
+                         row[i] = static_cast<unsigned char>(random());
+                     },
+                   random);
+  }
+
+  // shapes and gradients like a UI texture, Paeth filtered
+  std::vector<unsigned char> drawingPng(int size, std::mt19937 &random)
+  {
+    auto stride = static_cast<std::size_t>(size) * 4;
+    std::vector<unsigned char> pixels(stride * static_cast<std::size_t>(size));
+    for (int y = 0; y < size; ++y)
+      for (int x = 0; x < size; ++x)
+        {
+          unsigned char *texel = pixels.data() + stride * static_cast<std::size_t>(y) + 4 * static_cast<std::size_t>(x);
+          int dx = x - size / 2, dy = y - size / 2;
+          bool inside = dx * dx + dy * dy < size * size / 9;
+          texel[0] = static_cast<unsigned char>(inside ? 240 : x * 255 / size);
+          texel[1] = static_cast<unsigned char>(inside ? 200 : y * 255 / size);
+          texel[2] = static_cast<unsigned char>((x / 64 + y / 64) % 2 != 0 ? 40 : 90);
+          texel[3] = static_cast<unsigned char>(inside ? 255 : std::abs(dx) / 8 % 3 == 0 ? 128 : 0);
+        }
+    PngShape shape = {size, size, 6, 8, false};
+    return pngFile(shape, [](int) { return static_cast<unsigned char>(4); },
+                   [&](std::size_t bytes, int, int y, unsigned char *row)
+                     {
+                       const unsigned char *current = pixels.data() + stride * static_cast<std::size_t>(y);
+                       const unsigned char *above = y > 0 ? current - stride : nullptr;
+                       for (std::size_t i = 0; i < bytes; ++i)
+                         {
+                           int a = i >= 4 ? current[i - 4] : 0, b = above ? above[i] : 0, c = above && i >= 4 ? above[i - 4] : 0;
+                           int p = a + b - c, pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+                           int predicted = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+                           row[i] = static_cast<unsigned char>(current[i] - predicted);
+                         }
+                     },
+                   random);
+  }
+
+  // load file with both decoders as stored, as RGBA and flipped, false
+  // when either fails or they differ
+  bool sameDecodes(const std::vector<unsigned char> &file, std::string &difference)
+  {
+    for (int desiredChannels : {0, 4})
+      for (int flip : {0, 1})
+        {
+          int width, height, channels, referenceWidth, referenceHeight, referenceChannels;
+          stbi_load_options options;
+          stbi_load_options_init(&options);
+          options.desired_channels = desiredChannels;
+          options.flip_vertically = flip;
+          stbi_uc *image = stbi_load_from_memory_with_options(file.data(), static_cast<int>(file.size()), &width, &height, &channels, &options);
+          unsigned char *expected = reference_load_from_memory(file.data(), static_cast<int>(file.size()), &referenceWidth, &referenceHeight,
+                                                               &referenceChannels, desiredChannels, flip);
+          bool same = image != nullptr && expected != nullptr;
+          if (same)
+            {
+              auto size = static_cast<std::size_t>(width) * static_cast<std::size_t>(height)
+                * static_cast<std::size_t>(desiredChannels != 0 ? desiredChannels : channels);
+              same = width == referenceWidth && height == referenceHeight && channels == referenceChannels && std::memcmp(image, expected, size) == 0;
+            }
+          stbi_image_free_with_options(image, &options);
+          reference_image_free(expected);
+          if (!same)
+            {
+              difference = std::string(desiredChannels != 0 ? "as RGBA" : "as stored") + (flip != 0 ? ", flipped" : "")
+                + (image == nullptr ? std::string(", ") + options.failure_reason : "")
+                + (expected == nullptr ? std::string(", v2.19: ") + reference_failure_reason() : "");
+              return false;
+            }
+        }
+    return true;
+  }
+
+  // bytes an inflater meets: runs, repeats near and up to 32 KiB back,
+  // text of a few letters and noise, in random stretches
+  std::vector<unsigned char> randomData(std::size_t size, std::mt19937 &random)
+  {
+    std::vector<unsigned char> data;
+    data.reserve(size);
+    while (data.size() < size)
+      {
+        auto stretch = std::min(size - data.size(), static_cast<std::size_t>(randomInt(random, 1, 2000)));
+        int kind = randomInt(random, 0, 4);
+        if ((kind == 1 || kind == 2) && data.empty())
+          kind = 0;
+        auto back = std::min(data.size(), static_cast<std::size_t>(kind == 1 ? randomInt(random, 1, 16) : randomInt(random, 1, 32768)));
+        auto value = static_cast<unsigned char>(random());
+        for (std::size_t i = 0; i < stretch; ++i)
+          if (kind == 0)
+            data.push_back(value);
+          else if (kind <= 2)
+            data.push_back(data[data.size() - back]);
+          else if (kind == 3)
+            data.push_back(static_cast<unsigned char>('a' + randomInt(random, 0, 3)));
+          else
+            data.push_back(static_cast<unsigned char>(random()));
+      }
+    return data;
+  }
+
+  // what a zlib call gave: the bytes, or nothing when it failed
+  struct Inflated
+  {
+    bool ok;
+    std::vector<unsigned char> bytes;
+
+    bool operator==(const Inflated &other) const
+    {
+      return ok == other.ok && bytes == other.bytes;
+    }
+  };
+
+  // bytes as an Inflated, handed back to release
+  Inflated inflated(char *bytes, int length, void (*release)(void*))
+  {
+    Inflated result = {bytes != nullptr, std::vector<unsigned char>()};
+    if (bytes != nullptr)
+      result.bytes.assign(bytes, bytes + length);
+    release(bytes);
+    return result;
+  }
+
+  // stream through stb_image's zlib calls and v2.19's, false when one
+  // gives other than data: with and without its header, into memory of
+  // its own grown from initial bytes, into a buffer just large enough and
+  // into one a byte short
+  bool sameInflates(const std::vector<unsigned char> &stream, const std::vector<unsigned char> &data, int initial, std::string &difference)
+  {
+    const char *input = reinterpret_cast<const char*>(stream.data());
+    int length = static_cast<int>(stream.size());
+    const Inflated expected = {true, data};
+    for (int header : {1, 0})
+      {
+        const char *start = input + (header != 0 ? 0 : 2);
+        int size = header != 0 ? length : length - 6;
+        int outlen = 0, referenceOutlen = 0;
+        char *bytes = stbi_zlib_decode_malloc_guesssize_headerflag(start, size, initial, &outlen, header);
+        Inflated current = inflated(bytes, outlen, stbi_image_free);
+        bytes = reference_zlib_decode_malloc(start, size, initial, &referenceOutlen, header);
+        Inflated reference = inflated(bytes, referenceOutlen, reference_image_free);
+        if (!(current == expected) || !(reference == expected))
+          {
+            difference = std::string(header != 0 ? "with" : "without") + " its header, " + (current == expected ? "v2.19" : "now") + " gives other bytes";
+            return false;
+          }
+      }
+    for (std::size_t room : {data.size(), data.size() - 1})
+      {
+        if (room > data.size())
+          continue;
+        std::vector<char> buffer(room + 1), referenceBuffer(room + 1);
+        int count = stbi_zlib_decode_buffer(buffer.data(), static_cast<int>(room), input, length);
+        int referenceCount = reference_zlib_decode_buffer(referenceBuffer.data(), static_cast<int>(room), input, length);
+        bool fits = room == data.size();
+        if (count != (fits ? static_cast<int>(room) : -1) || referenceCount != count
+            || (fits && std::memcmp(data.data(), buffer.data(), room) != 0))
+          {
+            difference = "into " + std::to_string(room) + " bytes, " + std::to_string(count) + " now, " + std::to_string(referenceCount) + " in v2.19";
+            return false;
+          }
+      }
+    return true;
+  }
+
+  // how a damaged stream went
+  enum class Damage
+  {
+    same,
+    failedAlike,
+    // stb_image stops where v2.19 reads zeros past the end of its input,
+    // or symbols past its tables; v2.19 is not run on those, it can grow
+    // its output until memory runs out
+    stricter,
+    different
+  };
+
+  // stream with a few bits flipped past its header: both decoders must
+  // fail or give the same bytes, unless stb_image fails on a check v2.19
+  // lacks
+  Damage damagedInflate(std::vector<unsigned char> stream, std::mt19937 &random)
+  {
+    for (int flips = randomInt(random, 1, 3); flips > 0 && stream.size() > 2; --flips)
+      stream[static_cast<std::size_t>(randomInt(random, 2, static_cast<int>(stream.size()) - 1))] ^= static_cast<unsigned char>(1 << randomInt(random, 0, 7));
+    const char *input = reinterpret_cast<const char*>(stream.data());
+    int length = static_cast<int>(stream.size()), outlen = 0, referenceOutlen = 0;
+    char *bytes = stbi_zlib_decode_malloc_guesssize_headerflag(input, length, 64, &outlen, 1);
+    Inflated current = inflated(bytes, outlen, stbi_image_free);
+    if (!current.ok)
+      {
+        std::string reason = stbi_failure_reason();
+        if (reason == "unexpected end" || reason == "bad huffman code")
+          return Damage::stricter;
+      }
+    bytes = reference_zlib_decode_malloc(input, length, 64, &referenceOutlen, 1);
+    Inflated reference = inflated(bytes, referenceOutlen, reference_image_free);
+    if (!(current == reference))
+      return Damage::different;
+    return current.ok ? Damage::same : Damage::failedAlike;
+  }
+
+  bool readFile(const std::string &path, std::vector<unsigned char> &bytes)
+  {
+    std::FILE *file = std::fopen(path.c_str(), "rb");
+    if (file == nullptr)
+      return false;
+    unsigned char buffer[65536];
+    std::size_t read;
+    while ((read = std::fread(buffer, 1, sizeof(buffer), file)) != 0)
+      bytes.insert(bytes.end(), buffer, buffer + read);
+    return std::fclose(file) == 0;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  Settings settings;
+  if (!parseArguments(argc, argv, settings))
+    {
+      std::cout << "usage: pngbench [-n files] [-r runs] [png...]" << std::endl;
+      return 2;
+    }
+
+  std::mt19937 random(1);
+  for (int i = 0; i < settings.files; ++i)
+    {
+      PngShape shape;
+      std::vector<unsigned char> file = randomPng(random, shape);
+      std::string difference;
+      if (!sameDecodes(file, difference))
+        {
+          std::cout << "file " << i << ", " << shape.width << " x " << shape.height << " color type " << shape.colorType << " depth " << shape.depth
+                    << (shape.interlaced ? " interlaced" : "") << ", " << difference << ": differs from the reference" << std::endl;
+          return 1;
+        }
+    }
+  std::cout << settings.files << " generated files decode the same" << std::endl;
+
+  int damages[3] = {};
+  for (int i = 0; i < settings.files; ++i)
+    {
+      std::vector<unsigned char> data = randomData(static_cast<std::size_t>(randomInt(random, 0, 3) == 0 ? randomInt(random, 0, 300000)
+                                                                              : randomInt(random, 0, 3000)), random);
+      std::vector<unsigned char> stream = deflate(data, random);
+      std::string difference;
+      if (!sameInflates(stream, data, randomInt(random, 1, 4096), difference))
+        {
+          std::cout << "stream " << i << " of " << data.size() << " bytes, " << difference << ": differs from the reference" << std::endl;
+          return 1;
+        }
+      Damage damage = damagedInflate(stream, random);
+      if (damage == Damage::different)
+        {
+          std::cout << "stream " << i << " of " << data.size() << " bytes, damaged: differs from the reference" << std::endl;
+          return 1;
+        }
+      ++damages[static_cast<int>(damage)];
+    }
+  std::cout << settings.files << " generated zlib streams inflate the same; damaged, " << damages[0] << " still inflate the same, " << damages[1]
+            << " fail alike, " << damages[2] << " fail where v2.19 reads past its input or tables" << std::endl;
+
+  // 64 MiB of output, enough to time
+  std::vector<unsigned char> large = randomData(64 << 20, random);
+  std::vector<unsigned char> stream = deflate(large, random);
+  const char *input = reinterpret_cast<const char*>(stream.data());
+  int length = static_cast<int>(stream.size()), outlen;
+  double referenceInflate = bestTime(settings.runs, [&] { reference_image_free(reference_zlib_decode_malloc(input, length, length, &outlen, 1)); });
+  double currentInflate = bestTime(settings.runs, [&]
+    {
+      stbi_image_free(stbi_zlib_decode_malloc_guesssize_headerflag(input, length, length, &outlen, 1));
+    });
+  std::cout << "inflating " << large.size() / 1048576 << " MiB: v2.19 " << static_cast<double>(large.size()) / referenceInflate / 1e6 << " MB/s, now "
+            << static_cast<double>(large.size()) / currentInflate / 1e6 << " MB/s" << std::endl;
+
+  std::vector<std::pair<std::string, std::vector<unsigned char>>> images;
+  for (const std::string &path : settings.images)
+    {
+      std::vector<unsigned char> bytes;
+      if (!readFile(path, bytes))
+        {
+          std::cout << "can't read " << path << std::endl;
+          return 1;
+        }
+      images.emplace_back(path, std::move(bytes));
+    }
+  if (images.empty())
+    images.emplace_back("2048 x 2048 drawing", drawingPng(2048, random));
+  for (auto &image : images)
+    {
+      const std::vector<unsigned char> &file = image.second;
+      std::string difference;
+      if (!sameDecodes(file, difference))
+        {
+          std::cout << image.first << ", " << difference << ": differs from the reference" << std::endl;
+          return 1;
+        }
+      int width, height, channels;
+      double reference = bestTime(settings.runs, [&]
+        {
+          reference_image_free(reference_load_from_memory(file.data(), static_cast<int>(file.size()), &width, &height, &channels, 0, 0));
+        });
+      double current = bestTime(settings.runs, [&]
+        {
+          stbi_image_free(stbi_load_from_memory(file.data(), static_cast<int>(file.size()), &width, &height, &channels, 0));
+        });
+      std::cout << image.first << ": v2.19 " << reference * 1000.0 << " ms, now " << current * 1000.0 << " ms" << std::endl;
+    }
+  return 0;
+}
@@ -0,0 +1,271 @@
+// stbstress: decode images on many threads at once, each load with
+// settings of its own, and check every result against the same load done
+// alone first.
+//
+//   stbstress [-t threads] [-n loads] [image...]
+//
+// The images (data/container.jpg, data/wall.jpg and data/awesomeface.png
+// by default) are loaded with every mix of flip, desired channels and JPEG
+// scale, into memory of stb_image's or into a buffer too small for them,
+// along with damaged copies of each: cut in half, with bytes of the header
+// flipped, and of no known type. Then threads threads run loads each, picked
+// at random, through the *_with_options API. Each must give the same
+// pixels, or fail for the same reason, in options.failure_reason and in the
+// thread's stbi_failure_reason(), as it did alone, and hand every block
+// back to its own thread's allocator. Exits 1 on the first mismatch.
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stb_image.h>
+
+#include "content_hash.hpp"
+
+namespace
+{
+  struct Settings
+  {
+    std::size_t threads = 8;
+    int loads = 500;
+    std::vector<std::string> images;
+  };
+
+  bool parseArguments(int argc, char **argv, Settings &settings)
+  {
+    for (int i = 1; i < argc; ++i)
+      {
+        std::string argument = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (argument == "-t" && hasValue)
+          settings.threads = static_cast<std::size_t>(std::max(std::atoi(argv[++i]), 1));
+        else if (argument == "-n" && hasValue)
+          settings.loads = std::max(std::atoi(argv[++i]), 1);
+        else if (!argument.empty() && argument[0] != '-')
+          settings.images.push_back(argument);
+        else
+          return false;
+      }
+    if (settings.images.empty())
+      settings.images = {"data/container.jpg", "data/wall.jpg", "data/awesomeface.png"};
+    return true;
+  }
+
+  struct Input
+  {
+    std::string name;
+    std::vector<unsigned char> bytes;
+  };
+
+  // an input with one mix of settings
+  struct Load
+  {
+    std::size_t input;
+    bool flip;
+    int channels;
+    int scale;
+    bool tooSmall;
+  };
+
+  // what a load gave: the image's hash, or why it failed
+  struct Outcome
+  {
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+    std::uint64_t hash = 0;
+    std::string reason;
+
+    bool operator==(const Outcome &other) const
+    {
+      return width == other.width && height == other.height && channels == other.channels && hash == other.hash && reason == other.reason;
+    }
+  };
+
+  // heap blocks a thread's loads hold, which must drop back to 0 after
+  // each: a block freed through another thread's allocator would show
+  struct CountingAllocator
+  {
+    stbi_allocator hooks;
+    long live = 0;
+
+    CountingAllocator()
+    {
+      hooks.malloc = [](void *user, std::size_t size)
+        {
+          ++static_cast<CountingAllocator*>(user)->live;
+          return std::malloc(size);
+        };
+      hooks.realloc = [](void *user, void *block, std::size_t, std::size_t size)
+        {
+          if (block == nullptr)
+            ++static_cast<CountingAllocator*>(user)->live;
+          return std::realloc(block, size);
+        };
+      hooks.free = [](void *user, void *block)
+        {
+          if (block != nullptr)
+            --static_cast<CountingAllocator*>(user)->live;
+          std::free(block);
+        };
+      hooks.user = this;
+    }
+  };
+
+  bool readFile(const std::string &path, std::vector<unsigned char> &bytes)
+  {
+    std::FILE *file = std::fopen(path.c_str(), "rb");
+    if (file == nullptr)
+      return false;
+    unsigned char buffer[65536];
+    std::size_t read;
+    while ((read = std::fread(buffer, 1, sizeof(buffer), file)) != 0)
+      bytes.insert(bytes.end(), buffer, buffer + read);
+    return std::fclose(file) == 0;
+  }
+
+  // the image and its damaged copies
+  void addInputs(const std::string &path, const std::vector<unsigned char> &bytes, std::vector<Input> &inputs)
+  {
+    inputs.push_back({path, bytes});
+    inputs.push_back({path + ", cut in half", std::vector<unsigned char>(bytes.begin(), bytes.begin() + static_cast<std::ptrdiff_t>(bytes.size() / 2))});
+    Input flipped = {path + ", header damaged", bytes};
+    for (std::size_t i = 2; i < std::min<std::size_t>(flipped.bytes.size(), 64); i += 7)
+      flipped.bytes[i] = static_cast<unsigned char>(flipped.bytes[i] ^ 0x5a);
+    inputs.push_back(flipped);
+    Input unknown = {path + ", unknown type", bytes};
+    std::fill(unknown.bytes.begin(), unknown.bytes.begin() + static_cast<std::ptrdiff_t>(std::min<std::size_t>(unknown.bytes.size(), 16)), 0);
+    inputs.push_back(unknown);
+  }
+
+  Outcome decode(const Input &input, const Load &load, CountingAllocator &allocator, std::string &problem)
+  {
+    unsigned char small[64];
+    stbi_load_options options;
+    stbi_load_options_init(&options);
+    options.flip_vertically = load.flip;
+    options.desired_channels = load.channels;
+    options.jpeg_scale_denom = load.scale;
+    options.allocator = &allocator.hooks;
+    if (load.tooSmall)
+      {
+        options.output = small;
+        options.output_size = sizeof(small);
+      }
+
+    Outcome outcome;
+    stbi_uc *image = stbi_load_from_memory_with_options(input.bytes.data(), static_cast<int>(input.bytes.size()), &outcome.width, &outcome.height,
+                                                        &outcome.channels, &options);
+    if (image == nullptr)
+      {
+        outcome = Outcome();
+        outcome.reason = options.failure_reason != nullptr ? options.failure_reason : "(no reason)";
+        const char *threadReason = stbi_failure_reason();
+        if (threadReason == nullptr || outcome.reason != threadReason)
+          problem = "stbi_failure_reason() says " + std::string(threadReason != nullptr ? threadReason : "nothing") + ", the options "
+            + outcome.reason;
+      }
+    else
+      {
+        int channels = load.channels != 0 ? load.channels : outcome.channels;
+        auto size = static_cast<std::size_t>(outcome.width) * static_cast<std::size_t>(outcome.height) * static_cast<std::size_t>(channels);
+        outcome.hash = hashBytes(image, size, 0);
+        stbi_image_free_with_options(image, &options);
+      }
+    if (allocator.live != 0)
+      problem = std::to_string(allocator.live) + " blocks not handed back to the thread's allocator";
+    allocator.live = 0;
+    return outcome;
+  }
+
+  std::string describe(const Input &input, const Load &load)
+  {
+    return input.name + (load.flip ? ", flipped" : "") + ", " + std::to_string(load.channels) + " channels, scale 1/" + std::to_string(load.scale)
+      + (load.tooSmall ? ", into a small buffer" : "");
+  }
+}
+
+int main(int argc, char **argv)
+{
+  Settings settings;
+  if (!parseArguments(argc, argv, settings))
+    {
+      std::cout << "usage: stbstress [-t threads] [-n loads] [image...]" << std::endl;
+      return 2;
+    }
+
+  std::vector<Input> inputs;
+  for (const std::string &path : settings.images)
+    {
+      std::vector<unsigned char> bytes;
+      if (!readFile(path, bytes) || bytes.empty())
+        {
+          std::cout << "can't read " << path << std::endl;
+          return 1;
+        }
+      addInputs(path, bytes, inputs);
+    }
+
+  // every load alone first, on this thread
+  std::vector<Load> loads;
+  for (std::size_t input = 0; input < inputs.size(); ++input)
+    for (bool flip : {false, true})
+      for (int channels = 0; channels <= 4; ++channels)
+        for (int scale : {1, 2, 8})
+          for (bool tooSmall : {false, true})
+            loads.push_back({input, flip, channels, scale, tooSmall});
+  std::vector<Outcome> expected;
+  std::size_t failures = 0;
+  CountingAllocator allocator;
+  for (const Load &load : loads)
+    {
+      std::string problem;
+      expected.push_back(decode(inputs[load.input], load, allocator, problem));
+      if (!problem.empty())
+        {
+          std::cout << describe(inputs[load.input], load) << ": " << problem << std::endl;
+          return 1;
+        }
+      if (!expected.back().reason.empty())
+        ++failures;
+    }
+  std::cout << loads.size() << " loads, " << failures << " of them fail; " << settings.threads << " threads doing " << settings.loads
+            << " each" << std::endl;
+
+  std::atomic<bool> failed(false);
+  std::mutex mutex;
+  std::vector<std::thread> threads;
+  for (std::size_t t = 0; t < settings.threads; ++t)
+    threads.emplace_back([&, t]
+      {
+        std::mt19937 random(static_cast<unsigned>(t + 1));
+        CountingAllocator own;
+        for (int i = 0; i < settings.loads && !failed; ++i)
+          {
+            std::size_t index = random() % loads.size();
+            const Load &load = loads[index];
+            std::string problem;
+            Outcome outcome = decode(inputs[load.input], load, own, problem);
+            if (problem.empty() && !(outcome == expected[index]))
+              problem = outcome.reason.empty() ? "different pixels" : "failed with " + outcome.reason + " instead of "
+                + (expected[index].reason.empty() ? "loading" : expected[index].reason);
+            if (!problem.empty() && !failed.exchange(true))
+              {
+                std::lock_guard<std::mutex> lock(mutex);
+                std::cout << describe(inputs[load.input], load) << ": " << problem << std::endl;
+              }
+          }
+      });
+  for (std::thread &thread : threads)
+    thread.join();
+  if (failed)
+    return 1;
+  std::cout << "every load matched" << std::endl;
+  return 0;
+}
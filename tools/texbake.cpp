@@ -0,0 +1,255 @@
+// texbake: bakes images into block-compressed DDS textures with their mip
+// chains, and reports what the compression costs in quality and time.
+//
+//   texbake [-f bc1|bc3|bc4|bc7|all] [-o directory] [-j threads]
+//           [-r repeats] [--fast] [--flip] [--no-mips]
+//           [--mip-filter box|kaiser] [--srgb] [--cutoff alpha] image...
+//
+// For every image and format it prints the PSNR of the top level against
+// the source and the encode throughput, the best of the repeats. --fast
+// measures the encoders textures compressed at run time go through.
+// --srgb filters the mip levels in linear light, --cutoff keeps the alpha
+// test coverage of cutout textures at that alpha (0 to 1) down the chain.
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <stb_image.h>
+
+#include "block_compress.hpp"
+#include "mip_chain.hpp"
+#include "texture_container.hpp"
+#include "thread_pool.hpp"
+
+namespace
+{
+  struct Settings
+  {
+    std::vector<BlockFormat> formats = {BlockFormat::BC7};
+    std::string directory;
+    std::size_t threads = 0;
+    int repeats = 1;
+    BlockQuality quality = BlockQuality::Best;
+    bool flip = false;
+    bool mips = true;
+    MipOptions mipOptions;
+    std::vector<std::string> inputs;
+  };
+
+  const char *formatName(BlockFormat format)
+  {
+    switch (format)
+      {
+      case BlockFormat::BC1:
+        return "bc1";
+      case BlockFormat::BC3:
+        return "bc3";
+      case BlockFormat::BC4:
+        return "bc4";
+      case BlockFormat::BC7:
+        return "bc7";
+      }
+    return "?";
+  }
+
+  bool parseFormats(const std::string &name, std::vector<BlockFormat> &formats)
+  {
+    if (name == "all")
+      formats = {BlockFormat::BC1, BlockFormat::BC3, BlockFormat::BC4, BlockFormat::BC7};
+    else if (name == "bc1")
+      formats = {BlockFormat::BC1};
+    else if (name == "bc3")
+      formats = {BlockFormat::BC3};
+    else if (name == "bc4")
+      formats = {BlockFormat::BC4};
+    else if (name == "bc7")
+      formats = {BlockFormat::BC7};
+    else
+      return false;
+    return true;
+  }
+
+  bool parseArguments(int argc, char **argv, Settings &settings)
+  {
+    for (int i = 1; i < argc; ++i)
+      {
+        std::string argument = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (argument == "-f" && hasValue)
+          {
+            if (!parseFormats(argv[++i], settings.formats))
+              return false;
+          }
+        else if (argument == "-o" && hasValue)
+          {
+            settings.directory = argv[++i];
+          }
+        else if (argument == "-j" && hasValue)
+          {
+            settings.threads = static_cast<std::size_t>(std::max(std::atoi(argv[++i]), 1));
+          }
+        else if (argument == "-r" && hasValue)
+          {
+            settings.repeats = std::max(std::atoi(argv[++i]), 1);
+          }
+        else if (argument == "--fast")
+          {
+            settings.quality = BlockQuality::Fast;
+          }
+        else if (argument == "--flip")
+          {
+            settings.flip = true;
+          }
+        else if (argument == "--no-mips")
+          {
+            settings.mips = false;
+          }
+        else if (argument == "--mip-filter" && hasValue)
+          {
+            std::string filter = argv[++i];
+            if (filter == "box")
+              settings.mipOptions.filter = MipFilter::Box;
+            else if (filter == "kaiser")
+              settings.mipOptions.filter = MipFilter::Kaiser;
+            else
+              return false;
+          }
+        else if (argument == "--srgb")
+          {
+            settings.mipOptions.srgb = true;
+          }
+        else if (argument == "--cutoff" && hasValue)
+          {
+            settings.mipOptions.alphaCutoff = std::min(std::max(static_cast<float>(std::atof(argv[++i])), 0.0f), 1.0f);
+          }
+        else if (!argument.empty() && argument[0] == '-')
+          {
+            return false;
+          }
+        else
+          {
+            settings.inputs.push_back(argument);
+          }
+      }
+    return !settings.inputs.empty();
+  }
+
+  // where the baked texture of input goes
+  std::string outputPath(const Settings &settings, const std::string &input, BlockFormat format)
+  {
+    std::size_t slash = input.find_last_of("/\\");
+    std::string directory = slash == std::string::npos ? std::string(".") : input.substr(0, slash);
+    std::string name = slash == std::string::npos ? input : input.substr(slash + 1);
+    name = name.substr(0, name.find_last_of('.'));
+    if (settings.formats.size() > 1)
+      name += std::string("_") + formatName(format);
+    return (settings.directory.empty() ? directory : settings.directory) + "/" + name + ".dds";
+  }
+
+  // peak signal to noise ratio over channels [first, first + count) of two
+  // RGBA images, infinite when they match
+  double psnr(const unsigned char *source, const unsigned char *baked, std::size_t texels, int first, int count)
+  {
+    double squares = 0.0;
+    for (std::size_t i = 0; i < texels; ++i)
+      for (int c = first; c < first + count; ++c)
+        {
+          double difference = source[4 * i + static_cast<std::size_t>(c)] - baked[4 * i + static_cast<std::size_t>(c)];
+          squares += difference * difference;
+        }
+    if (squares == 0.0)
+      return INFINITY;
+    double meanSquare = squares / static_cast<double>(texels * static_cast<std::size_t>(count));
+    return 10.0 * std::log10(255.0 * 255.0 / meanSquare);
+  }
+
+  bool bake(const Settings &settings, const std::string &input, ThreadPool *pool)
+  {
+    int width;
+    int height;
+    int channels;
+    // always RGBA, so the PSNR compares like with like
+    unsigned char *pixels = stbi_load(input.c_str(), &width, &height, &channels, 4);
+    if (pixels == nullptr)
+      {
+        std::cout << input << ": " << stbi_failure_reason() << std::endl;
+        return false;
+      }
+
+    std::vector<MipLevel> levels = mipChainLayout(width, height, 4);
+    if (!settings.mips)
+      levels.resize(1);
+    std::vector<unsigned char> chain(mipChainBytes(levels));
+    std::memcpy(chain.data(), pixels, levels[0].bytes);
+    stbi_image_free(pixels);
+    buildMipChain(chain.data(), levels, 4, settings.mipOptions, pool);
+    std::size_t texels = 0;
+    for (const MipLevel &level : levels)
+      texels += level.bytes / 4;
+
+    bool baked = true;
+    for (BlockFormat format : settings.formats)
+      {
+        CompressedImage image;
+        double best = INFINITY;
+        for (int repeat = 0; repeat < settings.repeats; ++repeat)
+          {
+            auto start = std::chrono::steady_clock::now();
+            image = compressMipChain(format, chain.data(), levels, 4, pool, settings.quality);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            best = std::min(best, elapsed.count());
+          }
+
+        std::vector<unsigned char> decoded(levels[0].bytes);
+        decompressImage(format, image.blocks, width, height, decoded.data());
+        auto topTexels = static_cast<std::size_t>(width) * static_cast<std::size_t>(height);
+        bool alpha = (format == BlockFormat::BC3 || format == BlockFormat::BC7) && (channels == 2 || channels == 4);
+        // BC4 keeps red alone
+        bool red = format == BlockFormat::BC4;
+
+        std::string path = outputPath(settings, input, format);
+        std::string error;
+        bool written = writeDds(path, image, error);
+        baked = baked && written;
+
+        std::cout << std::fixed << std::setprecision(2) << input << " " << width << "x" << height << " " << formatName(format)
+                  << ": PSNR " << (red ? "r " : "rgb ") << psnr(chain.data(), decoded.data(), topTexels, 0, red ? 1 : 3) << " dB";
+        if (alpha)
+          std::cout << ", alpha " << psnr(chain.data(), decoded.data(), topTexels, 3, 1) << " dB";
+        std::cout << ", " << static_cast<double>(texels) / best / 1e6 << " Mtexel/s, " << levels.size() << " levels, "
+                  << mipChainBytes(image.levels) / 1024 << " KiB (" << chain.size() / 1024 << " KiB raw) -> "
+                  << (written ? path : error) << std::endl;
+      }
+    return baked;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  Settings settings;
+  if (!parseArguments(argc, argv, settings))
+    {
+      std::cout << "usage: texbake [-f bc1|bc3|bc4|bc7|all] [-o directory] [-j threads] [-r repeats] [--fast] [--flip] [--no-mips]\n"
+                << "               [--mip-filter box|kaiser] [--srgb] [--cutoff alpha] image..." << std::endl;
+      return 2;
+    }
+
+  stbi_set_flip_vertically_on_load(settings.flip);
+  // the calling thread encodes too, -j 1 keeps it alone
+  std::unique_ptr<ThreadPool> pool;
+  if (settings.threads != 1)
+    pool.reset(new ThreadPool(settings.threads == 0 ? 0 : settings.threads - 1));
+  std::cout << "encoding on " << (pool ? pool->size() + 1 : 1) << " threads" << std::endl;
+
+  bool baked = true;
+  for (const std::string &input : settings.inputs)
+    baked = bake(settings, input, pool.get()) && baked;
+  return baked ? 0 : 1;
+}